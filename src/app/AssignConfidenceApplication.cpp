@@ -26,13 +26,15 @@ static const double EPSILON = 0.00000000000001;
 * \returns a blank ComputeQValues object
 */
 AssignConfidenceApplication::AssignConfidenceApplication():
-  spectrum_flag_(NULL), iteration_cnt_(0) {
+  spectrum_flag_(NULL), iteration_cnt_(0), target_input_(NULL), decoy_input_(NULL) {
 }
 
 /**
 * Destructor
 */
 AssignConfidenceApplication::~AssignConfidenceApplication() {
+  delete target_input_;
+  delete decoy_input_;
 }
 
 /**
@@ -179,7 +181,16 @@ int AssignConfidenceApplication::main(const vector<string>& input_files) {
 
     check_target_decoy_files(target_path, decoy_path);
 
-    if (!FileUtils::Exists(target_path)) {
+    if (target_input_ != NULL) {
+      // Matches were handed over in memory (Cascade Search); the paths only label them.
+      if (decoy_input_ == NULL) {
+        if (estimation_method == MIXMAX_METHOD) {
+          carp(CARP_FATAL, "Cannot find file %s. Decoy file from separate target-decoy search is "
+                           "required for mix-max q-value calculation", decoy_path.c_str());
+        }
+        decoy_path = "";
+      }
+    } else if (!FileUtils::Exists(target_path)) {
       carp(CARP_FATAL, "Target file %s not found", target_path.c_str());
     } else if (!FileUtils::Exists(decoy_path)) {
       if (estimation_method == MIXMAX_METHOD) {
@@ -190,7 +201,9 @@ int AssignConfidenceApplication::main(const vector<string>& input_files) {
       decoy_path = "";
     }
 
-    MatchCollection* match_collection = parser.create(target_path, Params::GetString("protein-database"));
+    MatchCollection* match_collection = target_input_ != NULL ? target_input_ :
+      parser.create(target_path, Params::GetString("protein-database"));
+    target_input_ = NULL;
     distinct_matches = match_collection->getHasDistinctMatches();
     if (!match_collection->hasDecoyIndexes()) {
       avgTdc = false;
@@ -264,7 +277,9 @@ int AssignConfidenceApplication::main(const vector<string>& input_files) {
     int num_decoy_peptide_skipped = 0;
     
     if (decoy_path != "") {
-      MatchCollection* temp_collection = parser.create(decoy_path, Params::GetString("protein-database"));
+      MatchCollection* temp_collection = decoy_input_ != NULL ? decoy_input_ :
+        parser.create(decoy_path, Params::GetString("protein-database"));
+      decoy_input_ = NULL;
       carp(CARP_INFO, "Found %d PSMs in %s.", temp_collection->getMatchTotal(), decoy_path.c_str());
 
       if (temp_collection->hasDecoyIndexes()) {
@@ -682,9 +697,8 @@ int AssignConfidenceApplication::main(const vector<string>& input_files) {
       if (match->getScore(QVALUE_TDC) > qValueThreshold) {
         break;
       }
-      spectrum_flag_->insert(make_pair(pair<string, unsigned int>(
-        match->getSpectrum()->getFullFilename(),
-        match->getSpectrum()->getFirstScan() * 10 + match->getCharge()), true));
+      spectrum_flag_->Set(match->getSpectrum()->getFullFilename(),
+        SpectrumFlags::Id(match->getSpectrum()->getFirstScan(), match->getCharge()));
 
       match->setDatabaseIndexName(index_name_);
 
@@ -1282,11 +1296,11 @@ string AssignConfidenceApplication::getPeptideSeq(Match* match) {
   return peptideSeq;
 }
 
-map<pair<string, unsigned int>, bool>* AssignConfidenceApplication::getSpectrumFlag() {
+SpectrumFlags* AssignConfidenceApplication::getSpectrumFlag() {
   return spectrum_flag_;
 }
 
-void AssignConfidenceApplication::setSpectrumFlag(map<pair<string, unsigned int>, bool>* spectrum_flag) {
+void AssignConfidenceApplication::setSpectrumFlag(SpectrumFlags* spectrum_flag) {
   spectrum_flag_ = spectrum_flag;
 }
 
@@ -1306,6 +1320,14 @@ void AssignConfidenceApplication::setFinalIteration(bool is_final) {
   is_final_ = is_final;
 }
 
+void AssignConfidenceApplication::setInputMatches(
+  MatchCollection* target_matches,
+  MatchCollection* decoy_matches
+) {
+  target_input_ = target_matches;
+  decoy_input_ = decoy_matches;
+}
+
 unsigned int AssignConfidenceApplication::getAcceptedPSMs() {
   return accepted_psms_;
 }
@@ -21,6 +21,7 @@
 #include "model/MatchCollection.h"
 #include "io/OutputFiles.h"
 #include "model/Peptide.h"
+#include "SpectrumFlags.h"
 #include "boost/tuple/tuple.hpp" // This will be <tuple> once we move to C++11.
 #include "boost/tuple/tuple_comparison.hpp"
 
@@ -40,12 +41,14 @@ typedef enum _estimation_method ESTIMATION_METHOD_T;
 
 class AssignConfidenceApplication : public CruxApplication {
  protected:
-  map<pair<string, unsigned int>, bool>* spectrum_flag_;  // this variable is used in Cascade Search, this is an idicator 
+  SpectrumFlags* spectrum_flag_;  // this variable is used in Cascade Search, this is an idicator 
   unsigned int iteration_cnt_;
   OutputFiles* output_;
   unsigned int accepted_psms_;
   string index_name_;
   bool is_final_;
+  MatchCollection* target_input_;  // in-memory matches used instead of parsing the
+  MatchCollection* decoy_input_;   // first input file; owned until main() consumes them
 
   class AtdcScoreSet {
    public:
@@ -77,8 +80,8 @@ class AssignConfidenceApplication : public CruxApplication {
   };
 
  public:
-  map<pair<string, unsigned int>, bool>* getSpectrumFlag();
-  void setSpectrumFlag(map<pair<string, unsigned int>, bool>* spectrum_flag);
+  SpectrumFlags* getSpectrumFlag();
+  void setSpectrumFlag(SpectrumFlags* spectrum_flag);
   void setIterationCnt(unsigned int iteration_cnt);
   void setOutput(OutputFiles *output);
   unsigned int getAcceptedPSMs();
@@ -94,6 +97,12 @@ class AssignConfidenceApplication : public CruxApplication {
   */
   void setFinalIteration(bool is_final);
 
+  /**
+  * Hands over target (and optionally decoy) matches to be used in place of
+  * parsing the first input file. Ownership passes to this object.
+  */
+  void setInputMatches(MatchCollection* target_matches, MatchCollection* decoy_matches);
+
   /**
   * \returns a blank ComputeQValues object
   */
@@ -6,6 +6,10 @@
 #include "io/OutputFiles.h"
 #include "AssignConfidenceApplication.h"
 #include "TideSearchApplication.h"
+#include "SpectrumFlags.h"
+#include "TideMatchSet.h"
+#include "tide/spectrum_collection.h"
+#include "io/MatchCollectionParser.h"
 #include "util/Params.h"
 #include "util/StringUtils.h"
 #include "util/FileUtils.h"
@@ -33,7 +37,7 @@ CascadeSearchApplication::~CascadeSearchApplication() {
  * main method for CascadeSearchApplication
  */
 int CascadeSearchApplication::main(int argc, char** argv) {
-  map<pair<string, unsigned int>, bool>* spectrum_flag = new map<pair<string, unsigned int>, bool>;
+  SpectrumFlags spectrum_flag;
 
   carp(CARP_INFO, "Running cascade-search...");
 
@@ -41,34 +45,75 @@ int CascadeSearchApplication::main(int argc, char** argv) {
   vector<string> database_indices = StringUtils::Split(database_string, ',');
   OutputFiles* output = new OutputFiles(this);
 
-  int return_code;
+  // Convert and load the spectra once for all steps of the cascade; every
+  // tide-search below finds them already in its spectra_ map.
+  vector<string> spectrum_files = Params::GetStrings("tide spectra file");
+  vector<TideSearchApplication::InputFile> input_files =
+    TideSearchApplication().getInputFiles(spectrum_files);
+  map<string, SpectrumCollection*> spectra;
+  for (vector<TideSearchApplication::InputFile>::const_iterator i = input_files.begin();
+       i != input_files.end();
+       i++) {
+    if (spectra.find(i->SpectrumRecords) == spectra.end()) {
+      carp(CARP_INFO, "Reading spectrum file %s.", i->SpectrumRecords.c_str());
+      spectra[i->SpectrumRecords] = TideSearchApplication::loadSpectra(i->SpectrumRecords);
+    }
+  }
+
+  int return_code = 0;
   for (unsigned int cascade_cnt = 0; cascade_cnt < database_indices.size(); ++cascade_cnt) {
 
-    //carry out tide-search
+    // Proteins of the in-memory matches live in these until assign-confidence is done.
+    Database *database, *decoy_database;
+    MatchCollectionParser::loadDatabase(Params::GetString("protein-database"), database, decoy_database);
+    TideMatchSet::MatchDatabase = database;
+    TideMatchSet::MatchDecoyDatabase = decoy_database;
+
+    //carry out tide-search, keeping the PSMs in memory rather than in a tsv
     TideSearchApplication TideSearchProgram;
-    TideSearchProgram.setSpectrumFlag(spectrum_flag);
-    return_code = TideSearchProgram.main(Params::GetStrings("tide spectra file"), database_indices[cascade_cnt]);
+    TideSearchProgram.setSpectrumFlag(&spectrum_flag);
+    TideSearchProgram.in_memory_matches_ = true;
+    TideSearchProgram.spectra_ = spectra;
+    TideSearchProgram.inputFiles_ = input_files;
+    for (vector<TideSearchApplication::InputFile>::iterator i = TideSearchProgram.inputFiles_.begin();
+         i != TideSearchProgram.inputFiles_.end();
+         i++) {
+      i->Keep = true;  // removed below, after the last step
+    }
+    return_code = TideSearchProgram.main(spectrum_files, database_indices[cascade_cnt]);
     if (return_code != 0) {
-      return return_code;
+      Database::freeDatabase(database);
+      Database::freeDatabase(decoy_database);
+      TideMatchSet::MatchDatabase = NULL;
+      TideMatchSet::MatchDecoyDatabase = NULL;
+      break;
     }
 
-    //pass the output from Tide-Search to Assign-Confidence
+    //pass the matches from Tide-Search to Assign-Confidence; the file name only labels them
+    MatchCollection* target_matches = TideSearchProgram.target_matches_;
+    MatchCollection* decoy_matches = TideSearchProgram.decoy_matches_;
+    TideSearchProgram.target_matches_ = NULL;
+    TideSearchProgram.decoy_matches_ = NULL;
     vector<string> bridge_file_name;
     bridge_file_name.push_back(TideSearchProgram.getOutputFileName());
 
     //carry out assign confidence
     AssignConfidenceApplication AssignConfidenceProgram;
-    AssignConfidenceProgram.setSpectrumFlag(spectrum_flag);
+    AssignConfidenceProgram.setSpectrumFlag(&spectrum_flag);
     AssignConfidenceProgram.setIterationCnt(cascade_cnt);
     AssignConfidenceProgram.setOutput(output);
     AssignConfidenceProgram.setIndexName(database_indices[cascade_cnt]);
     AssignConfidenceProgram.setFinalIteration(cascade_cnt + 1 == database_indices.size());
+    AssignConfidenceProgram.setInputMatches(target_matches, decoy_matches);
 
     return_code = AssignConfidenceProgram.main(bridge_file_name);
+    Database::freeDatabase(database);
+    Database::freeDatabase(decoy_database);
+    TideMatchSet::MatchDatabase = NULL;
+    TideMatchSet::MatchDecoyDatabase = NULL;
     if (return_code != 0) {
-      return return_code;
+      break;
     }
-    spectrum_flag = AssignConfidenceProgram.getSpectrumFlag();
 
     //remove tide-search and assign-confidence output files.
     string outputdir = Params::GetString("output-dir");
@@ -82,12 +127,25 @@ int CascadeSearchApplication::main(int argc, char** argv) {
            numAccepted);
       break;
     }
-    carp(CARP_INFO, "Finished cascade-search of database %d.\n", cascade_cnt + 1);
+    carp(CARP_INFO, "Finished cascade-search of database %d; %d spectra "
+         "accepted so far.\n", cascade_cnt + 1, (int)spectrum_flag.Count());
 
   }
   delete output;
 
-  return 0;
+  for (map<string, SpectrumCollection*>::iterator i = spectra.begin(); i != spectra.end(); i++) {
+    delete i->second;
+  }
+  for (vector<TideSearchApplication::InputFile>::const_iterator i = input_files.begin();
+       i != input_files.end();
+       i++) {
+    if (!i->Keep) {
+      carp(CARP_DEBUG, "Deleting %s", i->SpectrumRecords.c_str());
+      FileUtils::Remove(i->SpectrumRecords);
+    }
+  }
+
+  return return_code;
 }
 
 /**
@@ -214,6 +272,9 @@ void CascadeSearchApplication::processParams() {
   if (Params::GetBool("sqt-output")) {
     carp(CARP_FATAL, "Cascade-Search cannot work with sqt-output=T.");
   }
+  if (Params::GetBool("peptide-centric-search")) {
+    carp(CARP_FATAL, "Cascade-Search cannot work with peptide-centric-search=T.");
+  }
 }
 
 void CascadeSearchApplication::RemoveTempFiles(const string& path, const string& prefix) {
@@ -120,8 +120,8 @@ int LocalizeModificationApplication::main(int argc, char** argv) {
     Spectrum spectrum(scan, precursorMz);
     spectrum.AddChargeState(charge);
     spectrum.ReservePeaks(cruxSpectrum->getNumPeaks());
-    for (PeakIterator i = cruxSpectrum->begin(); i != cruxSpectrum->end(); i++) {
-      spectrum.AddPeak((*i)->getLocation(), (*i)->getIntensity());
+    for (int i = 0; i < cruxSpectrum->getNumPeaks(); i++) {
+      spectrum.AddPeak(cruxSpectrum->getPeakMz(i), cruxSpectrum->getPeakIntensity(i));
     }
     delete cruxSpectrum;
 
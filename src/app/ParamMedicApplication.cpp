@@ -145,6 +145,7 @@ ParamMedicErrorCalculator::ParamMedicErrorCalculator():
 }
 
 ParamMedicErrorCalculator::~ParamMedicErrorCalculator() {
+  clearBins();
   for (vector< pair<const Peak*, const Peak*> >::const_iterator i = pairedFragmentPeaks_.begin();
       i != pairedFragmentPeaks_.begin();
       i++) {
@@ -157,15 +158,16 @@ void ParamMedicErrorCalculator::processFiles(const vector<string>& files) {
   for (vector<string>::const_iterator i = files.begin(); i != files.end(); i++) {
     carp(CARP_INFO, "param-medic processing input file %s...", i->c_str());
     SpectrumCollection* collection = SpectrumCollectionFactory::create(*i);
-    collection->parse();
-    for (SpectrumIterator j = collection->begin(); j != collection->end(); j++) {
-      processSpectrum(*j);
-    }
+    collection->parse(this);
     delete collection;
     clearBins();
   }
 }
 
+void ParamMedicErrorCalculator::handleSpectrum(Spectrum* spectrum) {
+  processSpectrum(spectrum);
+}
+
 void ParamMedicErrorCalculator::processSpectrum(Spectrum* spectrum) {
   ++numTotalSpectra_;
 
@@ -218,11 +220,17 @@ void ParamMedicErrorCalculator::processSpectrum(Spectrum* spectrum) {
       }
     }
   }
-  // make the new spectrum its bin's representative
-  spectra_[precursorBinIndex] = spectrum;
+  // make the new spectrum its bin's representative; the caller may free it,
+  // so keep a copy of its top fragments
+  Spectrum*& representative = spectra_[precursorBinIndex];
+  delete representative;
+  representative = new Spectrum(*spectrum);
 }
 
 void ParamMedicErrorCalculator::clearBins() {
+  for (map<int, Spectrum*>::iterator i = spectra_.begin(); i != spectra_.end(); i++) {
+    delete i->second;
+  }
   spectra_.clear();
 }
 
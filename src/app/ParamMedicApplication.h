@@ -3,6 +3,7 @@
 
 #include "CruxApplication.h"
 #include "Spectrum.h"
+#include "io/SpectrumCollection.h"
 
 class ParamMedicApplication : public CruxApplication {
  public:
@@ -18,15 +19,21 @@ class ParamMedicApplication : public CruxApplication {
   virtual bool needsOutputDirectory() const;
 };
 
-class ParamMedicErrorCalculator {
+class ParamMedicErrorCalculator : public Crux::SpectrumHandler {
  public:
   ParamMedicErrorCalculator();
   virtual ~ParamMedicErrorCalculator();
 
   void processFiles(const std::vector<std::string>& files);
+  // may reorder and truncate the peaks of spectrum; keeps no pointer to it
   void processSpectrum(Crux::Spectrum* spectrum);
+  // call between files, so that spectra of different files are not paired
   void clearBins();
 
+  // so that spectra can be processed while another pass (e.g. conversion to
+  // spectrumrecords) parses them
+  virtual void handleSpectrum(Crux::Spectrum* spectrum);
+
   // this is to be run after all spectra have been processed;
   // fits the mixed model to the mixed distributions of m/z differences
   void calcMassErrorDist(
@@ -78,7 +85,7 @@ class ParamMedicErrorCalculator {
   int numFragmentBins_;
   int numMultipleFragBins_;
   int numSingleFragBins_;
-  // map from bin index to current spectrum
+  // map from bin index to (a copy of the top fragments of) current spectrum
   std::map<int, Crux::Spectrum*> spectra_;
   // the paired peak values that we'll use to estimate mass error
   std::vector< std::pair<const Peak*, const Peak*> > pairedFragmentPeaks_;
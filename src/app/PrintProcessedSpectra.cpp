@@ -88,6 +88,7 @@ int PrintProcessedSpectra::main(int argc, char** argv) {
     // print processed spectrum
     cur_spectrum->printProcessedPeaks(cur_zstate,
                                       intensities, max_mz_bin, output_ms2);
+    free(intensities);
   }
 
   // close output file
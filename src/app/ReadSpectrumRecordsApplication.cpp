@@ -30,8 +30,8 @@ int ReadSpectrumRecordsApplication::main(int argc, char** argv) {
       cout << ", " << j->getCharge();
     }
     cout << endl;
-    for (PeakIterator j = (*i)->begin(); j != (*i)->end(); j++) {
-      cout << (*j)->getLocation() << " " << (*j)->getIntensity() << endl;
+    for (int j = 0; j < (*i)->getNumPeaks(); j++) {
+      cout << (*i)->getPeakMz(j) << " " << (*i)->getPeakIntensity(j) << endl;
     }
   }
 
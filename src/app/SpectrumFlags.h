@@ -0,0 +1,58 @@
+// SpectrumFlags records which spectra cascade-search has already identified,
+// so that later steps of the cascade skip them. A spectrum is identified by
+// the name of its spectrum file and by scan * 10 + charge (charges are
+// required to be less than 10). Each file has a bitset indexed by that
+// number, so that a lookup is a single bit test.
+//
+// AssignConfidenceApplication sets the flags between searches, and the
+// tide-search threads only read them, so no locking is needed.
+
+#ifndef SPECTRUM_FLAGS_H
+#define SPECTRUM_FLAGS_H
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+class SpectrumFlags {
+ public:
+  SpectrumFlags() : count_(0) {}
+
+  static unsigned int Id(int scan, int charge) { return scan * 10 + charge; }
+
+  void Set(const std::string& file, unsigned int id) {
+    std::vector<bool>& bits = files_[file];
+    if (id >= bits.size()) {
+      bits.resize(std::max<size_t>(id + 1, bits.size() * 2));
+    }
+    if (!bits[id]) {
+      bits[id] = true;
+      ++count_;
+    }
+  }
+
+  bool Get(const std::string& file, unsigned int id) const {
+    return Get(File(file), id);
+  }
+
+  // The flags of one file, or NULL if none of its spectra is flagged. Look
+  // them up once per file rather than once per spectrum.
+  const std::vector<bool>* File(const std::string& file) const {
+    std::map<std::string, std::vector<bool> >::const_iterator i = files_.find(file);
+    return i != files_.end() ? &i->second : NULL;
+  }
+
+  static bool Get(const std::vector<bool>* bits, unsigned int id) {
+    return bits != NULL && id < bits->size() && (*bits)[id];
+  }
+
+  // Number of flagged spectra.
+  size_t Count() const { return count_; }
+
+ private:
+  std::map<std::string, std::vector<bool> > files_;
+  size_t count_;
+};
+
+#endif // SPECTRUM_FLAGS_H
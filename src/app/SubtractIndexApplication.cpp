@@ -130,6 +130,8 @@ int SubtractIndexApplication::main(int argc, char** argv) {
   pb::Header_PeptidesHeader* subheader = new_header.mutable_peptides_header();
   subheader->CopyFrom(peptides_header1.peptides_header());
   subheader->set_has_peaks(true);
+  // The residue mass counts no longer match the remaining peptides.
+  subheader->clear_residue_mass_counts();
   pb::Header_Source* source = new_header.add_source();
   source->mutable_header()->CopyFrom(peptides_header1);
   HeadedRecordWriter writer(out_peptides, new_header);
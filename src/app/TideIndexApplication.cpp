@@ -1,5 +1,6 @@
 #include <cstdio>
 #include <fstream>
+#include <boost/thread.hpp>
 #include "io/carp.h"
 #include "util/CarpStreamBuf.h"
 #include "util/AminoAcidUtil.h"
@@ -14,11 +15,14 @@
 
 #ifdef _MSC_VER
 #include <io.h>
+#include <windows.h>
 #endif
 
 extern void AddTheoreticalPeaks(const vector<const pb::Protein*>& proteins,
                                 const string& input_filename,
-                                const string& output_filename);
+                                const string& output_filename,
+                                bool precompute, double bin_width,
+                                double bin_offset, bool mapped);
 extern void AddMods(HeadedRecordReader* reader,
                     string out_file,
                     string tmpDir,                    
@@ -28,6 +32,11 @@ extern void AddMods(HeadedRecordReader* reader,
 DECLARE_int32(max_mods);
 DECLARE_int32(min_mods);
 DECLARE_int32(modsoutputter_file_threshold);
+DECLARE_int32(mods_memory_limit);
+
+/* Number of proteins that are read from the FASTA file and then digested in
+ * parallel before their peptides are added to the index. */
+const size_t TideIndexApplication::PROTEIN_BATCH_SIZE = 16384;
 
 TideIndexApplication::TideIndexApplication() {
 }
@@ -66,6 +75,7 @@ int TideIndexApplication::main(
   FLAGS_max_mods = Params::GetInt("max-mods");
   FLAGS_min_mods = Params::GetInt("min-mods");
   FLAGS_modsoutputter_file_threshold = Params::GetInt("modsoutputter-threshold");
+  FLAGS_mods_memory_limit = Params::GetInt("mods-memory-limit");
   bool allowDups = Params::GetBool("allow-dups");
   if (FLAGS_min_mods > FLAGS_max_mods) {
     carp(CARP_FATAL, "The value for 'min-mods' cannot be greater than the value "
@@ -167,8 +177,11 @@ int TideIndexApplication::main(
   carp(CARP_INFO, "Reading %s and computing unmodified peptides...",
        fasta.c_str());
   pb::Header proteinPbHeader;
-  vector<TideIndexPeptide> peptideHeap;
   vector<string*> proteinSequences;
+  size_t maxPeptidesInMemory = (size_t)Params::GetInt("memory-limit") *
+    (1 << 20) / sizeof(TideIndexPeptide);
+  PeptideHeap peptideHeap(maxPeptidesInMemory, Params::GetString("temp-dir"),
+                          proteinSequences);
   fastaToPb(cmd_line, enzyme_t, digestion, missed_cleavages, min_mass, max_mass,
             min_length, max_length, allowDups, mass_type, decoy_type, fasta, out_proteins,
             proteinPbHeader, peptideHeap, proteinSequences, out_decoy_fasta);
@@ -238,7 +251,6 @@ int TideIndexApplication::main(
        ++i) {
     delete *i;
   }
-  vector<TideIndexPeptide>().swap(peptideHeap);
   ProteinVec proteins;
   if (!ReadRecordsToVector<pb::Protein>(&proteins, out_proteins)) {
     carp(CARP_FATAL, "Error reading proteins file");
@@ -321,7 +333,11 @@ int TideIndexApplication::main(
   }
 
   carp(CARP_INFO, "Precomputing theoretical spectra...");
-  AddTheoreticalPeaks(proteins, peakless_peptides, out_peptides);
+  AddTheoreticalPeaks(proteins, peakless_peptides, out_peptides,
+                      Params::GetBool("precompute-peaks"),
+                      Params::GetDouble("mz-bin-width"),
+                      Params::GetDouble("mz-bin-offset"),
+                      Params::GetBool("mapped-index"));
 
   // Clean up
   for (vector<const pb::Protein*>::iterator i = proteins.begin();
@@ -391,23 +407,30 @@ vector<string> TideIndexApplication::getOptions() const {
     "enzyme",
     "isotopic-mass",
     "keep-terminal-aminos",
+    "mapped-index",
     "mass-precision",
     "max-length",
     "max-mass",
     "max-mods",
+    "memory-limit",
     "min-length",
     "min-mass",
     "min-mods",
     "missed-cleavages",
     "mod-precision",
+    "mods-memory-limit",
     "mods-spec",
+    "mz-bin-offset",
+    "mz-bin-width",
     "nterm-peptide-mods-spec",
     "nterm-protein-mods-spec",
     "num-decoys-per-target",
+    "num-threads",
     "output-dir",
     "overwrite",
     "parameter-file",
     "peptide-list",
+    "precompute-peaks",
     "seed",
     "temp-dir",
     "verbosity"
@@ -438,6 +461,67 @@ COMMAND_T TideIndexApplication::getCommand() const {
   return TIDE_INDEX_COMMAND;
 }
 
+struct TideIndexApplication::DigestedProtein {
+  vector<GeneratePeptides::CleavedPeptide> peptides;
+  vector<FLOAT_T> masses; // calcPepMassTide() of each peptide
+};
+
+// Digests every numThreads'th sequence, starting at first.
+struct TideIndexApplication::DigestTask {
+  const vector<string*>* sequences;
+  vector<DigestedProtein>* digested;
+  int first;
+  int numThreads;
+  ENZYME_T enzyme;
+  DIGEST_T digestion;
+  int missedCleavages;
+  int minLength;
+  int maxLength;
+  MASS_TYPE_T massType;
+
+  void operator()() const {
+    for (size_t i = first; i < sequences->size(); i += numThreads) {
+      DigestedProtein& out = (*digested)[i];
+      out.peptides = GeneratePeptides::cleaveProtein(
+        *(*sequences)[i], enzyme, digestion, missedCleavages, minLength, maxLength);
+      out.masses.clear();
+      for (vector<GeneratePeptides::CleavedPeptide>::const_iterator j = out.peptides.begin();
+           j != out.peptides.end();
+           ++j) {
+        out.masses.push_back(calcPepMassTide(j->Sequence(), massType));
+      }
+    }
+  }
+};
+
+void TideIndexApplication::digestProteins(
+  const vector<string*>& sequences,
+  int numThreads,
+  ENZYME_T enzyme,
+  DIGEST_T digestion,
+  int missedCleavages,
+  int minLength,
+  int maxLength,
+  MASS_TYPE_T massType,
+  vector<DigestedProtein>& outDigested
+) {
+  outDigested.resize(sequences.size());
+  // calcPepMassTide() only reads the MassConstants tables, which main()
+  // initialized before any thread starts.
+
+  boost::thread_group threads;
+  for (int t = 0; t < numThreads; t++) {
+    DigestTask task = { &sequences, &outDigested, t, numThreads, enzyme, digestion,
+                        missedCleavages, minLength, maxLength, massType };
+    if (t < numThreads - 1) {
+      threads.create_thread(task);
+    } else {
+      task();
+    }
+  }
+  threads.join_all();
+}
+
 void TideIndexApplication::fastaToPb(
   const string& commandLine,
   const ENZYME_T enzyme,
@@ -453,7 +537,7 @@ void TideIndexApplication::fastaToPb(
   const string& fasta,
   const string& proteinPbFile,
   pb::Header& outProteinPbHeader,
-  vector<TideIndexPeptide>& outPeptideHeap,
+  PeptideHeap& outPeptideHeap,
   vector<string*>& outProteinSequences,
   ofstream* decoyFasta
 ) {
@@ -469,7 +553,6 @@ void TideIndexApplication::fastaToPb(
   unsigned int invalidPepCnt = 0;
   unsigned int failedDecoyCnt = 0;
 
-  outPeptideHeap.clear();
   outProteinSequences.clear();
 
   HeadedRecordWriter proteinWriter(proteinPbFile, outProteinPbHeader);
@@ -477,49 +560,68 @@ void TideIndexApplication::fastaToPb(
   string proteinName;
   string* proteinSequence = new string;
   int curProtein = -1;
-  vector< pair< ProteinInfo, vector<PeptideInfo> > > cleavedPeptideInfo;
+  // The peptides of each protein are not kept after they have been added to
+  // the heap; the passes below that need them digest the proteins again.
+  vector<ProteinInfo> proteinInfo;
   set<string> setTargets, setDecoys;
   map<const string*, TargetInfo> targetInfo;
 
-  // Iterate over all proteins in FASTA file
+  int numThreads = Params::GetInt("num-threads");
+  if (numThreads < 1) {
+    numThreads = max(1u, boost::thread::hardware_concurrency());
+  }
+  vector<DigestedProtein> digested;
+
+  // Iterate over all proteins in FASTA file. They are read in batches; each
+  // batch is digested in parallel and then added in FASTA order, so the
+  // results are the same for any number of threads.
   unsigned int targetsGenerated = 0, decoysGenerated = 0;
-  while (GeneratePeptides::getNextProtein(fastaStream, &proteinName, proteinSequence)) {
-    outProteinSequences.push_back(proteinSequence);
-    cleavedPeptideInfo.push_back(make_pair(
-      ProteinInfo(proteinName, proteinSequence), vector<PeptideInfo>()));
-    const ProteinInfo& proteinInfo = cleavedPeptideInfo.back().first;
-    vector<PeptideInfo>& cleavedPeptides = cleavedPeptideInfo.back().second;
-    // Write pb::Protein
-    writePbProtein(proteinWriter, ++curProtein, proteinName, *proteinSequence);
-    cleavedPeptides = GeneratePeptides::cleaveProtein(
-      *proteinSequence, enzyme, digestion, missedCleavages, minLength, maxLength);
-    // Iterate over all generated peptides for this protein
-    for (vector<PeptideInfo>::iterator i = cleavedPeptides.begin();
-         i != cleavedPeptides.end(); ) {
-      FLOAT_T pepMass = calcPepMassTide(i->Sequence(), massType);
-      if (pepMass < 0.0) {
-        // Sequence contained some invalid character
-        carp(CARP_DEBUG, "Ignoring invalid sequence <%s>", i->Sequence().c_str());
-        ++invalidPepCnt;
-        i = cleavedPeptides.erase(i);
-        continue;
-      } else if (pepMass < minMass || pepMass > maxMass) {
-        // Skip to next peptide if not in mass range
-        ++i;
-        continue;
-      }
-      // Add target to heap
-      TideIndexPeptide pepTarget(pepMass, i->Length(), proteinSequence, curProtein, i->Position());
-      outPeptideHeap.push_back(pepTarget);
-      push_heap(outPeptideHeap.begin(), outPeptideHeap.end(), greater<TideIndexPeptide>());
-      if (!allowDups && decoyType != NO_DECOYS) {
-        const string* setTarget = &*(setTargets.insert(i->Sequence()).first);
-        targetInfo.insert(make_pair(setTarget, TargetInfo(proteinInfo, i->Position(), pepMass)));
+  bool moreProteins = true;
+  while (moreProteins) {
+    size_t batchBegin = proteinInfo.size();
+    vector<string*> batch;
+    while (batch.size() < PROTEIN_BATCH_SIZE &&
+           (moreProteins = GeneratePeptides::getNextProtein(
+              fastaStream, &proteinName, proteinSequence))) {
+      outProteinSequences.push_back(proteinSequence);
+      proteinInfo.push_back(ProteinInfo(proteinName, proteinSequence));
+      batch.push_back(proteinSequence);
+      proteinSequence = new string;
+    }
+    digestProteins(batch, numThreads, enzyme, digestion, missedCleavages,
+                   minLength, maxLength, massType, digested);
+
+    for (size_t b = 0; b < batch.size(); ++b) {
+      const ProteinInfo& protein = proteinInfo[batchBegin + b];
+      const vector<FLOAT_T>& masses = digested[b].masses;
+      // Write pb::Protein
+      writePbProtein(proteinWriter, ++curProtein, protein.name,
+                     *protein.sequence);
+      // Iterate over all generated peptides for this protein
+      for (size_t i = 0; i < digested[b].peptides.size(); ++i) {
+        const PeptideInfo& peptide = digested[b].peptides[i];
+        FLOAT_T pepMass = masses[i];
+        if (pepMass < 0.0) {
+          // Sequence contained some invalid character
+          carp(CARP_DEBUG, "Ignoring invalid sequence <%s>", peptide.Sequence().c_str());
+          ++invalidPepCnt;
+          continue;
+        }
+        if (pepMass < minMass || pepMass > maxMass) {
+          // Skip to next peptide if not in mass range
+          continue;
+        }
+        // Add target to heap
+        TideIndexPeptide pepTarget(pepMass, peptide.Length(), batch[b],
+                                   curProtein, peptide.Position());
+        outPeptideHeap.push(pepTarget);
+        if (!allowDups && decoyType != NO_DECOYS) {
+          const string* setTarget = &*(setTargets.insert(peptide.Sequence()).first);
+          targetInfo.insert(make_pair(setTarget, TargetInfo(batchBegin + b, peptide.Position(), pepMass)));
+        }
+        ++targetsGenerated;
       }
-      ++targetsGenerated;
-      ++i;
     }
-    proteinSequence = new string;
   }
   delete proteinSequence;
   if (targetsGenerated == 0) {
@@ -538,47 +640,59 @@ void TideIndexApplication::fastaToPb(
     if (decoyFasta) {
       carp(CARP_INFO, "Writing reverse-protein fasta and decoys...");
     }
-    for (vector< pair< ProteinInfo, vector<PeptideInfo> > >::const_iterator i =
-         cleavedPeptideInfo.begin(); i != cleavedPeptideInfo.end(); ++i) {
-      string decoyProtein = *(i->first.sequence);
-      reverse(decoyProtein.begin(), decoyProtein.end());
-      if (decoyFasta) {
-        (*decoyFasta) << ">"<< decoyPrefix << i->first.name << endl
-                      << decoyProtein << endl;
+    // Reversed proteins are digested in parallel batches, like the targets.
+    for (size_t batchBegin = 0; batchBegin < proteinInfo.size();
+         batchBegin += PROTEIN_BATCH_SIZE) {
+      size_t batchEnd = min(batchBegin + PROTEIN_BATCH_SIZE, proteinInfo.size());
+      vector<string> reversed(batchEnd - batchBegin);
+      vector<string*> batch;
+      for (size_t b = batchBegin; b < batchEnd; ++b) {
+        string& decoyProtein = reversed[b - batchBegin];
+        decoyProtein = *(proteinInfo[b].sequence);
+        reverse(decoyProtein.begin(), decoyProtein.end());
+        batch.push_back(&decoyProtein);
       }
-      vector<PeptideInfo> cleavedReverse = GeneratePeptides::cleaveProtein(
-        decoyProtein, enzyme, digestion, missedCleavages, minLength, maxLength);
-      // Iterate over all generated peptides for this protein
-      for (vector<PeptideInfo>::iterator j = cleavedReverse.begin();
-           j != cleavedReverse.end();
-           ++j) {
-        FLOAT_T pepMass = calcPepMassTide(j->Sequence(), massType);
-        if (pepMass < 0.0) {
-          // Sequence contained some invalid character
-          carp(CARP_DEBUG, "Ignoring invalid sequence in decoy fasta <%s>",
-               j->Sequence().c_str());
-          ++invalidPepCnt;
-          continue;
-        } else if (pepMass < minMass || pepMass > maxMass) {
-          // Skip to next peptide if not in mass range
-          continue;
-        } else if (!allowDups && setTargets.find(j->Sequence()) != setTargets.end()) {
-          // Sequence already exists as a target
-          continue;
+      digestProteins(batch, numThreads, enzyme, digestion, missedCleavages,
+                     minLength, maxLength, massType, digested);
+      for (size_t b = batchBegin; b < batchEnd; ++b) {
+        const ProteinInfo& protein = proteinInfo[b];
+        const string& decoyProtein = reversed[b - batchBegin];
+        if (decoyFasta) {
+          (*decoyFasta) << ">"<< decoyPrefix << protein.name << endl
+                        << decoyProtein << endl;
+        }
+        const vector<PeptideInfo>& cleavedReverse = digested[b - batchBegin].peptides;
+        const vector<FLOAT_T>& masses = digested[b - batchBegin].masses;
+        // Iterate over all generated peptides for this protein
+        for (vector<PeptideInfo>::const_iterator j = cleavedReverse.begin();
+             j != cleavedReverse.end();
+             ++j) {
+          FLOAT_T pepMass = masses[j - cleavedReverse.begin()];
+          if (pepMass < 0.0) {
+            // Sequence contained some invalid character
+            carp(CARP_DEBUG, "Ignoring invalid sequence in decoy fasta <%s>",
+                 j->Sequence().c_str());
+            ++invalidPepCnt;
+            continue;
+          } else if (pepMass < minMass || pepMass > maxMass) {
+            // Skip to next peptide if not in mass range
+            continue;
+          } else if (!allowDups && setTargets.find(j->Sequence()) != setTargets.end()) {
+            // Sequence already exists as a target
+            continue;
+          }
+          string* decoySequence = new string(j->Sequence());
+          outProteinSequences.push_back(decoySequence);
+
+          // Write pb::Protein
+          writeDecoyPbProtein(++curProtein, ProteinInfo(protein.name, &decoyProtein),
+                              *decoySequence, j->Position(), proteinWriter);
+          // Add decoy to heap
+          TideIndexPeptide pepDecoy(pepMass, j->Length(), decoySequence,
+            curProtein, (j->Position() > 0) ? 1 : 0, 0);
+          outPeptideHeap.push(pepDecoy);
+          ++decoysGenerated;
         }
-        string* decoySequence = new string(j->Sequence());
-        outProteinSequences.push_back(decoySequence);
-
-        // Write pb::Protein
-        writeDecoyPbProtein(++curProtein, ProteinInfo(i->first.name, &decoyProtein),
-                            *decoySequence, j->Position(), proteinWriter);
-        // Add decoy to heap
-        TideIndexPeptide pepDecoy(pepMass, j->Length(), decoySequence,
-          curProtein, (j->Position() > 0) ? 1 : 0, 0);
-        outPeptideHeap.push_back(pepDecoy);
-        push_heap(outPeptideHeap.begin(), outPeptideHeap.end(),
-          greater<TideIndexPeptide>());
-        ++decoysGenerated;
       }
     }
   } else if (!allowDups) {
@@ -588,27 +702,34 @@ void TideIndexApplication::fastaToPb(
       const string* setTarget = &*i;
       const map<const string*, TargetInfo>::iterator targetLookup =
         targetInfo.find(setTarget);
-      const ProteinInfo& proteinInfo = (targetLookup->second.proteinInfo);
+      const ProteinInfo& protein = proteinInfo[targetLookup->second.protein];
       const int startLoc = targetLookup->second.start;
       FLOAT_T pepMass = targetLookup->second.mass;
       generateDecoys(numDecoys, *setTarget, targetToDecoy, &setTargets, &setDecoys, decoyType, allowDups,
-                     failedDecoyCnt, decoysGenerated, curProtein, proteinInfo, startLoc, proteinWriter,
+                     failedDecoyCnt, decoysGenerated, curProtein, protein, startLoc, proteinWriter,
                      pepMass, outPeptideHeap, outProteinSequences);
     }
   } else { // allow dups
-    for (vector<pair<ProteinInfo, vector<PeptideInfo> > >::const_iterator i = cleavedPeptideInfo.begin();
-         i != cleavedPeptideInfo.end();
-         ++i) {
-      const ProteinInfo& proteinInfo = i->first;
-      for (vector<PeptideInfo>::const_iterator j = i->second.begin();
-           j != i->second.end();
-           ++j) {
-        const string setTarget = j->Sequence();
-        const int startLoc = j->Position();
-        FLOAT_T pepMass = calcPepMassTide(setTarget, massType);
-        generateDecoys(numDecoys, setTarget, targetToDecoy, NULL, NULL, decoyType, allowDups, failedDecoyCnt,
-                       decoysGenerated, curProtein, proteinInfo, startLoc, proteinWriter,
-                       pepMass, outPeptideHeap, outProteinSequences);
+    for (size_t batchBegin = 0; batchBegin < proteinInfo.size();
+         batchBegin += PROTEIN_BATCH_SIZE) {
+      size_t batchEnd = min(batchBegin + PROTEIN_BATCH_SIZE, proteinInfo.size());
+      vector<string*> batch(outProteinSequences.begin() + batchBegin,
+                            outProteinSequences.begin() + batchEnd);
+      digestProteins(batch, numThreads, enzyme, digestion, missedCleavages,
+                     minLength, maxLength, massType, digested);
+      for (size_t b = batchBegin; b < batchEnd; ++b) {
+        const vector<PeptideInfo>& cleavedPeptides = digested[b - batchBegin].peptides;
+        const vector<FLOAT_T>& masses = digested[b - batchBegin].masses;
+        for (size_t j = 0; j < cleavedPeptides.size(); ++j) {
+          if (masses[j] < 0.0) {
+            continue; // already counted as invalid above
+          }
+          const string setTarget = cleavedPeptides[j].Sequence();
+          const int startLoc = cleavedPeptides[j].Position();
+          generateDecoys(numDecoys, setTarget, targetToDecoy, NULL, NULL, decoyType, allowDups, failedDecoyCnt,
+                         decoysGenerated, curProtein, proteinInfo[b], startLoc, proteinWriter,
+                         masses[j], outPeptideHeap, outProteinSequences);
+        }
       }
     }
   }
@@ -621,29 +742,185 @@ void TideIndexApplication::fastaToPb(
   if (decoyFasta && decoyType != PROTEIN_REVERSE_DECOYS) {
     carp(CARP_INFO, "Writing decoy fasta...");
     // Iterate over all (protein, peptides from that protein)
-    for (vector< pair< ProteinInfo, vector<PeptideInfo> > >::const_iterator i =
-         cleavedPeptideInfo.begin(); i != cleavedPeptideInfo.end(); ++i) {
-      string decoyProtein = *(i->first.sequence);
-      // Iterate over all peptides from the protein
-      for (vector<PeptideInfo>::const_iterator j = i->second.begin();
-           j != i->second.end();
-           ++j) {
-        // In the protein sequence, replace the target peptide with its decoy
-        const string setTarget = j->Sequence();
-        const map< const string, vector<const string*> >::const_iterator decoyCheck = targetToDecoy.find(setTarget);
-        if (decoyCheck != targetToDecoy.end() && !decoyCheck->second.empty()) {
-          decoyProtein.replace(j->Position(), j->Length(), *(decoyCheck->second.front()));
+    for (size_t batchBegin = 0; batchBegin < proteinInfo.size();
+         batchBegin += PROTEIN_BATCH_SIZE) {
+      size_t batchEnd = min(batchBegin + PROTEIN_BATCH_SIZE, proteinInfo.size());
+      vector<string*> batch(outProteinSequences.begin() + batchBegin,
+                            outProteinSequences.begin() + batchEnd);
+      digestProteins(batch, numThreads, enzyme, digestion, missedCleavages,
+                     minLength, maxLength, massType, digested);
+      for (size_t b = batchBegin; b < batchEnd; ++b) {
+        string decoyProtein = *(proteinInfo[b].sequence);
+        const vector<PeptideInfo>& cleavedPeptides = digested[b - batchBegin].peptides;
+        const vector<FLOAT_T>& masses = digested[b - batchBegin].masses;
+        // Iterate over all peptides from the protein
+        for (size_t j = 0; j < cleavedPeptides.size(); ++j) {
+          if (masses[j] < 0.0) {
+            continue;
+          }
+          // In the protein sequence, replace the target peptide with its decoy
+          const string setTarget = cleavedPeptides[j].Sequence();
+          const map< const string, vector<const string*> >::const_iterator decoyCheck = targetToDecoy.find(setTarget);
+          if (decoyCheck != targetToDecoy.end() && !decoyCheck->second.empty()) {
+            decoyProtein.replace(cleavedPeptides[j].Position(), cleavedPeptides[j].Length(),
+                                 *(decoyCheck->second.front()));
+          }
         }
+        // Write out the final protein
+        (*decoyFasta) << ">" << decoyPrefix << proteinInfo[b].name << endl
+                      << decoyProtein << endl;
       }
-      // Write out the final protein
-      (*decoyFasta) << ">" << decoyPrefix << i->first.name << endl
-                    << decoyProtein << endl;
     }
   }
 }
 
+namespace {
+// What is written to the temporary files of a PeptideHeap for each peptide.
+struct SpilledPeptide {
+  double mass;
+  int length;
+  int proteinId;
+  int proteinPos;
+  int decoyIdx;
+};
+}
+
+TideIndexApplication::PeptideHeap::PeptideHeap(
+  size_t maxSize,
+  const string& tempDir,
+  const vector<string*>& proteinSequences
+) : maxSize_(maxSize), tempDir_(tempDir), proteinSequences_(proteinSequences),
+    size_(0), numRuns_(0) {
+}
+
+TideIndexApplication::PeptideHeap::~PeptideHeap() {
+  for (vector<Source>::iterator i = sources_.begin(); i != sources_.end(); ++i) {
+    if (i->file) {
+      fclose(i->file);
+    }
+  }
+  for (int i = 0; i < numRuns_; ++i) {
+    remove(runName(i).c_str());
+  }
+}
+
+string TideIndexApplication::PeptideHeap::runName(int run) const {
+  char buf[64];
+  sprintf(buf, "tide_index_peptides_partial_%d", run);
+  if (!tempDir_.empty()) {
+    return FileUtils::Join(tempDir_, buf);
+  }
+#ifdef _MSC_VER
+  char buf2[261];
+  GetTempPath(261, buf2);
+  return FileUtils::Join(string(buf2), buf);
+#else
+  return FileUtils::Join(string("/tmp/"), buf);
+#endif
+}
+
+void TideIndexApplication::PeptideHeap::push(const TideIndexPeptide& peptide) {
+  heap_.push_back(peptide);
+  push_heap(heap_.begin(), heap_.end(), greater<TideIndexPeptide>());
+  ++size_;
+  if (maxSize_ > 0 && heap_.size() >= maxSize_) {
+    spill();
+  }
+}
+
+void TideIndexApplication::PeptideHeap::spill() {
+  string name = runName(numRuns_++);
+  FILE* file = fopen(name.c_str(), "wb");
+  if (file == NULL) {
+    carp(CARP_FATAL, "Error creating temporary file %s", name.c_str());
+  }
+  carp(CARP_DEBUG, "Writing %d peptides to %s", heap_.size(), name.c_str());
+  // After sort_heap the smallest peptide is at the back.
+  sort_heap(heap_.begin(), heap_.end(), greater<TideIndexPeptide>());
+  for (vector<TideIndexPeptide>::const_reverse_iterator i = heap_.rbegin();
+       i != heap_.rend();
+       ++i) {
+    SpilledPeptide spilled;
+    spilled.mass = i->getMass();
+    spilled.length = i->getLength();
+    spilled.proteinId = i->getProteinId();
+    spilled.proteinPos = i->getProteinPos();
+    spilled.decoyIdx = i->decoyIdx();
+    if (fwrite(&spilled, sizeof(spilled), 1, file) != 1) {
+      carp(CARP_FATAL, "Error writing temporary file %s", name.c_str());
+    }
+  }
+  if (fclose(file) != 0) {
+    carp(CARP_FATAL, "Error writing temporary file %s", name.c_str());
+  }
+  heap_.clear();
+}
+
+void TideIndexApplication::PeptideHeap::finish() {
+  if (numRuns_ > 0) {
+    carp(CARP_INFO, "Merging %d sorted runs of peptides", numRuns_ + 1);
+  }
+  sort_heap(heap_.begin(), heap_.end(), greater<TideIndexPeptide>());
+  // The runs are the first sources, then the peptides still in memory.
+  current_.resize(numRuns_);
+  sources_.clear();
+  for (int i = 0; i <= numRuns_; ++i) {
+    Source source;
+    source.index = i;
+    source.file = NULL;
+    if (i < numRuns_) {
+      string name = runName(i);
+      if ((source.file = fopen(name.c_str(), "rb")) == NULL) {
+        carp(CARP_FATAL, "Error reading temporary file %s", name.c_str());
+      }
+      source.peptide = &current_[i];
+      if (!advance(source)) {
+        continue;
+      }
+    } else if (heap_.empty()) {
+      continue;
+    } else {
+      source.peptide = &heap_.back();
+    }
+    sources_.push_back(source);
+  }
+  make_heap(sources_.begin(), sources_.end(), GreaterSource());
+}
+
+void TideIndexApplication::PeptideHeap::pop() {
+  pop_heap(sources_.begin(), sources_.end(), GreaterSource());
+  Source& source = sources_.back();
+  if (source.file == NULL) {
+    heap_.pop_back();
+    if (!heap_.empty()) {
+      source.peptide = &heap_.back();
+      push_heap(sources_.begin(), sources_.end(), GreaterSource());
+      return;
+    }
+    vector<TideIndexPeptide>().swap(heap_);
+  } else if (advance(source)) {
+    push_heap(sources_.begin(), sources_.end(), GreaterSource());
+    return;
+  } else {
+    fclose(source.file);
+    remove(runName(source.index).c_str());
+  }
+  sources_.pop_back();
+}
+
+bool TideIndexApplication::PeptideHeap::advance(Source& source) {
+  SpilledPeptide spilled;
+  if (fread(&spilled, sizeof(spilled), 1, source.file) != 1) {
+    return false;
+  }
+  *source.peptide = TideIndexPeptide(
+    spilled.mass, spilled.length, proteinSequences_[spilled.proteinId],
+    spilled.proteinId, spilled.proteinPos, spilled.decoyIdx);
+  return true;
+}
+
 void TideIndexApplication::writePeptidesAndAuxLocs(
-  vector<TideIndexPeptide>& peptideHeap,
+  PeptideHeap& peptideHeap,
   const string& peptidePbFile,
   const string& auxLocsPbFile,
   pb::Header& pbHeader
@@ -711,23 +988,24 @@ void TideIndexApplication::writePeptidesAndAuxLocs(
   int numDecoys = 0;
   int numDuplicateTargets = 0;
   int numDuplicateDecoys = 0;
-  sort_heap(peptideHeap.begin(), peptideHeap.end(),
-            greater<TideIndexPeptide>());
+  // Duplicates are found and their locations collected while the sorted
+  // runs are merged, so that no run has to be read more than once.
+  peptideHeap.finish();
   while (!peptideHeap.empty()) {
-    TideIndexPeptide curPeptide(peptideHeap.back());
-    peptideHeap.pop_back();
+    TideIndexPeptide curPeptide(peptideHeap.top());
+    peptideHeap.pop();
     // For duplicate peptides we only record the location
-    while (!peptideHeap.empty() && peptideHeap.back() == curPeptide) {
-      if (peptideHeap.back().isDecoy()) {
+    while (!peptideHeap.empty() && peptideHeap.top() == curPeptide) {
+      if (peptideHeap.top().isDecoy()) {
         numDuplicateDecoys++;
       } else {
         numDuplicateTargets++;
       }        
       carp(CARP_DEBUG, "Skipping duplicate %s.", curPeptide.getSequence().c_str());
       pb::Location* location = pbAuxLoc.add_location();
-      location->set_protein_id(peptideHeap.back().getProteinId());
-      location->set_pos(peptideHeap.back().getProteinPos());
-      peptideHeap.pop_back();
+      location->set_protein_id(peptideHeap.top().getProteinId());
+      location->set_pos(peptideHeap.top().getProteinPos());
+      peptideHeap.pop();
     }
     getPbPeptide(count, curPeptide, pbPeptide);
     // Not all peptides have aux locations associated with them. Check to see
@@ -950,7 +1228,7 @@ void TideIndexApplication::generateDecoys(
   const int startLoc,
   HeadedRecordWriter& proteinWriter,
   FLOAT_T pepMass,
-  vector<TideIndexPeptide>& outPeptideHeap,
+  PeptideHeap& outPeptideHeap,
   vector<string*>& outProteinSequences
 ) {
   vector<string*> decoySequences;
@@ -1017,8 +1295,7 @@ void TideIndexApplication::generateDecoys(
     writeDecoyPbProtein(++curProtein, proteinInfo, *seq, startLoc, proteinWriter);
     // Add decoy to heap
     TideIndexPeptide pepDecoy(pepMass, setTarget.length(), seq, curProtein, (startLoc > 0) ? 1 : 0, i);
-    outPeptideHeap.push_back(pepDecoy);
-    push_heap(outPeptideHeap.begin(), outPeptideHeap.end(), greater<TideIndexPeptide>());
+    outPeptideHeap.push(pepDecoy);
   }
   decoysGenerated += decoySequences.size();
  }
@@ -77,6 +77,9 @@ class TideIndexApplication : public CruxApplication {
 
   virtual COMMAND_T getCommand() const;
 
+  // See TideIndexApplication.cpp for a description of this constant
+  static const size_t PROTEIN_BATCH_SIZE;
+
  protected:
 
   class TideIndexPeptide {
@@ -102,14 +105,6 @@ class TideIndexApplication : public CruxApplication {
       }
       decoyIdx_ = decoyIdx;
     }
-    TideIndexPeptide(const TideIndexPeptide& other) {
-      mass_ = other.mass_;
-      length_ = other.length_;
-      proteinId_ = other.proteinId_;
-      proteinPos_ = other.proteinPos_;
-      residues_ = other.residues_;
-      decoyIdx_ = other.decoyIdx_;
-    }
     double getMass() const { return mass_; }
     int getLength() const { return length_; }
     int getProteinId() const { return proteinId_; }
@@ -135,7 +130,13 @@ class TideIndexApplication : public CruxApplication {
       if (lhs.decoyIdx_ != rhs.decoyIdx_) {
         return lhs.decoyIdx_ > rhs.decoyIdx_;
       }
-      return false;
+      // Equal peptides are ordered by location, so that the first location
+      // (the one stored with the peptide) does not depend on the order in
+      // which they were added.
+      if (lhs.proteinId_ != rhs.proteinId_) {
+        return lhs.proteinId_ > rhs.proteinId_;
+      }
+      return lhs.proteinPos_ > rhs.proteinPos_;
     }
     friend bool operator ==(
       const TideIndexPeptide& lhs, const TideIndexPeptide& rhs) {
@@ -145,6 +146,64 @@ class TideIndexApplication : public CruxApplication {
     }
   };
 
+  /**
+   * Sorts the peptides of the index by mass, length, sequence, decoy index
+   * and location, like a heap that is only emptied after all peptides have been added.
+   * If maxSize > 0, at most maxSize peptides are kept in memory; whenever that
+   * many have been added, they are sorted and written to a temporary file in
+   * tempDir (a run), and the runs are merged when the peptides are popped.
+   * Only the numbers of a peptide are written; its residues are found again
+   * in proteinSequences, which is indexed by protein id. maxSize bounds only
+   * this sort; the proteins themselves stay in memory.
+   */
+  class PeptideHeap {
+   public:
+    PeptideHeap(size_t maxSize, const std::string& tempDir,
+                const std::vector<string*>& proteinSequences);
+    ~PeptideHeap();
+
+    void push(const TideIndexPeptide& peptide);
+    // Number of peptides pushed so far.
+    size_t size() const { return size_; }
+
+    // Call after the last push() and before popping.
+    void finish();
+    bool empty() const { return sources_.empty(); }
+    // Smallest remaining peptide. The order does not depend on maxSize.
+    const TideIndexPeptide& top() const { return *sources_.front().peptide; }
+    void pop();
+
+   private:
+    struct Source {
+      FILE* file;  // NULL for the peptides still in memory
+      int index;
+      TideIndexPeptide* peptide;
+    };
+    struct GreaterSource {
+      bool operator()(const Source& lhs, const Source& rhs) const {
+        if (*lhs.peptide > *rhs.peptide) {
+          return true;
+        } else if (*rhs.peptide > *lhs.peptide) {
+          return false;
+        }
+        return lhs.index > rhs.index;
+      }
+    };
+
+    std::string runName(int run) const;
+    void spill();
+    bool advance(Source& source);
+
+    size_t maxSize_;
+    std::string tempDir_;
+    const std::vector<string*>& proteinSequences_;
+    std::vector<TideIndexPeptide> heap_;
+    size_t size_;
+    int numRuns_;
+    std::vector<TideIndexPeptide> current_;  // one per source
+    std::vector<Source> sources_;  // heap of the sources that are not empty
+  };
+
   struct ProteinInfo {
     string name;
     const string* sequence;
@@ -153,13 +212,34 @@ class TideIndexApplication : public CruxApplication {
   };
 
   struct TargetInfo {
-    ProteinInfo proteinInfo;
+    int protein;  // index of the target protein, in FASTA order
     int start;
     FLOAT_T mass;
-    TargetInfo(const ProteinInfo& protein, int startLoc, FLOAT_T pepMass)
-      : proteinInfo(protein), start(startLoc), mass(pepMass) {}
+    TargetInfo(int proteinIdx, int startLoc, FLOAT_T pepMass)
+      : protein(proteinIdx), start(startLoc), mass(pepMass) {}
   };
 
+  // The peptides of one protein and their masses (see digestProteins()), and
+  // the work of one digestion thread.
+  struct DigestedProtein;
+  struct DigestTask;
+
+  /**
+   * Digest each of sequences into the same element of outDigested, with
+   * numThreads threads. The results do not depend on the number of threads.
+   */
+  static void digestProteins(
+    const std::vector<std::string*>& sequences,
+    int numThreads,
+    ENZYME_T enzyme,
+    DIGEST_T digestion,
+    int missedCleavages,
+    int minLength,
+    int maxLength,
+    MASS_TYPE_T massType,
+    std::vector<DigestedProtein>& outDigested
+  );
+
   static void fastaToPb(
     const std::string& commandLine,
     const ENZYME_T enzyme,
@@ -175,13 +255,13 @@ class TideIndexApplication : public CruxApplication {
     const std::string& fasta,
     const std::string& proteinPbFile,
     pb::Header& outProteinPbHeader,
-    std::vector<TideIndexPeptide>& outPeptideHeap,
+    PeptideHeap& outPeptideHeap,
     std::vector<string*>& outProteinSequences,
     std::ofstream* decoyFasta
   );
 
   static void writePeptidesAndAuxLocs(
-    std::vector<TideIndexPeptide>& peptideHeap, // will be destroyed.
+    PeptideHeap& peptideHeap, // will be emptied.
     const std::string& peptidePbFile,
     const std::string& auxLocsPbFile,
     pb::Header& pbHeader
@@ -239,7 +319,7 @@ class TideIndexApplication : public CruxApplication {
     const int startLoc,
     HeadedRecordWriter& proteinWriter,
     FLOAT_T pepMass,
-    vector<TideIndexPeptide>& outPeptideHeap,
+    PeptideHeap& outPeptideHeap,
     vector<string*>& outProteinSequences
   );
 
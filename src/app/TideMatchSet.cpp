@@ -13,19 +13,28 @@
 #include "TideIndexApplication.h"
 #include "TideMatchSet.h"
 #include "TideSearchApplication.h"
+#include "io/MatchCollectionParser.h"
+#include "model/PeptideSrc.h"
 #include "util/Params.h"
 #include "util/StringUtils.h"
 
 string TideMatchSet::CleavageType;
+Database* TideMatchSet::MatchDatabase = NULL;
+Database* TideMatchSet::MatchDecoyDatabase = NULL;
 char TideMatchSet::match_collection_loc_[] = {0};
 char TideMatchSet::decoy_match_collection_loc_[] = {0};
 
+// Search threads share the match databases and Match's file paths.
+static boost::mutex match_database_mutex;
+
 TideMatchSet::TideMatchSet(Arr* matches, double max_mz)
-  : matches_(matches), max_mz_(max_mz), exact_pval_search_(false), elution_window_(0) {
+  : matches_(matches), max_mz_(max_mz), exact_pval_search_(false), elution_window_(0),
+    target_matches_(NULL), decoy_matches_(NULL) {
 }
 
 TideMatchSet::TideMatchSet(Peptide* peptide, double max_mz)
-  : peptide_(peptide), max_mz_(max_mz), exact_pval_search_(false), elution_window_(0) {
+  : peptide_(peptide), max_mz_(max_mz), exact_pval_search_(false), elution_window_(0),
+    target_matches_(NULL), decoy_matches_(NULL) {
 }
 
 TideMatchSet::~TideMatchSet() {
@@ -252,8 +261,8 @@ void TideMatchSet::writeToFile(
  * This is for writing tab-delimited only
  */
 void TideMatchSet::report(
-  ofstream* target_file,  ///< target file to write to
-  ofstream* decoy_file, ///< decoy file to write to
+  ostream* target_file,  ///< target file to write to
+  ostream* decoy_file, ///< decoy file to write to
   int top_n,  ///< number of matches to report
   int decoys_per_target,
   const string& spectrum_filename, ///< name of spectrum file
@@ -263,8 +272,7 @@ void TideMatchSet::report(
   const ProteinVec& proteins,  ///< proteins corresponding with peptides
   const vector<const pb::AuxLocation*>& locations,  ///< auxiliary locations
   bool compute_sp, ///< whether to compute sp or not
-  bool highScoreBest, //< indicates semantics of score magnitude
-  boost::mutex * rwlock
+  bool highScoreBest //< indicates semantics of score magnitude
 ) {
   if (matches_->empty()) {
     return;
@@ -287,19 +295,28 @@ void TideMatchSet::report(
     computeSpData(targets, &sp_map, &sp_scorer, peptides);
     computeSpData(decoys, &sp_map, &sp_scorer, peptides);
   }
+  if (target_matches_) {
+    addToMatches(target_matches_, top_n, decoys_per_target, targets, spectrum_filename, spectrum,
+                 charge, peptides, proteins, locations, delta_cn_map, delta_lcn_map,
+                 compute_sp ? &sp_map : NULL);
+    addToMatches(decoy_matches_, top_n, decoys_per_target, decoys, spectrum_filename, spectrum,
+                 charge, peptides, proteins, locations, delta_cn_map, delta_lcn_map,
+                 compute_sp ? &sp_map : NULL);
+    return;
+  }
   writeToFile(target_file, top_n, decoys_per_target, targets, spectrum_filename, spectrum, charge,
               peptides, proteins, locations, delta_cn_map, delta_lcn_map,
-              compute_sp ? &sp_map : NULL, rwlock);
+              compute_sp ? &sp_map : NULL);
   writeToFile(decoy_file, top_n, decoys_per_target, decoys, spectrum_filename, spectrum, charge,
               peptides, proteins, locations, delta_cn_map, delta_lcn_map,
-              compute_sp ? &sp_map : NULL, rwlock);
+              compute_sp ? &sp_map : NULL);
 }
 
 /**
  * Helper function for tab delimited report function
  */
 void TideMatchSet::writeToFile(
-  ofstream* file,
+  ostream* file,
   int top_n,
   int decoys_per_target,
   const vector<Arr::iterator>& vec,
@@ -311,8 +328,7 @@ void TideMatchSet::writeToFile(
   const vector<const pb::AuxLocation*>& locations,
   const map<Arr::iterator, FLOAT_T>& delta_cn_map,
   const map<Arr::iterator, FLOAT_T>& delta_lcn_map,
-  const map<Arr::iterator, pair<const SpScorer::SpScoreData, int> >* sp_map,
-  boost::mutex * rwlock
+  const map<Arr::iterator, pair<const SpScorer::SpScoreData, int> >* sp_map
 ) {
   if (!file || vec.empty()) {
     return;
@@ -372,7 +388,6 @@ void TideMatchSet::writeToFile(
     Crux::Peptide cruxPep = getCruxPeptide(peptide);
     const SpScorer::SpScoreData* sp_data = sp_map ? &(sp_map->at(i).first) : NULL;
 
-    rwlock->lock();
     if (Params::GetBool("file-column")) {
       *file << spectrum_filename << '\t';
     }
@@ -455,9 +470,171 @@ void TideMatchSet::writeToFile(
         *file << '\t';
       }
     }
-    *file << endl;
-    rwlock->unlock();
+    *file << '\n';
+  }
+}
+
+/**
+ * Helper function for the spectrum centric report function that adds the
+ * matches to a vector instead of writing them. Each match is made the way
+ * MatchFileReader::parse() makes it from the row that writeToFile() would
+ * write, except that the masses and scores are not rounded.
+ */
+void TideMatchSet::addToMatches(
+  vector<Crux::Match*>* matches,
+  int top_n,
+  int decoys_per_target,
+  const vector<Arr::iterator>& vec,
+  const string& spectrum_filename,
+  const Spectrum* spectrum,
+  int charge,
+  const ActivePeptideQueue* peptides,
+  const ProteinVec& proteins,
+  const vector<const pb::AuxLocation*>& locations,
+  const map<Arr::iterator, FLOAT_T>& delta_cn_map,
+  const map<Arr::iterator, FLOAT_T>& delta_lcn_map,
+  const map<Arr::iterator, pair<const SpScorer::SpScoreData, int> >* sp_map
+) {
+  if (!matches || vec.empty()) {
+    return;
+  }
+
+  const bool concat = Params::GetBool("concat");
+  const string filename = Params::GetBool("file-column") ? spectrum_filename : "";
+  const string decoy_prefix = Params::GetString("decoy-prefix");
+  const int concatDistinctMatches = peptides->ActiveTargets() + peptides->ActiveDecoys();
+  map<int, int> decoyWriteCount;
+
+  for (size_t idx = 0; idx < vec.size(); idx++) {
+    const Arr::iterator& i = vec[idx];
+    const Peptide* peptide = peptides->GetPeptide(i->rank);
+    size_t rank;
+    if (concat || !peptide->IsDecoy() || decoys_per_target <= 1) {
+      if (idx >= top_n) {
+        return;
+      }
+      rank = idx + 1;
+    } else {
+      int decoyIdx = peptide->DecoyIdx();
+      map<int, int>::iterator j = decoyWriteCount.find(decoyIdx);
+      if (j == decoyWriteCount.end()) {
+        j = decoyWriteCount.insert(make_pair(decoyIdx, 0)).first;
+      }
+      if (j->second >= top_n) {
+        continue;
+      }
+      rank = ++(j->second);
+    }
+
+    Crux::Peptide* cruxPep = new Crux::Peptide(peptide->Seq(), getMods(peptide));
+    const pb::Protein* protein = proteins[peptide->FirstLocProteinId()];
+    bool nullPeptide = StringUtils::StartsWith(protein->name(), decoy_prefix);
+    addPeptideSrc(cruxPep, peptide, protein, peptide->FirstLocPos());
+    if (peptide->HasAuxLocationsIndex()) {
+      const pb::AuxLocation* aux = locations[peptide->AuxLocationsIndex()];
+      for (int j = 0; j < aux->location_size(); j++) {
+        const pb::Location& location = aux->location(j);
+        addPeptideSrc(cruxPep, peptide, proteins[location.protein_id()], location.pos());
+      }
+    }
+
+    Crux::Spectrum* cruxSpectrum = new Crux::Spectrum(
+      spectrum->SpectrumNumber(), spectrum->SpectrumNumber(), spectrum->PrecursorMZ(),
+      vector<int>(1, charge), filename);
+    Crux::Match* match = new Crux::Match(cruxPep, cruxSpectrum,
+      SpectrumZState((spectrum->PrecursorMZ() - MASS_PROTON) * charge, charge), false);
+    match->setPostProcess(true);
+    if (!filename.empty()) {
+      boost::mutex::scoped_lock lock(match_database_mutex);
+      match->setFilePath(filename);
+    }
+
+    if (sp_map) {
+      const SpScorer::SpScoreData& sp_data = sp_map->at(i).first;
+      match->setScore(SP, sp_data.sp_score);
+      match->setRank(SP, sp_map->at(i).second);
+      match->setScore(BY_IONS_MATCHED, sp_data.matched_ions);
+      match->setScore(BY_IONS_TOTAL, sp_data.total_ions);
+    } else {
+      match->setScore(SP, NOT_SCORED);
+      match->setRank(SP, 0);
+    }
+    match->setScore(DELTA_CN, delta_cn_map.at(i));
+    match->setScore(DELTA_LCN, delta_lcn_map.at(i));
+
+    // Scores missing from the file are read as -1.
+    switch (cur_score_function_) {
+    case XCORR_SCORE:
+      match->setScore(XCORR, exact_pval_search_ ? -1 : i->xcorr_score);
+      match->setRank(XCORR, rank);
+      if (exact_pval_search_) {
+        match->setScore(TIDE_SEARCH_EXACT_PVAL, i->xcorr_pval);
+        match->setScore(TIDE_SEARCH_REFACTORED_XCORR, i->xcorr_score);
+      }
+      break;
+    case RESIDUE_EVIDENCE_MATRIX:
+      match->setScore(XCORR, -1);
+      match->setRank(XCORR, -1);
+      match->setScore(RESIDUE_EVIDENCE_SCORE, i->resEv_score);
+      match->setScore(RESIDUE_EVIDENCE_PVAL, exact_pval_search_ ? i->resEv_pval : -1);
+      match->setRank(RESIDUE_EVIDENCE_PVAL, rank);
+      break;
+    case BOTH_SCORE:
+      match->setScore(XCORR, -1);
+      match->setRank(XCORR, -1);
+      match->setScore(TIDE_SEARCH_EXACT_PVAL, i->xcorr_pval);
+      match->setScore(TIDE_SEARCH_REFACTORED_XCORR, i->xcorr_score);
+      match->setScore(RESIDUE_EVIDENCE_SCORE, i->resEv_score);
+      match->setScore(RESIDUE_EVIDENCE_PVAL, i->resEv_pval);
+      match->setRank(RESIDUE_EVIDENCE_PVAL, -1);
+      match->setScore(BOTH_PVALUE, i->combinedPval);
+      match->setRank(BOTH_PVALUE, rank);
+      break;
+    }
+
+    if (decoys_per_target > 1 && peptide->IsDecoy()) {
+      match->setDecoyIndex(peptide->DecoyIdx());
+    }
+    int experimentSize = concat ? concatDistinctMatches :
+      (!peptide->IsDecoy() ? peptides->ActiveTargets() : peptides->ActiveDecoys());
+    match->setTargetExperimentSize(experimentSize);
+    match->setLnExperimentSize(log((FLOAT_T) experimentSize));
+    if (nullPeptide) {
+      match->setNullPeptide(true);
+    }
+    matches->push_back(match);
+  }
+}
+
+/**
+ * Adds the source of a Tide peptide at pos in protein to a Crux peptide, as
+ * PeptideSrc::parseTabDelimited() does for a protein id and flanking
+ * residues.
+ */
+void TideMatchSet::addPeptideSrc(
+  Crux::Peptide* crux_peptide,
+  const Peptide* peptide,
+  const pb::Protein* protein,
+  int pos
+) {
+  string n_term, c_term;
+  getFlankingAAs(peptide, protein, pos, &n_term, &c_term);
+  string protein_id = protein->name();
+  int protein_pos = (!protein->has_target_pos() ? pos : protein->target_pos()) + 1;
+
+  PeptideSrc* peptide_src = new PeptideSrc();
+  peptide_src->setDigest(string_to_digest_type(CleavageType));
+
+  boost::mutex::scoped_lock lock(match_database_mutex);
+  bool is_decoy;
+  Crux::Protein* parent_protein = MatchCollectionParser::getProtein(
+    MatchDatabase, MatchDecoyDatabase, protein_id, is_decoy);
+  if (parent_protein->isPostProcess()) {
+    peptide_src->setStartIdxOriginal(protein_pos);
   }
+  peptide_src->setStartIdx(parent_protein->findStart(peptide->Seq(), n_term, c_term));
+  peptide_src->setParentProtein(parent_protein);
+  crux_peptide->addPeptideSrc(peptide_src);
 }
 
 /**
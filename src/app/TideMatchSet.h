@@ -24,6 +24,10 @@ class TideMatchSet {
   bool exact_pval_search_;
   int elution_window_;
   SCORE_FUNCTION_T cur_score_function_;
+  // If set, the spectrum centric report() adds the matches it would write
+  // to these instead (see addToMatches()).
+  vector<Crux::Match*>* target_matches_;
+  vector<Crux::Match*>* decoy_matches_;
 
   typedef pair<int, int> Pair2;
   typedef FixedCapacityArray<Pair2> Arr2;
@@ -73,8 +77,8 @@ class TideMatchSet {
    * Write spectrum centric to output files
    */
   void report(
-    ofstream* target_file,  ///< target file to write to
-    ofstream* decoy_file, ///< decoy file to write to
+    ostream* target_file,  ///< target file to write to
+    ostream* decoy_file, ///< decoy file to write to
     int top_n,  ///< number of matches to report
     int decoys_per_target,
     const string& spectrum_filename, ///< name of spectrum file
@@ -84,8 +88,7 @@ class TideMatchSet {
     const ProteinVec& proteins, ///< proteins corresponding with peptides
     const vector<const pb::AuxLocation*>& locations,  ///< auxiliary locations
     bool compute_sp, ///< whether to compute sp or not
-    bool highScoreBest, //< indicates semantics of score magnitude
-    boost::mutex * rwlock
+    bool highScoreBest //< indicates semantics of score magnitude
   );
 
   static void writeHeaders(
@@ -100,6 +103,11 @@ class TideMatchSet {
 
   static string CleavageType;
 
+  // Databases in which the proteins of the matches made by addToMatches()
+  // are found, or to which they are added.
+  static Database* MatchDatabase;
+  static Database* MatchDecoyDatabase;
+
  protected:
   Arr* matches_;
   Arr2* matches2_;
@@ -165,7 +173,28 @@ class TideMatchSet {
    * Helper function for tab delimited report function
    */
   void writeToFile(
-    ofstream* file,
+    ostream* file,
+    int top_n,
+    int decoys_per_target,
+    const vector<Arr::iterator>& vec,
+    const string& spectrum_filename,
+    const Spectrum* spectrum,
+    int charge,
+    const ActivePeptideQueue* peptides,
+    const ProteinVec& proteins,
+    const vector<const pb::AuxLocation*>& locations,
+    const map<Arr::iterator, FLOAT_T>& delta_cn_map,
+    const map<Arr::iterator, FLOAT_T>& delta_lcn_map,
+    const map<Arr::iterator, pair<const SpScorer::SpScoreData, int> >* sp_map
+  );
+
+  /**
+   * Helper function for the spectrum centric report function that makes the
+   * matches MatchCollectionParser would read back from the tab delimited
+   * file.
+   */
+  void addToMatches(
+    vector<Crux::Match*>* matches,
     int top_n,
     int decoys_per_target,
     const vector<Arr::iterator>& vec,
@@ -177,8 +206,17 @@ class TideMatchSet {
     const vector<const pb::AuxLocation*>& locations,
     const map<Arr::iterator, FLOAT_T>& delta_cn_map,
     const map<Arr::iterator, FLOAT_T>& delta_lcn_map,
-    const map<Arr::iterator, pair<const SpScorer::SpScoreData, int> >* sp_map,
-    boost::mutex * rwlock
+    const map<Arr::iterator, pair<const SpScorer::SpScoreData, int> >* sp_map
+  );
+
+  /**
+   * Adds the source of a Tide peptide at pos in protein to a Crux peptide.
+   */
+  static void addPeptideSrc(
+    Crux::Peptide* crux_peptide,
+    const Peptide* peptide,
+    const pb::Protein* protein,
+    int pos
   );
 
   Crux::Peptide getCruxPeptide(const Peptide* peptide);
@@ -1,15 +1,20 @@
 #include <cstdio>
+#include <stdexcept>
 #include "app/tide/abspath.h"
 #include "app/tide/records_to_vector-inl.h"
 
 #include "io/carp.h"
 #include "parameter.h"
+#include "io/SpectrumRecordSpectrumCollection.h"
 #include "io/SpectrumRecordWriter.h"
+#include "model/MatchIterator.h"
 #include "TideIndexApplication.h"
 #include "TideSearchApplication.h"
 #include "ParamMedicApplication.h"
 #include "PSMConvertApplication.h"
+#include "tide/dot_product.h"
 #include "tide/mass_constants.h"
+#include "tide/spectrum_scheduler.h"
 #include "TideMatchSet.h"
 #include "util/Params.h"
 #include "util/FileUtils.h"
@@ -35,11 +40,24 @@ const double TideSearchApplication::XCORR_SCALING = 100000000.0;
  * tide/spectrum_preprocess2.cc). */
 const double TideSearchApplication::RESCALE_FACTOR = 20.0;
 
+/* Number of spectrum-charge pairs that are searched against one filling of
+ * the shared peptide queue, whatever the number of threads. Larger chunks
+ * synchronize the threads less often, but keep the peptides of a wider mass
+ * range in memory. */
+const int TideSearchApplication::SEARCH_CHUNK_SIZE = 256;
+
+/* Number of milliseconds the server mode waits before it looks for new jobs
+ * in the spool directory again. */
+const int TideSearchApplication::SPOOL_POLL_INTERVAL = 1000;
+
 TideSearchApplication::TideSearchApplication():
-  exact_pval_search_(false), remove_index_(""), spectrum_flag_(NULL) {
+  exact_pval_search_(false), remove_index_(""), spectrum_flag_(NULL),
+  in_memory_matches_(false), target_matches_(NULL), decoy_matches_(NULL) {
 }
 
 TideSearchApplication::~TideSearchApplication() {
+  delete target_matches_;
+  delete decoy_matches_;
   if (!remove_index_.empty()) {
     carp(CARP_DEBUG, "Removing temp index '%s'", remove_index_.c_str());
     FileUtils::Remove(remove_index_);
@@ -72,6 +90,8 @@ int TideSearchApplication::main(const vector<string>& input_files, const string
   }
   carp(CARP_INFO, "Number of Threads: %d", NUM_THREADS);
 
+  DotProduct::Select(Params::GetString("xcorr-kernel"));
+
   const string index = input_index;
   string peptides_file = FileUtils::Join(index, "pepix");
   string proteins_file = FileUtils::Join(index, "protix");
@@ -186,49 +206,43 @@ int TideSearchApplication::main(const vector<string>& input_files, const string
   vector<double> dAAMass;
   int nAARes = 0;
 
-  if (curScoreFunction == RESIDUE_EVIDENCE_MATRIX || curScoreFunction == BOTH_SCORE) {
+  bool needAAFreqRes = curScoreFunction == RESIDUE_EVIDENCE_MATRIX || curScoreFunction == BOTH_SCORE;
+  // For SCORE_FUNCTION=="XCORR_SCORE" with p-val=T or SCORE_FUNCTION=="BOTH_SCORE"
+  bool needAAFreq = exact_pval_search_ && (curScoreFunction == XCORR_SCORE || curScoreFunction == BOTH_SCORE);
+  if (needAAFreqRes || needAAFreq) {
     pb::Header aaf_peptides_header;
     HeadedRecordReader aaf_peptide_reader(peptides_file, &aaf_peptides_header);
 
-    if (aaf_peptides_header.file_type() != pb::Header::PEPTIDES ||
+    if ((aaf_peptides_header.file_type() != pb::Header::PEPTIDES) ||
         !aaf_peptides_header.has_peptides_header()) {
       carp(CARP_FATAL, "Error reading index (%s)", peptides_file.c_str());
     }
 
-    MassConstants::Init(&aaf_peptides_header.peptides_header().mods(),
-                        &aaf_peptides_header.peptides_header().nterm_mods(),
-                        &aaf_peptides_header.peptides_header().cterm_mods(),
-                        bin_width_, bin_offset_);
-
-    ActivePeptideQueue* active_peptide_queue =
-      new ActivePeptideQueue(aaf_peptide_reader.Reader(), proteins);
-
-    nAARes = active_peptide_queue->CountAAFrequencyRes(bin_width_, bin_offset_,
-                                                       dAAFreqN, dAAFreqI, dAAFreqC, dAAMass);
-    delete active_peptide_queue;
-  }
-
-  // For SCORE_FUNCTION=="XCORR_SCORE" with p-val=T or SCORE_FUNCTION=="BOTH_SCORE"
-  if (exact_pval_search_ && (curScoreFunction == XCORR_SCORE || curScoreFunction == BOTH_SCORE)) {
-    pb::Header aaf_peptides_header;
-    HeadedRecordReader aaf_peptide_reader(peptides_file, &aaf_peptides_header);
-
-    if (( aaf_peptides_header.file_type() != pb::Header::PEPTIDES) ||
-         !aaf_peptides_header.has_peptides_header()) {
-      carp(CARP_FATAL, "Error reading index (%s)", peptides_file.c_str());
+    // Indexes store the residue mass counts in their header; only older
+    // indexes need a pass over all peptides.
+    google::protobuf::RepeatedPtrField<pb::ResidueMassCount> residueMassCounts =
+      aaf_peptides_header.peptides_header().residue_mass_counts();
+    if (residueMassCounts.size() == 0) {
+      carp(CARP_INFO, "Counting amino acid frequencies in the index.");
+      MassConstants::Init(&aaf_peptides_header.peptides_header().mods(),
+                          &aaf_peptides_header.peptides_header().nterm_mods(),
+                          &aaf_peptides_header.peptides_header().cterm_mods(),
+                          bin_width_, bin_offset_);
+
+      ActivePeptideQueue* active_peptide_queue =
+        new ActivePeptideQueue(aaf_peptide_reader.Reader(), proteins);
+      active_peptide_queue->CountResidueMasses(&residueMassCounts);
+      delete active_peptide_queue;
     }
 
-    MassConstants::Init(&aaf_peptides_header.peptides_header().mods(),
-                        &aaf_peptides_header.peptides_header().nterm_mods(),
-                        &aaf_peptides_header.peptides_header().cterm_mods(),
-                        bin_width_, bin_offset_);
-
-    ActivePeptideQueue* active_peptide_queue =
-      new ActivePeptideQueue(aaf_peptide_reader.Reader(), proteins);
-
-    nAA = active_peptide_queue->CountAAFrequency(bin_width_, bin_offset_,
-                                                 &aaFreqN, &aaFreqI, &aaFreqC, &aaMass);
-    delete active_peptide_queue;
+    if (needAAFreqRes) {
+      nAARes = ActivePeptideQueue::CountAAFrequencyRes(residueMassCounts,
+        dAAFreqN, dAAFreqI, dAAFreqC, dAAMass);
+    }
+    if (needAAFreq) {
+      nAA = ActivePeptideQueue::CountAAFrequency(residueMassCounts, bin_width_, bin_offset_,
+        &aaFreqN, &aaFreqI, &aaFreqC, &aaMass);
+    }
   } // End calculation of amino acid frequencies.
 
   // Read auxlocs index file
@@ -241,10 +255,7 @@ int TideSearchApplication::main(const vector<string>& input_files, const string
   // Read peptides index file
   pb::Header peptides_header;
 
-  vector<HeadedRecordReader*> peptide_reader;
-  for (int i = 0; i < NUM_THREADS; i++) {
-    peptide_reader.push_back(new HeadedRecordReader(peptides_file, &peptides_header));
-  }
+  HeadedRecordReader* peptide_reader = new HeadedRecordReader(peptides_file, &peptides_header);
 
   if ((peptides_header.file_type() != pb::Header::PEPTIDES) ||
       !peptides_header.has_peptides_header()) {
@@ -263,119 +274,189 @@ int TideSearchApplication::main(const vector<string>& input_files, const string
 
   MassConstants::Init(&pepHeader.mods(), &pepHeader.nterm_mods(),
     &pepHeader.cterm_mods(), bin_width_, bin_offset_);
+
+  // Theoretical peaks stored by tide-index --precompute-peaks can only be used
+  // if they were binned the same way as this search.
+  bool use_stored_peaks = false;
+  if (pepHeader.has_search_peaks()) {
+    if (pepHeader.peaks_bin_width() == bin_width_ &&
+        pepHeader.peaks_bin_offset() == bin_offset_) {
+      carp(CARP_INFO, "Using the theoretical peaks stored in the index.");
+      use_stored_peaks = true;
+    } else {
+      carp(CARP_INFO, "The index peaks were computed with mz-bin-width=%g and "
+           "mz-bin-offset=%g; recomputing them for this search.",
+           pepHeader.peaks_bin_width(), pepHeader.peaks_bin_offset());
+    }
+  }
   ModificationDefinition::ClearAll();
   TideMatchSet::initModMap(pepHeader.mods(), ANY);
   TideMatchSet::initModMap(pepHeader.nterm_mods(), PEPTIDE_N);
   TideMatchSet::initModMap(pepHeader.cterm_mods(), PEPTIDE_C);
 
-  ofstream* target_file = NULL;
-  ofstream* decoy_file = NULL;
-
   bool overwrite = Params::GetBool("overwrite");
   stringstream ss;
   ss << Params::GetString("enzyme") << '-' << Params::GetString("digestion");
   TideMatchSet::CleavageType = ss.str();
-  if (!Params::GetBool("concat")) {
-    string target_file_name = make_file_path("tide-search.target.txt");
-    target_file = create_stream_in_path(target_file_name.c_str(), NULL, overwrite);
-    output_file_name_ = target_file_name;
-    if (HAS_DECOYS) {
-      string decoy_file_name = make_file_path("tide-search.decoy.txt");
-      decoy_file = create_stream_in_path(decoy_file_name.c_str(), NULL, overwrite);
-    }
-  } else {
-    string concat_file_name = make_file_path("tide-search.txt");
-    target_file = create_stream_in_path(concat_file_name.c_str(), NULL, overwrite);
-    output_file_name_ = concat_file_name;
-  }
 
-  if (target_file) {
-    TideMatchSet::writeHeaders(target_file, false, decoysPerTarget > 1, compute_sp);
-    TideMatchSet::writeHeaders(decoy_file, true, decoysPerTarget > 1, compute_sp);
-  }
+  // All threads share a single queue, so the index is read and the
+  // theoretical peaks are computed only once per search. The reader and the
+  // queue are kept for all spectrum files (and, in server mode, all jobs);
+  // each search rewinds them to the first peptide.
+  ActivePeptideQueue* active_peptide_queue =
+    new ActivePeptideQueue(peptide_reader->Reader(), proteins);
+  active_peptide_queue->SetBinSize(bin_width_, bin_offset_);
+  active_peptide_queue->setUseStoredPeaks(use_stored_peaks);
+
+  // In server mode the index stays loaded once the spectrum files given on
+  // the command line have been searched, and the jobs that appear in the
+  // spool directory are searched one after another (see nextSpoolJob()).
+  // A fatal error in a job only fails that job, except during the search
+  // itself, whose threads cannot be unwound.
+  string spool_dir = Params::GetString("spool-dir");
+  string server_output_dir = Params::GetString("output-dir");
+  SpoolJob job;
+  do {
+    ofstream* target_file = NULL;
+    ofstream* decoy_file = NULL;
+    bool succeeded = true;
+
+    set_carp_fatal_throws(!job.Name.empty());
+    try {
+      if (in_memory_matches_) {
+        output_file_name_ = make_file_path(
+          Params::GetBool("concat") ? "tide-search.txt" : "tide-search.target.txt");
+        target_matches_ = new MatchCollection();
+        target_matches_->preparePostProcess();
+        if (!Params::GetBool("concat") && HAS_DECOYS) {
+          decoy_matches_ = new MatchCollection();
+          decoy_matches_->preparePostProcess();
+        }
+      } else if (!Params::GetBool("concat")) {
+        string target_file_name = make_file_path("tide-search.target.txt");
+        target_file = create_stream_in_path(target_file_name.c_str(), NULL, overwrite);
+        output_file_name_ = target_file_name;
+        if (HAS_DECOYS) {
+          string decoy_file_name = make_file_path("tide-search.decoy.txt");
+          decoy_file = create_stream_in_path(decoy_file_name.c_str(), NULL, overwrite);
+        }
+      } else {
+        string concat_file_name = make_file_path("tide-search.txt");
+        target_file = create_stream_in_path(concat_file_name.c_str(), NULL, overwrite);
+        output_file_name_ = concat_file_name;
+      }
 
-  vector<InputFile> sr = getInputFiles(input_files);
+      if (target_file) {
+        TideMatchSet::writeHeaders(target_file, false, decoysPerTarget > 1, compute_sp);
+        TideMatchSet::writeHeaders(decoy_file, true, decoysPerTarget > 1, compute_sp);
+      }
 
-  // Loop through spectrum files
-  for (vector<InputFile>::const_iterator f = sr.begin(); f != sr.end(); f++) {
-    if (!peptide_reader[0]) {
-      for (int i = 0; i < NUM_THREADS; i++) {
-        peptide_reader[i] = new HeadedRecordReader(peptides_file, &peptides_header);
+      vector<InputFile> sr;
+      if (job.Name.empty()) {
+        // processParams() may have converted the spectrum files already.
+        bool converted = inputFiles_.size() == input_files.size();
+        for (size_t i = 0; converted && i < input_files.size(); i++) {
+          converted = inputFiles_[i].OriginalName == input_files[i];
+        }
+        sr = converted ? inputFiles_ : getInputFiles(input_files);
+        inputFiles_.clear();
+      } else {
+        sr = getInputFiles(job.SpectrumFiles, NULL, false);
       }
-    }
 
-    vector<ActivePeptideQueue*> active_peptide_queue;
-    for (int i = 0; i < NUM_THREADS; i++) {
-      active_peptide_queue.push_back(new ActivePeptideQueue(peptide_reader[i]->Reader(), proteins));
-      active_peptide_queue[i]->SetBinSize(bin_width_, bin_offset_);
-    }
+      // Loop through spectrum files
+      for (vector<InputFile>::const_iterator f = sr.begin(); f != sr.end(); f++) {
+        string spectra_file = f->SpectrumRecords;
+        SpectrumCollection* spectra = NULL;
+        map<string, SpectrumCollection*>::iterator spectraIter = spectra_.find(spectra_file);
+        if (spectraIter == spectra_.end()) {
+          carp(CARP_INFO, "Reading spectrum file %s.", spectra_file.c_str());
+          // Peptide-centric search keeps the spectra of its hits until the end,
+          // so only a spectrum-centric search can free them as it goes.
+          spectra = loadSpectra(spectra_file,
+                                !Params::GetBool("peptide-centric-search"),
+                                NUM_THREADS);
+          carp(CARP_INFO, "Read %d spectra.", spectra->Size());
+        } else {
+          spectra = spectraIter->second;
+        }
 
-    string spectra_file = f->SpectrumRecords;
-    SpectrumCollection* spectra = NULL;
-    map<string, SpectrumCollection*>::iterator spectraIter = spectra_.find(spectra_file);
-    if (spectraIter == spectra_.end()) {
-      carp(CARP_INFO, "Reading spectrum file %s.", spectra_file.c_str());
-      spectra = loadSpectra(spectra_file);
-      carp(CARP_INFO, "Read %d spectra.", spectra->Size());
-    } else {
-      spectra = spectraIter->second;
-    }
+        active_peptide_queue->Reset();
+        if (!peptide_reader->Rewind()) {
+          carp(CARP_FATAL, "Error reading index (%s)", peptides_file.c_str());
+        }
 
-    double highest_mz = spectra->FindHighestMZ();
-    unsigned int spectrum_num = spectra->SpecCharges()->size();
-    if (spectrum_num > 0 &&
-        (exact_pval_search_ || curScoreFunction == RESIDUE_EVIDENCE_MATRIX || curScoreFunction == BOTH_SCORE)) {
-      highest_mz = spectra->SpecCharges()->at(spectrum_num - 1).neutral_mass;
-    }
-    carp(CARP_DEBUG, "Maximum observed m/z = %f.", highest_mz);
-    MaxBin::SetGlobalMax(highest_mz);
-    // Do the search
-    carp(CARP_INFO, "Starting search.");
-    if (spectrum_flag_ == NULL) {
-      resetMods();
-    }
-    search(f->OriginalName, spectra->SpecCharges(), active_peptide_queue, proteins,
-           locations, Params::GetDouble("precursor-window"),
-           string_to_window_type(Params::GetString("precursor-window-type")),
-           Params::GetDouble("spectrum-min-mz"), Params::GetDouble("spectrum-max-mz"),
-           min_scan, max_scan, Params::GetInt("min-peaks"), charge_to_search,
-           Params::GetInt("top-match"), spectra->FindHighestMZ(),
-           target_file, decoy_file, compute_sp,
-           nAA, aaFreqN, aaFreqI, aaFreqC, aaMass,
-           nAARes, dAAFreqN, dAAFreqI, dAAFreqC, dAAMass,
-           pepHeader.mods(), pepHeader.nterm_mods(), pepHeader.cterm_mods(),
-           decoysPerTarget, &negative_isotope_errors);
-
-    if (spectraIter == spectra_.end()) {
-      delete spectra;
-    }
-    // convert tab delimited to other file formats.
-    convertResults();
+        double highest_mz = spectra->FindHighestMZ();
+        unsigned int spectrum_num = spectra->SpecCharges()->size();
+        if (spectrum_num > 0 &&
+            (exact_pval_search_ || curScoreFunction == RESIDUE_EVIDENCE_MATRIX || curScoreFunction == BOTH_SCORE)) {
+          highest_mz = spectra->SpecCharges()->at(spectrum_num - 1).neutral_mass;
+        }
+        carp(CARP_DEBUG, "Maximum observed m/z = %f.", highest_mz);
+        MaxBin::SetGlobalMax(highest_mz);
+        // Do the search
+        carp(CARP_INFO, "Starting search.");
+        if (spectrum_flag_ == NULL) {
+          resetMods();
+        }
+        set_carp_fatal_throws(false);
+        search(f->OriginalName, spectra, active_peptide_queue, proteins,
+               locations, Params::GetDouble("precursor-window"),
+               string_to_window_type(Params::GetString("precursor-window-type")),
+               Params::GetDouble("spectrum-min-mz"), Params::GetDouble("spectrum-max-mz"),
+               min_scan, max_scan, Params::GetInt("min-peaks"), charge_to_search,
+               Params::GetInt("top-match"), spectra->FindHighestMZ(),
+               target_file, decoy_file, compute_sp,
+               nAA, aaFreqN, aaFreqI, aaFreqC, aaMass,
+               nAARes, dAAFreqN, dAAFreqI, dAAFreqC, dAAMass,
+               pepHeader.mods(), pepHeader.nterm_mods(), pepHeader.cterm_mods(),
+               decoysPerTarget, &negative_isotope_errors);
+        set_carp_fatal_throws(!job.Name.empty());
+
+        if (spectraIter == spectra_.end()) {
+          delete spectra;
+        }
 
-    // Delete temporary spectrumrecords file
-    if (!f->Keep) {
-      carp(CARP_DEBUG, "Deleting %s", spectra_file.c_str());
-      remove(spectra_file.c_str());
-    }
+        // Delete temporary spectrumrecords file
+        if (!f->Keep) {
+          carp(CARP_DEBUG, "Deleting %s", spectra_file.c_str());
+          remove(spectra_file.c_str());
+        }
+
+        // convert tab delimited to other file formats.
+        convertResults();
+      } // End of spectrum file loop
 
-    // Clean up
-    for (int i = 0; i < NUM_THREADS; i++) {
-      delete active_peptide_queue[i];
-      delete peptide_reader[i];
-      peptide_reader[i] = NULL;
+      if (target_matches_) {
+        setMatchScoredTypes(target_matches_, compute_sp);
+        target_matches_->setFilePath(output_file_name_, false);
+      }
+      if (decoy_matches_) {
+        setMatchScoredTypes(decoy_matches_, compute_sp);
+        decoy_matches_->setFilePath(make_file_path("tide-search.decoy.txt"), false);
+      }
+    } catch (const runtime_error& e) {
+      carp(CARP_ERROR, "Job %s failed: %s", job.Name.c_str(), e.what());
+      succeeded = false;
     }
+    set_carp_fatal_throws(false);
 
-  } // End of spectrum file loop
+    if (target_file) {
+      delete target_file;
+      if (decoy_file) {
+        delete decoy_file;
+      }
+    }
+    if (!job.Name.empty()) {
+      finishSpoolJob(spool_dir, job, succeeded);
+    }
+  } while (!spool_dir.empty() && nextSpoolJob(spool_dir, server_output_dir, &job));
 
+  delete active_peptide_queue;
+  delete peptide_reader;
   for (ProteinVec::iterator i = proteins.begin(); i != proteins.end(); ++i) {
     delete *i;
   }
-  if (target_file) {
-    delete target_file;
-    if (decoy_file) {
-      delete decoy_file;
-    }
-  }
   delete[] aaFreqN;
   delete[] aaFreqI;
   delete[] aaFreqC;
@@ -414,20 +495,24 @@ vector<int> TideSearchApplication::getNegativeIsotopeErrors() const {
 }
 
 vector<TideSearchApplication::InputFile> TideSearchApplication::getInputFiles(
-  const vector<string>& filepaths
+  const vector<string>& filepaths,
+  ParamMedicErrorCalculator* errCalc,
+  bool storeSpectra
 ) const {
   // Try to read all spectrum files as spectrumrecords, convert those that fail
   vector<InputFile> input_sr;
   for (vector<string>::const_iterator f = filepaths.begin(); f != filepaths.end(); f++) {
-    SpectrumCollection spectra;
-    pb::Header spectrum_header;
     string spectrumrecords = *f;
     bool keepSpectrumrecords = true;
-    if (!spectra.ReadSpectrumRecords(spectrumrecords, &spectrum_header)) {
+    if (SpectrumRecordSpectrumCollection::IsSpectrumRecordFile(spectrumrecords)) {
+      if (errCalc != NULL) {
+        errCalc->processFiles(vector<string>(1, *f));
+      }
+    } else {
       // Failed, try converting to spectrumrecords file
       carp(CARP_INFO, "Converting %s to spectrumrecords format", f->c_str());
       carp(CARP_INFO, "Elapsed time starting conversion: %.3g s", wall_clock() / 1e6);
-      spectrumrecords = Params::GetString("store-spectra");
+      spectrumrecords = storeSpectra ? Params::GetString("store-spectra") : "";
       keepSpectrumrecords = !spectrumrecords.empty();
       if (!keepSpectrumrecords) {
         spectrumrecords = make_file_path(FileUtils::BaseName(*f) + ".spectrumrecords.tmp");
@@ -436,12 +521,17 @@ vector<TideSearchApplication::InputFile> TideSearchApplication::getInputFiles(
                          "spectrum files");
       }
       carp(CARP_DEBUG, "New spectrumrecords filename: %s", spectrumrecords.c_str());
-      if (!SpectrumRecordWriter::convert(*f, spectrumrecords)) {
+      if (errCalc != NULL) {
+        carp(CARP_INFO, "param-medic processing input file %s...", f->c_str());
+      }
+      if (!SpectrumRecordWriter::convert(*f, spectrumrecords, errCalc)) {
         carp(CARP_FATAL, "Error converting %s to spectrumrecords format", f->c_str());
       }
-      carp(CARP_DEBUG, "Reading converted spectrum file %s", spectrumrecords.c_str());
-      // Re-read converted file as spectrumrecords file
-      if (!spectra.ReadSpectrumRecords(spectrumrecords, &spectrum_header)) {
+      if (errCalc != NULL) {
+        errCalc->clearBins();
+      }
+      // Check the header of the converted file; the spectra are read later
+      if (!SpectrumRecordSpectrumCollection::IsSpectrumRecordFile(spectrumrecords)) {
         carp(CARP_DEBUG, "Deleting %s", spectrumrecords.c_str());
         FileUtils::Remove(spectrumrecords);
         carp(CARP_FATAL, "Error reading spectra file %s", spectrumrecords.c_str());
@@ -452,10 +542,105 @@ vector<TideSearchApplication::InputFile> TideSearchApplication::getInputFiles(
   return input_sr;
 }
 
-SpectrumCollection* TideSearchApplication::loadSpectra(const string& file) {
+bool TideSearchApplication::nextSpoolJob(
+  const string& spoolDir,
+  const string& serverOutputDir,
+  SpoolJob* job
+) const {
+  const string jobExtension = ".job";
+  carp(CARP_INFO, "Waiting for jobs in %s.", spoolDir.c_str());
+  while (true) {
+    if (FileUtils::Exists(FileUtils::Join(spoolDir, "stop"))) {
+      carp(CARP_INFO, "Found %s; stopping.",
+           FileUtils::Join(spoolDir, "stop").c_str());
+      FileUtils::Remove(FileUtils::Join(spoolDir, "stop"));
+      Params::SetOutputDir(serverOutputDir);
+      return false;
+    }
+    // Jobs are taken in the order of their names.
+    vector<string> names = FileUtils::List(spoolDir);
+    for (vector<string>::const_iterator i = names.begin(); i != names.end(); i++) {
+      if (!StringUtils::EndsWith(*i, jobExtension)) {
+        continue;
+      }
+      job->Name = i->substr(0, i->length() - jobExtension.length());
+      job->OutputDir.clear();
+      job->SpectrumFiles.clear();
+      job->StartTime = wall_clock();
+      // Claim the job, so that it is not taken twice.
+      string running = FileUtils::Join(spoolDir, job->Name + ".running");
+      try {
+        FileUtils::Rename(FileUtils::Join(spoolDir, *i), running);
+      } catch (...) {
+        continue;
+      }
+      // The first line is the output directory, the others are spectrum files.
+      ifstream jobStream(running.c_str());
+      string line;
+      while (getline(jobStream, line)) {
+        line = StringUtils::Trim(line);
+        if (line.empty() || line[0] == '#') {
+          continue;
+        } else if (job->OutputDir.empty()) {
+          job->OutputDir = line;
+        } else {
+          job->SpectrumFiles.push_back(line);
+        }
+      }
+      carp(CARP_INFO, "Starting job %s: %d spectrum files, output to %s.",
+           job->Name.c_str(), job->SpectrumFiles.size(), job->OutputDir.c_str());
+      bool valid = !job->SpectrumFiles.empty();
+      for (vector<string>::const_iterator f = job->SpectrumFiles.begin();
+           valid && f != job->SpectrumFiles.end();
+           f++) {
+        if (!FileUtils::Exists(*f)) {
+          carp(CARP_ERROR, "Spectrum file %s of job %s does not exist.",
+               f->c_str(), job->Name.c_str());
+          valid = false;
+        }
+      }
+      if (valid &&
+          create_output_directory(job->OutputDir, Params::GetBool("overwrite")) != 0) {
+        carp(CARP_ERROR, "Cannot create output directory %s for job %s.",
+             job->OutputDir.c_str(), job->Name.c_str());
+        valid = false;
+      }
+      if (!valid) {
+        finishSpoolJob(spoolDir, *job, false);
+        continue;
+      }
+      Params::SetOutputDir(job->OutputDir);
+      // Each job records the parameters it was searched with.
+      ofstream* paramsFile = FileUtils::GetWriteStream(
+        make_file_path(getFileStem() + ".params.txt"), true);
+      if (paramsFile) {
+        Params::Write(paramsFile);
+        delete paramsFile;
+      }
+      return true;
+    }
+    boost::this_thread::sleep(boost::posix_time::milliseconds(SPOOL_POLL_INTERVAL));
+  }
+}
+
+void TideSearchApplication::finishSpoolJob(
+  const string& spoolDir,
+  const SpoolJob& job,
+  bool succeeded
+) const {
+  FileUtils::Rename(FileUtils::Join(spoolDir, job.Name + ".running"),
+                    FileUtils::Join(spoolDir, job.Name + (succeeded ? ".done" : ".failed")));
+  carp(CARP_INFO, "Job %s %s after %.3g s.", job.Name.c_str(),
+       succeeded ? "finished" : "failed", (wall_clock() - job.StartTime) / 1e6);
+}
+
+SpectrumCollection* TideSearchApplication::loadSpectra(const string& file,
+                                                       bool lazy,
+                                                       int num_threads) {
   SpectrumCollection* spectra = new SpectrumCollection();
   pb::Header header;
-  if (!spectra->ReadSpectrumRecords(file, &header)) {
+  if (!(lazy ? spectra->ReadSpectrumRecordsLazily(file, num_threads, &header)
+             : spectra->ReadSpectrumRecords(file, &header))) {
     carp(CARP_FATAL, "Error reading spectrum file %s", file.c_str());
   }
   if (string_to_window_type(Params::GetString("precursor-window-type")) != WINDOW_MZ) {
@@ -470,7 +655,8 @@ void TideSearchApplication::search(void* threadarg) {
   struct thread_data *my_data = (struct thread_data *) threadarg;
 
   const string& spectrum_filename = my_data->spectrum_filename;
-  const vector<SpectrumCollection::SpecCharge>* spec_charges = my_data->spec_charges;
+  SpectrumCollection* spectra = my_data->spectra;
+  const vector<SpectrumCollection::SpecCharge>* spec_charges = spectra->SpecCharges();
   ActivePeptideQueue* active_peptide_queue = my_data->active_peptide_queue;
   ProteinVec& proteins = my_data->proteins;
   vector<const pb::AuxLocation*>& locations = my_data->locations;
@@ -488,7 +674,6 @@ void TideSearchApplication::search(void* threadarg) {
   ofstream* decoy_file = my_data->decoy_file;
   bool compute_sp = my_data->compute_sp;
   int64_t thread_num = my_data->thread_num;
-  int64_t num_threads = my_data->num_threads;
   int nAA = my_data->nAA;
   double* aaFreqN = my_data->aaFreqN;
   double* aaFreqI = my_data->aaFreqI;
@@ -510,10 +695,25 @@ void TideSearchApplication::search(void* threadarg) {
   double bin_width = my_data->bin_width;
   double bin_offset = my_data->bin_offset;
   bool exact_pval_search = my_data->exact_pval_search;
-  map<pair<string, unsigned int>, bool>* spectrum_flag = my_data->spectrum_flag;
+  // Spectra identified by earlier steps of cascade-search
+  const vector<bool>* accepted_spectra = my_data->spectrum_flag != NULL ?
+    my_data->spectrum_flag->File(spectrum_filename) : NULL;
 
-  int* sc_index = my_data->sc_index;
+  SpectrumScheduler* scheduler = my_data->scheduler;
   int* total_candidate_peptides = my_data->total_candidate_peptides;
+  ActivePeptideQueue* shared_peptide_queue = my_data->shared_peptide_queue;
+  boost::barrier* chunk_barrier = my_data->chunk_barrier;
+  vector<ThreadOutput*>* thread_outputs = my_data->thread_outputs;
+  const int num_threads = my_data->num_threads;
+  // PSMs are formatted into this thread's buffers. Each thread has two sets,
+  // used by alternate chunks: while the threads fill one set, a writer thread
+  // started by thread 0 writes the other set of the previous chunk.
+  ThreadOutput* output = NULL;
+  ostream* target_out = NULL;
+  ostream* decoy_out = NULL;
+  vector<Crux::Match*>* target_matches = NULL;
+  vector<Crux::Match*>* decoy_matches = NULL;
+  boost::thread* writer = NULL;
 
   // params
   bool peptide_centric = Params::GetBool("peptide-centric-search");
@@ -529,256 +729,282 @@ void TideSearchApplication::search(void* threadarg) {
                            use_neutral_loss_peaks,
                            use_flanking_peaks);
 
+  // Residue-evidence workspaces, reused for every spectrum this thread searches.
+  ResidueEvidenceMatrix residueEvidenceMatrix;
+  vector<double> dynProgArray;
+
   // Keep track of observed peaks that get filtered out in various ways.
   long int num_range_skipped = 0;
   long int num_precursors_skipped = 0;
   long int num_isotopes_skipped = 0;
   long int num_retained = 0;
 
-  // cycle through spectrum-charge pairs, sorted by neutral mass
-  FLOAT_T sc_total = (FLOAT_T)spec_charges->size();
-  int print_interval = Params::GetInt("print-search-progress");
-
-  for (vector<SpectrumCollection::SpecCharge>::const_iterator sc = spec_charges->begin()+thread_num;
-       sc < spec_charges->begin() + (spec_charges->size());
-       sc = sc + num_threads) {
-    locks_array[LOCK_REPORTING]->lock();
-    ++(*sc_index);
-    if (print_interval > 0 && *sc_index > 0 && *sc_index % print_interval == 0) {
-      carp(CARP_INFO, "%d spectrum-charge combinations searched, %.0f%% complete",
-           *sc_index, *sc_index / sc_total * 100);
+  // Spectrum-charge pairs are searched in chunks of consecutive (i.e. similar
+  // mass) pairs. Before each chunk thread 0 moves into the shared peptide
+  // queue all peptides that any pair in the chunk may need; then the threads
+  // take pairs of the chunk from the scheduler until none are left. Thread 0
+  // first reads and compiles the peptides of the next chunk, while the other
+  // threads already search this one. If the spectra are loaded lazily, the
+  // peaks of a chunk are decoded in the background two chunks ahead, so
+  // that at the start of a chunk thread 0 normally only frees the peaks that
+  // no later chunk needs. The PSMs of the previous chunk are written by a
+  // writer thread while this one is searched.
+  const int num_spec_charges = spec_charges->size();
+  const int chunk_size = SEARCH_CHUNK_SIZE;
+  const bool b_ions = curScoreFunction != XCORR_SCORE || exact_pval_search;
+  double chunk_min_range = 0.0, chunk_max_range = 0.0;
+  if (thread_num == 0 && num_spec_charges > 0) {
+    computeChunkRange(spec_charges, 0, min(chunk_size, num_spec_charges),
+                      window_type, precursor_window, max_charge,
+                      negative_isotope_errors, &chunk_min_range, &chunk_max_range);
+    shared_peptide_queue->PrefetchActiveRange(chunk_min_range, chunk_max_range, b_ions);
+    spectra->LoadSpecCharges(0, min(chunk_size, num_spec_charges));
+    spectra->PrefetchSpecCharges(min(chunk_size, num_spec_charges),
+                                 min(2 * chunk_size, num_spec_charges));
+  }
+  for (int chunk_begin = 0; chunk_begin < num_spec_charges; chunk_begin += chunk_size) {
+    int chunk_end = min(chunk_begin + chunk_size, num_spec_charges);
+    int parity = (chunk_begin / chunk_size) % 2;
+    if (thread_num == 0) {
+      if (chunk_begin > 0) {
+        // The writer of two chunks ago has emptied the buffers of this chunk.
+        waitForWriter(&writer);
+        writer = startWriter(thread_outputs, 1 - parity, target_file, decoy_file);
+      }
+      spectra->LoadSpecCharges(chunk_begin, chunk_end);
+      spectra->ReleaseSpecCharges(max(chunk_begin - chunk_size, 0), chunk_begin);
+      spectra->PrefetchSpecCharges(min(chunk_end + chunk_size, num_spec_charges),
+                                   min(chunk_end + 2 * chunk_size, num_spec_charges));
+      shared_peptide_queue->CommitActiveRange(chunk_min_range, b_ions);
+      scheduler->StartBatch(chunk_begin, chunk_end);
+    }
+    chunk_barrier->wait();
+    output = (*thread_outputs)[parity * num_threads + thread_num];
+    target_out = target_file ? &output->target : NULL;
+    decoy_out = decoy_file ? &output->decoy : NULL;
+    target_matches = target_matches_ ? &output->target_matches : NULL;
+    decoy_matches = decoy_matches_ ? &output->decoy_matches : NULL;
+    if (thread_num == 0 && chunk_end < num_spec_charges) {
+      computeChunkRange(spec_charges, chunk_end, min(chunk_end + chunk_size, num_spec_charges),
+                        window_type, precursor_window, max_charge,
+                        negative_isotope_errors, &chunk_min_range, &chunk_max_range);
+      shared_peptide_queue->PrefetchActiveRange(chunk_min_range, chunk_max_range, b_ions);
     }
-    locks_array[LOCK_REPORTING]->unlock();
 
-    Spectrum* spectrum = sc->spectrum;
-    double precursor_mz = spectrum->PrecursorMZ();
-    double precursorMass = sc->neutral_mass;  //Added by Andy Lin (needed for residue evidence)
-    int charge = sc->charge;
-    int scan_num = spectrum->SpectrumNumber();
-    if (spectrum_flag != NULL) {
-      locks_array[LOCK_CASCADE]->lock();
-      map<pair<string, unsigned int>, bool>::iterator spectrum_id;
-      spectrum_id = spectrum_flag->find(pair<string, unsigned int>(
-        spectrum_filename, scan_num * 10 + charge));
-      if (spectrum_id != spectrum_flag->end()) {
-        locks_array[LOCK_CASCADE]->unlock();
+    int sc_pos;
+    while (scheduler->Next(thread_num, &sc_pos)) {
+      vector<SpectrumCollection::SpecCharge>::const_iterator sc = spec_charges->begin() + sc_pos;
+      Spectrum* spectrum = sc->spectrum;
+      double precursor_mz = spectrum->PrecursorMZ();
+      double precursorMass = sc->neutral_mass;  //Added by Andy Lin (needed for residue evidence)
+      int charge = sc->charge;
+      int scan_num = spectrum->SpectrumNumber();
+      if (SpectrumFlags::Get(accepted_spectra, SpectrumFlags::Id(scan_num, charge))) {
         continue;
       }
-      locks_array[LOCK_CASCADE]->unlock();
-    }
 
-    if (precursor_mz < spectrum_min_mz || precursor_mz > spectrum_max_mz ||
-        scan_num < min_scan || scan_num > max_scan ||
-        spectrum->Size() < min_peaks ||
-        (search_charge != 0 && charge != search_charge) || charge > max_charge) {
-      continue;
-    }
-    // The active peptide queue holds the candidate peptides for spectrum.
-    // Calculate and set the window, depending on the window type.
-    vector<double>* min_mass = new vector<double>();
-    vector<double>* max_mass = new vector<double>();
-    vector<bool>* candidatePeptideStatus = new vector<bool>();
-    double min_range, max_range;
-    computeWindow(*sc, window_type, precursor_window, max_charge,
-                  negative_isotope_errors, min_mass, max_mass, &min_range, &max_range);
-
-    //TODO throw error when fragment-tolerance and evidence-granularity parameters are defined
-
-    if (curScoreFunction == XCORR_SCORE && !exact_pval_search_) {  //execute original tide-search program
-      // Normalize the observed spectrum and compute the cache of
-      // frequently-needed values for taking dot products with theoretical
-      // spectra.
-      observed.PreprocessSpectrum(*spectrum, charge, &num_range_skipped,
-                                  &num_precursors_skipped,
-                                  &num_isotopes_skipped, &num_retained);
-      int nCandPeptide = active_peptide_queue->SetActiveRange(
-        min_mass, max_mass, min_range, max_range, candidatePeptideStatus);
-      if (nCandPeptide == 0) {
+      if (precursor_mz < spectrum_min_mz || precursor_mz > spectrum_max_mz ||
+          scan_num < min_scan || scan_num > max_scan ||
+          spectrum->Size() < min_peaks ||
+          (search_charge != 0 && charge != search_charge) || charge > max_charge) {
         continue;
       }
-      locks_array[LOCK_CANDIDATES]->lock();
-      *total_candidate_peptides += nCandPeptide;
-      locks_array[LOCK_CANDIDATES]->unlock();
-
-      int candidatePeptideStatusSize = candidatePeptideStatus->size();
-      TideMatchSet::Arr2 match_arr2(candidatePeptideStatusSize); // Scored peptides will go here.
-
-      // Programs for taking the dot-product with the observed spectrum are laid
-      // out in memory managed by the active_peptide_queue, one program for each
-      // candidate peptide. The programs will store the results directly into
-      // match_arr. We now pass control to those programs.
-      collectScoresCompiled(active_peptide_queue, spectrum, observed, &match_arr2,
-                            candidatePeptideStatusSize, charge);
-
-      // matches will arrange the results in a heap by score, return the top
-      // few, and recover the association between counter and peptide. We output
-      // the top matches.
-      if (peptide_centric) {
-        deque<Peptide*>::const_iterator iter_ = active_peptide_queue->iter_;
-        TideMatchSet::Arr2::iterator it = match_arr2.begin();
-        for (; it != match_arr2.end(); ++iter_, ++it) {
-          int peptide_idx = candidatePeptideStatusSize - (it->second);
-          if ((*candidatePeptideStatus)[peptide_idx]) {
-            (*iter_)->AddHit(spectrum, it->first, 0.0, it->second, charge);
-          }
-        }
-      } else {  //spectrum centric match report.
-        TideMatchSet::Arr match_arr(nCandPeptide);
-        for (TideMatchSet::Arr2::iterator it = match_arr2.begin();
-             it != match_arr2.end();
-             ++it) {
-          int peptide_idx = candidatePeptideStatusSize - (it->second);
-          if ((*candidatePeptideStatus)[peptide_idx]) {
-            TideMatchSet::Scores curScore;
-            curScore.xcorr_score = (double)(it->first / XCORR_SCALING);
-            curScore.rank = it->second;
-            match_arr.push_back(curScore);
-          }
+      // The active peptide queue holds the candidate peptides for spectrum.
+      // Calculate and set the window, depending on the window type.
+      vector<double>* min_mass = new vector<double>();
+      vector<double>* max_mass = new vector<double>();
+      vector<bool>* candidatePeptideStatus = new vector<bool>();
+      double min_range, max_range;
+      computeWindow(*sc, window_type, precursor_window, max_charge,
+                    negative_isotope_errors, min_mass, max_mass, &min_range, &max_range);
+
+      //TODO throw error when fragment-tolerance and evidence-granularity parameters are defined
+
+      if (curScoreFunction == XCORR_SCORE && !exact_pval_search_) {  //execute original tide-search program
+        // Normalize the observed spectrum and compute the cache of
+        // frequently-needed values for taking dot products with theoretical
+        // spectra.
+        observed.PreprocessSpectrum(*spectrum, charge, &num_range_skipped,
+                                    &num_precursors_skipped,
+                                    &num_isotopes_skipped, &num_retained);
+        int nCandPeptide = active_peptide_queue->SetActiveRange(
+          min_mass, max_mass, min_range, max_range, candidatePeptideStatus);
+        if (nCandPeptide == 0) {
+          continue;
         }
+        locks_array[LOCK_CANDIDATES]->lock();
+        *total_candidate_peptides += nCandPeptide;
+        locks_array[LOCK_CANDIDATES]->unlock();
 
-        TideMatchSet matches(&match_arr, highest_mz);
-        matches.exact_pval_search_ = exact_pval_search;
-        matches.cur_score_function_ = curScoreFunction;
+        int candidatePeptideStatusSize = candidatePeptideStatus->size();
+        TideMatchSet::Arr2 match_arr2(candidatePeptideStatusSize); // Scored peptides will go here.
 
-        matches.report(target_file, decoy_file, top_matches, numDecoys, spectrum_filename,
-                       spectrum, charge, active_peptide_queue, proteins,
-                       locations, compute_sp, true, locks_array[LOCK_RESULTS]);
-      }  //end peptide_centric == false
-    } else { //This runs curScoreFunction=BOTH_SCORE, curScoreFunction=RESIUDUE_EVIDENCE_MATRIX, and xcorr p-val
+        // Programs for taking the dot-product with the observed spectrum are laid
+        // out in memory managed by the active_peptide_queue, one program for each
+        // candidate peptide. The programs will store the results directly into
+        // match_arr. We now pass control to those programs.
+        collectScoresCompiled(active_peptide_queue, spectrum, observed, &match_arr2,
+                              candidatePeptideStatusSize, charge);
 
-      int nCandPeptide = active_peptide_queue->SetActiveRangeBIons(min_mass, max_mass, min_range, max_range, candidatePeptideStatus);
-      int candidatePeptideStatusSize = candidatePeptideStatus->size();
-      if (nCandPeptide == 0) {
-        continue;
-      }
+        // matches will arrange the results in a heap by score, return the top
+        // few, and recover the association between counter and peptide. We output
+        // the top matches.
+        if (peptide_centric) {
+          // The peptides are shared by all threads, but main() runs
+          // peptide-centric searches on a single thread.
+          deque<Peptide*>::const_iterator iter_ = active_peptide_queue->iter_;
+          TideMatchSet::Arr2::iterator it = match_arr2.begin();
+          for (; it != match_arr2.end(); ++iter_, ++it) {
+            int peptide_idx = candidatePeptideStatusSize - (it->second);
+            if ((*candidatePeptideStatus)[peptide_idx]) {
+              (*iter_)->AddHit(spectrum, it->first, 0.0, it->second, charge);
+            }
+          }
+        } else {  //spectrum centric match report.
+          TideMatchSet::Arr match_arr(nCandPeptide);
+          for (TideMatchSet::Arr2::iterator it = match_arr2.begin();
+               it != match_arr2.end();
+               ++it) {
+            int peptide_idx = candidatePeptideStatusSize - (it->second);
+            if ((*candidatePeptideStatus)[peptide_idx]) {
+              TideMatchSet::Scores curScore;
+              curScore.xcorr_score = (double)(it->first / XCORR_SCALING);
+              curScore.rank = it->second;
+              match_arr.push_back(curScore);
+            }
+          }
 
-      locks_array[LOCK_CANDIDATES]->lock();
-      *total_candidate_peptides += nCandPeptide;
-      locks_array[LOCK_CANDIDATES]->unlock();
-
-      //TODO so this includes ALL amino acids seen (including modified, NTerm mod, CTerm Mod)
-      //as a result -- we will look for NTerm mod amino acids throughout spectrum instead of
-      //just amino acids without NTerm mod
-      vector<int> aaMassInt;
-      if (curScoreFunction != XCORR_SCORE) {
-        for (int i = 0; i < aaMassDouble.size(); i++) {
-          int tmpMass = MassConstants::mass2bin(aaMassDouble[i]);
-          aaMassInt.push_back(tmpMass);
+          TideMatchSet matches(&match_arr, highest_mz);
+          matches.exact_pval_search_ = exact_pval_search;
+          matches.cur_score_function_ = curScoreFunction;
+          matches.target_matches_ = target_matches;
+          matches.decoy_matches_ = decoy_matches;
+
+          matches.report(target_out, decoy_out, top_matches, numDecoys, spectrum_filename,
+                         spectrum, charge, active_peptide_queue, proteins,
+                         locations, compute_sp, true);
+          output->endSegment(sc_pos);
+        }  //end peptide_centric == false
+      } else { //This runs curScoreFunction=BOTH_SCORE, curScoreFunction=RESIUDUE_EVIDENCE_MATRIX, and xcorr p-val
+
+        int nCandPeptide = active_peptide_queue->SetActiveRangeBIons(min_mass, max_mass, min_range, max_range, candidatePeptideStatus);
+        int candidatePeptideStatusSize = candidatePeptideStatus->size();
+        if (nCandPeptide == 0) {
+          continue;
         }
-      }
-      int maxPrecurMassBin = floor(MaxBin::Global().CacheBinEnd() + 50.0);
-      double fragTol = Params::GetDouble("fragment-tolerance");
-      int granularityScale = Params::GetInt("evidence-granularity");
-
-      //TODO look at this
-      int minDeltaMass;
-      int maxDeltaMass;
-      if (curScoreFunction == XCORR_SCORE) {
-        minDeltaMass = aaMass[0];
-        maxDeltaMass = aaMass[nAA - 1];
-      } else {
-        minDeltaMass = aaMassInt[0];
-        maxDeltaMass = aaMassInt[nAARes - 1];
-      }
 
-      TideMatchSet::Arr match_arr(nCandPeptide); // scored peptides will go here.
-
-      // iterators needed at multiple places in following code
-      deque<Peptide*>::const_iterator iter_ = active_peptide_queue->iter_;
-      deque<TheoreticalPeakSetBIons>::const_iterator iter1_ = active_peptide_queue->iter1_;
-
-      //************************************************************************
-      /* For one observed spectrum, calculates:
-       *  - vector of cleavage evidence
-       *  - score count vectors for a range of integer masses
-       *  - p-values of XCorr match scores between spectrum and all selected candidate target and decoy peptides
-       * Written by Jeff Howbert, October 2013.
-       * Ported to and integrated with Tide by Jeff Howbert, November 2013.
-       *
-       * In addition calculates:
-       *   - a residue evidence matrix for a range of int masses
-       *   - score count vectors for range of int masses (using res-ev matrix)
-       *   - p-values of residue-evidence match between spectrum and all selected target and decoy peptides
-       * Written by Jeff Howbert
-       * Ported to and integrated with Tide by Andy Lin, Nov 2016
-       */
-      int peidx, pe, ma;
-      vector<int> pepMassInt;
-      pepMassInt.reserve(nCandPeptide);
-      vector<int> pepMassIntUnique;
-      pepMassIntUnique.reserve(nCandPeptide);
-
-      //For each candidate peptide, determine which discretized mass bin it is in
-      //pepMassInt contains the corresponding mass bin for each candidate peptide
-      //pepMassIntUnique contains the unique set of mass bins that candidate peptides fall in
-      getMassBin(pepMassInt, pepMassIntUnique, active_peptide_queue, candidatePeptideStatus);
-      int nPepMassIntUniq = (int)pepMassIntUnique.size();
-
-      //XCORR
-      vector< vector<int> > evidenceObs(nPepMassIntUniq, vector<int>(maxPrecurMassBin, 0));
-      int* scoreOffsetObs = new int[nPepMassIntUniq];
-      double** pValueScoreObs = new double*[nPepMassIntUniq];
-      int* intensArrayTheor = new int [maxPrecurMassBin]; // initialized later in loop
-      //END XCORR
-
-      //RES-EV
-      //Creates a 3D vector representing 3D matrix
-      //nPepMassIntUniq: number of mass bins candidate are in
-      //nAARes: number of amino acids
-      //maxPrecurMassBin: max number of mass bins
-      vector<vector<vector<double> > > residueEvidenceMatrix(nPepMassIntUniq,
-	      vector<vector<double> >(nAARes, vector<double>(maxPrecurMassBin, 0)));
-
-      //Stores the score offset needed calculating res-ev p-values
-      vector<int> scoreResidueOffsetObs(maxPrecurMassBin, -1);
-
-      //For each mass bin, a vector hold the p-values for each corresponding res-ev score
-      vector<vector<double> > pValuesResidueObs(maxPrecurMassBin);
-
-      //TODO assumption is that there is one nterm mod per peptide
-      int nTermMassBin;
-      double nTermMass;
-      if (nterm_mod_table.static_mod_size() > 0) {
-        nTermMassBin = MassConstants::mass2bin(
-                         MassConstants::mono_h + nterm_mod_table.static_mod(0).delta());
-        nTermMass = MassConstants::mono_h + nterm_mod_table.static_mod(0).delta();
-      } else {
-        nTermMassBin = MassConstants::mass2bin(MassConstants::mono_h);
-        nTermMass = MassConstants::mono_h;
-      }
+        locks_array[LOCK_CANDIDATES]->lock();
+        *total_candidate_peptides += nCandPeptide;
+        locks_array[LOCK_CANDIDATES]->unlock();
 
-      //TODO assumption is that there is one cterm mod per peptide
-      int cTermMassBin;
-      double cTermMass;
-      if (cterm_mod_table.static_mod_size() > 0) {
-        cTermMassBin = MassConstants::mass2bin(
-		      MassConstants::mono_oh + cterm_mod_table.static_mod(0).delta());
-        cTermMass = MassConstants::mono_oh + cterm_mod_table.static_mod(0).delta();
-      } else {
-        cTermMassBin = MassConstants::mass2bin(MassConstants::mono_oh);
-        cTermMass = MassConstants::mono_oh;
-      }
+        //TODO so this includes ALL amino acids seen (including modified, NTerm mod, CTerm Mod)
+        //as a result -- we will look for NTerm mod amino acids throughout spectrum instead of
+        //just amino acids without NTerm mod
+        vector<int> aaMassInt;
+        if (curScoreFunction != XCORR_SCORE) {
+          for (int i = 0; i < aaMassDouble.size(); i++) {
+            int tmpMass = MassConstants::mass2bin(aaMassDouble[i]);
+            aaMassInt.push_back(tmpMass);
+          }
+        }
+        int maxPrecurMassBin = floor(MaxBin::Global().CacheBinEnd() + 50.0);
+        double fragTol = Params::GetDouble("fragment-tolerance");
+        int granularityScale = Params::GetInt("evidence-granularity");
+
+        //TODO look at this
+        int minDeltaMass;
+        int maxDeltaMass;
+        if (curScoreFunction == XCORR_SCORE) {
+          minDeltaMass = aaMass[0];
+          maxDeltaMass = aaMass[nAA - 1];
+        } else {
+          minDeltaMass = aaMassInt[0];
+          maxDeltaMass = aaMassInt[nAARes - 1];
+        }
 
-      map<int, bool> calcDPMatrix; //for each precursor mass bin, bool determines whether to calc DP matrix
-      //END RES-EV
+        TideMatchSet::Arr match_arr(nCandPeptide); // scored peptides will go here.
 
-      //Create a residue evidence matrix and evidence vector
-      //for each mass bin candidate peptides are in
-      for (pe = 0; pe < nPepMassIntUniq; pe++) {
-        //XCORR
-        if (curScoreFunction != RESIDUE_EVIDENCE_MATRIX) {
-          scoreOffsetObs[pe] = 0;
-          int pepMaInt = pepMassIntUnique[pe]; // TODO should be accessed with an iterator
-
-          //preprocess to create one integerized evidence vector for each cluster of masses among selected peptides
-          double pepMassMonoMean = (pepMaInt - 0.5 + bin_offset_) * bin_width_;
-          evidenceObs[pe] = spectrum->CreateEvidenceVectorDiscretized(
-            bin_width, bin_offset, charge, pepMassMonoMean, maxPrecurMassBin,
-            &num_range_skipped, &num_precursors_skipped, &num_isotopes_skipped, &num_retained);
+        // iterators needed at multiple places in following code
+        deque<Peptide*>::const_iterator iter_ = active_peptide_queue->iter_;
+        deque<TheoreticalPeakSetBIons>::const_iterator iter1_ = active_peptide_queue->iter1_;
+
+        //************************************************************************
+        /* For one observed spectrum, calculates:
+         *  - vector of cleavage evidence
+         *  - score count vectors for a range of integer masses
+         *  - p-values of XCorr match scores between spectrum and all selected candidate target and decoy peptides
+         * Written by Jeff Howbert, October 2013.
+         * Ported to and integrated with Tide by Jeff Howbert, November 2013.
+         *
+         * In addition calculates:
+         *   - a residue evidence matrix for a range of int masses
+         *   - score count vectors for range of int masses (using res-ev matrix)
+         *   - p-values of residue-evidence match between spectrum and all selected target and decoy peptides
+         * Written by Jeff Howbert
+         * Ported to and integrated with Tide by Andy Lin, Nov 2016
+         */
+        int peidx, pe, ma;
+        vector<int> pepMassInt(nCandPeptide);
+        vector<int> pepMassIntUnique;
+        pepMassIntUnique.reserve(nCandPeptide);
+
+        //For each candidate peptide, determine which discretized mass bin it is in
+        //pepMassInt contains the corresponding mass bin for each candidate peptide
+        //pepMassIntUnique contains the unique set of mass bins that candidate peptides fall in
+        getMassBin(pepMassInt, pepMassIntUnique, active_peptide_queue, candidatePeptideStatus);
+        int nPepMassIntUniq = (int)pepMassIntUnique.size();
+
+        //pepMassIntIdx contains, for each candidate peptide, the index of its
+        //mass bin in pepMassIntUnique (which is sorted)
+        vector<int> pepMassIntIdx(nCandPeptide);
+        for (pe = 0; pe < nCandPeptide; pe++) {
+          pepMassIntIdx[pe] = lower_bound(pepMassIntUnique.begin(), pepMassIntUnique.end(),
+                                          pepMassInt[pe]) - pepMassIntUnique.begin();
         }
+
+        //XCORR
+        vector< vector<int> > evidenceObs(nPepMassIntUniq, vector<int>(maxPrecurMassBin, 0));
+        int* scoreOffsetObs = new int[nPepMassIntUniq];
+        double** pValueScoreObs = new double*[nPepMassIntUniq];
+        int* intensArrayTheor = new int [maxPrecurMassBin]; // initialized later in loop
         //END XCORR
 
         //RES-EV
+        //Stores the score offset needed calculating res-ev p-values
+        vector<int> scoreResidueOffsetObs(maxPrecurMassBin, -1);
+
+        //For each mass bin, a vector hold the p-values for each corresponding res-ev score
+        vector<vector<double> > pValuesResidueObs(maxPrecurMassBin);
+
+        //TODO assumption is that there is one nterm mod per peptide
+        int nTermMassBin;
+        double nTermMass;
+        if (nterm_mod_table.static_mod_size() > 0) {
+          nTermMassBin = MassConstants::mass2bin(
+                           MassConstants::mono_h + nterm_mod_table.static_mod(0).delta());
+          nTermMass = MassConstants::mono_h + nterm_mod_table.static_mod(0).delta();
+        } else {
+          nTermMassBin = MassConstants::mass2bin(MassConstants::mono_h);
+          nTermMass = MassConstants::mono_h;
+        }
+
+        //TODO assumption is that there is one cterm mod per peptide
+        int cTermMassBin;
+        double cTermMass;
+        if (cterm_mod_table.static_mod_size() > 0) {
+          cTermMassBin = MassConstants::mass2bin(
+  		      MassConstants::mono_oh + cterm_mod_table.static_mod(0).delta());
+          cTermMass = MassConstants::mono_oh + cterm_mod_table.static_mod(0).delta();
+        } else {
+          cTermMassBin = MassConstants::mass2bin(MassConstants::mono_oh);
+          cTermMass = MassConstants::mono_oh;
+        }
+
+        map<int, bool> calcDPMatrix; //for each precursor mass bin, bool determines whether to calc DP matrix
+
+        //The residue evidence matrix (nAARes x maxPrecurMassBin) depends only on
+        //the spectrum, so one matrix serves all mass bins of the candidates.
+        //Each mass bin only reads the columns below its own mass.
         if (curScoreFunction != XCORR_SCORE) {
           // note: aaMassDouble differs from aaMass
           // aaMassDouble contains amino acids masses in float form
@@ -786,293 +1012,295 @@ void TideSearchApplication::search(void* threadarg) {
           // precursorMass is the neutral mass
           observed.CreateResidueEvidenceMatrix(*spectrum, charge, maxPrecurMassBin, precursorMass,
                                                nAARes, aaMassDouble, fragTol, granularityScale,
-                                               nTermMass, cTermMass,&num_range_skipped, 
+                                               nTermMass, cTermMass,&num_range_skipped,
                                                &num_precursors_skipped, &num_isotopes_skipped, &num_retained,
-                                               residueEvidenceMatrix[pe]);
-          vector<vector<double> > curResidueEvidenceMatrix = residueEvidenceMatrix[pe];
-
-          //Get rid of values larger than curPepMassInt
-          int curPepMassInt = pepMassIntUnique[pe];
-          for (int i = 0; i < curResidueEvidenceMatrix.size(); i++) {
-            curResidueEvidenceMatrix[i].resize(curPepMassInt);
-          }
-          residueEvidenceMatrix[pe] = curResidueEvidenceMatrix;
-          calcDPMatrix[curPepMassInt] = false;
+                                               residueEvidenceMatrix);
         }
-        //END RES-Ev
-      }
-
-      //Calculates a residue evidence score and a xcorr score
-      //between a spectrum and all possible peptide candidates
-      //based upon the residue evidence matrix and the theoretical spectrum
-      int scoreResidueEvidence;
-      int scoreRefactInt;
-      vector<int> resEvScores;
-      vector<int> xcorrScores;
-      pe = 0;
-      for (peidx = 0; peidx < candidatePeptideStatusSize; peidx++) {
-        if ((*candidatePeptideStatus)[peidx]) {
-          int pepMassIntIdx = 0;
-          int curPepMassInt;
-          for (ma = 0; ma < nPepMassIntUniq; ma++ ) { //TODO should probably use iterator instead
-            if (pepMassIntUnique[ma] == pepMassInt[pe]) { //TODO pepMassIntUnique should be accessed with an interator
-              pepMassIntIdx = ma;
-              curPepMassInt = pepMassIntUnique[ma];
-              break;
-            }
-          }
+        //END RES-EV
 
+        //Create an evidence vector for each mass bin candidate peptides are in
+        for (pe = 0; pe < nPepMassIntUniq; pe++) {
           //XCORR
-          // score XCorr for target peptide with integerized evidenceObs array
           if (curScoreFunction != RESIDUE_EVIDENCE_MATRIX) {
-            for (ma = 0; ma < maxPrecurMassBin; ma++) {
-              intensArrayTheor[ma] = 0;
-            }
-
-            for (vector<unsigned int>::const_iterator iter_uint = iter1_->unordered_peak_list_.begin();
-                 iter_uint != iter1_->unordered_peak_list_.end();
-                 iter_uint++) {
-              intensArrayTheor[*iter_uint] = 1;
-            }
-
-            scoreRefactInt = 0;
-            for (ma = 0; ma < maxPrecurMassBin; ma++) {
-              scoreRefactInt += evidenceObs[pepMassIntIdx][ma] * intensArrayTheor[ma];
-            }
-            xcorrScores.push_back(scoreRefactInt);
+            scoreOffsetObs[pe] = 0;
+            int pepMaInt = pepMassIntUnique[pe]; // TODO should be accessed with an iterator
+
+            //preprocess to create one integerized evidence vector for each cluster of masses among selected peptides
+            double pepMassMonoMean = (pepMaInt - 0.5 + bin_offset_) * bin_width_;
+            evidenceObs[pe] = spectrum->CreateEvidenceVectorDiscretized(
+              bin_width, bin_offset, charge, pepMassMonoMean, maxPrecurMassBin,
+              &num_range_skipped, &num_precursors_skipped, &num_isotopes_skipped, &num_retained);
           }
           //END XCORR
 
           //RES-EV
           if (curScoreFunction != XCORR_SCORE) {
-            vector<vector<double> > curResidueEvidenceMatrix = residueEvidenceMatrix[pepMassIntIdx];
-            Peptide* curPeptide = (*iter_);
-
-            vector<unsigned int> intensArrayTheorResEv;
-            for (vector<unsigned int>::const_iterator iter_uint = iter1_->unordered_peak_list_.begin();
-                 iter_uint != iter1_->unordered_peak_list_.end();
-                 iter_uint++) {
-              intensArrayTheorResEv.push_back(*iter_uint);
-            }
-
-            scoreResidueEvidence = calcResEvScore(curResidueEvidenceMatrix,intensArrayTheorResEv,aaMassDouble,curPeptide);
-            resEvScores.push_back(scoreResidueEvidence);
+            calcDPMatrix[pepMassIntUnique[pe]] = false;
+          }
+          //END RES-Ev
+        }
 
-            if (scoreResidueEvidence > 0) { // if > 0, set bool to true to create DP matrix
-              calcDPMatrix[curPepMassInt] = true;
+        //Calculates a residue evidence score and a xcorr score
+        //between a spectrum and all possible peptide candidates
+        //based upon the residue evidence matrix and the theoretical spectrum
+        int scoreResidueEvidence;
+        int scoreRefactInt;
+        vector<int> resEvScores;
+        vector<int> xcorrScores;
+        pe = 0;
+        for (peidx = 0; peidx < candidatePeptideStatusSize; peidx++) {
+          if ((*candidatePeptideStatus)[peidx]) {
+            int curPepMassIntIdx = pepMassIntIdx[pe];
+            int curPepMassInt = pepMassInt[pe];
+
+            //XCORR
+            // score XCorr for target peptide with integerized evidenceObs array
+            if (curScoreFunction != RESIDUE_EVIDENCE_MATRIX) {
+              for (ma = 0; ma < maxPrecurMassBin; ma++) {
+                intensArrayTheor[ma] = 0;
+              }
+
+              for (vector<unsigned int>::const_iterator iter_uint = iter1_->unordered_peak_list_.begin();
+                   iter_uint != iter1_->unordered_peak_list_.end();
+                   iter_uint++) {
+                intensArrayTheor[*iter_uint] = 1;
+              }
+
+              scoreRefactInt = 0;
+              for (ma = 0; ma < maxPrecurMassBin; ma++) {
+                scoreRefactInt += evidenceObs[curPepMassIntIdx][ma] * intensArrayTheor[ma];
+              }
+              xcorrScores.push_back(scoreRefactInt);
             }
+            //END XCORR
+
+            //RES-EV
+            if (curScoreFunction != XCORR_SCORE) {
+              Peptide* curPeptide = (*iter_);
+              scoreResidueEvidence = calcResEvScore(residueEvidenceMatrix, iter1_->unordered_peak_list_,
+                                                    aaMassDouble, curPeptide);
+              resEvScores.push_back(scoreResidueEvidence);
+
+              if (scoreResidueEvidence > 0) { // if > 0, set bool to true to create DP matrix
+                calcDPMatrix[curPepMassInt] = true;
+              }
+            }
+            //END RES-EV
+            pe++;
           }
-          //END RES-EV
-          pe++;
+          ++iter_;
+          ++iter1_;
         }
-        ++iter_;
-        ++iter1_;
-      }
 
-      if (curScoreFunction == RESIDUE_EVIDENCE_MATRIX || curScoreFunction == BOTH_SCORE) {
-        assert(resEvScores.size() == nCandPeptide);
-      }
-      if (curScoreFunction == XCORR_SCORE || curScoreFunction == BOTH_SCORE) {
-        assert(xcorrScores.size() == nCandPeptide);
-      }
+        if (curScoreFunction == RESIDUE_EVIDENCE_MATRIX || curScoreFunction == BOTH_SCORE) {
+          assert(resEvScores.size() == nCandPeptide);
+        }
+        if (curScoreFunction == XCORR_SCORE || curScoreFunction == BOTH_SCORE) {
+          assert(xcorrScores.size() == nCandPeptide);
+        }
 
-      //XCORR
-      //Create a dynamic programming vector is there is a xcorr
-      //and if user specified as a score function either 'xcorr' or 'both'
-      if (curScoreFunction != RESIDUE_EVIDENCE_MATRIX) {
-        for (pe = 0; pe < nPepMassIntUniq; pe++) { // TODO should probably instead use iterator over pepMassIntUnique
-          int pepMaInt = pepMassIntUnique[pe]; // TODO should be accessed with an iterator
-
-          // NOTE: will have to go back to separate dynamic programming for
-          //       target and decoy if they have different probNI and probC
-          int maxEvidence = *std::max_element(evidenceObs[pe].begin(), evidenceObs[pe].end());
-          int minEvidence = *std::min_element(evidenceObs[pe].begin(), evidenceObs[pe].end());
-
-          // estimate maxScore and minScore
-          int maxNResidue = (int)floor((double)pepMaInt / (double)minDeltaMass);
-          vector<int> sortEvidenceObs(evidenceObs[pe].begin(), evidenceObs[pe].end());
-          std::sort(sortEvidenceObs.begin(), sortEvidenceObs.end(), greater<int>());
-          int maxScore = 0;
-          int minScore = 0;
-          for (int sc = 0; sc < maxNResidue; sc++) {
-            maxScore += sortEvidenceObs[sc];
-          }
+        //XCORR
+        //Create a dynamic programming vector is there is a xcorr
+        //and if user specified as a score function either 'xcorr' or 'both'
+        if (curScoreFunction != RESIDUE_EVIDENCE_MATRIX) {
+          for (pe = 0; pe < nPepMassIntUniq; pe++) { // TODO should probably instead use iterator over pepMassIntUnique
+            int pepMaInt = pepMassIntUnique[pe]; // TODO should be accessed with an iterator
+
+            // NOTE: will have to go back to separate dynamic programming for
+            //       target and decoy if they have different probNI and probC
+            int maxEvidence = *std::max_element(evidenceObs[pe].begin(), evidenceObs[pe].end());
+            int minEvidence = *std::min_element(evidenceObs[pe].begin(), evidenceObs[pe].end());
+
+            // estimate maxScore and minScore
+            int maxNResidue = (int)floor((double)pepMaInt / (double)minDeltaMass);
+            vector<int> sortEvidenceObs(evidenceObs[pe].begin(), evidenceObs[pe].end());
+            std::sort(sortEvidenceObs.begin(), sortEvidenceObs.end(), greater<int>());
+            int maxScore = 0;
+            int minScore = 0;
+            for (int sc = 0; sc < maxNResidue; sc++) {
+              maxScore += sortEvidenceObs[sc];
+            }
 
-          for (int sc = maxPrecurMassBin - maxNResidue; sc < maxPrecurMassBin; sc++) {
-            minScore += sortEvidenceObs[sc];
-          }
+            for (int sc = maxPrecurMassBin - maxNResidue; sc < maxPrecurMassBin; sc++) {
+              minScore += sortEvidenceObs[sc];
+            }
 
-          int bottomRowBuffer = maxEvidence + 1;
-          int topRowBuffer = -minEvidence;
-          int nRowDynProg = bottomRowBuffer - minScore + 1 + maxScore + topRowBuffer;
-          pValueScoreObs[pe] = new double[nRowDynProg];
+            int bottomRowBuffer = maxEvidence + 1;
+            int topRowBuffer = -minEvidence;
+            int nRowDynProg = bottomRowBuffer - minScore + 1 + maxScore + topRowBuffer;
+            pValueScoreObs[pe] = new double[nRowDynProg];
 
-          scoreOffsetObs[pe] = calcScoreCount(maxPrecurMassBin, &evidenceObs[pe][0], pepMaInt,
-                               maxEvidence, minEvidence, maxScore, minScore,
-                               nAA, aaFreqN, aaFreqI, aaFreqC, aaMass,
-                               pValueScoreObs[pe]);
-        }
-      }
-      //END XCORR
-
-      //RES-EV
-      //Create dyanamic programming matrix if there is a res-ev score greater than 0
-      //and if user specified as a score function either 'residue-evidence matrix' or 'both'
-      if (curScoreFunction != XCORR_SCORE) {
-        for (pe=0 ; pe<nPepMassIntUniq ; pe++) {
-          int curPepMassInt = pepMassIntUnique[pe];
-          if (calcDPMatrix[curPepMassInt] == false) {
-            continue;
+            scoreOffsetObs[pe] = calcScoreCount(maxPrecurMassBin, &evidenceObs[pe][0], pepMaInt,
+                                 maxEvidence, minEvidence, maxScore, minScore,
+                                 nAA, aaFreqN, aaFreqI, aaFreqC, aaMass,
+                                 pValueScoreObs[pe]);
           }
+        }
+        //END XCORR
 
-          vector<vector<double> > curResidueEvidenceMatrix = residueEvidenceMatrix[pe];
-          vector<int> maxColEvidence(curPepMassInt,0);
+        //RES-EV
+        //Create dyanamic programming matrix if there is a res-ev score greater than 0
+        //and if user specified as a score function either 'residue-evidence matrix' or 'both'
+        if (curScoreFunction != XCORR_SCORE) {
+          for (pe=0 ; pe<nPepMassIntUniq ; pe++) {
+            int curPepMassInt = pepMassIntUnique[pe];
+            if (calcDPMatrix[curPepMassInt] == false) {
+              continue;
+            }
 
-          //maxColEvidence is edited by reference
-          int maxEvidence = getMaxColEvidence(curResidueEvidenceMatrix,maxColEvidence,curPepMassInt);
-          int maxNResidue = floor((double)curPepMassInt / 57.0);
+            vector<int> maxColEvidence(curPepMassInt,0);
 
-          std::sort(maxColEvidence.begin(),maxColEvidence.end(),greater<int>());
-          int maxScore = 0;
-          for(int i = 0; i < maxNResidue; i++) { //maxColEvidence has been sorted
-            maxScore += maxColEvidence[i];
-          }
+            //maxColEvidence is edited by reference
+            int maxEvidence = getMaxColEvidence(residueEvidenceMatrix,maxColEvidence,curPepMassInt);
+            int maxNResidue = floor((double)curPepMassInt / 57.0);
 
-          int scoreOffset;
-          vector<double> scoreResidueCount;
+            std::sort(maxColEvidence.begin(),maxColEvidence.end(),greater<int>());
+            int maxScore = 0;
+            for(int i = 0; i < maxNResidue; i++) { //maxColEvidence has been sorted
+              maxScore += maxColEvidence[i];
+            }
 
-          calcResidueScoreCount(nAARes,curPepMassInt,curResidueEvidenceMatrix,aaMassInt,
-                                dAAFreqN, dAAFreqI, dAAFreqC,nTermMassBin,cTermMassBin,
-                                minDeltaMass,maxDeltaMass,maxEvidence,maxScore,
-                                scoreResidueCount,scoreOffset);
-          scoreResidueOffsetObs[curPepMassInt] = scoreOffset;
+            int scoreOffset;
+            vector<double> scoreResidueCount;
 
-          double totalCount = 0;
-          for (int i=scoreOffset ; i<scoreResidueCount.size() ; i++) {
-            totalCount += scoreResidueCount[i];
-          }
-          for (int i=scoreResidueCount.size()-2 ; i>-1; i--) {
-            scoreResidueCount[i] = scoreResidueCount[i] + scoreResidueCount[i+1];
-          }
-          for (int i = 0; i < scoreResidueCount.size(); i++) {
-            //Avoid potential underflow
-            scoreResidueCount[i] = exp(log(scoreResidueCount[i]) - log(totalCount));
+            calcResidueScoreCount(nAARes,curPepMassInt,residueEvidenceMatrix,aaMassInt,
+                                  dAAFreqN, dAAFreqI, dAAFreqC,nTermMassBin,cTermMassBin,
+                                  minDeltaMass,maxDeltaMass,maxEvidence,maxScore,
+                                  scoreResidueCount,scoreOffset,dynProgArray);
+            scoreResidueOffsetObs[curPepMassInt] = scoreOffset;
+
+            double totalCount = 0;
+            for (int i=scoreOffset ; i<scoreResidueCount.size() ; i++) {
+              totalCount += scoreResidueCount[i];
+            }
+            for (int i=scoreResidueCount.size()-2 ; i>-1; i--) {
+              scoreResidueCount[i] = scoreResidueCount[i] + scoreResidueCount[i+1];
+            }
+            for (int i = 0; i < scoreResidueCount.size(); i++) {
+              //Avoid potential underflow
+              scoreResidueCount[i] = exp(log(scoreResidueCount[i]) - log(totalCount));
+            }
+            pValuesResidueObs[curPepMassInt].swap(scoreResidueCount);
           }
-          pValuesResidueObs[curPepMassInt] = scoreResidueCount;
         }
-      }
-      //END RES-EV
-
-      /************ calculate p-values for PSMs using residue evidence matrix ****************/
-      iter_ = active_peptide_queue->iter_;
-      iter1_ = active_peptide_queue->iter1_;
-      int curPepMassInt;
-      double pValue_xcorr;
-      double pValue_resEv;
-      double pValue_both;
-      pe = 0;
-      for (peidx = 0; peidx < candidatePeptideStatusSize; peidx++) {
-        if ((*candidatePeptideStatus)[peidx]) {
-          int pepMassIntIdx = 0;
-
-          for (ma = 0; ma < nPepMassIntUniq; ma++ ) { //TODO should probably use iterator instead
-            if (pepMassIntUnique[ma] == pepMassInt[pe]) { //TODO pepMassIntUnique should be accessed with an interator
-              pepMassIntIdx = ma;
-              curPepMassInt = pepMassIntUnique[ma];
-              break;
+        //END RES-EV
+
+        /************ calculate p-values for PSMs using residue evidence matrix ****************/
+        iter_ = active_peptide_queue->iter_;
+        iter1_ = active_peptide_queue->iter1_;
+        int curPepMassInt;
+        double pValue_xcorr;
+        double pValue_resEv;
+        double pValue_both;
+        pe = 0;
+        for (peidx = 0; peidx < candidatePeptideStatusSize; peidx++) {
+          if ((*candidatePeptideStatus)[peidx]) {
+            int curPepMassIntIdx = pepMassIntIdx[pe];
+            curPepMassInt = pepMassInt[pe];
+
+            int scoreCountIdx;
+            //XCORR
+            if (curScoreFunction != RESIDUE_EVIDENCE_MATRIX) {
+              scoreRefactInt = xcorrScores[pe];
+              scoreCountIdx = scoreRefactInt + scoreOffsetObs[curPepMassIntIdx];
+              pValue_xcorr = pValueScoreObs[curPepMassIntIdx][scoreCountIdx];
             }
-          }
+            //END XCORR
+
+            //RES-EV
+            if (curScoreFunction != XCORR_SCORE) {
+              scoreResidueEvidence = resEvScores[pe];
+              if (calcDPMatrix[curPepMassInt]) {
+                scoreCountIdx = scoreResidueEvidence + scoreResidueOffsetObs[curPepMassInt];
+                pValue_resEv = pValuesResidueObs[curPepMassInt][scoreCountIdx];
+              } else {
+                pValue_resEv = 1.0;
+              }
+            }
+            //END RES-EV
 
-          int scoreCountIdx;
-          //XCORR
-          if (curScoreFunction != RESIDUE_EVIDENCE_MATRIX) {
-            scoreRefactInt = xcorrScores[pe];
-            scoreCountIdx = scoreRefactInt + scoreOffsetObs[pepMassIntIdx];
-            pValue_xcorr = pValueScoreObs[pepMassIntIdx][scoreCountIdx];
-          }
-          //END XCORR
+            //BOTH SCORE
+            if (curScoreFunction == BOTH_SCORE) {
+              double cPval = pValue_xcorr * pValue_resEv;
 
-          //RES-EV
-          if (curScoreFunction != XCORR_SCORE) {
-            scoreResidueEvidence = resEvScores[pe];
-            if (calcDPMatrix[curPepMassInt]) {
-              scoreCountIdx = scoreResidueEvidence + scoreResidueOffsetObs[curPepMassInt];
-              pValue_resEv = pValuesResidueObs[curPepMassInt][scoreCountIdx];
+              double m = 1.2; // This value has been empircally determined
+              pValue_both = calcCombinedPval(m,cPval,2); //2 is the # of p-values that are combined
+            }
+            //END BOTH_SCORE
+
+            if (curScoreFunction == XCORR_SCORE && pValue_xcorr == 0.0) {
+              carp(CARP_FATAL, "PSM p-value should not be equal to 0.0");
+            } else if (curScoreFunction == RESIDUE_EVIDENCE_MATRIX && pValue_resEv == 0.0) {
+              carp(CARP_FATAL, "PSM p-value should not be equal to 0.0");
+            } else if (curScoreFunction == BOTH_SCORE && pValue_both == 0.0) {
+              carp(CARP_FATAL, "PSM p-value should not be equal to 0.0");
+            }
+
+            if (peptide_centric) {
+              carp(CARP_FATAL, "residue-evidence has not been implemented with 'peptide-centric-search T' yet.");
             } else {
-              pValue_resEv = 1.0;
+              TideMatchSet::Scores curScore;
+              curScore.xcorr_score = (double)scoreRefactInt / RESCALE_FACTOR;
+              curScore.xcorr_pval = pValue_xcorr;
+              curScore.resEv_pval = pValue_resEv;
+              curScore.resEv_score = scoreResidueEvidence;
+              curScore.combinedPval = pValue_both;
+              //TODO ugly hack to conform with the way these indices are generated in standard tide-search
+              curScore.rank = candidatePeptideStatusSize - peidx;
+              match_arr.push_back(curScore);
             }
+            pe++;
           }
-          //END RES-EV
-
-          //BOTH SCORE
-          if (curScoreFunction == BOTH_SCORE) {
-            double cPval = pValue_xcorr * pValue_resEv;
+          ++iter_;
+          ++iter1_;
+        }
 
-            double m = 1.2; // This value has been empircally determined
-            pValue_both = calcCombinedPval(m,cPval,2); //2 is the # of p-values that are combined
-          }
-          //END BOTH_SCORE
-
-          if (curScoreFunction == XCORR_SCORE && pValue_xcorr == 0.0) {
-            carp(CARP_FATAL, "PSM p-value should not be equal to 0.0");
-          } else if (curScoreFunction == RESIDUE_EVIDENCE_MATRIX && pValue_resEv == 0.0) {
-            carp(CARP_FATAL, "PSM p-value should not be equal to 0.0");
-          } else if (curScoreFunction == BOTH_SCORE && pValue_both == 0.0) {
-            carp(CARP_FATAL, "PSM p-value should not be equal to 0.0");
+        //clean up
+        if (curScoreFunction != RESIDUE_EVIDENCE_MATRIX) {
+          for (pe = 0; pe < nPepMassIntUniq; pe++) {
+            delete [] pValueScoreObs[pe];
           }
-
-          if (peptide_centric) {
-            carp(CARP_FATAL, "residue-evidence has not been implemented with 'peptide-centric-search T' yet.");
+        }
+        delete [] scoreOffsetObs;
+        delete [] pValueScoreObs;
+        delete [] intensArrayTheor;
+
+        if (!peptide_centric) {
+          // below text is copied from text above in the exact-p-value XCORR case
+          // matches will arrange the results in a heap by score, return the top
+          // few, and recover the association between counter and peptide. We output
+          // the top matches.
+          TideMatchSet matches(&match_arr, highest_mz);
+          matches.exact_pval_search_ = exact_pval_search_;
+          matches.cur_score_function_ = curScoreFunction;
+          matches.target_matches_ = target_matches;
+          matches.decoy_matches_ = decoy_matches;
+
+          if (curScoreFunction == RESIDUE_EVIDENCE_MATRIX && exact_pval_search_ == false) {
+            matches.report(target_out, decoy_out, top_matches, numDecoys, spectrum_filename,
+                           spectrum, charge, active_peptide_queue, proteins,
+                           locations, compute_sp, true);
           } else {
-            TideMatchSet::Scores curScore;
-            curScore.xcorr_score = (double)scoreRefactInt / RESCALE_FACTOR;
-            curScore.xcorr_pval = pValue_xcorr;
-            curScore.resEv_pval = pValue_resEv;
-            curScore.resEv_score = scoreResidueEvidence;
-            curScore.combinedPval = pValue_both;
-            //TODO ugly hack to conform with the way these indices are generated in standard tide-search
-            curScore.rank = candidatePeptideStatusSize - peidx;
-            match_arr.push_back(curScore);
+            matches.report(target_out, decoy_out, top_matches, numDecoys, spectrum_filename,
+                           spectrum, charge, active_peptide_queue, proteins,
+                           locations, compute_sp, false);
           }
-          pe++;
-        }
-        ++iter_;
-        ++iter1_;
+          output->endSegment(sc_pos);
+        } //end peptide_centric == false
       }
-
-      //clean up
-      if (curScoreFunction != RESIDUE_EVIDENCE_MATRIX) {
-        for (pe = 0; pe < nPepMassIntUniq; pe++) {
-          delete [] pValueScoreObs[pe];
-        }
-      }
-      delete [] scoreOffsetObs;
-      delete [] pValueScoreObs;
-      delete [] intensArrayTheor;
-
-      if (!peptide_centric) {
-        // below text is copied from text above in the exact-p-value XCORR case
-        // matches will arrange the results in a heap by score, return the top
-        // few, and recover the association between counter and peptide. We output
-        // the top matches.
-        TideMatchSet matches(&match_arr, highest_mz);
-        matches.exact_pval_search_ = exact_pval_search_;
-        matches.cur_score_function_ = curScoreFunction;
-
-        if (curScoreFunction == RESIDUE_EVIDENCE_MATRIX && exact_pval_search_ == false) {
-          matches.report(target_file, decoy_file, top_matches, numDecoys, spectrum_filename,
-                         spectrum, charge, active_peptide_queue, proteins,
-                         locations, compute_sp, true, locks_array[LOCK_RESULTS]);
-        } else {
-          matches.report(target_file, decoy_file, top_matches, numDecoys, spectrum_filename,
-                         spectrum, charge, active_peptide_queue, proteins,
-                         locations, compute_sp, false, locks_array[LOCK_RESULTS]);
-        }
-      } //end peptide_centric == false
+      delete min_mass;
+      delete max_mass;
+      delete candidatePeptideStatus;
     }
-    delete min_mass;
-    delete max_mass;
-    delete candidatePeptideStatus;
+
+    // Nobody may be using the shared peptide queue when it is refilled.
+    chunk_barrier->wait();
+  }
+  if (thread_num == 0 && num_spec_charges > 0) {
+    waitForWriter(&writer);
+    int parity = ((num_spec_charges - 1) / chunk_size) % 2;
+    writer = startWriter(thread_outputs, parity, target_file, decoy_file);
+    waitForWriter(&writer);
   }
 
   if (!Params::GetBool("skip-preprocessing")) {
@@ -1104,8 +1332,8 @@ void TideSearchApplication::search(void* threadarg) {
 
 void TideSearchApplication::search(
   const string& spectrum_filename,
-  const vector<SpectrumCollection::SpecCharge>* spec_charges,
-  vector<ActivePeptideQueue*> active_peptide_queue,
+  SpectrumCollection* spectra,
+  ActivePeptideQueue* active_peptide_queue,
   ProteinVec& proteins,
   vector<const pb::AuxLocation*>& locations,
   double precursor_window,
@@ -1146,35 +1374,45 @@ void TideSearchApplication::search(
   int elution_window = Params::GetInt("elution-window-size");
   bool peptide_centric = Params::GetBool("peptide-centric-search");
 
+  const vector<SpectrumCollection::SpecCharge>* spec_charges = spectra->SpecCharges();
+
   // initialize fields required for output
-  int* sc_index = new int(-1);
   int* total_candidate_peptides = new int(0);
   FLOAT_T sc_total = (FLOAT_T)spec_charges->size();
+  SpectrumScheduler scheduler(NUM_THREADS, spec_charges->size(),
+                              Params::GetInt("print-search-progress"));
 
   if (peptide_centric == false) {
     elution_window = 0;
   }
 
-  for (int i = 0; i < NUM_THREADS; i++) {
-    active_peptide_queue[i]->setElutionWindow(elution_window);
-    active_peptide_queue[i]->setPeptideCentric(peptide_centric);
-  }
-
   if (elution_window > 0 && elution_window % 2 == 0) {
-    for (int i = 0; i < NUM_THREADS; i++) {
-      active_peptide_queue[i]->setElutionWindow(elution_window+1);
-    }
+    elution_window++;
   }
 
   if (!peptide_centric || !exact_pval_search_) {
-    for (int i = 0; i < NUM_THREADS; i++) {
-      active_peptide_queue[i]->setElutionWindow(0);
-    }
+    elution_window = 0;
   }
 
+  // Peptide-centric hits are reported by the shared queue as it discards
+  // peptides, so only it needs the outputs.
+  active_peptide_queue->setElutionWindow(elution_window);
+  active_peptide_queue->setPeptideCentric(peptide_centric);
+  active_peptide_queue->SetOutputs(
+    NULL, &locations, top_matches, compute_sp, target_file, decoy_file, highest_mz);
+
+  // Each thread selects its candidates from the shared queue.
+  vector<ActivePeptideQueue*> thread_peptide_queue;
   for (int i = 0; i < NUM_THREADS; i++) {
-    active_peptide_queue[i]->SetOutputs(
-      NULL, &locations, top_matches, compute_sp, target_file, decoy_file, highest_mz);
+    thread_peptide_queue.push_back(new ActivePeptideQueue(active_peptide_queue));
+    thread_peptide_queue[i]->setElutionWindow(elution_window);
+    thread_peptide_queue[i]->setPeptideCentric(peptide_centric);
+  }
+  boost::barrier chunk_barrier(NUM_THREADS);
+  // Two sets of buffers per thread; see search().
+  vector<ThreadOutput*> thread_outputs;
+  for (int i = 0; i < 2 * NUM_THREADS; i++) {
+    thread_outputs.push_back(new ThreadOutput());
   }
 
   // Creating structs to hold information required for each thread to search through
@@ -1182,14 +1420,15 @@ void TideSearchApplication::search(
 
   vector<thread_data> thread_data_array;
   for (int i= 0; i < NUM_THREADS; i++) {
-      thread_data_array.push_back(thread_data(spectrum_filename, spec_charges, active_peptide_queue[i],
+      thread_data_array.push_back(thread_data(spectrum_filename, spectra, thread_peptide_queue[i],
       proteins, locations, precursor_window, window_type, spectrum_min_mz,
       spectrum_max_mz, min_scan, max_scan, min_peaks, search_charge, top_matches,
       highest_mz, target_file, decoy_file, compute_sp,
       i, NUM_THREADS, nAA, aaFreqN, aaFreqI, aaFreqC, aaMass,
       nAARes, &dAAFreqN, &dAAFreqI, &dAAFreqC, &dAAMass,
       &mod_table, &nterm_mod_table, &cterm_mod_table, numDecoys, locks_array, //TODO do I need to delete pointer somewhere?
-      bin_width_, bin_offset_, exact_pval_search_, spectrum_flag_, sc_index, total_candidate_peptides, negative_isotope_errors));
+      bin_width_, bin_offset_, exact_pval_search_, spectrum_flag_, &scheduler, total_candidate_peptides, negative_isotope_errors,
+      active_peptide_queue, &chunk_barrier, &thread_outputs));
   }
 
   boost::thread_group threadgroup;
@@ -1205,6 +1444,7 @@ void TideSearchApplication::search(
 
   // Join threads
   threadgroup.join_all();
+  scheduler.Report();
 
   carp(CARP_INFO, "Time per spectrum-charge combination: %lf s.", wall_clock() / (1e6*sc_total));
   carp(CARP_INFO, "Average number of candidates per spectrum-charge combination: %lf ",
@@ -1212,7 +1452,12 @@ void TideSearchApplication::search(
   for (int i = 0; i < NUMBER_LOCK_TYPES; i++) {
     delete locks_array[i];
   }
-  delete sc_index;
+  for (int i = 0; i < NUM_THREADS; i++) {
+    delete thread_peptide_queue[i];
+  }
+  for (size_t i = 0; i < thread_outputs.size(); i++) {
+    delete thread_outputs[i];
+  }
   delete total_candidate_peptides;
 
 }
@@ -1228,6 +1473,13 @@ void TideSearchApplication::collectScoresCompiled(
   if (!active_peptide_queue->HasNext()) {
     return;
   }
+  if (!DotProduct::UseJit()) {
+    DotProduct::Score(active_peptide_queue->iter_, queue_size, charge,
+                      observed.GetCache(), match_arr->data());
+    match_arr->set_size(queue_size);
+    return;
+  }
+#ifdef TIDE_HAVE_JIT
   // prog gets the address of the dot-product program for the first peptide
   // in the active queue.
   const void* prog = active_peptide_queue->NextPeptide()->Prog(charge);
@@ -1323,6 +1575,7 @@ void TideSearchApplication::collectScoresCompiled(
                          "D" (results)
   );
 #endif
+#endif // TIDE_HAVE_JIT
 
   // match_arr is filled by the compiled programs, not by calls to
   // push_back(). We have to set the final size explicitly.
@@ -1426,6 +1679,150 @@ void TideSearchApplication::computeWindow(
        sc.spectrum->SpectrumNumber(), sc.charge, (*out_min)[0], (*out_max)[0]);
 }
 
+/**
+ * Computes the range of peptide masses that any spectrum-charge pair in
+ * [begin, end) may need.
+ */
+void TideSearchApplication::computeChunkRange(
+  const vector<SpectrumCollection::SpecCharge>* spec_charges,
+  int begin,
+  int end,
+  WINDOW_TYPE_T window_type,
+  double precursor_window,
+  int max_charge,
+  vector<int>* negative_isotope_errors,
+  double* min_range,
+  double* max_range
+) {
+  *min_range = numeric_limits<double>::max();
+  *max_range = -numeric_limits<double>::max();
+  for (int i = begin; i < end; i++) {
+    vector<double> min_mass, max_mass;
+    double pair_min_range, pair_max_range;
+    computeWindow((*spec_charges)[i], window_type, precursor_window, max_charge,
+                  negative_isotope_errors, &min_mass, &max_mass,
+                  &pair_min_range, &pair_max_range);
+    *min_range = min(*min_range, pair_min_range);
+    *max_range = max(*max_range, pair_max_range);
+  }
+}
+
+void TideSearchApplication::writeThreadOutputs(
+  vector<ThreadOutput*>& outputs,
+  ofstream* target_file,
+  ofstream* decoy_file
+) {
+  struct Piece {
+    int sc_pos;
+    int thread;
+    streamoff target_begin, target_end, decoy_begin, decoy_end;
+    size_t target_matches_begin, target_matches_end;
+    size_t decoy_matches_begin, decoy_matches_end;
+    bool operator<(const Piece& other) const { return sc_pos < other.sc_pos; }
+  };
+  vector<Piece> pieces;
+  vector<string> targets(outputs.size()), decoys(outputs.size());
+  for (size_t t = 0; t < outputs.size(); t++) {
+    targets[t] = outputs[t]->target.str();
+    decoys[t] = outputs[t]->decoy.str();
+    streamoff target_begin = 0, decoy_begin = 0;
+    size_t target_matches_begin = 0, decoy_matches_begin = 0;
+    const vector<ThreadOutput::Segment>& segments = outputs[t]->segments;
+    for (vector<ThreadOutput::Segment>::const_iterator i = segments.begin();
+         i != segments.end();
+         ++i) {
+      Piece piece = { i->sc_pos, (int)t, target_begin, i->target_end,
+                      decoy_begin, i->decoy_end,
+                      target_matches_begin, i->target_matches_end,
+                      decoy_matches_begin, i->decoy_matches_end };
+      pieces.push_back(piece);
+      target_begin = i->target_end;
+      decoy_begin = i->decoy_end;
+      target_matches_begin = i->target_matches_end;
+      decoy_matches_begin = i->decoy_matches_end;
+    }
+    outputs[t]->target.str("");
+    outputs[t]->decoy.str("");
+    outputs[t]->segments.clear();
+  }
+  // Each pair is searched by exactly one thread.
+  sort(pieces.begin(), pieces.end());
+  for (vector<Piece>::const_iterator i = pieces.begin(); i != pieces.end(); ++i) {
+    if (target_file && i->target_end > i->target_begin) {
+      target_file->write(targets[i->thread].data() + i->target_begin,
+                         i->target_end - i->target_begin);
+    }
+    if (decoy_file && i->decoy_end > i->decoy_begin) {
+      decoy_file->write(decoys[i->thread].data() + i->decoy_begin,
+                        i->decoy_end - i->decoy_begin);
+    }
+    for (size_t j = i->target_matches_begin; j < i->target_matches_end; j++) {
+      target_matches_->addMatchToPostMatchCollection(outputs[i->thread]->target_matches[j]);
+    }
+    for (size_t j = i->decoy_matches_begin; j < i->decoy_matches_end; j++) {
+      decoy_matches_->addMatchToPostMatchCollection(outputs[i->thread]->decoy_matches[j]);
+    }
+  }
+  for (size_t t = 0; t < outputs.size(); t++) {
+    outputs[t]->target_matches.clear();
+    outputs[t]->decoy_matches.clear();
+  }
+}
+
+boost::thread* TideSearchApplication::startWriter(
+  vector<ThreadOutput*>* thread_outputs,
+  int parity,
+  ofstream* target_file,
+  ofstream* decoy_file
+) {
+  size_t num_threads = thread_outputs->size() / 2;
+  vector<ThreadOutput*> outputs(thread_outputs->begin() + parity * num_threads,
+                                thread_outputs->begin() + (parity + 1) * num_threads);
+  return new boost::thread(boost::bind(&TideSearchApplication::writeThreadOutputs,
+                                       this, outputs, target_file, decoy_file));
+}
+
+void TideSearchApplication::waitForWriter(boost::thread** writer) {
+  if (*writer != NULL) {
+    (*writer)->join();
+    delete *writer;
+    *writer = NULL;
+  }
+}
+
+void TideSearchApplication::setMatchScoredTypes(
+  MatchCollection* matches,
+  bool compute_sp
+) const {
+  if (matches->getMatchTotal() == 0) {
+    return;
+  }
+  SCORE_FUNCTION_T score_function =
+    string_to_score_function_type(Params::GetString("score-function"));
+  bool xcorr = score_function == XCORR_SCORE;
+  bool res_ev = score_function == RESIDUE_EVIDENCE_MATRIX;
+  bool both = score_function == BOTH_SCORE;
+  matches->setHasDistinctMatches(true);
+  matches->setScoredType(DELTA_CN, true);
+  matches->setScoredType(DELTA_LCN, true);
+  matches->setScoredType(SP, compute_sp);
+  matches->setScoredType(BY_IONS_MATCHED, compute_sp);
+  matches->setScoredType(BY_IONS_TOTAL, compute_sp);
+  matches->setScoredType(XCORR, xcorr && !exact_pval_search_);
+  matches->setScoredType(TIDE_SEARCH_EXACT_PVAL, (xcorr && exact_pval_search_) || both);
+  matches->setScoredType(TIDE_SEARCH_REFACTORED_XCORR, (xcorr && exact_pval_search_) || both);
+  matches->setScoredType(RESIDUE_EVIDENCE_PVAL, (res_ev && exact_pval_search_) || both);
+  matches->setScoredType(RESIDUE_EVIDENCE_SCORE, res_ev || both);
+  matches->setScoredType(BOTH_PVALUE, both);
+  MatchIterator iter(matches);
+  while (iter.hasNext()) {
+    if (iter.next()->decoyIndex() >= 0) {
+      matches->setHasDecoyIndexes(true);
+      break;
+    }
+  }
+}
+
 bool TideSearchApplication::proteinLevelDecoys() {
   return PROTEIN_LEVEL_DECOYS;
 }
@@ -1530,6 +1927,7 @@ vector<string> TideSearchApplication::getOptions() const {
     "spectrum-max-mz",
     "spectrum-min-mz",
     "spectrum-parser",
+    "spool-dir",
     "sqt-output",
     "store-index",
     "store-spectra",
@@ -1538,7 +1936,8 @@ vector<string> TideSearchApplication::getOptions() const {
     "use-flanking-peaks",
     "use-neutral-loss-peaks",
     "use-z-line",
-    "verbosity"
+    "verbosity",
+    "xcorr-kernel"
   };
   return vector<string>(arr, arr + sizeof(arr) / sizeof(string));
 }
@@ -1727,7 +2126,7 @@ int TideSearchApplication::calcScoreCount(
 void TideSearchApplication::calcResidueScoreCount (
   int nAa,
   int pepMassInt,
-  vector<vector<double> >& residueEvidenceMatrix,
+  const ResidueEvidenceMatrix& residueEvidenceMatrix,
   vector<int>& aaMass,
   const vector<double>& aaFreqN,
   const vector<double>& aaFreqI,
@@ -1739,7 +2138,8 @@ void TideSearchApplication::calcResidueScoreCount (
   int maxEvidence,
   int maxScore,
   vector<double>& scoreCount, //this is returned for later use
-  int& scoreOffset //this is returned for later use
+  int& scoreOffset, //this is returned for later use
+  vector<double>& dynProgArray //workspace, reused between calls
 ) {
   int minEvidence  = 0;
   int minScore     = 0;
@@ -1749,8 +2149,6 @@ void TideSearchApplication::calcResidueScoreCount (
   int ma;
   int evid;
   int de;
-  int evidRow;
-  double sumScore;
 
   int bottomRowBuffer = maxEvidence;
   int topRowBuffer = -minEvidence;
@@ -1773,19 +2171,17 @@ void TideSearchApplication::calcResidueScoreCount (
   initCountRow = initCountRow - 1;
   initCountCol = initCountCol - 1;
 
-  double** dynProgArray = 0;
-  dynProgArray = new double*[nRow];
-  for (row = 0; row < nRow; row++) {
-    dynProgArray[row] = new double[nCol];
-    for (col = 0; col < nCol; col++) {
-      dynProgArray[row][col] = 0.0;
-    }
-  }
+  // The DP matrix is stored column by column in one buffer: entry (row, col)
+  // is dynProg[col * nRow + row]. Each step then adds a shifted, scaled
+  // column to another column, a contiguous loop over rows that the compiler
+  // can vectorize. For each entry the terms are still added in amino acid
+  // order, so the counts are the same as with the former row-major arrays.
+  dynProgArray.assign((size_t)nRow * nCol, 0.0);
+  double* dynProg = &dynProgArray[0];
 
   // initial count of peptides with mass = nTermMass
-  dynProgArray[initCountRow][initCountCol] = 1.0;
+  dynProg[(size_t)initCountCol * nRow + initCountRow] = 1.0;
 
-  int* aaMassCol = new int[nAa];
   // populate matrix with scores for first (i.e. N-terminal) amino acid in sequence
   for (de = 0; de < nAa; de++) {
     ma = aaMass[de];
@@ -1803,29 +2199,28 @@ void TideSearchApplication::calcResidueScoreCount (
 
 //    if ( col <= maxAaMass + colLast ) { //original
     if (col <= maxAaMass + colLast && col >= initCountCol) { //TODO not sure if below or above is correct
-      //dynProgArray[ row ][ col ] += dynProgArray[ initCountRow ][ initCountCol ];
-      dynProgArray[row][col] += dynProgArray[initCountRow][initCountCol] * aaFreqN[de];
+      dynProg[(size_t)col * nRow + row] +=
+        dynProg[(size_t)initCountCol * nRow + initCountRow] * aaFreqN[de];
     }
   }
 
   //set to zero now that score counts for first amino acid are in matrix
-  dynProgArray[initCountRow][initCountCol] = 0.0;
+  dynProg[(size_t)initCountCol * nRow + initCountRow] = 0.0;
 
   // populate matrix with score counts for non-terminal amino acids in sequence
   for (ma = colFirst; ma < colLast; ma++) {
     col = maxAaMass + ma;
+    double* dst = dynProg + (size_t)col * nRow;
 
     for (de = 0; de < nAa; de++) {
-      aaMassCol[de] = col - aaMass[de];
-    }
-    for (row = rowFirst; row <= rowLast; row++) {
-      sumScore = dynProgArray[row][col];
-      for (de = 0; de < nAa; de++) {
-        evidRow = row - residueEvidenceMatrix[de][ma];
-        //sumScore += dynProgArray[ evidRow ][ aaMassCol[ de ] ];
-        sumScore += dynProgArray[evidRow][aaMassCol[de]] * aaFreqI[de];
+      // dst[row] += src[row - evid] * freq, for all rows
+      evid = (int)residueEvidenceMatrix[de][ma];
+      const double* src = dynProg + (size_t)(col - aaMass[de]) * nRow + rowFirst - evid;
+      double* out = dst + rowFirst;
+      double freq = aaFreqI[de];
+      for (row = 0; row <= rowLast - rowFirst; row++) {
+        out[row] += src[row] * freq;
       }
-      dynProgArray[row][col] = sumScore;
     }
   }
 
@@ -1834,33 +2229,22 @@ void TideSearchApplication::calcResidueScoreCount (
   col = maxAaMass + ma;
 
   //no evidence should be added for last amino acid in sequence
-  evid = 0;
-  for (de = 0; de < nAa; de++) {
-    aaMassCol[de] = col - aaMass[de];
-  }
+  double* dst = dynProg + (size_t)col * nRow;
   for (row = rowFirst; row <= rowLast; row++) {
-    evidRow = row - evid;
-    sumScore = 0.0;
-    for (de = 0; de < nAa; de++) {
-      //sumScore += dynProgArray[ evidRow ][ aaMassCol[ de ] ];
-      sumScore += dynProgArray[evidRow][aaMassCol[de]] * aaFreqC[de];
+    dst[row] = 0.0;
+  }
+  for (de = 0; de < nAa; de++) {
+    const double* src = dynProg + (size_t)(col - aaMass[de]) * nRow;
+    double freq = aaFreqC[de];
+    for (row = rowFirst; row <= rowLast; row++) {
+      dst[row] += src[row] * freq;
     }
-    dynProgArray[row][col] = sumScore;
   }
 
   int colScoreCount = maxAaMass + colLast;
-  scoreCount.resize(nRow);
-  for (int row = 0; row < nRow; row++) {
-    scoreCount[row] = dynProgArray[row][colScoreCount];
-  }
+  const double* scoreCol = dynProg + (size_t)colScoreCount * nRow;
+  scoreCount.assign(scoreCol, scoreCol + nRow);
   scoreOffset = initCountRow;
-
-  // clean up
-  for (int row = 0; row < nRow; row++) {
-    delete [] dynProgArray[row];
-  }
-  delete [] dynProgArray;
-  delete [] aaMassCol;
 }
 
 void TideSearchApplication::processParams() {
@@ -1909,8 +2293,10 @@ void TideSearchApplication::processParams() {
                        "units. Please re-run with auto-precursor-window set to 'false' or "
                        "precursor-window-type set to 'ppm'.");
     }
+    // Convert the spectrum files while param-medic looks at their spectra,
+    // so that each file is parsed only once. main() searches the results.
     ParamMedicErrorCalculator errCalc;
-    errCalc.processFiles(Params::GetStrings("tide spectra file"));
+    inputFiles_ = getInputFiles(Params::GetStrings("tide spectra file"), &errCalc);
     string precursorFailure, fragmentFailure;
     double precursorSigmaPpm = 0;
     double fragmentSigmaPpm = 0;
@@ -1945,7 +2331,7 @@ void TideSearchApplication::processParams() {
   }
 }
 
-void TideSearchApplication::setSpectrumFlag(map<pair<string, unsigned int>, bool>* spectrum_flag) {
+void TideSearchApplication::setSpectrumFlag(SpectrumFlags* spectrum_flag) {
   spectrum_flag_ = spectrum_flag;
 }
 
@@ -1995,21 +2381,23 @@ void TideSearchApplication::getMassBin(
 //Once function runs, maxColEvidence will contain the max evidence in
 //each column of curResidueEvidenceMatrix
 int TideSearchApplication::getMaxColEvidence(
-  const vector<vector<double> >& curResidueEvidenceMatrix,
+  const ResidueEvidenceMatrix& curResidueEvidenceMatrix,
   vector<int>& maxColEvidence,
   int pepMassInt
 ) {
-  assert(maxColEvidence.size() == curResidueEvidenceMatrix[0].size());
+  assert(maxColEvidence.size() == pepMassInt);
+  assert(pepMassInt <= curResidueEvidenceMatrix.Cols());
 
   int maxEvidence = -1;
 
-  for (int curAA = 0; curAA < curResidueEvidenceMatrix.size(); curAA++) {
+  for (int curAA = 0; curAA < curResidueEvidenceMatrix.Rows(); curAA++) {
+    const double* evidence = curResidueEvidenceMatrix[curAA];
     for (int curMassBin = 0; curMassBin < pepMassInt; curMassBin++) {
-      if (curResidueEvidenceMatrix[curAA][curMassBin] > maxColEvidence[curMassBin]) {
-        maxColEvidence[curMassBin] = curResidueEvidenceMatrix[curAA][curMassBin];
+      if (evidence[curMassBin] > maxColEvidence[curMassBin]) {
+        maxColEvidence[curMassBin] = evidence[curMassBin];
       }
-      if (curResidueEvidenceMatrix[curAA][curMassBin] > maxEvidence) {
-        maxEvidence = curResidueEvidenceMatrix[curAA][curMassBin];
+      if (evidence[curMassBin] > maxEvidence) {
+        maxEvidence = evidence[curMassBin];
       }
     }
   }
@@ -2021,7 +2409,7 @@ int TideSearchApplication::getMaxColEvidence(
 //Calculates residue evidence score given a
 //residue evidence matrix and a theoretical spectrum
 int TideSearchApplication::calcResEvScore(
-  const vector<vector<double> >& curResidueEvidenceMatrix,
+  const ResidueEvidenceMatrix& curResidueEvidenceMatrix,
   const vector<unsigned int>& intensArrayTheor,
   const vector<double>& aaMassDouble,
   Peptide* curPeptide
@@ -2037,7 +2425,7 @@ int TideSearchApplication::calcResEvScore(
     int tmpAA = find(aaMassDouble.begin(),aaMassDouble.end(),tmpAAMass) - aaMassDouble.begin();
     scoreResidueEvidence += curResidueEvidenceMatrix[tmpAA][intensArrayTheor[res]-1];
   }
-  delete residueMasses;
+  delete [] residueMasses;
   return scoreResidueEvidence;
 }
 
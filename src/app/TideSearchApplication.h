@@ -3,15 +3,19 @@
 
 #include "CruxApplication.h"
 #include "TideMatchSet.h"
+#include "SpectrumFlags.h"
 
 #include <iostream>
 #include <fstream>
 #include <iomanip>
+#include <sstream>
+#include <map>
 #include <gflags/gflags.h>
 #include "peptides.pb.h"
 #include "spectrum.pb.h"
 #include "tide/theoretical_peak_set.h"
 #include "tide/max_mz.h"
+#include "tide/spectrum_preprocess.h"
 
 using namespace std;
 
@@ -19,16 +23,17 @@ using namespace std;
  * Locks for multi-threading in Tide.
  */
 enum _tide_search_lock {
-  LOCK_RESULTS,       // Results file output
-  LOCK_CASCADE,       // Only used by cascade-search on spectrum_flag (map)
   LOCK_CANDIDATES,    // Updating # of candidate peptides
-  LOCK_REPORTING,     // Updating sc_index and reporting progress
+  LOCK_REPORTING,     // Reporting per-thread statistics
   NUMBER_LOCK_TYPES   // always keep this last so the value
                       // changes as cmds are added
 };
 
 typedef enum _tide_search_lock TIDE_SEARCH_LOCK_T;
 
+class ParamMedicErrorCalculator;
+class SpectrumScheduler;
+
 class TideSearchApplication : public CruxApplication {
 private:
   //Added by Andy Lin in Feb 2016
@@ -45,7 +50,7 @@ private:
   //up to mass bin of candidate precursor
   //Returns max value in curResidueEvidenceMatrix
   int getMaxColEvidence(
-    const vector<vector<double> >& curResidueEvidenceMatrix,
+    const ResidueEvidenceMatrix& curResidueEvidenceMatrix,
     vector<int>& maxEvidence,
     int pepMassInt
   );
@@ -54,13 +59,14 @@ private:
   //Calculatse a residue evidence score given a
   //residue evidence matrix and a theoretical spectrum
   int calcResEvScore(
-    const vector<vector<double> >& curResidueEvidenceMatrix,
+    const ResidueEvidenceMatrix& curResidueEvidenceMatrix,
     const vector<unsigned int>& intensArrayTheor,
     const vector<double>& aaMassDouble,
     Peptide* curPeptide
   );
 
   friend class SubtractIndexApplication;
+  friend class CascadeSearchApplication;
 
  protected:
 
@@ -74,24 +80,67 @@ private:
       OriginalName(name), SpectrumRecords(spectrumrecords), Keep(keep) {}
   };
 
-  /**
-  brief This variable is used with Cascade Search.
-  This map contains a flag for each spectrum whether
-  a spectrum has not been identified in a prior cycle (0) or not (1).
-  The spectrum ID is a pair containing the ordinal number of the
-  input file in the first component and a scanId-charge-state in the second component.
-  The scanID and the charge state is combined into a single number
-  as scanID*10 + charge_state. Charge state is required to be less than 10.
-  */
-  map<pair<string, unsigned int>, bool>* spectrum_flag_;
+  // Spectra that earlier steps of cascade-search have identified; these are
+  // not searched again. NULL except in cascade-search.
+  SpectrumFlags* spectrum_flag_;
   string output_file_name_;
 
+  // Set by cascade-search to keep the PSMs in target_matches_ and
+  // decoy_matches_ instead of writing them to tab delimited files. The
+  // proteins of the PSMs are found in, or added to,
+  // TideMatchSet::MatchDatabase and TideMatchSet::MatchDecoyDatabase.
+  // decoy_matches_ is NULL if the decoys are not kept apart.
+  bool in_memory_matches_;
+  MatchCollection* target_matches_;
+  MatchCollection* decoy_matches_;
+
   static bool HAS_DECOYS;
   static bool PROTEIN_LEVEL_DECOYS;
 
   vector<int> getNegativeIsotopeErrors() const;
-  vector<InputFile> getInputFiles(const vector<string>& filepaths) const;
-  static SpectrumCollection* loadSpectra(const std::string& file);
+  /**
+   * Convert the spectrum files that are not spectrumrecords yet. If errCalc
+   * is given, it also sees every spectrum, read during the conversion or
+   * from the spectrumrecords file.
+   */
+  vector<InputFile> getInputFiles(
+    const vector<string>& filepaths,
+    ParamMedicErrorCalculator* errCalc = NULL,
+    bool storeSpectra = true
+  ) const;
+
+  // A search job of the server mode: the spectrum files of job file
+  // <spool-dir>/<Name>.job, and the directory for its results.
+  struct SpoolJob {
+    std::string Name;
+    std::string OutputDir;
+    std::vector<std::string> SpectrumFiles;
+    double StartTime;
+  };
+
+  /**
+   * Wait for the next job in spoolDir, claim it, and make its output
+   * directory the current one. Returns false, after restoring serverOutputDir,
+   * once a file named "stop" appears in spoolDir.
+   */
+  bool nextSpoolJob(
+    const std::string& spoolDir,
+    const std::string& serverOutputDir,
+    SpoolJob* job
+  ) const;
+  void finishSpoolJob(
+    const std::string& spoolDir,
+    const SpoolJob& job,
+    bool succeeded
+  ) const;
+  /**
+   * Read and sort the spectra of a spectrumrecords file. If lazy, the
+   * peaks are decoded only as the search reaches them (see
+   * SpectrumCollection::ReadSpectrumRecordsLazily()).
+   */
+  static SpectrumCollection* loadSpectra(const std::string& file,
+                                         bool lazy = false,
+                                         int num_threads = 1);
 
   /**
    * Function that contains the search algorithm and performs the search
@@ -112,8 +161,8 @@ private:
     */
   void search(
     const string& spectrum_filename,
-    const vector<SpectrumCollection::SpecCharge>* spec_charges,
-    vector<ActivePeptideQueue*> active_peptide_queue,
+    SpectrumCollection* spectra,
+    ActivePeptideQueue* active_peptide_queue,
     ProteinVec& proteins,
     vector<const pb::AuxLocation*>& locations,
     double precursor_window,
@@ -157,6 +206,24 @@ private:
 
   void convertResults() const;
 
+  /**
+   * Mark the scores that the PSMs of an in-memory search have, as
+   * MatchFileReader does for the columns of a tab delimited file.
+   */
+  void setMatchScoredTypes(MatchCollection* matches, bool compute_sp) const;
+
+  void computeChunkRange(
+    const vector<SpectrumCollection::SpecCharge>* spec_charges,
+    int begin,
+    int end,
+    WINDOW_TYPE_T window_type,
+    double precursor_window,
+    int max_charge,
+    vector<int>* negative_isotope_errors,
+    double* min_range,
+    double* max_range
+  );
+
   void computeWindow(
     const SpectrumCollection::SpecCharge& sc,
     WINDOW_TYPE_T window_type,
@@ -188,11 +255,16 @@ private:
   // the SpectrumCollection must be sorted
   std::map<std::string, SpectrumCollection*> spectra_;
 
+  // spectrum files already converted by processParams(), for param-medic
+  vector<InputFile> inputFiles_;
+
  public:
 
-  // See TideSearchApplication.cpp for descriptions of these two constants
+  // See TideSearchApplication.cpp for descriptions of these constants
   static const double XCORR_SCALING;
   static const double RESCALE_FACTOR;
+  static const int SEARCH_CHUNK_SIZE;
+  static const int SPOOL_POLL_INTERVAL;
 
   bool exact_pval_search_;
 
@@ -251,13 +323,69 @@ private:
 
   virtual COMMAND_T getCommand() const;
 
+  /**
+   * PSMs formatted by one thread for the current chunk of spectrum-charge
+   * pairs. The report of each pair is a segment of the buffers, so that
+   * writeThreadOutputs() can write the chunk in spectrum-charge order.
+   */
+  struct ThreadOutput {
+    struct Segment {
+      int sc_pos;
+      streamoff target_end;
+      streamoff decoy_end;
+      size_t target_matches_end;
+      size_t decoy_matches_end;
+    };
+    ostringstream target;
+    ostringstream decoy;
+    // The PSMs of an in-memory search instead.
+    vector<Crux::Match*> target_matches;
+    vector<Crux::Match*> decoy_matches;
+    vector<Segment> segments;
+
+    // Close the segment of pair sc_pos, i.e. everything written since the
+    // previous segment.
+    void endSegment(int sc_pos) {
+      Segment segment = { sc_pos, target.tellp(), decoy.tellp(),
+                          target_matches.size(), decoy_matches.size() };
+      segments.push_back(segment);
+    }
+  };
+
+  /**
+   * Write the segments of all threads to the output files (or add their
+   * PSMs to target_matches_ and decoy_matches_) in order of spectrum-charge
+   * pair, and empty the buffers.
+   */
+  void writeThreadOutputs(
+    vector<ThreadOutput*>& outputs,
+    ofstream* target_file,
+    ofstream* decoy_file
+  );
+
+  /**
+   * Start a thread that runs writeThreadOutputs() on one of the two sets of
+   * buffers (parity 0 or 1) in thread_outputs.
+   */
+  boost::thread* startWriter(
+    vector<ThreadOutput*>* thread_outputs,
+    int parity,
+    ofstream* target_file,
+    ofstream* decoy_file
+  );
+
+  /**
+   * Join and delete the writer thread, if any.
+   */
+  static void waitForWriter(boost::thread** writer);
+
   /**
    * Struct holding necessary information for each thread to run.
    */
   struct thread_data {
 
     string spectrum_filename;
-    const vector<SpectrumCollection::SpecCharge>* spec_charges;
+    SpectrumCollection* spectra;
     ActivePeptideQueue* active_peptide_queue;
     ProteinVec proteins;
     vector<const pb::AuxLocation*> locations;
@@ -294,12 +422,15 @@ private:
     double bin_width;
     double bin_offset;
     bool exact_pval_search;
-    map<pair<string, unsigned int>, bool>* spectrum_flag;
-    int* sc_index;
+    SpectrumFlags* spectrum_flag;
+    SpectrumScheduler* scheduler;
     int* total_candidate_peptides;
     vector<int>* negative_isotope_errors;
+    ActivePeptideQueue* shared_peptide_queue;
+    boost::barrier* chunk_barrier;
+    vector<ThreadOutput*>* thread_outputs;
 
-    thread_data (const string& spectrum_filename_, const vector<SpectrumCollection::SpecCharge>* spec_charges_,
+    thread_data (const string& spectrum_filename_, SpectrumCollection* spectra_,
             ActivePeptideQueue* active_peptide_queue_, ProteinVec proteins_,
             vector<const pb::AuxLocation*> locations_, double precursor_window_,
             WINDOW_TYPE_T window_type_, double spectrum_min_mz_, double spectrum_max_mz_,
@@ -311,9 +442,10 @@ private:
             const vector<double>* dAAFreqC_, const vector<double>* dAAMass_,
             const pb::ModTable* mod_table_, const pb::ModTable* nterm_mod_table_, const pb::ModTable* cterm_mod_table_, const int decoysPerTarget_,
             vector<boost::mutex*> locks_array_, double bin_width_, double bin_offset_, bool exact_pval_search_,
-            map<pair<string, unsigned int>, bool>* spectrum_flag_, int* sc_index_, int* total_candidate_peptides_,
-            vector<int>* negative_isotope_errors_) :
-            spectrum_filename(spectrum_filename_), spec_charges(spec_charges_), active_peptide_queue(active_peptide_queue_),
+            SpectrumFlags* spectrum_flag_, SpectrumScheduler* scheduler_, int* total_candidate_peptides_,
+            vector<int>* negative_isotope_errors_, ActivePeptideQueue* shared_peptide_queue_,
+            boost::barrier* chunk_barrier_, vector<ThreadOutput*>* thread_outputs_) :
+            spectrum_filename(spectrum_filename_), spectra(spectra_), active_peptide_queue(active_peptide_queue_),
             proteins(proteins_), locations(locations_), precursor_window(precursor_window_), window_type(window_type_),
             spectrum_min_mz(spectrum_min_mz_), spectrum_max_mz(spectrum_max_mz_), min_scan(min_scan_), max_scan(max_scan_),
             min_peaks(min_peaks_), search_charge(search_charge_), top_matches(top_matches_), highest_mz(highest_mz_),
@@ -322,7 +454,9 @@ private:
             aaMass(aaMass_), nAARes(nAARes_), dAAFreqN(dAAFreqN_), dAAFreqI(dAAFreqI_), dAAFreqC(dAAFreqC_), dAAMass(dAAMass_),
             mod_table(mod_table_), nterm_mod_table(nterm_mod_table_), cterm_mod_table(cterm_mod_table_), decoysPerTarget(decoysPerTarget_),
             locks_array(locks_array_), bin_width(bin_width_), bin_offset(bin_offset_), exact_pval_search(exact_pval_search_),
-            spectrum_flag(spectrum_flag_), sc_index(sc_index_), total_candidate_peptides(total_candidate_peptides_), negative_isotope_errors(negative_isotope_errors_) {}
+            spectrum_flag(spectrum_flag_), scheduler(scheduler_), total_candidate_peptides(total_candidate_peptides_), negative_isotope_errors(negative_isotope_errors_),
+            shared_peptide_queue(shared_peptide_queue_), chunk_barrier(chunk_barrier_),
+            thread_outputs(thread_outputs_) {}
   };
 
   int calcScoreCount(
@@ -344,7 +478,7 @@ private:
   void calcResidueScoreCount (
     int nAa,
     int pepMassInt,
-    vector<vector<double> >& residueEvidenceMatrix,
+    const ResidueEvidenceMatrix& residueEvidenceMatrix,
     vector<int>& aaMass,
     const vector<double>& aaFreqN,
     const vector<double>& aaFreqI,
@@ -356,7 +490,8 @@ private:
     int maxEvidence,
     int maxScore,
     vector<double>& scoreCount, //this is returned for later use
-    int& scoreOffSet //this is returned for later use
+    int& scoreOffSet, //this is returned for later use
+    vector<double>& dynProgArray //workspace, reused between calls
   );
 
   double calcCombinedPval( //calculates combined p-value
@@ -367,7 +502,7 @@ private:
 
   int factorial(int n);
 
-  void setSpectrumFlag(map<pair<string, unsigned int>, bool>* spectrum_flag);
+  void setSpectrumFlag(SpectrumFlags* spectrum_flag);
   virtual void processParams();
   string getOutputFileName();
 };
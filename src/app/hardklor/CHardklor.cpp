@@ -30,6 +30,7 @@
 #include "CSpecAnalyze.h"
 #include "Smooth.h"
 #include <iomanip>
+#include <sstream>
 using namespace std;
 
 
@@ -76,6 +77,8 @@ CHardklor::CHardklor(){
 	mercury=NULL;
 	bEcho=true;
   bMem=false;
+  threads=1;
+  out=NULL;
 }
 
 CHardklor::CHardklor(CAveragine *a, CMercury8 *m){
@@ -85,6 +88,8 @@ CHardklor::CHardklor(CAveragine *a, CMercury8 *m){
   sa.setMercury(mercury);
 	bEcho=true;
   bMem=false;
+  threads=1;
+  out=NULL;
 }
 
 CHardklor::~CHardklor(){
@@ -147,7 +152,6 @@ void CHardklor::Analyze(Spectrum* s) {
 
   //Variables for some basic information output.
   int iPercent;
-  int zeroPep=0;   //Stores the number of spectra from which no potential peptides could be identified
   int manyPep=0;   //Stores the number of spectra from which the number of potential peptides 
                    //exceeds the user-defined threshold.
   int lowSigPep=0; //Stores the number of spectra whose max intensity was below the user defined threshold.
@@ -169,9 +173,6 @@ void CHardklor::Analyze(Spectrum* s) {
   bool bCutMe=false;
   bool ReadScan=false;
   bool bFirst=true;
-  CSplitSpectrum* cSS;
-  int winCount=0;
-
   vResults.clear();
 
   //Ouput file info to user
@@ -246,13 +247,35 @@ void CHardklor::Analyze(Spectrum* s) {
  
   //Reset some basic stat counters
   manyPep=0;
-  zeroPep=0;
   lowSigPep=0;
 
   //Set and display on screen percentage counter
   iPercent=0;
   if(bEcho) cout << iPercent;
   
+  //With more than one thread, scans are analyzed by worker threads, each
+  //with its own averagine and mercury objects, and written here in the order
+  //they were read. Everything written between the results of two scans is
+  //collected in text and written with the results of the second.
+  CScanQueue<CHardklorScan> queue(4*threads);
+  bool bFirstAnalyzed=true;
+  vector<CHardklor*> workers;
+  boost::thread_group workerThreads;
+  if(threads>1 && !bMem){
+    for(i=0;i<threads;i++){
+      CHardklor* w=new CHardklor(new CAveragine(cs.MercuryFile,cs.HardklorFile),new CMercury8(cs.MercuryFile));
+      w->cs=cs;
+      w->pepVariants=pepVariants;
+      w->PT=w->averagine->getPT();
+      w->bEcho=false;
+      workers.push_back(w);
+      workerThreads.create_thread(boost::bind(&CHardklor::ScanWorker,&queue,w));
+    }
+  }
+  CHardklorScan* scan;
+  ostringstream text;
+  text << setiosflags(ios::fixed) << setprecision(4);
+
   //While there is still data to read in the file.
   while(true){
 
@@ -260,7 +283,7 @@ void CHardklor::Analyze(Spectrum* s) {
 		if(!bFirst){
 			
 			//close out xml tag for previous spectrum
-			if(!bMem && cs.xml) fptr << "</Spectrum>" << endl;
+			if(!bMem && cs.xml) text << "</Spectrum>" << endl;
 
       if(s!=NULL) break;
 
@@ -288,99 +311,36 @@ void CHardklor::Analyze(Spectrum* s) {
 		if(curSpec.getScanNumber()!=0){	
       if(!bMem){
 			  if(cs.scan.iUpper>0 && curSpec.getScanNumber()>cs.scan.iUpper) break;
-			  if(cs.reducedOutput) WriteScanLine(curSpec,fptr,2);
-			  else if(cs.xml) WriteScanLine(curSpec,fptr,1);
-			  else WriteScanLine(curSpec,fptr,0);
-      } else {
-        currentScanNumber = curSpec.getScanNumber();
+			  if(cs.reducedOutput) WriteScanLine(curSpec,text,2);
+			  else if(cs.xml) WriteScanLine(curSpec,text,1);
+			  else WriteScanLine(curSpec,text,0);
       }
 		} else {
 			break; //exit if there is no spectrum left to analyze
 		}
 		TotalScans++;
 
-		//Preprocess spectrum
 		//If we have an empty spectrum, go on to the next one
     if(curSpec.size()==0) continue;
 
-		getExactTime(startTime);
-    if(cs.smooth>0) SG_Smooth(curSpec,cs.smooth,4);
-		//if(curSpec.getScanNumber()==1999){
-		//	for(int xx=0;xx<curSpec.size();xx++) cout << curSpec[xx].mz << "\t" << curSpec[xx].intensity << endl;
-		//}
-
-    //Check our spectrum for file type. Zoom and UltraZoom scans do not
-    //need splitting.
-    if(cs.fileFormat==zs || cs.fileFormat==uzs){
-
-      sa.clear();
-			sa.setParams(cs);
-      sa.setSpectrum(curSpec);
-			sa.FindPeaks();
-			sa.PredictPeptides();
-
-			//do not analyze spectrum with 0 predicted peaks; Keep count of these occurrances.
-			if(sa.predPeak->size()==0){
-				zeroPep++;
-				continue;
-			}
-
-			AnalyzePeaks(sa);
-
-    } else {
-      	
-			//Reinitialize our split spectrum
-			cSS=new CSplitSpectrum(&curSpec,cs);
-			cSS->SetAveragine(averagine);
-			cSS->SetMercury(mercury);
-
-			//Check if data already centroided
-			if(cs.centroid) {
-				if(cs.chargeMode=='F' || cs.chargeMode=='P' || cs.chargeMode=='S'){
-					cout << "-cdm settings of F, P, and S (FFT, Patterson, Senko) only work on profile data." << endl;
-					cout << "Please choose settings of Q or C (QuickCharge, Complete)" << endl;
-					exit(5);
-				}
-				//This function directly copies the already centroided spectra to the CSS object
-				cSS->Centroid(curSpec);
-
-			//if not, process the data here (ultimately includes centroiding)
-			} else {
-				if(cs.boxcarFilter>0){ //TODO: Figure out how filtering interferes here
-          cs.sn=0;
-					cSS->Centroid(curSpec);
-				} else if(cs.staticSN) {
-					if(cs.sn==0) cSS->NoSplitAnalysis();
-					else cSS->NewSNPass(cs.snWindow);
-		  	} else {
-			  	cSS->OverlappingAnalysis(cs.snWindow);
-				 	if(cs.iAnalysis) cSS->IntersectionAnalysis();
-				  else cSS->UnionAnalysis();
-				}
+		//Analyze the spectrum
+		scan=new CHardklorScan;
+		scan->spec=curSpec;
+		scan->first=bFirstAnalyzed;
+		bFirstAnalyzed=false;
+		scan->pre=text.str();
+		text.str("");
+		if(workers.empty()){
+			AnalyzeScan(*scan);
+			WriteScan(*scan);
+			delete scan;
+		} else {
+			while(queue.Full()){
+				CHardklorScan* oldest=queue.Pop();
+				WriteScan(*oldest);
+				delete oldest;
 			}
-		
-			//Split the spectrum
-		  cSS->MakeAnalysis(cs.winSize);
-
-		  //Analyze each window
-		  for(winCount=0;winCount<cSS->getNumWindows();winCount++){
-			  sa = cSS->getWindow(winCount);
-			  sa.setParams(cs);
-			  sa.PredictPeptides();	
-
-			  //do not analyze spectrum with 0 predicted peaks; Keep count of these occurrances.
-			  if(sa.predPeak->size()==0){
-				  zeroPep++;
-				  continue;
-			  }
-
-			  AnalyzePeaks(sa);
-
-		  }
-
-			//clean up cSS object
-			delete cSS;
-
+			queue.Push(scan);
 		}
 
     //Update the percentage indicator
@@ -395,13 +355,23 @@ void CHardklor::Analyze(Spectrum* s) {
 			}
 		}
 
-		if(!bMem && cs.xml) {
-			fptr << "</Spectrum>" << endl;
-			fptr << "</File>" << endl;
-			fptr << "</Hardklor>" << endl;
-		}
-
 	} //loop to next spectrum (while)
+
+	//Write the scans still being analyzed, and whatever follows them
+	queue.Close();
+	while((scan=queue.Pop())!=NULL){
+		WriteScan(*scan);
+		delete scan;
+	}
+	workerThreads.join_all();
+	bool bThreaded=!workers.empty();
+	for(i=0;i<(int)workers.size();i++){
+		analysisTime+=workers[i]->analysisTime;
+		delete workers[i]->averagine;
+		delete workers[i]->mercury;
+		delete workers[i];
+	}
+	if(!bMem) fptr << text.str();
   
   //Close the output file and clear it so it can be reused.
   if(!bMem){
@@ -450,7 +420,6 @@ void CHardklor::Analyze(Spectrum* s) {
   //Output the simple statistics
 	if(bEcho) cout << "  Total number of scans analyzed: " << TotalScans << endl;
   //cout << "  Number of (sub)scans not analyzed:" << endl;
-  //cout << "    No Peptides Predicted: " << zeroPep << endl;
   //cout << "    Intensity Below Limit: " << lowSigPep << endl;
   //cout << "  Number of scans with more predicted peptides than were analyzed: " << manyPep << endl;
 	//cout << "  Total Correlations Made: " << TotalIterations << endl;
@@ -468,7 +437,9 @@ void CHardklor::Analyze(Spectrum* s) {
 		i=(int)timeToSec(analysisTime,timerFrequency);
 		minutes = (int)(i/60);
 		seconds = i - (60*minutes);
-		cout << "Analysis Time:    " << minutes << " minutes, " << seconds << " seconds." << endl;
+		//With worker threads, this is the time spent by all of them together.
+		if(bThreaded) cout << "Analysis CPU Time (all threads): " << minutes << " minutes, " << seconds << " seconds." << endl;
+		else cout << "Analysis Time:    " << minutes << " minutes, " << seconds << " seconds." << endl;
 
 		if (minutes==0 && seconds==0){
 			cout << "IMPOSSIBLE!!!" << endl;
@@ -493,6 +464,117 @@ void CHardklor::Analyze(Spectrum* s) {
 
 }
 
+//Smooths, splits and analyzes one scan, collecting its results in scan.peps.
+void CHardklor::AnalyzeScan(CHardklorScan& scan){
+
+  CSplitSpectrum* cSS;
+  int winCount;
+  Spectrum& curSpec=scan.spec;
+  ostringstream peps;
+  peps << setiosflags(ios::fixed) << setprecision(4);
+  out=&peps;
+  currentScanNumber=curSpec.getScanNumber();
+  scan.empty=false;
+
+  //Preprocess spectrum
+  if(cs.smooth>0) SG_Smooth(curSpec,cs.smooth,4);
+
+  //Check our spectrum for file type. Zoom and UltraZoom scans do not
+  //need splitting.
+  if(cs.fileFormat==zs || cs.fileFormat==uzs){
+
+    sa.clear();
+		sa.setParams(cs);
+    sa.setSpectrum(curSpec);
+		sa.FindPeaks();
+		sa.PredictPeptides();
+
+		//do not analyze spectrum with 0 predicted peaks
+		if(sa.predPeak->size()==0) scan.empty=true;
+		else AnalyzePeaks(sa);
+
+  } else {
+
+		//Boxcar filtering sets the S/N threshold to 0 after the first scan
+		//(see below), whichever object analyzed the scans before this one.
+		if(cs.boxcarFilter>0 && !cs.centroid && !scan.first) cs.sn=0;
+
+		//Reinitialize our split spectrum
+		cSS=new CSplitSpectrum(&curSpec,cs);
+		cSS->SetAveragine(averagine);
+		cSS->SetMercury(mercury);
+
+		//Check if data already centroided
+		if(cs.centroid) {
+			if(cs.chargeMode=='F' || cs.chargeMode=='P' || cs.chargeMode=='S'){
+				cout << "-cdm settings of F, P, and S (FFT, Patterson, Senko) only work on profile data." << endl;
+				cout << "Please choose settings of Q or C (QuickCharge, Complete)" << endl;
+				exit(5);
+			}
+			//This function directly copies the already centroided spectra to the CSS object
+			cSS->Centroid(curSpec);
+
+		//if not, process the data here (ultimately includes centroiding)
+		} else {
+			if(cs.boxcarFilter>0){ //TODO: Figure out how filtering interferes here
+        cs.sn=0;
+				cSS->Centroid(curSpec);
+			} else if(cs.staticSN) {
+				if(cs.sn==0) cSS->NoSplitAnalysis();
+				else cSS->NewSNPass(cs.snWindow);
+	  	} else {
+		  	cSS->OverlappingAnalysis(cs.snWindow);
+			 	if(cs.iAnalysis) cSS->IntersectionAnalysis();
+			  else cSS->UnionAnalysis();
+			}
+		}
+	
+		//Split the spectrum
+	  cSS->MakeAnalysis(cs.winSize);
+
+	  //Analyze each window
+	  for(winCount=0;winCount<cSS->getNumWindows();winCount++){
+		  sa = cSS->getWindow(winCount);
+		  sa.setParams(cs);
+		  sa.PredictPeptides();	
+
+		  //do not analyze spectrum with 0 predicted peaks
+		  if(sa.predPeak->size()==0) continue;
+
+		  AnalyzePeaks(sa);
+
+	  }
+
+		//clean up cSS object
+		delete cSS;
+
+	}
+
+  scan.peps=peps.str();
+  out=NULL;
+}
+
+//Body of each worker thread: analyzes scans until the queue is closed and empty.
+void CHardklor::ScanWorker(CScanQueue<CHardklorScan>* queue, CHardklor* worker){
+	CHardklorScan* scan;
+	worker->analysisTime=0;
+	while((scan=queue->Claim())!=NULL){
+		worker->AnalyzeScan(*scan);
+		queue->Done(scan);
+	}
+}
+
+//Writes the output that precedes an analyzed scan and its results.
+void CHardklor::WriteScan(CHardklorScan& scan){
+  if(bMem) return;
+  fptr << scan.pre << scan.peps;
+  if(cs.xml && !scan.empty) {
+    fptr << "</Spectrum>" << endl;
+    fptr << "</File>" << endl;
+    fptr << "</Hardklor>" << endl;
+  }
+}
+
 bool CHardklor::AnalyzePeaks(CSpecAnalyze& sa){
 	
 	int i;
@@ -585,9 +667,9 @@ bool CHardklor::AnalyzePeaks(CSpecAnalyze& sa){
 	//if we exceeded our threshold, output the data to file or store it in memoryt
   if(bsso.corr > cs.corr) {
     if(!bMem){
-		  if(cs.reducedOutput) WritePepLine(bsso,PT,fptr,2);
-      else if(cs.xml) WritePepLine(bsso,PT,fptr,1);
-      else WritePepLine(bsso,PT,fptr,0);
+		  if(cs.reducedOutput) WritePepLine(bsso,PT,*out,2);
+      else if(cs.xml) WritePepLine(bsso,PT,*out,1);
+      else WritePepLine(bsso,PT,*out,0);
     } else {
       ResultToMem(bsso,PT);
     }
@@ -2138,7 +2220,7 @@ void CHardklor::ResultToMem(SSObject& obj, CPeriodicTable* PT){
 
 }
 
-void CHardklor::WritePepLine(SSObject& obj, CPeriodicTable* PT, fstream& fptr, int format){
+void CHardklor::WritePepLine(SSObject& obj, CPeriodicTable* PT, ostream& fptr, int format){
   int j,k;
   int pepID;
   int varID;
@@ -2215,7 +2297,7 @@ void CHardklor::WritePepLine(SSObject& obj, CPeriodicTable* PT, fstream& fptr, i
   }
 }
 
-void CHardklor::WriteScanLine(Spectrum& s, fstream& fptr, int format){
+void CHardklor::WriteScanLine(Spectrum& s, ostream& fptr, int format){
   //int i;
 
   if(format==0) {
@@ -2274,6 +2356,10 @@ void CHardklor::SetResultsToMemory(bool b){
   bMem=b;
 }
 
+void CHardklor::SetThreads(int n){
+  threads=n;
+}
+
 hkMem& CHardklor::operator[](const int& index){
   return vResults[index];
 }
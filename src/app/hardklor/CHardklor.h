@@ -15,6 +15,7 @@
 #include "MSReader.h"
 #include "Spectrum.h"
 #include "CNoiseReduction.h"
+#include "CScanQueue.h"
 //#include "CHardklorFileReader.h"
 
 #ifdef _MSC_VER
@@ -47,6 +48,17 @@ public:
   
 };
 
+//A scan, analyzed by a worker thread and written by the main thread.
+class CHardklorScan {
+ public:
+  Spectrum spec;    //the scan as read
+  string pre;       //output preceding the results of the scan
+  string peps;      //results
+  bool first;       //whether this is the first scan analyzed
+  bool empty;       //whether a zoom scan had no predicted peaks
+  bool done;
+};
+
 class CHardklor{
 
  public:
@@ -64,6 +76,7 @@ class CHardklor{
 	void SetAveragine(CAveragine *a);
 	void SetMercury(CMercury8 *m);
   void SetResultsToMemory(bool b);
+  void SetThreads(int n);
   int Size();
 
  protected:
@@ -72,12 +85,16 @@ class CHardklor{
   //Methods:
   void Analyze(Spectrum* s=NULL);
   bool AnalyzePeaks(CSpecAnalyze& sa);
+  void AnalyzeScan(CHardklorScan& scan);
   int compareData(const void*, const void*);
   double LinReg(float *match, float *mismatch);
   void ResultToMem(SSObject& obj, CPeriodicTable* PT);
   void WriteParams(fstream& fptr, int format=1); 
-  void WritePepLine(SSObject& obj, CPeriodicTable* PT, fstream& fptr, int format=0); 
-  void WriteScanLine(Spectrum& s, fstream& fptr, int format=0); 
+  void WritePepLine(SSObject& obj, CPeriodicTable* PT, ostream& fptr, int format=0); 
+  void WriteScan(CHardklorScan& scan);
+  void WriteScanLine(Spectrum& s, ostream& fptr, int format=0); 
+
+  static void ScanWorker(CScanQueue<CHardklorScan>* queue, CHardklor* worker);
 
 	//Finished analysis algorithms
 	void BasicMethod(float *match, float *mismatch,SSObject* combo, int depth, int maxDepth, int start);
@@ -105,6 +122,8 @@ class CHardklor{
   bool bMem;
   int currentScanNumber;
 	fstream fptr; //TODO: Get rid of this and use FILE* instead.
+  ostream* out; //where AnalyzePeaks writes the results of the current scan
+  int threads;  //number of threads analyzing scans
 
 	//Vector for holding peptide list of distribution
   vector<CHardklorVariant> pepVariants;
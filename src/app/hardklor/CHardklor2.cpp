@@ -7,6 +7,7 @@ CHardklor2::CHardklor2(CAveragine *a, CMercury8 *m, CModelLibrary *lib){
 	bEcho=true;
   bMem=false;
 	PT=NULL;
+	threads=1;
 }
 
 CHardklor2::~CHardklor2(){
@@ -30,15 +31,14 @@ int CHardklor2::GoHardklor(CHardklorSetting sett, Spectrum* s){
 	
 	//Member variables
 	MSReader r;
-	Spectrum curSpec,c;
+	Spectrum curSpec;
 	vector<int> v;
 	FILE* fout;
 	int TotalScans;
-	int manyPep, zeroPep, lowSigPep;
+	int manyPep, lowSigPep;
 	int iPercent;
 	int minutes, seconds;
 	int i;
-	vector<pepHit> vPeps;
 
 	//initialize variables
 	cs=sett;
@@ -46,7 +46,6 @@ int CHardklor2::GoHardklor(CHardklorSetting sett, Spectrum* s){
 	analysisTime=0;
 	TotalScans=0;
 	manyPep=0;
-  zeroPep=0;
   lowSigPep=0;
   iPercent=0;
 	getTimerFrequency(timerFrequency);
@@ -115,48 +114,44 @@ int CHardklor2::GoHardklor(CHardklorSetting sett, Spectrum* s){
     return -2;
   }
 
-	//Write scan information to output file.
-  if(!bMem){
-    if(cs.reducedOutput) WriteScanLine(curSpec,fout,2);
-    else if(cs.xml) WriteScanLine(curSpec,fout,1);
-    else WriteScanLine(curSpec,fout,0);
-  } else {
-    currentScanNumber = curSpec.getScanNumber();
-  }
-
 	//Output progress indicator
 	if(bEcho) cout << iPercent;
+
+  //With more than one thread, scans are analyzed by worker threads and
+  //written here in the order they were read. The workers share the model
+  //library, which is not changed during the analysis. Results kept in
+  //memory are analyzed on this thread.
+  CScanQueue<CHardklor2Scan> queue(4*threads);
+  vector<CHardklor2*> workers;
+  boost::thread_group workerThreads;
+  if(threads>1 && !bMem){
+    for(i=0;i<threads;i++){
+      CHardklor2* w=new CHardklor2(averagine,mercury,models);
+      w->cs=cs;
+      workers.push_back(w);
+      workerThreads.create_thread(boost::bind(&CHardklor2::ScanWorker,&queue,w));
+    }
+  }
+  CHardklor2Scan* scan;
+  int written=0;
   
   //While there is still data to read in the file.
   while(true){
 
-		getExactTime(startTime);
 		TotalScans++;
-		
-		//Smooth if requested
-		if(cs.smooth>0) SG_Smooth(curSpec,cs.smooth,4);
-
-		//Centroid if needed; notice that this copy wastes a bit of time.
-		//TODO: make this more efficient
-		if(cs.boxcar==0 && !cs.centroid) Centroid(curSpec,c);
-		else c=curSpec;
-
-		//There is a bug when using noise reduction that results in out of order m/z values
-		//TODO: fix noise reduction so sorting isn't needed
-		if(c.size()>0) c.sortMZ();
-
-		//Analyze
-		QuickHardklor(c,vPeps);
-
-		//export results
-		for(i=0;i<(int)vPeps.size();i++){
-      if(!bMem){
-			  if(cs.reducedOutput) WritePepLine(vPeps[i],c,fout,2);
-			  else if(cs.xml) WritePepLine(vPeps[i],c,fout,1);
-			  else WritePepLine(vPeps[i],c,fout,0);
-      } else {
-        ResultToMem(vPeps[i],c);
-      }
+		scan=new CHardklor2Scan;
+		scan->spec=curSpec;
+		if(workers.empty()){
+			AnalyzeScan(*scan);
+			WriteScan(*scan,fout,written++==0);
+			delete scan;
+		} else {
+			while(queue.Full()){
+				CHardklor2Scan* oldest=queue.Pop();
+				WriteScan(*oldest,fout,written++==0);
+				delete oldest;
+			}
+			queue.Push(scan);
 		}
 
 		//Update progress
@@ -170,11 +165,6 @@ int CHardklor2::GoHardklor(CHardklorSetting sett, Spectrum* s){
 				cout.flush();
 			}
 		}
-
-		getExactTime(stopTime);
-    tmpTime1=toMicroSec(stopTime);
-    tmpTime2=toMicroSec(startTime);
-    analysisTime+=tmpTime1-tmpTime2;
     
     if(s!=NULL) break;
 
@@ -204,19 +194,20 @@ int CHardklor2::GoHardklor(CHardklorSetting sett, Spectrum* s){
 		tmpTime2=toMicroSec(startTime);
 		loadTime+=(tmpTime1-tmpTime2);
 
-		if(curSpec.getScanNumber()!=0){
-			//Write scan information to output file.
-			if(cs.reducedOutput){
-				WriteScanLine(curSpec,fout,2);
-			} else if(cs.xml) {
-				fprintf(fout,"</Spectrum>\n");
-				WriteScanLine(curSpec,fout,1);
-			} else {
-				WriteScanLine(curSpec,fout,0);
-			}
-		} else {
-			break;
-		}
+		if(curSpec.getScanNumber()==0) break;
+	}
+
+	//Write the scans still being analyzed
+	queue.Close();
+	while((scan=queue.Pop())!=NULL){
+		WriteScan(*scan,fout,written++==0);
+		delete scan;
+	}
+	workerThreads.join_all();
+	bool bThreaded=!workers.empty();
+	for(i=0;i<(int)workers.size();i++){
+		analysisTime+=workers[i]->analysisTime;
+		delete workers[i];
 	}
 
 	if(!bMem) fclose(fout);
@@ -232,7 +223,9 @@ int CHardklor2::GoHardklor(CHardklorSetting sett, Spectrum* s){
 		i=(int)timeToSec(analysisTime,timerFrequency);
 		minutes = (int)(i/60);
 		seconds = i - (60*minutes);
-		cout << "Analysis Time:    " << minutes << " minutes, " << seconds << " seconds." << endl;
+		//With worker threads, this is the time spent by all of them together.
+		if(bThreaded) cout << "Analysis CPU Time (all threads): " << minutes << " minutes, " << seconds << " seconds." << endl;
+		else cout << "Analysis Time:    " << minutes << " minutes, " << seconds << " seconds." << endl;
 
 		if (minutes==0 && seconds==0){
 			cout << "IMPOSSIBLE!!!" << endl;
@@ -256,6 +249,71 @@ int CHardklor2::GoHardklor(CHardklorSetting sett, Spectrum* s){
 
 }
 
+//Smooths, centroids and analyzes one scan.
+void CHardklor2::AnalyzeScan(CHardklor2Scan& scan){
+	getExactTime(startTime);
+
+	//Smooth if requested
+	if(cs.smooth>0) SG_Smooth(scan.spec,cs.smooth,4);
+
+	//Centroid if needed; notice that this copy wastes a bit of time.
+	//TODO: make this more efficient
+	if(cs.boxcar==0 && !cs.centroid) Centroid(scan.spec,scan.centroid);
+	else scan.centroid=scan.spec;
+
+	//There is a bug when using noise reduction that results in out of order m/z values
+	//TODO: fix noise reduction so sorting isn't needed
+	if(scan.centroid.size()>0) scan.centroid.sortMZ();
+
+	//Analyze
+	QuickHardklor(scan.centroid,scan.vPeps);
+
+	getExactTime(stopTime);
+	tmpTime1=toMicroSec(stopTime);
+	tmpTime2=toMicroSec(startTime);
+	analysisTime+=tmpTime1-tmpTime2;
+}
+
+//Body of each worker thread: analyzes scans until the queue is closed and empty.
+void CHardklor2::ScanWorker(CScanQueue<CHardklor2Scan>* queue, CHardklor2* worker){
+	CHardklor2Scan* scan;
+	worker->analysisTime=0;
+	while((scan=queue->Claim())!=NULL){
+		worker->AnalyzeScan(*scan);
+		queue->Done(scan);
+	}
+}
+
+//Writes the scan line and the results of an analyzed scan, or stores the
+//results in memory.
+void CHardklor2::WriteScan(CHardklor2Scan& scan, FILE* fout, bool first){
+	int i;
+
+  if(!bMem){
+    if(cs.reducedOutput) {
+      WriteScanLine(scan.spec,fout,2);
+    } else if(cs.xml) {
+      if(!first) fprintf(fout,"</Spectrum>\n");
+      WriteScanLine(scan.spec,fout,1);
+    } else {
+      WriteScanLine(scan.spec,fout,0);
+    }
+  } else {
+    currentScanNumber = scan.spec.getScanNumber();
+  }
+
+	//export results
+	for(i=0;i<(int)scan.vPeps.size();i++){
+    if(!bMem){
+		  if(cs.reducedOutput) WritePepLine(scan.vPeps[i],scan.centroid,fout,2);
+		  else if(cs.xml) WritePepLine(scan.vPeps[i],scan.centroid,fout,1);
+		  else WritePepLine(scan.vPeps[i],scan.centroid,fout,0);
+    } else {
+      ResultToMem(scan.vPeps[i],scan.centroid);
+    }
+	}
+}
+
 int CHardklor2::BinarySearch(Spectrum& s, double mz, bool floor){
 
 	int mid=s.size()/2;
@@ -1358,6 +1416,10 @@ void CHardklor2::SetResultsToMemory(bool b){
   bMem=b;
 }
 
+void CHardklor2::SetThreads(int n){
+  threads=n;
+}
+
 int CHardklor2::Size(){
   return vResults.size();
 }
@@ -1481,4 +1543,4 @@ void CHardklor2::WriteScanLine(Spectrum& s, FILE* fptr, int format){
 	} else if(format==2) {
 		fprintf(fptr, "Scan=%d	RT=%.4f\n", s.getScanNumber(),s.getRTime());
 	}
-}
\ No newline at end of file
+}
\ No newline at end of file
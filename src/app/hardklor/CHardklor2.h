@@ -15,6 +15,7 @@
 #include "CMercury8.h"
 #include "CHardklor.h"
 #include "CModelLibrary.h"
+#include "CScanQueue.h"
 
 #ifdef _MSC_VER
 
@@ -24,6 +25,15 @@
 
 using namespace std;
 
+//A scan, analyzed by a worker thread and written by the main thread.
+class CHardklor2Scan {
+ public:
+  Spectrum spec;          //the scan as read
+  Spectrum centroid;      //the scan as analyzed
+  vector<pepHit> vPeps;   //results
+  bool done;
+};
+
 class CHardklor2{
 
  public:
@@ -39,12 +49,14 @@ class CHardklor2{
   int   GoHardklor(CHardklorSetting sett, Spectrum* s=NULL);
   void    QuickCharge(Spectrum& s, int index, vector<int>& v);
   void  SetResultsToMemory(bool b);
+  void  SetThreads(int n);
   int   Size();
 
  protected:
 
  private:
   //Methods:
+  void    AnalyzeScan(CHardklor2Scan& scan);
   int     BinarySearch(Spectrum& s, double mz, bool floor);
   double  CalcFWHM(double mz,double res,int iType);
   void    Centroid(Spectrum& s, Spectrum& out);
@@ -58,9 +70,11 @@ class CHardklor2{
   void    RefineHits(vector<pepHit>& vPeps, Spectrum& s);
   void    ResultToMem(pepHit& ph, Spectrum& s);
   void    WritePepLine(pepHit& ph, Spectrum& s, FILE* fptr, int format=0); 
+  void    WriteScan(CHardklor2Scan& scan, FILE* fout, bool first);
   void    WriteScanLine(Spectrum& s, FILE* fptr, int format=0); 
 
   static int CompareBPI(const void *p1, const void *p2);
+  static void ScanWorker(CScanQueue<CHardklor2Scan>* queue, CHardklor2* worker);
 
   //Data Members:
   CHardklorSetting  cs;
@@ -73,6 +87,7 @@ class CHardklor2{
   bool              bEcho;
   bool              bMem;
   int               currentScanNumber;
+  int               threads;            //number of threads analyzing scans
 
   //Vector for holding results in memory should that be needed
   vector<hkMem> vResults;
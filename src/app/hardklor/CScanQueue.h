@@ -0,0 +1,88 @@
+#ifndef _CSCANQUEUE_H
+#define _CSCANQUEUE_H
+
+#include <deque>
+#include <boost/thread.hpp>
+
+using namespace std;
+
+//Scans read by the main thread, analyzed by worker threads, and handed back
+//to the main thread in the order they were read, so that results are written
+//exactly as a single thread would write them. Items must have a bool member
+//named done. At most maxAhead scans are held at once, so that a long run is
+//never loaded into memory as a whole.
+template<class Item>
+class CScanQueue {
+ public:
+  CScanQueue(size_t maxAhead){
+    max=maxAhead;
+    next=0;
+    closed=false;
+  }
+
+  //Main thread: adds a scan to be analyzed.
+  void Push(Item* item){
+    {
+      boost::mutex::scoped_lock lock(mutex);
+      item->done=false;
+      items.push_back(item);
+    }
+    changed.notify_all();
+  }
+
+  //Main thread: marks that no more scans will be added.
+  void Close(){
+    {
+      boost::mutex::scoped_lock lock(mutex);
+      closed=true;
+    }
+    changed.notify_all();
+  }
+
+  //Main thread: whether the oldest scan must be popped before another is added.
+  bool Full(){
+    boost::mutex::scoped_lock lock(mutex);
+    return items.size()>=max;
+  }
+
+  //Main thread: removes the oldest scan, waiting until it has been analyzed.
+  //Returns NULL when the queue is closed and empty.
+  Item* Pop(){
+    boost::mutex::scoped_lock lock(mutex);
+    while((items.empty() && !closed) || (!items.empty() && !items.front()->done)) changed.wait(lock);
+    if(items.empty()) return NULL;
+    Item* item=items.front();
+    items.pop_front();
+    next--;
+    return item;
+  }
+
+  //Worker threads: claims the next scan to analyze. Returns NULL when the
+  //queue is closed and every scan has been claimed.
+  Item* Claim(){
+    boost::mutex::scoped_lock lock(mutex);
+    while(next==items.size() && !closed) changed.wait(lock);
+    if(next==items.size()) return NULL;
+    return items[next++];
+  }
+
+  //Worker threads: hands an analyzed scan back to the main thread.
+  void Done(Item* item){
+    {
+      boost::mutex::scoped_lock lock(mutex);
+      item->done=true;
+    }
+    changed.notify_all();
+  }
+
+ private:
+  deque<Item*> items;       //scans in the order read, not yet popped
+  size_t next;              //index in items of the next scan to be claimed
+  size_t max;
+  bool closed;
+  boost::mutex mutex;
+  boost::condition_variable changed;
+
+};
+
+#endif
@@ -14,6 +14,7 @@
 #include "util/Params.h"
 #include "util/StringUtils.h"
 #include "io/DelimitedFileWriter.h"
+#include <boost/thread.hpp>
 
 using namespace std;
 
@@ -116,8 +117,15 @@ int CruxHardklorApplication::main(const string& ms1) {
   CMercury8* mercury = new CMercury8(hp.queue(0).MercuryFile);
   CModelLibrary* models = new CModelLibrary(averagine, mercury);
 
+  int numThreads = Params::GetInt("num-threads");
+  if (numThreads < 1) {
+    numThreads = max(1u, boost::thread::hardware_concurrency());
+  }
+
   CHardklor h(averagine, mercury);
   CHardklor2 h2(averagine, mercury, models);
+  h.SetThreads(numThreads);
+  h2.SetThreads(numThreads);
   vector<CHardklorVariant> pepVariants;
   CHardklorVariant hkv;
 
@@ -250,6 +258,7 @@ vector<string> CruxHardklorApplication::getOptions() const {
     "smooth",
     "sn-window",
     "static-sn",
+    "num-threads",
     "parameter-file",
     "verbosity"
   };
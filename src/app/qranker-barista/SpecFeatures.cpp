@@ -41,11 +41,10 @@ void SpecFeaturesGenerator :: read_spectrum()
   mz_values_.clear();
   intens_values_.clear();
 
-  for (PeakIterator i = spectrum_->begin(); i != spectrum_->end(); ++i) {
-    Peak* peak = *i;
-    FLOAT_T mz = peak->getLocation();
+  for (int i = 0; i < spectrum_->getNumPeaks(); ++i) {
+    FLOAT_T mz = spectrum_->getPeakMz(i);
     mz_values_.push_back(mz);
-    intens_values_.push_back(peak->getIntensity());
+    intens_values_.push_back(spectrum_->getPeakIntensity(i));
     /*int mz_bin = (int)(mz / bin_width_mono + 0.5);
     if (mz_bin >= max_mz_) {
       max_mz_ = mz_bin + 1;
@@ -18,7 +18,8 @@ DEFINE_int32(fifo_page_size, 1, "Page size for FIFO allocator, in megs");
 ActivePeptideQueue::ActivePeptideQueue(RecordReader* reader,
                                        const vector<const pb::Protein*>&
                                        proteins)
-  : reader_(reader),
+  : shared_(NULL),
+    reader_(reader),
     proteins_(proteins),
     theoretical_peak_set_(2000),   // probably overkill, but no harm
     theoretical_b_peak_set_(200),  // probably overkill, but no harm
@@ -29,8 +30,27 @@ ActivePeptideQueue::ActivePeptideQueue(RecordReader* reader,
   CHECK(reader_->OK());
   compiler_prog1_ = new TheoreticalPeakCompiler(&fifo_alloc_prog1_);
   compiler_prog2_ = new TheoreticalPeakCompiler(&fifo_alloc_prog2_);
+  uncompiled_ = NULL;
   peptide_centric_ = false;
   elution_window_ = 0;
+  use_stored_peaks_ = false;
+}
+
+ActivePeptideQueue::ActivePeptideQueue(ActivePeptideQueue* shared)
+  : shared_(shared),
+    reader_(NULL),
+    proteins_(shared->proteins_),
+    theoretical_peak_set_(2000),
+    theoretical_b_peak_set_(200),
+    active_targets_(0), active_decoys_(0),
+    fifo_alloc_peptides_(FLAGS_fifo_page_size << 20),
+    fifo_alloc_prog1_(FLAGS_fifo_page_size << 20),
+    fifo_alloc_prog2_(FLAGS_fifo_page_size << 20),
+    compiler_prog1_(NULL), compiler_prog2_(NULL) {
+  uncompiled_ = NULL;
+  peptide_centric_ = false;
+  elution_window_ = 0;
+  use_stored_peaks_ = false;
 }
 
 ActivePeptideQueue::~ActivePeptideQueue() {
@@ -45,11 +65,15 @@ ActivePeptideQueue::~ActivePeptideQueue() {
   delete compiler_prog2_;
 }
 
-// Compute the theoretical peaks of the peptide in the "back" of the queue
-// (i.e. the one most recently read from disk -- the heaviest).
-void ActivePeptideQueue::ComputeTheoreticalPeaksBack() {
+// Compute the theoretical peaks of the peptide most recently read from disk
+// (i.e. the heaviest).
+void ActivePeptideQueue::ComputeTheoreticalPeaks(Peptide* peptide) {
+  if (use_stored_peaks_) {
+    peptide->CompileStoredPeaks(current_pb_peptide_,
+                                compiler_prog1_, compiler_prog2_);
+    return;
+  }
   theoretical_peak_set_.Clear();
-  Peptide* peptide = queue_.back();
   peptide->ComputeTheoreticalPeaks(&theoretical_peak_set_, current_pb_peptide_,
                                    compiler_prog1_, compiler_prog2_);
 }
@@ -71,8 +95,82 @@ int ActivePeptideQueue::SetActiveRange(vector<double>* min_mass, vector<double>*
   //introduced by m/z selection. see #222 in sourceforge
   //this has to be true:
   // min_range <= min_mass <= max_mass <= max_range
+  if (!shared_) {
+    FillActiveRange(min_range, max_range);
+  }
+  return SelectActiveRange(min_mass, max_mass, candidatePeptideStatus, false);
+}
 
+void ActivePeptideQueue::FillActiveRange(double min_range, double max_range) {
+  PrefetchActiveRange(min_range, max_range, false);
+  CommitActiveRange(min_range, false);
+}
+
+void ActivePeptideQueue::PrefetchActiveRange(double min_range, double max_range,
+                                             bool b_ions) {
+  assert(!shared_);
+  // Enqueue all peptides that are not yet queued but are lighter than
+  // max_range. For each new enqueued peptide compute the corresponding
+  // theoretical peaks. Data associated with each peptide is allocated by
+  // fifo_alloc_peptides_. Nothing here touches the peptides already in
+  // queue_, other than computing the peaks of uncompiled_, which no search
+  // of the current window uses.
+  const Peptide* last = !pending_.empty() ? pending_.back() :
+                        !queue_.empty() ? queue_.back() : NULL;
+  if (last != NULL && last->Mass() > max_range) {
+    return;
+  }
+  if (uncompiled_ != NULL) {
+    if (uncompiled_->Mass() >= min_range) {
+      ComputeTheoreticalPeaks(uncompiled_);
+    }
+    uncompiled_ = NULL;
+  }
+  if (last == NULL || last->Mass() < min_range) {
+    // Everything read so far is below min_range; a mapped index lets us
+    // skip ahead instead of parsing the peptides in between.
+    reader_->Seek(min_range);
+  }
+  while (!reader_->Done()) {
+    // read all peptides lighter than max_range
+    reader_->Read(&current_pb_peptide_);
+    if (current_pb_peptide_.mass() < min_range) {
+      // we would delete current_pb_peptide_;
+      continue; // skip peptides that fall below min_range
+    }
+    Peptide* peptide = new(&fifo_alloc_peptides_)
+      Peptide(current_pb_peptide_, proteins_, &fifo_alloc_peptides_);
+    pending_.push_back(peptide);
+    if (b_ions) {
+      ComputeBTheoreticalPeaks(peptide);
+    }
+    if (peptide->Mass() > max_range) {
+      if (!b_ions) {
+        uncompiled_ = peptide;
+      }
+      break;
+    }
+    if (!b_ions) {
+      ComputeTheoreticalPeaks(peptide);
+    }
+  }
+  // by now, if not EOF, then the last (and only the last) enqueued
+  // peptide is too heavy
+}
+
+void ActivePeptideQueue::CommitActiveRange(double min_range, bool b_ions) {
+  assert(!shared_);
+  if (b_ions) {
+    exact_pval_search_ = true;
+  }
   // queue front() is lightest; back() is heaviest
+  queue_.insert(queue_.end(), pending_.begin(), pending_.end());
+  pending_.clear();
+  if (b_ions) {
+    b_ion_queue_.insert(b_ion_queue_.end(), pending_b_ion_queue_.begin(),
+                        pending_b_ion_queue_.end());
+    pending_b_ion_queue_.clear();
+  }
 
   // delete anything already loaded that falls below min_range
   while (!queue_.empty() && queue_.front()->Mass() < min_range) {
@@ -83,13 +181,18 @@ int ActivePeptideQueue::SetActiveRange(vector<double>* min_mass, vector<double>*
     vector<Peptide::spectrum_matches>().swap(peptide->spectrum_matches_array);
     // would delete peptide's underlying pb::Peptide;
     queue_.pop_front();
+    if (b_ions) {
+      b_ion_queue_.pop_front();
+    }
 //    delete peptide;
   }
   if (queue_.empty()) {
     //cerr << "Releasing All\n";
     fifo_alloc_peptides_.ReleaseAll();
-    fifo_alloc_prog1_.ReleaseAll();
-    fifo_alloc_prog2_.ReleaseAll();
+    if (!b_ions) {
+      fifo_alloc_prog1_.ReleaseAll();
+      fifo_alloc_prog2_.ReleaseAll();
+    }
     //cerr << "Prog1: ";
     //fifo_alloc_prog1_.Show();
     //cerr << "Prog2: ";
@@ -98,55 +201,57 @@ int ActivePeptideQueue::SetActiveRange(vector<double>* min_mass, vector<double>*
     Peptide* peptide = queue_.front();
     // Free all peptides up to, but not including peptide.
     fifo_alloc_peptides_.Release(peptide);
-    peptide->ReleaseFifo(&fifo_alloc_prog1_, &fifo_alloc_prog2_);
+    if (!b_ions) {
+      peptide->ReleaseFifo(&fifo_alloc_prog1_, &fifo_alloc_prog2_);
+    }
   }
+}
 
-  // Enqueue all peptides that are not yet queued but are lighter than
-  // max_range. For each new enqueued peptide compute the corresponding
-  // theoretical peaks. Data associated with each peptide is allocated by
-  // fifo_alloc_peptides_.
-  bool done = false;
-  if (queue_.empty() || queue_.back()->Mass() <= max_range) {
-    if (!queue_.empty()) {
-      ComputeTheoreticalPeaksBack();
-    }
-    while (!(done = reader_->Done())) {
-      // read all peptides lighter than max_range
-      reader_->Read(&current_pb_peptide_);
-      if (current_pb_peptide_.mass() < min_range) {
-        // we would delete current_pb_peptide_;
-        continue; // skip peptides that fall below min_range
-      }
-      Peptide* peptide = new(&fifo_alloc_peptides_)
-        Peptide(current_pb_peptide_, proteins_, &fifo_alloc_peptides_);
-      queue_.push_back(peptide);
-      if (peptide->Mass() > max_range) {
-        break;
-      }
-      ComputeTheoreticalPeaksBack();
-    }
+void ActivePeptideQueue::Reset() {
+  assert(!shared_);
+  for (deque<Peptide*>::iterator i = queue_.begin(); i != queue_.end(); ++i) {
+    vector<Peptide::spectrum_matches>().swap((*i)->spectrum_matches_array);
   }
-  // by now, if not EOF, then the last (and only the last) enqueued
-  // peptide is too heavy
-  assert(!queue_.empty() || done);
+  queue_.clear();
+  pending_.clear();
+  b_ion_queue_.clear();
+  pending_b_ion_queue_.clear();
+  uncompiled_ = NULL;
+  active_targets_ = active_decoys_ = 0;
+  fifo_alloc_peptides_.ReleaseAll();
+  fifo_alloc_prog1_.ReleaseAll();
+  fifo_alloc_prog2_.ReleaseAll();
+}
 
-  // Set up iterator for use with HasNext(),
-  // GetPeptide(), and NextPeptide(). Return the number of enqueued peptides.
-  if (queue_.empty()) {
+// Set up iterators for use with HasNext(), GetPeptide(), and NextPeptide()
+// over the loaded peptides that fall within [min_mass, max_mass]. Return the
+// number of candidate peptides.
+int ActivePeptideQueue::SelectActiveRange(vector<double>* min_mass, vector<double>* max_mass, vector<bool>* candidatePeptideStatus, bool b_ions) {
+  const deque<Peptide*>& queue = Queue();
+  active_targets_ = active_decoys_ = 0;
+  if (queue.empty()) {
     return 0;
   }
 
-  iter_ = queue_.begin();
-  while (iter_ != queue_.end() && (*iter_)->Mass() < min_mass->front()) {
+  iter_ = queue.begin();
+  if (b_ions) {
+    iter1_ = BIonQueue().begin();
+  }
+  while (iter_ != queue.end() && (*iter_)->Mass() < min_mass->front()) {
     ++iter_;
+    if (b_ions) {
+      ++iter1_;
+    }
   }
 
-  int* isotope_idx = new int(0);
+  int isotope_idx = 0;
   end_ = iter_;
+  if (b_ions) {
+    end1_ = iter1_;
+  }
   int active = 0;
-  active_targets_ = active_decoys_ = 0;
-  while (end_ != queue_.end() && (*end_)->Mass() < max_mass->back() ){
-    if (isWithinIsotope(min_mass, max_mass, (*end_)->Mass(), isotope_idx)) {
+  while (end_ != queue.end() && (*end_)->Mass() < max_mass->back()) {
+    if (isWithinIsotope(min_mass, max_mass, (*end_)->Mass(), &isotope_idx)) {
       ++active;
       candidatePeptideStatus->push_back(true);
       if (!(*end_)->IsDecoy()) {
@@ -158,110 +263,73 @@ int ActivePeptideQueue::SetActiveRange(vector<double>* min_mass, vector<double>*
       candidatePeptideStatus->push_back(false);
     }
     ++end_;
+    if (b_ions) {
+      ++end1_;
+    }
   }
-  delete isotope_idx;
-  if (active == 0) {
-    return 0;
-  }
-
   return active;
-
 }
 
-// Compute the b ion only theoretical peaks of the peptide in the "back" of the queue
-// (i.e. the one most recently read from disk -- the heaviest).
-void ActivePeptideQueue::ComputeBTheoreticalPeaksBack() {
+// Compute the b ion only theoretical peaks of the peptide most recently read
+// from disk (i.e. the heaviest).
+void ActivePeptideQueue::ComputeBTheoreticalPeaks(Peptide* peptide) {
   theoretical_b_peak_set_.Clear();
-  Peptide* peptide = queue_.back();
   peptide->ComputeBTheoreticalPeaks(&theoretical_b_peak_set_);
-  b_ion_queue_.push_back(theoretical_b_peak_set_);
+  pending_b_ion_queue_.push_back(theoretical_b_peak_set_);
 }
 
 int ActivePeptideQueue::SetActiveRangeBIons(vector<double>* min_mass, vector<double>* max_mass, double min_range, double max_range, vector<bool>* candidatePeptideStatus) {
-    exact_pval_search_ = true;
-  // queue front() is lightest; back() is heaviest
-
-  // delete anything already loaded that falls below min_range
-  while (!queue_.empty() && queue_.front()->Mass() < min_range) {
-    Peptide* peptide = queue_.front();
-    // would delete peptide's underlying pb::Peptide;
-    ReportPeptideHits(peptide);
-    peptide->spectrum_matches_array.clear();
-    vector<Peptide::spectrum_matches>().swap(peptide->spectrum_matches_array);
-    queue_.pop_front();
-    b_ion_queue_.pop_front();
-//    delete peptide;
-  }
-  if (queue_.empty()) {
-    fifo_alloc_peptides_.ReleaseAll();
-  } else {
-    Peptide* peptide = queue_.front();
-    // Free all peptides up to, but not including peptide.
-    fifo_alloc_peptides_.Release(peptide);
+  exact_pval_search_ = true;
+  if (!shared_) {
+    FillActiveRangeBIons(min_range, max_range);
   }
+  return SelectActiveRange(min_mass, max_mass, candidatePeptideStatus, true);
+}
 
-  // Enqueue all peptides that are not yet queued but are lighter than
-  // max_range. For each new enqueued peptide compute the corresponding
-  // theoretical peaks. Data associated with each peptide is allocated by
-  // fifo_alloc_peptides_.
-  bool done;
-  if (queue_.empty() || queue_.back()->Mass() <= max_range) {
-    while (!(done = reader_->Done())) {
-      // read all peptides lighter than max_range
-      reader_->Read(&current_pb_peptide_);
-      if (current_pb_peptide_.mass() < min_range) {
-        // we would delete current_pb_peptide_;
-        continue; // skip peptides that fall below min_range
-      }
-      Peptide* peptide = new(&fifo_alloc_peptides_)
-        Peptide(current_pb_peptide_, proteins_, &fifo_alloc_peptides_);
-      queue_.push_back(peptide);
-      ComputeBTheoreticalPeaksBack();
-      if (peptide->Mass() > max_range) {
-        break;
-      }
-    }
-  }
-  // by now, if not EOF, then the last (and only the last) enqueued
-  // peptide is too heavy
-  assert(!queue_.empty() || done);
+void ActivePeptideQueue::FillActiveRangeBIons(double min_range, double max_range) {
+  PrefetchActiveRange(min_range, max_range, true);
+  CommitActiveRange(min_range, true);
+}
 
-  iter1_ = b_ion_queue_.begin();
-  iter_ = queue_.begin();
-  while (iter_ != queue_.end() && (*iter_)->Mass() < min_mass->front() ){
-    ++iter_;
-    ++iter1_;
-  }
+// Tally the residue masses of all remaining peptides in the index, in
+// increasing order of mass. tide-index stores the result in the peptides
+// header; CountAAFrequency() and CountAAFrequencyRes() derive their tables
+// from it.
+void ActivePeptideQueue::CountResidueMasses(
+  google::protobuf::RepeatedPtrField<pb::ResidueMassCount>* counts
+) {
+  map<double, pb::ResidueMassCount> massMap;
 
-  int* isotope_idx = new int(0);
-  end_ = iter_;
-  end1_ = iter1_;
-  int active = 0;
-  active_targets_ = active_decoys_ = 0;
-  while (end_ != queue_.end() && (*end_)->Mass() < max_mass->back() ){
-    if (isWithinIsotope(min_mass, max_mass, (*end_)->Mass(), isotope_idx)) {
-      ++active;
-      candidatePeptideStatus->push_back(true);
-      if (!(*end_)->IsDecoy()) {
-        ++active_targets_;
-      } else {
-        ++active_decoys_;
-      }
-    } else {
-      candidatePeptideStatus->push_back(false);
+  while (!(reader_->Done())) { // read all peptides in index
+    reader_->Read(&current_pb_peptide_);
+    Peptide* peptide = new(&fifo_alloc_peptides_) Peptide(current_pb_peptide_, proteins_, &fifo_alloc_peptides_);
+
+    double* dAAResidueMass = peptide->getAAMasses(); //retrieves the amino acid masses, modifications included
+
+    int nLen = peptide->Len(); //peptide length
+    pb::ResidueMassCount* count = &massMap[dAAResidueMass[0]];
+    count->set_nterm(count->nterm() + 1);
+    for (int i = 1; i < nLen-1; ++i) {
+      count = &massMap[dAAResidueMass[i]];
+      count->set_inner(count->inner() + 1);
     }
-    ++end_;
-    ++end1_;
-  }
-  delete isotope_idx;
-  if (active == 0) {
-    return 0;
+    count = &massMap[dAAResidueMass[nLen - 1]];
+    count->set_cterm(count->cterm() + 1);
+
+    delete[] dAAResidueMass;
+    fifo_alloc_peptides_.ReleaseAll();
   }
 
-  return active;
+  counts->Clear();
+  for (map<double, pb::ResidueMassCount>::iterator it = massMap.begin(); it != massMap.end(); ++it) {
+    pb::ResidueMassCount* count = counts->Add();
+    count->CopyFrom(it->second);
+    count->set_mass(it->first);
+  }
 }
 
 int ActivePeptideQueue::CountAAFrequency(
+  const google::protobuf::RepeatedPtrField<pb::ResidueMassCount>& counts,
   double binWidth,
   double binOffset,
   double** dAAFreqN,
@@ -281,23 +349,14 @@ int ActivePeptideQueue::CountAAFrequency(
     memset(nvAAMassCounterC, 0, MaxModifiedAAMassBin * sizeof(unsigned int));
     memset(nvAAMassCounterI, 0, MaxModifiedAAMassBin * sizeof(unsigned int));
 
-    while (!(reader_->Done())) { // read all peptides in index
-      reader_->Read(&current_pb_peptide_);
-      Peptide* peptide = new(&fifo_alloc_peptides_) Peptide(current_pb_peptide_, proteins_, &fifo_alloc_peptides_);
-
-      double* dAAResidueMass = peptide->getAAMasses(); //retrieves the amino acid masses, modifications included
-
-      int nLen = peptide->Len(); //peptide length
-      ++nvAAMassCounterN[(unsigned int)(dAAResidueMass[0] / binWidth + 1.0 - binOffset)];
-      for (i = 1; i < nLen-1; ++i) {
-        ++nvAAMassCounterI[(unsigned int)(dAAResidueMass[i] / binWidth + 1.0 - binOffset)];
-        ++cntInside;
-      }
-      ++nvAAMassCounterC[(unsigned int)(dAAResidueMass[nLen - 1] / binWidth + 1.0 - binOffset)];
-      ++cntTerm;
-
-      delete[] dAAResidueMass;
-      fifo_alloc_peptides_.ReleaseAll();
+    for (int j = 0; j < counts.size(); ++j) {
+      const pb::ResidueMassCount& count = counts.Get(j);
+      unsigned int bin = (unsigned int)(count.mass() / binWidth + 1.0 - binOffset);
+      nvAAMassCounterN[bin] += count.nterm();
+      nvAAMassCounterI[bin] += count.inner();
+      nvAAMassCounterC[bin] += count.cterm();
+      cntTerm += count.nterm();
+      cntInside += count.inner();
     }
 
   //calculate the unique masses
@@ -336,71 +395,26 @@ int ActivePeptideQueue::CountAAFrequency(
 //not in int form
 //Most of code is based/stolen from ActivePeptideQueue::CountAAFrequency
 int ActivePeptideQueue::CountAAFrequencyRes(
-  double binWidth,
-  double binOffset,
+  const google::protobuf::RepeatedPtrField<pb::ResidueMassCount>& counts,
   vector<double>& dAAFreqN,
   vector<double>& dAAFreqI,
   vector<double>& dAAFreqC,
   vector<double>& dAAMass
 ) {
-  unsigned int i = 0;
   unsigned int cntTerm = 0; //counter for terminal residues
   unsigned int cntInside = 0; //counter for internal residues
-  map<double,int> nMap; //Nterm residues
-  map<double,int> iMap; //internal residues
-  map<double,int> cMap; //Cterm residues
-  map<double,int> allMap; //all residues
-
-  while (!(reader_->Done())) { //read all peptides in index
-    reader_->Read(&current_pb_peptide_);
-    Peptide* peptide = new(&fifo_alloc_peptides_) Peptide(current_pb_peptide_, proteins_, &fifo_alloc_peptides_);
-
-    double* dAAResidueMass = peptide->getAAMasses(); //retrieves the amino acid massses, modifications included
-
-    int nLen = peptide->Len(); //peptide length
-
-    //N terminal
-    if (nMap.count(dAAResidueMass[0]) == 0) {
-      nMap[dAAResidueMass[0]] = 1;
-    } else {
-      nMap[dAAResidueMass[0]] += 1;
-    }
-
-    //Internal residues
-    for(i = 1; i < nLen-1; i++) {
-      if (iMap.count(dAAResidueMass[i]) == 0) {
-        iMap[dAAResidueMass[i]] = 1;
-      } else {
-        iMap[dAAResidueMass[i]] += 1;
-      }
-      cntInside += 1;
-    }
-
-    //C terminal
-    if (cMap.count(dAAResidueMass[nLen-1]) == 0) {
-      cMap[dAAResidueMass[nLen-1]] = 1;
-    } else {
-      cMap[dAAResidueMass[nLen-1]] += 1;
-    }
-    cntTerm += 1;
-
-    //determine the unique masses for all residues
-    for(i = 0; i < nLen; i++) {
-      if (allMap.count(dAAResidueMass[i]) == 0) {
-        allMap[dAAResidueMass[i]] = 1;
-      }
-    }
-  }
-
-  //determine the unique masses for all residues
-  for (map<double,int>::iterator it = allMap.begin(); it != allMap.end(); it++) {
-    dAAMass.push_back(it->first);
+  for (int i = 0; i < counts.size(); ++i) {
+    cntTerm += counts.Get(i).nterm();
+    cntInside += counts.Get(i).inner();
   }
 
-  for (i = 0; i < dAAMass.size(); i++) {
-    dAAFreqN.push_back((double)nMap[dAAMass[i]] / cntTerm);
-    dAAFreqI.push_back((double)iMap[dAAMass[i]] / cntInside);
-    dAAFreqC.push_back((double)cMap[dAAMass[i]] / cntTerm);
+  //counts holds the unique masses for all residues, in increasing order
+  for (int i = 0; i < counts.size(); i++) {
+    const pb::ResidueMassCount& count = counts.Get(i);
+    dAAMass.push_back(count.mass());
+    dAAFreqN.push_back((double)count.nterm() / cntTerm);
+    dAAFreqI.push_back((double)count.inner() / cntInside);
+    dAAFreqC.push_back((double)count.cterm() / cntTerm);
   }
 
   return dAAMass.size();
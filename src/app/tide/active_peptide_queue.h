@@ -13,8 +13,25 @@
 // SetActiveRange() the client may use the iterator interface HasNext() and
 // NextPeptide() to iterate over the window. The client may also use
 // GetPeptide() to get a specific peptide in the window.
+//
+// Several search threads can share one window of peptides. The owning queue
+// is constructed with the file of peptides, and each thread constructs its
+// own queue on top of it with ActivePeptideQueue(ActivePeptideQueue*). The
+// owner's FillActiveRange() (or FillActiveRangeBIons()) reads, decodes and
+// compiles every peptide exactly once; it must be called while no thread is
+// using the window. The threads' queues then only select candidates from the
+// shared peptides in SetActiveRange() and SetActiveRangeBIons(), and may do
+// so concurrently, provided the requested range lies within the filled one.
+//
+// FillActiveRange() is PrefetchActiveRange() followed by
+// CommitActiveRange(). The former reads, decodes and compiles the peptides of
+// the next range without changing the window, so one thread may call it while
+// the others search the current window; only the latter, which moves the
+// prefetched peptides into the window and discards the light ones, has to
+// wait until no thread is using the window.
 
 #include <deque>
+#include "header.pb.h"
 #include "peptides.pb.h"
 #include "peptide.h"
 #include "theoretical_peak_set.h"
@@ -32,6 +49,9 @@ class ActivePeptideQueue {
  public:
   ActivePeptideQueue(RecordReader* reader,
             const vector<const pb::Protein*>& proteins);
+  // Construct a queue that selects candidates from the peptides loaded by
+  // shared, without reading any peptides itself.
+  explicit ActivePeptideQueue(ActivePeptideQueue* shared);
 
   ~ActivePeptideQueue();
 
@@ -41,6 +61,21 @@ class ActivePeptideQueue {
   int SetActiveRange(vector<double>* min_mass, vector<double>* max_mass, double min_range, double max_range, vector<bool>* candidatePeptideStatus);
   int SetActiveRangeBIons(vector<double>* min_mass, vector<double>* max_mass, double min_range, double max_range, vector<bool>* candidatePeptideStatus);
 
+  // Load the peptides in [min_range, max_range] without selecting
+  // candidates. Only valid for a queue that reads its own peptides.
+  void FillActiveRange(double min_range, double max_range);
+  void FillActiveRangeBIons(double min_range, double max_range);
+  // See above. The ranges passed to successive calls must be non-decreasing,
+  // and each CommitActiveRange() takes the min_range of the preceding
+  // PrefetchActiveRange().
+  void PrefetchActiveRange(double min_range, double max_range, bool b_ions);
+  void CommitActiveRange(double min_range, bool b_ions);
+  bool IsShared() const { return shared_ != NULL; }
+  // Discard all loaded peptides, so that the queue can be filled again from
+  // the start of its reader once the caller has rewound it. Only valid for a
+  // queue that reads its own peptides.
+  void Reset();
+
   bool HasNext() const { return iter_ != end_; }
   Peptide* NextPeptide() { return *iter_; }
   const Peptide* GetPeptide(int back_index) const {
@@ -54,11 +89,17 @@ class ActivePeptideQueue {
   deque<TheoreticalPeakSetBIons> b_ion_queue_;
   deque<TheoreticalPeakSetBIons>::const_iterator iter1_, end1_;
  
-  int CountAAFrequency(double binWidth, double binOffset, double** dAAFreqN,
-                       double** dAAFreqI, double** dAAFreqC, int** dAAMass);
+  // Read the remaining peptides and tally their residue masses. Indexes
+  // store the result in their header (residue_mass_counts); older ones
+  // don't, and have to be counted at search time.
+  void CountResidueMasses(google::protobuf::RepeatedPtrField<pb::ResidueMassCount>* counts);
+  static int CountAAFrequency(const google::protobuf::RepeatedPtrField<pb::ResidueMassCount>& counts,
+                              double binWidth, double binOffset, double** dAAFreqN,
+                              double** dAAFreqI, double** dAAFreqC, int** dAAMass);
   //Added by Andy Lin for RESIDUE_EVIDENCE_MATRIX
-  int CountAAFrequencyRes(double binWidth, double binOffset, vector<double>& dAAFreqN,
-                          vector<double>& dAAFreqI, vector<double>& dAAFreqC, vector<double>& dAAMass);
+  static int CountAAFrequencyRes(const google::protobuf::RepeatedPtrField<pb::ResidueMassCount>& counts,
+                                 vector<double>& dAAFreqN, vector<double>& dAAFreqI,
+                                 vector<double>& dAAFreqC, vector<double>& dAAMass);
   
   int ActiveTargets() const { return active_targets_; }
   int ActiveDecoys() const { return active_decoys_; }
@@ -81,6 +122,10 @@ class ActivePeptideQueue {
   void setElutionWindow(int elution_window) {
     elution_window_ = elution_window;
   }
+  // Compile the peaks stored in the index rather than recomputing them.
+  void setUseStoredPeaks(bool use_stored_peaks) {
+    use_stored_peaks_ = use_stored_peaks;
+  }
   // iter_ points to the current peptide. Client access is by HasNext(),
   // GetPeptide(), and NextPeptide(). end_ points just beyond the last active
   // peptide.
@@ -99,14 +144,28 @@ class ActivePeptideQueue {
   bool exact_pval_search_;
   bool peptide_centric_;
   int elution_window_;
+  bool use_stored_peaks_;
 
 
 //  Spectrum* spectrum_;
   // IMPLEMENTATION DETAILS
 
   // See .cc file.
-  void ComputeTheoreticalPeaksBack();
-  void ComputeBTheoreticalPeaksBack();
+  void ComputeTheoreticalPeaks(Peptide* peptide);
+  void ComputeBTheoreticalPeaks(Peptide* peptide);
+  int SelectActiveRange(vector<double>* min_mass, vector<double>* max_mass,
+                        vector<bool>* candidatePeptideStatus, bool b_ions);
+
+  // The peptides to select candidates from: our own, or those of shared_.
+  const deque<Peptide*>& Queue() const {
+    return shared_ ? shared_->queue_ : queue_;
+  }
+  const deque<TheoreticalPeakSetBIons>& BIonQueue() const {
+    return shared_ ? shared_->b_ion_queue_ : b_ion_queue_;
+  }
+
+  // Queue that owns the peptides, or NULL if this queue owns them.
+  ActivePeptideQueue* shared_;
 
   RecordReader* reader_;
   pb::Peptide current_pb_peptide_;
@@ -124,6 +183,15 @@ class ActivePeptideQueue {
   // by the last call to SetActiveRange().
   deque<Peptide*> queue_;
 
+  // Peptides read by PrefetchActiveRange() but not yet committed to queue_
+  // (and their b ions), in the same order.
+  deque<Peptide*> pending_;
+  deque<TheoreticalPeakSetBIons> pending_b_ion_queue_;
+
+  // The last peptide read, if it was too heavy for the range being filled;
+  // its theoretical peaks are computed once a range includes it.
+  Peptide* uncompiled_;
+
   // Set by most recent call to SetActiveRange()
   double min_mass_, max_mass_;
 
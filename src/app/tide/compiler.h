@@ -151,6 +151,10 @@ class TheoreticalPeakCompiler {
     }
   }
 
+  // The portable kernels keep their peak indices in the same allocator as
+  // the programs (see dot_product.h).
+  FifoAllocator* Allocator() const { return fifo_alloc_; }
+
   void Done() {
     // Write the coda instructions which will store results and update
     // counter. See comments above.
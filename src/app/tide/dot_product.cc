@@ -0,0 +1,151 @@
+// See .h file.
+
+#include <stdint.h>
+#include "io/carp.h"
+#include "peptide.h"
+#include "dot_product.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__clang__) || __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+// The SIMD kernels are compiled with target attributes, so that the rest of
+// the program does not require these instruction sets.
+#define TIDE_HAVE_SIMD
+#include <immintrin.h>
+#endif
+
+namespace {
+
+// Sums are accumulated unsigned, so that they wrap around like the 32-bit
+// adds of the generated programs.
+
+int SumScalar(const int* codes, int n, const int* cache) {
+  uint32_t sum0 = 0, sum1 = 0, sum2 = 0, sum3 = 0;
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    sum0 += cache[codes[i]];
+    sum1 += cache[codes[i + 1]];
+    sum2 += cache[codes[i + 2]];
+    sum3 += cache[codes[i + 3]];
+  }
+  for (; i < n; ++i)
+    sum0 += cache[codes[i]];
+  return (int) (sum0 + sum1 + sum2 + sum3);
+}
+
+#ifdef TIDE_HAVE_SIMD
+__attribute__((target("avx2")))
+int SumAvx2(const int* codes, int n, const int* cache) {
+  __m256i sum = _mm256_setzero_si256();
+  int i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256i index = _mm256_loadu_si256((const __m256i*) (codes + i));
+    sum = _mm256_add_epi32(sum, _mm256_i32gather_epi32(cache, index, 4));
+  }
+  __m128i half = _mm_add_epi32(_mm256_castsi256_si128(sum),
+                               _mm256_extracti128_si256(sum, 1));
+  half = _mm_add_epi32(half, _mm_shuffle_epi32(half, 0x4e));
+  half = _mm_add_epi32(half, _mm_shuffle_epi32(half, 0xb1));
+  uint32_t total = (uint32_t) _mm_cvtsi128_si32(half);
+  for (; i < n; ++i)
+    total += cache[codes[i]];
+  return (int) total;
+}
+
+__attribute__((target("avx512f")))
+int SumAvx512(const int* codes, int n, const int* cache) {
+  __m512i sum = _mm512_setzero_si512();
+  int i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m512i index = _mm512_loadu_si512(codes + i);
+    sum = _mm512_add_epi32(sum, _mm512_i32gather_epi32(index, cache, 4));
+  }
+  if (i < n) {
+    // Masked-off lanes are neither loaded nor gathered.
+    __mmask16 mask = (__mmask16) ((1u << (n - i)) - 1);
+    __m512i index = _mm512_maskz_loadu_epi32(mask, codes + i);
+    sum = _mm512_add_epi32(sum, _mm512_mask_i32gather_epi32(
+      _mm512_setzero_si512(), mask, index, cache, 4));
+  }
+  return _mm512_reduce_add_epi32(sum);
+}
+#endif
+
+template<int (*Sum)(const int*, int, const int*)>
+void ScoreQueue(deque<Peptide*>::const_iterator peptide, int queue_size,
+                int charge, const int* cache, pair<int, int>* results) {
+  // Same choice of peaks as Peptide::Prog().
+  int which = charge <= 2 ? 0 : 1;
+  for (int counter = queue_size; counter > 0; --counter, ++peptide, ++results) {
+    const int* index = (*peptide)->PeakIndex();
+    results->first = Sum(index + 2, index[which], cache);
+    results->second = counter;
+  }
+}
+
+} // namespace
+
+#ifdef TIDE_HAVE_JIT
+DotProduct::Kernel DotProduct::kernel_ = DotProduct::JIT;
+#else
+DotProduct::Kernel DotProduct::kernel_ = DotProduct::SCALAR;
+#endif
+DotProduct::ScoreFunction DotProduct::score_ = ScoreQueue<SumScalar>;
+
+DotProduct::Kernel DotProduct::BestSimd() {
+#ifdef TIDE_HAVE_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) {
+    return AVX512;
+  }
+  if (__builtin_cpu_supports("avx2")) {
+    return AVX2;
+  }
+#endif
+  return SCALAR;
+}
+
+void DotProduct::Select(const string& name) {
+  Kernel kernel = SCALAR;
+  if (name == "auto") {
+#ifdef TIDE_HAVE_JIT
+    kernel = JIT;
+#else
+    kernel = BestSimd();
+#endif
+  } else if (name == "jit") {
+#ifndef TIDE_HAVE_JIT
+    carp(CARP_FATAL, "xcorr-kernel=jit is only available on x86 processors.");
+#endif
+    kernel = JIT;
+  } else if (name == "simd") {
+    kernel = BestSimd();
+    if (kernel == SCALAR) {
+      carp(CARP_WARNING, "This processor supports neither AVX2 nor AVX-512; "
+           "using the scalar XCorr kernel.");
+    }
+  } else if (name == "scalar") {
+    kernel = SCALAR;
+  } else {
+    carp(CARP_FATAL, "Invalid xcorr-kernel value '%s'.", name.c_str());
+  }
+
+  kernel_ = kernel;
+  switch (kernel) {
+#ifdef TIDE_HAVE_SIMD
+  case AVX512: score_ = ScoreQueue<SumAvx512>; break;
+  case AVX2: score_ = ScoreQueue<SumAvx2>; break;
+#endif
+  default: score_ = ScoreQueue<SumScalar>; break;
+  }
+  carp(CARP_INFO, "Using the %s XCorr kernel.", Name(kernel));
+}
+
+const char* DotProduct::Name(Kernel kernel) {
+  switch (kernel) {
+  case JIT: return "JIT";
+  case SCALAR: return "scalar";
+  case AVX2: return "AVX2";
+  case AVX512: return "AVX-512";
+  }
+  return "unknown";
+}
@@ -0,0 +1,125 @@
+// Portable alternative to the dot-product programs generated by
+// TheoreticalPeakCompiler (see compiler.h).
+//
+// Instead of machine code, each Peptide keeps a peak index: the cache codes
+// of its theoretical peaks, stored in the same FifoAllocator that would hold
+// its programs. The layout is
+//
+//    index[0]              number of codes used for charge 1 and 2 (prog1)
+//    index[1]              number of codes used for higher charges (prog2)
+//    index[2 .. 2+index[1]) the codes; the prog1 codes come first
+//
+// The score of a peptide is the sum of cache[code] over its codes, which is
+// a gather followed by a horizontal add. Kernels exist for AVX-512 and AVX2,
+// chosen at run time according to the CPU, and a scalar fallback for all
+// other machines. The sums wrap around exactly like the 32-bit adds of the
+// generated programs, so all kernels give bit-identical scores to the JIT.
+// (The one exception is a peptide with no peaks inside the cache, which the
+// JIT never sees in practice; its generated program returns whatever was left
+// in EAX, while the kernels here return 0.)
+//
+// The JIT is only available on x86. Elsewhere the portable kernels are the
+// only choice.
+
+#ifndef DOT_PRODUCT_H
+#define DOT_PRODUCT_H
+
+#include <deque>
+#include <string>
+#include <utility>
+#include "fifo_alloc.h"
+#include "max_mz.h"
+#include "theoretical_peak_pair.h"
+#include "peptides.pb.h"
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define TIDE_HAVE_JIT
+#endif
+
+using namespace std;
+
+class Peptide;
+
+class DotProduct {
+ public:
+  enum Kernel { JIT, SCALAR, AVX2, AVX512 };
+
+  // Choose the kernel from the value of the xcorr-kernel parameter:
+  // "auto" (the JIT where available, otherwise the best SIMD kernel), "jit",
+  // "simd" (the best SIMD kernel this CPU supports) or "scalar". Must be
+  // called before any peptides are compiled.
+  static void Select(const string& name);
+
+  static Kernel Selected() { return kernel_; }
+  static bool UseJit() { return kernel_ == JIT; }
+  static const char* Name(Kernel kernel);
+
+  // Best kernel the current CPU supports, other than the JIT.
+  static Kernel BestSimd();
+
+  // Fill results with (score, counter) pairs for the queue_size peptides
+  // starting at peptide, exactly as the generated programs would: counter
+  // counts down from queue_size.
+  static void Score(deque<Peptide*>::const_iterator peptide, int queue_size,
+                    int charge, const int* cache, pair<int, int>* results) {
+    score_(peptide, queue_size, charge, cache, results);
+  }
+
+ private:
+  typedef void (*ScoreFunction)(deque<Peptide*>::const_iterator, int, int,
+                                const int*, pair<int, int>*);
+
+  static Kernel kernel_;
+  static ScoreFunction score_;
+};
+
+// Builds the peak index described above, in the same way that
+// TheoreticalPeakCompiler builds a program.
+class PeakIndexCompiler {
+ public:
+  explicit PeakIndexCompiler(FifoAllocator* fifo_alloc)
+    : fifo_alloc_(fifo_alloc), index_(NULL), pos_(NULL) {
+  }
+
+  // size is the largest number of codes that will be added.
+  int* Init(int size) {
+    index_ = (int*) fifo_alloc_->New(sizeof(int) * (size + 2));
+    pos_ = index_ + 2;
+    return index_;
+  }
+
+  // Peaks may be unsorted; peaks past the end of the cache are skipped.
+  void AddPositive(const TheoreticalPeakArr& peaks) {
+    int end = MaxBin::Global().CacheBinEnd() * NUM_PEAK_TYPES;
+    for (int i = 0; i < peaks.size(); ++i)
+      if (peaks[i].Code() < end)
+        *pos_++ = peaks[i].Code();
+  }
+
+  // Peaks are sorted and delta-encoded, as stored in the index.
+  void AddPositive(const google::protobuf::RepeatedField<int>& peaks) {
+    int end = MaxBin::Global().CacheBinEnd() * NUM_PEAK_TYPES;
+    int total = 0;
+    google::protobuf::RepeatedField<int>::const_iterator i = peaks.begin();
+    for (; i != peaks.end(); ++i) {
+      if ((total += *i) >= end)
+        break;
+      *pos_++ = total;
+    }
+  }
+
+  // Codes added so far are the ones used for charge 1 and 2.
+  void EndProg1() { index_[0] = pos_ - index_ - 2; }
+
+  void Done() {
+    index_[1] = pos_ - index_ - 2;
+    fifo_alloc_->Unalloc(pos_);
+  }
+
+ private:
+  FifoAllocator* fifo_alloc_;
+  int* index_;
+  int* pos_;
+};
+
+#endif // DOT_PRODUCT_H
@@ -10,6 +10,7 @@
 #include "theoretical_peak_set.h"
 #include "peptide.h"
 #include "compiler.h"
+#include "dot_product.h"
 
 #ifdef DEBUG
 DEFINE_int32(debug_peptide_id, -1, "Peptide id to debug.");
@@ -179,6 +180,16 @@ void Peptide::Compile(const TheoreticalPeakArr* peaks,
                       const pb::Peptide& pb_peptide,
                       TheoreticalPeakCompiler* compiler_prog1,
                       TheoreticalPeakCompiler* compiler_prog2) {
+  if (!DotProduct::UseJit()) {
+    PeakIndexCompiler compiler(compiler_prog1->Allocator());
+    prog1_ = compiler.Init(peaks[0].size() + peaks[1].size());
+    prog2_ = NULL;
+    compiler.AddPositive(peaks[0]);
+    compiler.EndProg1();
+    compiler.AddPositive(peaks[1]);
+    compiler.Done();
+    return;
+  }
   int pos_size = peaks[0].size();
   prog1_ = compiler_prog1->Init(pos_size, 0);
   compiler_prog1->AddPositive(peaks[0]);
@@ -244,6 +255,39 @@ void Peptide::ComputeTheoreticalPeaks(ST_TheoreticalPeakSet* workspace,
 #endif
 }
 
+void Peptide::CompileStoredPeaks(const pb::Peptide& pb_peptide,
+                                 TheoreticalPeakCompiler* compiler_prog1,
+                                 TheoreticalPeakCompiler* compiler_prog2) {
+  // peak1 holds the charge 1 peaks and peak2 the remaining charge 2 peaks,
+  // i.e. the same sets Compile() gets from the search-time workspace.
+  if (!DotProduct::UseJit()) {
+    PeakIndexCompiler compiler(compiler_prog1->Allocator());
+    prog1_ = compiler.Init(pb_peptide.peak1_size() + pb_peptide.peak2_size());
+    prog2_ = NULL;
+    compiler.AddPositive(pb_peptide.peak1());
+    compiler.EndProg1();
+    compiler.AddPositive(pb_peptide.peak2());
+    compiler.Done();
+    return;
+  }
+  prog1_ = compiler_prog1->Init(pb_peptide.peak1_size(), 0);
+  compiler_prog1->AddPositive(pb_peptide.peak1());
+  compiler_prog1->Done();
+
+  prog2_ = compiler_prog2->Init(pb_peptide.peak1_size() + pb_peptide.peak2_size(), 0);
+  compiler_prog2->AddPositive(pb_peptide.peak1());
+  compiler_prog2->AddPositive(pb_peptide.peak2());
+  compiler_prog2->Done();
+#ifdef DEBUG
+  if (Id() == FLAGS_debug_peptide_id) {
+    cout << "Prog1:" << endl;
+    DisAsm(prog1_);
+    cout << "Prog2:" << endl;
+    DisAsm(prog2_);
+  }
+#endif
+}
+
 // return the amino acid masses in the current peptide
 double* Peptide::getAAMasses(){
   double* masses_charge = new double[Len()];
@@ -265,17 +309,3 @@ double* Peptide::getAAMasses(){
   }
   return masses_charge;
 }
-
-// Probably defunct, uses old calling format.
-int NoInlineDotProd(Peptide* peptide, const int* cache, int charge) {
-  const void* prog = peptide->Prog(charge);
-  int result;
-#ifdef _MSC_VER
-  // FIXME CEG add Windows compatible inline assembly
-#else
-  __asm__ __volatile__("call *%[prog]\n"
-                       : "=a" (result)
-                       : "d" (cache), [prog] "abcSD" (prog));
-#endif
-  return result;
-}
@@ -18,7 +18,8 @@
 // product of its theoretical peaks with a given observed spectrum.
 // Specifically, ComputeTheoreticalPeaks() generates a compiled program for
 // doing so.  A different version of the generated program exists for charge 1
-// and  charge 2.
+// and  charge 2. When the JIT is not used, a peak index for the portable
+// kernels in dot_product.h is stored in place of the programs.
 
 #ifndef PEPTIDE_H
 #define PEPTIDE_H
@@ -177,12 +178,23 @@ class Peptide {
                                TheoreticalPeakCompiler* compiler_prog2);
   void ComputeBTheoreticalPeaks(TheoreticalPeakSetBIons* workspace) const;
 
+  // Produce the compiled programs from the peaks stored in pb_peptide by
+  // tide-index --precompute-peaks, instead of computing them again. The
+  // caller must check that the index peaks match the search bin size.
+  void CompileStoredPeaks(const pb::Peptide& pb_peptide,
+                          TheoreticalPeakCompiler* compiler_prog1,
+                          TheoreticalPeakCompiler* compiler_prog2);
+
   // Return the appropriate program depending on the precursor charge.
   // TODO 257: fix the unfortunate use of max_charge.
   const void* Prog(int max_charge) const {
     return max_charge <= 2 ? prog1_ : prog2_;
   }
 
+  // Return the peak index for the portable dot-product kernels, when the JIT
+  // is not used (see dot_product.h).
+  const int* PeakIndex() const { return (const int*) prog1_; }
+
   void ReleaseFifo(FifoAllocator* fifo_alloc_prog1,
        FifoAllocator* fifo_alloc_prog2) {
     // TODO 258: this code should probably move to ActivePeptideQueue
@@ -12,6 +12,7 @@
 #include <vector>
 #include <algorithm>
 #include <numeric>
+#include <limits>
 #include <gflags/gflags.h>
 #include "abspath.h"
 #include "records.h"
@@ -24,6 +25,7 @@
 #include "util/FileUtils.h"
 #include "util/MathUtil.h"
 #include "io/carp.h"
+#include "util/utils.h"
 #include "app/tide/peptide.h"
 
 using namespace std;
@@ -37,8 +39,14 @@ DEFINE_int32(max_mods, 255,
 DEFINE_int32(min_mods, 0,
   "Minimum number of modifications that can be applied to a single peptide.");
 DEFINE_int32(modsoutputter_file_threshold, 1000,
-  "Maximum number of temporary files that would be opened by ModsOutputter "
-  "before switching to ModsOutputterAlt.");
+  "Maximum number of combinations of modification counts handled by "
+  "ModsOutputter before switching to ModsOutputterAlt.");
+DEFINE_int32(mods_memory_limit, 4096,
+  "Maximum amount of memory, in MB, for modified peptides waiting to be "
+  "written by ModsOutputter. 0 means no limit.");
+DEFINE_int32(mods_spill_files, 16,
+  "Maximum number of temporary files used by ModsOutputter when the modified "
+  "peptides do not fit in mods_memory_limit.");
 
 static string GetTempName(const string& tempDir, int filenum) {
   char buf[64];
@@ -58,12 +66,20 @@ static string GetTempName(const string& tempDir, int filenum) {
 class IModsOutputter {
  public:
   virtual void Output(pb::Peptide* peptide) = 0;
+  // Write everything that is still pending; call after the last Output().
+  virtual void Finish() = 0;
   virtual int64_t Total() const = 0;
 };
 
-// Original class to generate modified peptides. Writes to temporary files
-// before merging them. As the number of possible modifications increases, the
-// number of required temporary files can grow extremely large.
+// Original class to generate modified peptides. All peptides with the same
+// combination of modification counts have the same mass delta, and the
+// unmodified peptides arrive in order of mass, so a modified peptide can be
+// written as soon as no peptide generated later can be lighter. Until then it
+// waits in memory. If the waiting peptides need more than mods_memory_limit,
+// they are sorted and written to a temporary file (a run), which is merged
+// with the peptides in memory as they are written. No more than
+// mods_spill_files runs exist at once: when that many exist, the next run also
+// takes in the contents of all existing runs.
 class ModsOutputter : public IModsOutputter {
  public:
   ModsOutputter(string tmpDir,
@@ -77,28 +93,37 @@ class ModsOutputter : public IModsOutputter {
       max_counts_(*mod_table_->MaxCounts()),
       counts_mapper_vec_(max_counts_.size(), 0),
       final_writer_(final_writer),
-      count_(0) {
-    numFiles_ = 1;
+      count_(0),
+      min_delta_(0),
+      next_seq_(0),
+      pending_bytes_(0),
+      max_pending_bytes_((int64_t)FLAGS_mods_memory_limit << 20),
+      peak_pending_bytes_(0),
+      max_runs_(1),
+      written_(0),
+      runs_written_(0) {
+    numCombinations_ = 1;
     for (int i = 0; i < max_counts_.size(); ++i) {
-      counts_mapper_vec_[i] = numFiles_;
+      counts_mapper_vec_[i] = numCombinations_;
       if (max_counts_[i] == 0)
-        numFiles_ *= (max_counts_[i]+2);
+        numCombinations_ *= (max_counts_[i]+2);
       else
-        numFiles_ *= (max_counts_[i]+1);
+        numCombinations_ *= (max_counts_[i]+1);
     }
   }
 
   ~ModsOutputter() {
-    for (int i = 0; i < writers_.size(); ++i) {
-      delete writers_[i];
+    for (int i = 0; i < pending_.size(); ++i) {
+      delete pending_[i];
     }
-    if (modPeptideCnt_ > 0) {
-      Merge();
+    for (int i = 0; i < runs_.size(); ++i) {
+      delete runs_[i];
+      unlink(GetTempName(tmpDir_, run_slots_[i]).c_str());
     }
   }
 
-  int NumFiles() const {
-    return numFiles_;
+  int NumCombinations() const {
+    return numCombinations_;
   }
 
   int64_t Total() const {
@@ -106,24 +131,9 @@ class ModsOutputter : public IModsOutputter {
   }
 
   void InitCountsMapper() {
-    writers_.resize(numFiles_);
-    if (numFiles_ > 100) {
-      carp(CARP_INFO, "Opening %d files for modifications.", numFiles_);
-    }
-
-    for (int i = 0; i < numFiles_; ++i) {
-      writers_[i] = new RecordWriter(GetTempName(tmpDir_, i), FLAGS_buf_size << 10);
-      if (!writers_[i]->OK()) {
-        // delete temporary files
-        for (int j = 0; j < i; ++j)
-          unlink(GetTempName(tmpDir_, j).c_str());
-        CHECK(writers_[i]->OK());
-      }
-    }
-
     const vector<double>& deltas = *mod_table_->OriginalDeltas();
-    delta_by_file_.resize(numFiles_);
-    for (int i = 0; i < numFiles_; ++i) {
+    delta_by_counts_.resize(numCombinations_);
+    for (int i = 0; i < numCombinations_; ++i) {
       double total_delta = 0;
       int x = i;
       for (int j = max_counts_.size() - 1; j >= 0; --j) {
@@ -131,11 +141,20 @@ class ModsOutputter : public IModsOutputter {
         x %= counts_mapper_vec_[j];
         total_delta += deltas[j] * digit;
       }
-      delta_by_file_[i] = total_delta;
+      delta_by_counts_[i] = total_delta;
+    }
+    min_delta_ = *min_element(delta_by_counts_.begin(), delta_by_counts_.end());
+
+    max_runs_ = max(FLAGS_mods_spill_files, 1);
+    free_slots_.clear();
+    for (int i = max_runs_; i >= 0; --i) {
+      free_slots_.push_back(i);
     }
   }
 
   void Output(pb::Peptide* peptide) {
+    // Nothing generated from this or any later peptide can be lighter.
+    Flush(peptide->mass() + min_delta_);
     peptide_ = peptide;
     const pb::Location& loc = peptide->first_location();
     residues_ = proteins_[loc.protein_id()]->residues().data() + loc.pos();
@@ -145,7 +164,7 @@ class ModsOutputter : public IModsOutputter {
 
  private:
   string tmpDir_;
-  int numFiles_;
+  int numCombinations_;
   int64_t modPeptideCnt_;
 
   class PepReader {
@@ -155,16 +174,6 @@ class ModsOutputter : public IModsOutputter {
       CHECK(reader_.OK());
     }
 
-    bool operator<(const PepReader& other) {
-      double mass = current_.mass();
-      double other_mass = other.current_.mass();
-      if (mass < other_mass)
-        return true;
-      if (mass > other_mass)
-        return false;
-      return current_.id() < other.current_.id();
-    }
-
     bool Advance() {
       if (reader_.Done())
         return false;
@@ -180,9 +189,27 @@ class ModsOutputter : public IModsOutputter {
     pb::Peptide current_;
   };
 
-  struct greater_pepreader : public binary_function<PepReader*, PepReader*, bool> {
-    bool operator()(PepReader* x, PepReader* y) {
-      return x != y && *y < *x;
+  // A modified peptide waiting in memory, serialized, since that takes much
+  // less space than a pb::Peptide. seq numbers the peptides in the order they
+  // were generated; runs store it in the id field of each peptide.
+  struct Pending {
+    double mass;
+    int64_t seq;
+    string bytes;
+  };
+
+  // Peptides are written in order of mass, then in the order they were
+  // generated. Since seq is unique, the heaps never see two equal peptides,
+  // and the output does not depend on how they break ties.
+  static bool Before(double mass, int64_t seq, double other_mass, int64_t other_seq) {
+    if (mass != other_mass)
+      return mass < other_mass;
+    return seq < other_seq;
+  }
+
+  struct greater_pending : public binary_function<Pending*, Pending*, bool> {
+    bool operator()(const Pending* x, const Pending* y) const {
+      return Before(y->mass, y->seq, x->mass, x->seq);
     }
   };
 
@@ -400,46 +427,117 @@ class ModsOutputter : public IModsOutputter {
     }
   }
 
-  void Merge() {
-    int num_files = writers_.size();
-    vector<PepReader*> readers(num_files);
-    for (int i = 0; i < num_files; ++i)
-      readers[i] = new PepReader(GetTempName(tmpDir_, i));
-
-    // initialize heap
-    PepReader** heap_end = &(readers[0]) + num_files;
-    for (PepReader** reader = &(readers[0]); reader < heap_end; ++reader)
-      if (!(*reader)->Advance())
-        swap(*reader--, *--heap_end);
-    make_heap(&(readers[0]), heap_end, greater_pepreader());
-
-    // do heap merge
-    int id = 0;
-#ifndef NDEBUG
-    double last_mass = 0.0;
-#endif
-    while (heap_end > &(readers[0])) {
-      pop_heap(&(readers[0]), heap_end, greater_pepreader());
-      pb::Peptide* current = (*(heap_end-1))->Current();
-      current->set_id(id++);
-#ifndef NDEBUG
-      assert(current->mass() >= last_mass);
-      last_mass = current->mass();
-#endif
-      final_writer_->Write(current);
-      CHECK(final_writer_->OK());
-      if ((*(heap_end-1))->Advance()) {
-        push_heap(&(readers[0]), heap_end, greater_pepreader());
-      } else {
-        --heap_end;
+  void Finish() {
+    Flush(numeric_limits<double>::infinity());
+    if (runs_written_ > 0) {
+      carp(CARP_INFO, "Wrote %d runs of modified peptides to temporary files.",
+           runs_written_);
+    }
+    carp(CARP_DEBUG, "At most %.1f MB of modified peptides were waiting in memory.",
+         peak_pending_bytes_ / 1048576.0);
+  }
+
+  // Find the first waiting peptide: *run is its index in runs_, or -1 if it is
+  // in memory. Returns false if no peptides are waiting.
+  bool Peek(int* run, double* mass) const {
+    *run = -1;
+    int64_t seq = 0;
+    bool found = !pending_.empty();
+    if (found) {
+      *mass = pending_.front()->mass;
+      seq = pending_.front()->seq;
+    }
+    for (int i = 0; i < runs_.size(); ++i) {
+      const pb::Peptide* current = runs_[i]->Current();
+      if (!found || Before(current->mass(), current->id(), *mass, seq)) {
+        found = true;
+        *run = i;
+        *mass = current->mass();
+        seq = current->id();
       }
     }
+    return found;
+  }
 
-    // delete temporary files
-    for (int i = 0; i < num_files; ++i) {
-      delete readers[i];
-      unlink(GetTempName(tmpDir_, i).c_str());
+  // Write the first waiting peptide, which Peek() found in run, to writer.
+  // Peptides written to the final file get their final ids; those written to
+  // a run get their seq as id.
+  void Take(int run, RecordWriter* writer, bool final) {
+    pb::Peptide* peptide;
+    if (run < 0) {
+      pop_heap(pending_.begin(), pending_.end(), greater_pending());
+      Pending* pending = pending_.back();
+      pending_.pop_back();
+      pending_bytes_ -= PendingSize(*pending);
+      CHECK(scratch_.ParseFromString(pending->bytes));
+      scratch_.set_id(pending->seq);
+      delete pending;
+      peptide = &scratch_;
+    } else {
+      peptide = runs_[run]->Current();
     }
+    if (final) {
+      peptide->set_id(written_++);
+    }
+    if (!writer->Write(peptide)) {
+      carp(CARP_FATAL, "I/O error writing modifications");
+    }
+    if (run >= 0 && !runs_[run]->Advance()) {
+      delete runs_[run];
+      unlink(GetTempName(tmpDir_, run_slots_[run]).c_str());
+      free_slots_.push_back(run_slots_[run]);
+      runs_.erase(runs_.begin() + run);
+      run_slots_.erase(run_slots_.begin() + run);
+    }
+  }
+
+  // Write all waiting peptides up to mass limit to the final file.
+  void Flush(double limit) {
+    int run;
+    double mass;
+    while (Peek(&run, &mass) && mass <= limit) {
+      Take(run, final_writer_->Writer(), true);
+    }
+  }
+
+  // Write the peptides waiting in memory to a new run. If there are already
+  // mods_spill_files runs, the new run takes in their contents as well.
+  void Spill() {
+    bool merge = runs_.size() >= max_runs_;
+    int slot = free_slots_.back();
+    free_slots_.pop_back();
+    string filename = GetTempName(tmpDir_, slot);
+    carp(CARP_DEBUG, "Writing %d modified peptides%s to %s", pending_.size(),
+         merge ? " and all existing runs" : "", filename.c_str());
+    {
+      RecordWriter writer(filename, FLAGS_buf_size << 10);
+      CHECK(writer.OK());
+      if (merge) {
+        int run;
+        double mass;
+        while (Peek(&run, &mass)) {
+          Take(run, &writer, false);
+        }
+      } else {
+        while (!pending_.empty()) {
+          Take(-1, &writer, false);
+        }
+      }
+    }
+    PepReader* reader = new PepReader(filename);
+    if (reader->Advance()) {
+      runs_.push_back(reader);
+      run_slots_.push_back(slot);
+    } else {
+      delete reader;
+      unlink(filename.c_str());
+      free_slots_.push_back(slot);
+    }
+    ++runs_written_;
+  }
+
+  static int64_t PendingSize(const Pending& pending) {
+    return sizeof(Pending) + pending.bytes.capacity();
   }
 
   int TotalMods(const vector<int>& counts) {
@@ -453,26 +551,46 @@ class ModsOutputter : public IModsOutputter {
     return dot;
   }
 
-  RecordWriter* Write(const vector<int>& counts) {
+  void Write(const vector<int>& counts) {
     ++modPeptideCnt_;
     int index = DotProd(counts);
     double mass = peptide_->mass();
-    peptide_->set_mass(delta_by_file_[index] + mass);
-    if (!writers_[index]->Write(peptide_)) {
-      carp(CARP_FATAL, "I/O error writing modifications");
-    }
+    peptide_->set_mass(delta_by_counts_[index] + mass);
+    Pending* pending = new Pending;
+    pending->mass = peptide_->mass();
+    pending->seq = next_seq_++;
+    peptide_->SerializeToString(&pending->bytes);
     peptide_->set_mass(mass);
-    return writers_[index];
+    pending_.push_back(pending);
+    push_heap(pending_.begin(), pending_.end(), greater_pending());
+    pending_bytes_ += PendingSize(*pending);
+    peak_pending_bytes_ = max(peak_pending_bytes_, pending_bytes_);
+    if (max_pending_bytes_ > 0 && pending_bytes_ > max_pending_bytes_) {
+      Spill();
+    }
   }
 
   const vector<const pb::Protein*>& proteins_;
   VariableModTable* mod_table_;
   const vector<int>& max_counts_;
   vector<int> counts_mapper_vec_;
-  vector<RecordWriter*> writers_;
-  vector<double> delta_by_file_;
   HeadedRecordWriter* final_writer_;
   int count_;
+  vector<double> delta_by_counts_;  // by DotProd() of the counts
+  double min_delta_;
+
+  int64_t next_seq_;  // seq of the next peptide generated
+  vector<Pending*> pending_;  // heap, first to be written at the front
+  int64_t pending_bytes_;
+  int64_t max_pending_bytes_;
+  int64_t peak_pending_bytes_;
+  vector<PepReader*> runs_;
+  int max_runs_;
+  vector<int> run_slots_;  // temporary file number of each run
+  vector<int> free_slots_;
+  int written_;
+  int runs_written_;
+  pb::Peptide scratch_;
 
   pb::Peptide* peptide_;
   const char* residues_;
@@ -519,6 +637,10 @@ class ModsOutputterAlt : public IModsOutputter {
   }
 
   ~ModsOutputterAlt() {
+    Finish();
+  }
+
+  void Finish() {
     // delete all temp file writers, since destructor writes end-of-records marker
     for (map< int, pair<string, RecordWriter*> >::iterator i = tempFiles_.begin();
          i != tempFiles_.end();
@@ -827,22 +949,30 @@ void AddMods(HeadedRecordReader* reader,
   ModsOutputterAlt outputAlt(tmpDir, proteins, var_mod_table, &writer);
   IModsOutputter* outputter;
 
-  if (outputOrig.NumFiles() <= FLAGS_modsoutputter_file_threshold) {
+  if (outputOrig.NumCombinations() <= FLAGS_modsoutputter_file_threshold) {
     outputOrig.InitCountsMapper();
     outputter = &outputOrig;
   } else {
     // Switch to alternate ModsOutputter if the regular one would open too many files
-    carp(CARP_DEBUG, "Using alternate ModsOutputter, original version would open %d files",
-         outputOrig.NumFiles());
+    carp(CARP_DEBUG, "Using alternate ModsOutputter, original version would need "
+         "%d combinations of modification counts", outputOrig.NumCombinations());
     outputter = &outputAlt;
   }
 
+  double start = wall_clock();
+  int64_t numPeptides = 0;
   pb::Peptide peptide;
   while (!reader->Done()) {
     CHECK(reader->Read(&peptide));
     outputter->Output(&peptide);
+    ++numPeptides;
   }
-  carp(CARP_INFO, "Created %d peptides.", outputter->Total());
   CHECK(reader->OK());
+  outputter->Finish();
+  double seconds = (wall_clock() - start) / 1e6;
+  carp(CARP_INFO, "Created %lld peptides from %lld unmodified peptides in %.1f s "
+       "(%.0f peptides per second).", (long long)outputter->Total(),
+       (long long)numPeptides, seconds,
+       seconds > 0 ? outputter->Total() / seconds : 0.0);
 }
 
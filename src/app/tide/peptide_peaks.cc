@@ -1,7 +1,8 @@
 // Benjamin Diament
 //
 // Add to the index of peptide records the pre-computed theoretical peaks.
-// We store the TheoreticalPeakSetDiff (q.v.) for each peptide. 
+// We store the search-time peak set (ST_TheoreticalPeakSet, q.v.) for each
+// peptide, so that tide-search can compile it without calling AddIons().
 //
 // Example command-line:
 // peptide_peaks --proteins=<raw_proteins.proto input file> \
@@ -21,77 +22,93 @@
 #include <iostream>
 #include <string>
 #include <vector>
+#include <algorithm>
 #include "records.h"
 #include "peptide.h"
+#include "active_peptide_queue.h"
 #include "theoretical_peak_set.h"
 #include "abspath.h"
+#include "mass_constants.h"
+#include "io/carp.h"
 
 using namespace std;
 
 #define CHECK(x) GOOGLE_CHECK(x)
-/*
-static void AddPeaksToPB(pb::Peptide* peptide, const TheoreticalPeakArr* peaks,
-			 int charge, bool neg) {
+
+// Append the codes of peaks to dest, sorted and delta-encoded. Sorting lets
+// TheoreticalPeakCompiler::AddPositive() stop at the first peak beyond the
+// cache; the order of the adds doesn't change the (integer) dot product.
+static void AddPeaksToPB(const TheoreticalPeakArr& peaks,
+                         google::protobuf::RepeatedField<int>* dest) {
+  vector<int> codes;
+  codes.reserve(peaks.size());
+  for (int i = 0; i < peaks.size(); ++i)
+    codes.push_back(peaks[i].Code());
+  sort(codes.begin(), codes.end());
   int last_code = 0;
-  TheoreticalPeakArr::const_iterator i = peaks->begin();
-  for (; i != peaks->end(); ++i) {
-    int delta = i->Code() - last_code;
-    last_code = i->Code();
-    if (neg) {
-      if (charge == 1) {
-        peptide->add_neg_peak1(delta);
-      } else {
-        peptide->add_neg_peak2(delta);
-      }
-    } else {
-      if (charge == 1) {
-        peptide->add_peak1(delta);
-      } else {
-        peptide->add_peak2(delta);
-      }
-    }
+  for (vector<int>::const_iterator i = codes.begin(); i != codes.end(); ++i) {
+    dest->Add(*i - last_code);
+    last_code = *i;
   }
 }
-*/
 
+// When precompute is set, store in peak1 the charge 1 peaks and in peak2 the
+// additional charge 2 peaks, exactly as ActivePeptideQueue would compute them
+// at search time for the given m/z bin width and offset. Otherwise the records
+// are copied unchanged. If mapped is set, the output is a mapped record file
+// (see records.h) keyed by peptide mass.
 void AddTheoreticalPeaks(const vector<const pb::Protein*>& proteins,
 			 const string& input_filename,
-			 const string& output_filename) {
+			 const string& output_filename,
+			 bool precompute, double bin_width, double bin_offset,
+			 bool mapped) {
   pb::Header orig_header, new_header;
   HeadedRecordReader reader(input_filename, &orig_header);
   CHECK(orig_header.file_type() == pb::Header::PEPTIDES);
   CHECK(orig_header.has_peptides_header());
-//  MassConstants::Init(&orig_header.peptides_header().mods());
   new_header.set_file_type(pb::Header::PEPTIDES);
   pb::Header_PeptidesHeader* subheader = new_header.mutable_peptides_header();
   subheader->CopyFrom(orig_header.peptides_header());
   subheader->set_has_peaks(true);
+  const pb::Header_PeptidesHeader& orig = orig_header.peptides_header();
+  if (!MassConstants::Init(&orig.mods(), &orig.nterm_mods(),
+                           &orig.cterm_mods(), bin_width, bin_offset)) {
+    carp(CARP_FATAL, "Error in MassConstants::Init");
+  }
+  // Store the residue mass counts from which tide-search computes amino acid
+  // frequencies. The header comes first, so this takes a pass of its own.
+  {
+    HeadedRecordReader count_reader(input_filename);
+    ActivePeptideQueue count_queue(count_reader.Reader(), proteins);
+    count_queue.CountResidueMasses(subheader->mutable_residue_mass_counts());
+  }
+  if (precompute) {
+    subheader->set_has_search_peaks(true);
+    subheader->set_peaks_bin_width(bin_width);
+    subheader->set_peaks_bin_offset(bin_offset);
+  }
   pb::Header_Source* source = new_header.add_source();
   source->mutable_header()->CopyFrom(orig_header);
   source->set_filename(AbsPath(input_filename));
-  HeadedRecordWriter writer(output_filename, new_header);
+  HeadedRecordWriter writer(output_filename, new_header, -1, mapped);
   CHECK(reader.OK());
   CHECK(writer.OK());
 
   pb::Peptide pb_peptide;
-//  const int workspace_size = 2000; // More than sufficient for theor. peaks.
-//  TheoreticalPeakSetDiff workspace(workspace_size);
+  ST_TheoreticalPeakSet workspace(2000); // Same size as ActivePeptideQueue's.
   while (!reader.Done()) {
     reader.Read(&pb_peptide);
-/*    Peptide peptide(pb_peptide, proteins);
-    workspace.Clear();
-    peptide.ComputeTheoreticalPeaks(&workspace);
-    TheoreticalPeakArr peaks_charge_1(2000);
-    TheoreticalPeakArr peaks_charge_2(2000);
-    TheoreticalPeakArr negs_charge_1(2000);
-    TheoreticalPeakArr negs_charge_2(2000);
-    workspace.GetPeaks(&peaks_charge_1, &negs_charge_1,
-		       &peaks_charge_2, &negs_charge_2, NULL);
-    AddPeaksToPB(&pb_peptide, &peaks_charge_1, 1, false);
-    AddPeaksToPB(&pb_peptide, &peaks_charge_2, 2, false);
-    AddPeaksToPB(&pb_peptide, &negs_charge_1, 1, true);
-    AddPeaksToPB(&pb_peptide, &negs_charge_2, 2, true);
-*/    CHECK(writer.Write(&pb_peptide));
+    if (precompute) {
+      Peptide peptide(pb_peptide, proteins);
+      workspace.Clear();
+      peptide.ComputeTheoreticalPeaks(&workspace);
+      const TheoreticalPeakArr* peaks = workspace.GetPeaks();
+      pb_peptide.clear_peak1();
+      pb_peptide.clear_peak2();
+      AddPeaksToPB(peaks[0], pb_peptide.mutable_peak1());
+      AddPeaksToPB(peaks[1], pb_peptide.mutable_peak2());
+    }
+    CHECK(writer.Write(&pb_peptide, pb_peptide.mass()));
   }
   CHECK(reader.OK());
 }
@@ -39,6 +39,21 @@
 // Note that CodedInputStream isn't built to handle large streams of
 // input, so it should be reconstructed at each record. Perhaps the
 // underlying ZeroCopyStream should handle EOF determination
+//
+// Mapped record files. A RecordWriter constructed with mapped = true writes
+// a different magic number and the same stream of records, each written
+// with a key by Write(message, key) in nondecreasing order of key (e.g. the
+// peptide mass). After the end-of-records marker follows a directory of
+// fixed-width entries {key, file offset}, one for every
+// MAPPED_DIRECTORY_STRIDE records, and a fixed-width trailer locating it:
+//
+//   magic | records... | 0 | padding to 8 | directory entries | trailer
+//
+// RecordReader recognizes either format. A mapped file is mmap'ed read-only
+// and shared, so records are parsed directly from the page cache (which is
+// shared by all processes reading the same index), and Seek() moves to any
+// key with a binary search of the directory. Integers in the directory are
+// stored in native byte order. records.py does not read this format.
 
 
 #ifndef RECORDS_H
@@ -52,9 +67,15 @@
 #include <io.h>
 #else
 #include <unistd.h>
+#include <sys/mman.h>
 #endif
+#include <string.h>
+#include <math.h>
+#include <assert.h>
 #include <iostream>
 #include <string>
+#include <vector>
+#include <algorithm>
 #include <google/protobuf/message.h>
 #include <google/protobuf/io/zero_copy_stream_impl.h>
 #include <google/protobuf/io/coded_stream.h>
@@ -67,11 +88,25 @@ using namespace std;
 #define UINT32_MAX 0xfffffffful
 #endif
 #define MAGIC_NUMBER  0xfead1234ul
+#define MAPPED_MAGIC_NUMBER  0xfead1235ul
+#define MAPPED_DIRECTORY_STRIDE  64
+
+struct MappedDirectoryEntry {
+  double key; // key of the record at offset
+  google::protobuf::uint64 offset;
+};
+
+struct MappedTrailer {
+  google::protobuf::uint64 directory_offset;
+  google::protobuf::uint64 num_entries;
+};
 
 class RecordWriter {
  public:
-  explicit RecordWriter(const string& filename, int buf_size = -1)
-    : raw_output_(NULL), coded_output_(NULL) {
+  explicit RecordWriter(const string& filename, int buf_size = -1,
+                        bool mapped = false)
+    : raw_output_(NULL), coded_output_(NULL), mapped_(mapped), bytes_(0),
+    num_keyed_(0), last_key_(-HUGE_VAL) {
     if ((fd_ = open(filename.c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0644)) < 0) {
       carp(CARP_FATAL, "Couldn't open file %s for write (errno %d: %s).",
 	   filename.c_str(), errno, strerror(errno));
@@ -82,13 +117,17 @@ class RecordWriter {
   }
   
   explicit RecordWriter(google::protobuf::io::ZeroCopyOutputStream* raw_output)
-    : fd_(-1), raw_output_(raw_output) {
+    : fd_(-1), raw_output_(raw_output), mapped_(false), bytes_(0),
+    num_keyed_(0), last_key_(-HUGE_VAL) {
     Init();
     raw_output_ = NULL; // we do not own (and will not delete) raw_output
   }
 
   ~RecordWriter() {
     coded_output_->WriteVarint32(0); // end-of-records marker
+    ++bytes_;
+    if (mapped_)
+      WriteDirectory();
     delete coded_output_;
     delete raw_output_;
     if (fd_ > -1)
@@ -99,60 +138,156 @@ class RecordWriter {
   bool OK() const { return NULL != coded_output_; }
 
   bool Write(const google::protobuf::Message* message) {
-    coded_output_->WriteVarint32(message->ByteSize());
+    int size = message->ByteSize();
+    coded_output_->WriteVarint32(size);
     if (coded_output_->HadError()) {
       delete coded_output_;
       coded_output_ = NULL;
       return false;
     }
     message->SerializeWithCachedSizes(coded_output_);
+    bytes_ += google::protobuf::io::CodedOutputStream::VarintSize32(size) + size;
     return !coded_output_->HadError();
   }
 
+  // As above, but for a mapped file also index the record by key. Keys must
+  // be nondecreasing.
+  bool Write(const google::protobuf::Message* message, double key) {
+    if (mapped_) {
+      if (key < last_key_)
+        carp(CARP_FATAL, "Records of a mapped file must be written in order "
+             "(%g after %g).", key, last_key_);
+      if (num_keyed_++ % MAPPED_DIRECTORY_STRIDE == 0) {
+        MappedDirectoryEntry entry = { key, bytes_ };
+        directory_.push_back(entry);
+      }
+      last_key_ = key;
+    }
+    return Write(message);
+  }
+
  private:
   void Init() {
     coded_output_ = new google::protobuf::io::CodedOutputStream(raw_output_);
-    coded_output_->WriteLittleEndian32(MAGIC_NUMBER);
+    coded_output_->WriteLittleEndian32(mapped_ ? MAPPED_MAGIC_NUMBER
+                                               : MAGIC_NUMBER);
+    bytes_ = 4;
     if (coded_output_->HadError()) {
       delete coded_output_;
       coded_output_ = NULL;
     }
   }
 
+  void WriteDirectory() {
+    const char padding[8] = { 0 };
+    if (bytes_ % 8 != 0) {
+      coded_output_->WriteRaw(padding, 8 - bytes_ % 8);
+      bytes_ += 8 - bytes_ % 8;
+    }
+    MappedTrailer trailer = { bytes_, directory_.size() };
+    if (!directory_.empty())
+      coded_output_->WriteRaw(&directory_[0],
+                              directory_.size() * sizeof(directory_[0]));
+    coded_output_->WriteRaw(&trailer, sizeof(trailer));
+    if (coded_output_->HadError())
+      carp(CARP_FATAL, "Error writing the directory of a mapped file.");
+  }
+
   int fd_;
   google::protobuf::io::ZeroCopyOutputStream* raw_output_;
   google::protobuf::io::CodedOutputStream* coded_output_;
+  bool mapped_;
+  google::protobuf::uint64 bytes_; // bytes written so far
+  google::protobuf::uint64 num_keyed_;
+  double last_key_;
+  vector<MappedDirectoryEntry> directory_;
 };
 
 
 class RecordReader {
  public:
   explicit RecordReader(const string& filename, int buf_size = -1)
-    : raw_input_(NULL), coded_input_(NULL), size_(UINT32_MAX), valid_(false) {
+    : raw_input_(NULL), coded_input_(NULL), size_(UINT32_MAX), valid_(false),
+    buf_size_(buf_size), map_(NULL), map_size_(0), pos_(0), end_(0), directory_(NULL),
+    directory_size_(0) {
     fd_ = open(filename.c_str(), O_RDONLY);
     if (fd_ < 0)
       return;
     raw_input_ = new google::protobuf::io::FileInputStream(fd_, buf_size);
     google::protobuf::io::CodedInputStream coded_input(raw_input_);
     google::protobuf::uint32 magic_number;
-    if (coded_input.ReadLittleEndian32(&magic_number) 
-        && magic_number == MAGIC_NUMBER)
-      valid_ = true;
+    if (coded_input.ReadLittleEndian32(&magic_number)) {
+      if (magic_number == MAGIC_NUMBER)
+        valid_ = true;
+      else if (magic_number == MAPPED_MAGIC_NUMBER)
+        valid_ = Map(filename);
+    }
   }
 
   ~RecordReader() {
     if (coded_input_)
       delete coded_input_;
     delete raw_input_;
+#ifndef _MSC_VER
+    if (map_)
+      munmap((void*) map_, map_size_);
+#endif
     if (fd_ >= 0)
       close(fd_);
   }
 
   bool OK() const { return valid_; }
 
+  // True if the file is a mapped record file, which supports Seek().
+  bool Mapped() const { return map_ != NULL; }
+
+  // Move forward past records that all have keys below key, so that the next
+  // record read is at or before the first record with a key >= key. Never
+  // moves backwards. Call only before Done(). Returns false, without moving,
+  // if the file is not a mapped record file.
+  bool Seek(double key) {
+    if (!map_)
+      return false;
+    const MappedDirectoryEntry* entry = lower_bound(
+      directory_, directory_ + directory_size_, key, EntryKeyLess);
+    if (entry != directory_ && (--entry)->offset > pos_)
+      pos_ = entry->offset;
+    return true;
+  }
+
+  // Move back to the first record, so the file can be read again without
+  // reopening (and, for a mapped file, remapping) it.
+  bool Rewind() {
+    if (!valid_)
+      return false;
+    size_ = UINT32_MAX;
+    if (map_) {
+      pos_ = 4;
+      return true;
+    }
+    delete coded_input_;
+    coded_input_ = NULL;
+    delete raw_input_;
+    raw_input_ = NULL;
+    if (lseek(fd_, 4, SEEK_SET) != 4)
+      return valid_ = false;
+    raw_input_ = new google::protobuf::io::FileInputStream(fd_, buf_size_);
+    return true;
+  }
+
   bool Done() {
     if (!valid_)
       return true;
+    if (map_) {
+      google::protobuf::io::CodedInputStream coded_input(
+        map_ + pos_, (int) min<google::protobuf::uint64>(end_ - pos_, 5));
+      if (!coded_input.ReadVarint32(&size_))
+        return valid_ = false;
+      if (size_ == 0)
+        return true; // stay at the marker, so Done() remains true
+      pos_ += coded_input.CurrentPosition();
+      return false;
+    }
     coded_input_ = new google::protobuf::io::CodedInputStream(raw_input_);
     if (!coded_input_->ReadVarint32(&size_))
       return valid_ = false;
@@ -166,6 +301,13 @@ class RecordReader {
     if (!valid_)
       return false;
     assert(size_ != UINT32_MAX);
+    if (map_) {
+      if (size_ > end_ - pos_ || !message->ParseFromArray(map_ + pos_, size_))
+        return valid_ = false;
+      pos_ += size_;
+      size_ = UINT32_MAX;
+      return true;
+    }
     google::protobuf::io::CodedInputStream::Limit limit
       = coded_input_->PushLimit(size_);
     if (!message->ParseFromCodedStream(coded_input_))
@@ -180,19 +322,88 @@ class RecordReader {
     return true;
   }
 
+  // Like Read(), but copy the encoded record into bytes without parsing it.
+  bool ReadBytes(string* bytes) {
+    if (!valid_)
+      return false;
+    assert(size_ != UINT32_MAX);
+    if (map_) {
+      if (size_ > end_ - pos_)
+        return valid_ = false;
+      bytes->assign((const char*) map_ + pos_, size_);
+      pos_ += size_;
+      size_ = UINT32_MAX;
+      return true;
+    }
+    bool ok = coded_input_->ReadString(bytes, size_);
+    delete coded_input_;
+    coded_input_ = NULL;
+    size_ = UINT32_MAX;
+    return ok || (valid_ = false);
+  }
+
  private:
+  static bool EntryKeyLess(const MappedDirectoryEntry& entry, double key) {
+    return entry.key < key;
+  }
+
+  // Map the whole file and locate its directory. Records start right after
+  // the magic number.
+  bool Map(const string& filename) {
+#ifdef _MSC_VER
+    carp(CARP_FATAL, "Mapped record files are not supported on Windows (%s).",
+         filename.c_str());
+    return false;
+#else
+    struct stat st;
+    if (fstat(fd_, &st) != 0 || st.st_size < 4 + (off_t) sizeof(MappedTrailer))
+      return false;
+    map_size_ = st.st_size;
+    void* p = mmap(NULL, map_size_, PROT_READ, MAP_SHARED, fd_, 0);
+    if (p == MAP_FAILED) {
+      carp(CARP_ERROR, "Couldn't map file %s (errno %d: %s).",
+           filename.c_str(), errno, strerror(errno));
+      return false;
+    }
+    map_ = (const google::protobuf::uint8*) p;
+    MappedTrailer trailer;
+    memcpy(&trailer, map_ + map_size_ - sizeof(trailer), sizeof(trailer));
+    if (trailer.directory_offset % 8 != 0 ||
+        trailer.directory_offset + trailer.num_entries * sizeof(MappedDirectoryEntry)
+          != map_size_ - sizeof(trailer)) {
+      carp(CARP_ERROR, "The directory of mapped file %s is corrupt.",
+           filename.c_str());
+      return false;
+    }
+    directory_ = (const MappedDirectoryEntry*) (map_ + trailer.directory_offset);
+    directory_size_ = trailer.num_entries;
+    pos_ = 4;
+    end_ = trailer.directory_offset;
+    return true;
+#endif
+  }
+
   int fd_;
   google::protobuf::io::ZeroCopyInputStream* raw_input_;
   google::protobuf::io::CodedInputStream* coded_input_;
   google::protobuf::uint32 size_;
   bool valid_;
+  int buf_size_;
+
+  // For mapped files only.
+  const google::protobuf::uint8* map_;
+  google::protobuf::uint64 map_size_;
+  google::protobuf::uint64 pos_; // offset of the next record
+  google::protobuf::uint64 end_; // end of the records
+  const MappedDirectoryEntry* directory_;
+  google::protobuf::uint64 directory_size_;
 };
 
 class HeadedRecordWriter {
  public:
   HeadedRecordWriter(const string& filename, const pb::Header& header,
-                     int buf_size = -1) 
-    : writer_(filename, buf_size) {
+                     int buf_size = -1, bool mapped = false)
+    : writer_(filename, buf_size, mapped) {
     if (!writer_.OK())
       carp(CARP_FATAL, "Cannot create the file %s\n", filename.c_str());
     Write(&header);
@@ -212,6 +423,9 @@ class HeadedRecordWriter {
   bool Write(const google::protobuf::Message* message) {
     return writer_.Write(message);
   }
+  bool Write(const google::protobuf::Message* message, double key) {
+    return writer_.Write(message, key);
+  }
 
  private:
   RecordWriter writer_;
@@ -237,6 +451,14 @@ class HeadedRecordReader {
   bool Read(google::protobuf::Message* message) { 
     return reader_.Read(message);
   }
+  bool ReadBytes(string* bytes) { return reader_.ReadBytes(bytes); }
+  bool Mapped() const { return reader_.Mapped(); }
+  bool Seek(double key) { return reader_.Seek(key); }
+  // Move back to the first record after the header.
+  bool Rewind() {
+    pb::Header header;
+    return reader_.Rewind() && !Done() && Read(&header);
+  }
   const pb::Header* GetHeader() const { return header_; }
 
  private:
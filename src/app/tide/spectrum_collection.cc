@@ -7,6 +7,7 @@
 #include <iostream>
 #include <algorithm>
 #include <functional>
+#include <boost/bind.hpp>
 #include "spectrum.pb.h"
 #include "spectrum_collection.h"
 #include "mass_constants.h"
@@ -30,8 +31,24 @@ Spectrum::Spectrum(const pb::Spectrum& spec) {
   rtime_ = spec.rtime();
   for (int i = 0; i < spec.charge_state_size(); ++i)
     charge_states_.push_back(spec.charge_state(i));
+  ReadPeaks(spec);
+}
+
+Spectrum::Spectrum(const pb::Spectrum& spec, bool with_peaks) {
+  spectrum_number_ = spec.spectrum_number();
+  precursor_m_z_ = spec.precursor_m_z();
+  rtime_ = spec.rtime();
+  for (int i = 0; i < spec.charge_state_size(); ++i)
+    charge_states_.push_back(spec.charge_state(i));
+  if (with_peaks)
+    ReadPeaks(spec);
+}
+
+void Spectrum::ReadPeaks(const pb::Spectrum& spec) {
   int size = spec.peak_m_z_size();
   CHECK(size == spec.peak_intensity_size());
+  peak_m_z_.clear();
+  peak_intensity_.clear();
   ReservePeaks(size);
   uint64 total = 0;
   double m_z_denom = spec.peak_m_z_denominator();
@@ -481,10 +498,18 @@ void SpectrumCollection::MakeSpecCharges() {
     }
     spectrum_index++;
   }
+  if (lazy_) {
+    pending_.assign(spectra_.size(), 0);
+    for (vector<SpecCharge>::const_iterator j = spec_charges_.begin();
+         j != spec_charges_.end(); ++j)
+      ++pending_[j->spectrum_index];
+  }
 }
 
 double SpectrumCollection::FindHighestMZ() const {
   // Return the maximum MZ seen across all input spectra.
+  if (lazy_)
+    return highest_mz_;
   double highest = 0;
   vector<Spectrum*>::const_iterator i = spectra_.begin();
   for (; i != spectra_.end(); ++i) {
@@ -497,6 +522,146 @@ double SpectrumCollection::FindHighestMZ() const {
   return highest;
 }
 
+bool SpectrumCollection::ReadSpectrumRecordsLazily(const string& filename,
+                                                   int num_threads,
+                                                   pb::Header* header) {
+  pb::Header tmp_header;
+  if (header == NULL)
+    header = &tmp_header;
+  HeadedRecordReader reader(filename, header);
+  if (header->file_type() != pb::Header::SPECTRA)
+    return false;
+  while (!reader.Done()) {
+    records_.push_back(string());
+    if (!reader.ReadBytes(&records_.back()))
+      break;
+  }
+  if (!reader.OK()) {
+    records_.clear();
+    return false;
+  }
+
+  // Parse the records in parallel, keeping only what the spectra need
+  // without their peaks.
+  lazy_ = true;
+  num_threads_ = max(num_threads, 1);
+  int size = records_.size();
+  spectra_.resize(size, NULL);
+  decoded_.resize(size, false);
+  prefetch_slot_.resize(size, 0);
+  vector<double> highest_mz(num_threads_, 0);
+  boost::thread_group threads;
+  for (int t = 1; t < num_threads_; ++t) {
+    threads.create_thread(boost::bind(&SpectrumCollection::ParseRecords, this,
+                                      (long long) size * t / num_threads_,
+                                      (long long) size * (t + 1) / num_threads_,
+                                      &highest_mz[t]));
+  }
+  ParseRecords(0, (long long) size / num_threads_, &highest_mz[0]);
+  threads.join_all();
+  highest_mz_ = *max_element(highest_mz.begin(), highest_mz.end());
+  return true;
+}
+
+void SpectrumCollection::ParseRecords(int begin, int end,
+                                      double* highest_mz) {
+  pb::Spectrum pb_spectrum;
+  for (int i = begin; i < end; ++i) {
+    CHECK(pb_spectrum.ParseFromString(records_[i]));
+    spectra_[i] = new Spectrum(pb_spectrum, false);
+    CHECK(pb_spectrum.peak_m_z_size() > 0) << "ERROR: spectrum "
+      << pb_spectrum.spectrum_number() << " has no peaks.\n";
+    uint64 total = 0;
+    for (int j = 0; j < pb_spectrum.peak_m_z_size(); ++j)
+      total += pb_spectrum.peak_m_z(j);
+    double last_peak = total / (double) pb_spectrum.peak_m_z_denominator();
+    if (last_peak > *highest_mz)
+      *highest_mz = last_peak;
+  }
+}
+
+void SpectrumCollection::DecodeSpectra(const vector<int>* indices,
+                                       int begin, int end) {
+  pb::Spectrum pb_spectrum;
+  for (int i = begin; i < end; ++i) {
+    int index = (*indices)[i];
+    CHECK(pb_spectrum.ParseFromString(records_[index]));
+    spectra_[index]->ReadPeaks(pb_spectrum);
+  }
+}
+
+void SpectrumCollection::WaitForPrefetch(int slot) {
+  if (prefetch_[slot] != NULL) {
+    prefetch_[slot]->join();
+    delete prefetch_[slot];
+    prefetch_[slot] = NULL;
+  }
+  for (vector<int>::const_iterator i = prefetch_indices_[slot].begin();
+       i != prefetch_indices_[slot].end(); ++i)
+    prefetch_slot_[*i] = 0;
+  prefetch_indices_[slot].clear();
+}
+
+void SpectrumCollection::LoadSpecCharges(int begin, int end) {
+  if (!lazy_)
+    return;
+  vector<int> indices;
+  for (int i = begin; i < end; ++i) {
+    int index = spec_charges_[i].spectrum_index;
+    if (prefetch_slot_[index] != 0) {
+      WaitForPrefetch(prefetch_slot_[index] - 1);
+    } else if (!decoded_[index]) {
+      decoded_[index] = true;
+      indices.push_back(index);
+    }
+  }
+  int size = indices.size();
+  boost::thread_group threads;
+  for (int t = 1; t < num_threads_; ++t) {
+    threads.create_thread(boost::bind(&SpectrumCollection::DecodeSpectra, this,
+                                      &indices,
+                                      (long long) size * t / num_threads_,
+                                      (long long) size * (t + 1) / num_threads_));
+  }
+  DecodeSpectra(&indices, 0, (long long) size / num_threads_);
+  threads.join_all();
+}
+
+void SpectrumCollection::PrefetchSpecCharges(int begin, int end) {
+  if (!lazy_)
+    return;
+  int slot = next_prefetch_;
+  next_prefetch_ = (next_prefetch_ + 1) % NUM_PREFETCHES;
+  WaitForPrefetch(slot);
+  vector<int>* indices = &prefetch_indices_[slot];
+  for (int i = begin; i < end; ++i) {
+    int index = spec_charges_[i].spectrum_index;
+    if (!decoded_[index]) {
+      decoded_[index] = true;
+      prefetch_slot_[index] = slot + 1;
+      indices->push_back(index);
+    }
+  }
+  if (!indices->empty()) {
+    prefetch_[slot] = new boost::thread(boost::bind(
+      &SpectrumCollection::DecodeSpectra, this, indices, 0,
+      (int) indices->size()));
+  }
+}
+
+void SpectrumCollection::ReleaseSpecCharges(int begin, int end) {
+  if (!lazy_)
+    return;
+  for (int i = begin; i < end; ++i) {
+    int index = spec_charges_[i].spectrum_index;
+    if (--pending_[index] == 0) {
+      spectra_[index]->ClearPeaks();
+      // The peaks are not needed again; free the record as well.
+      string().swap(records_[index]);
+    }
+  }
+}
+
 void SpectrumCollection::Sort() {
   MakeSpecCharges();
   sort(spec_charges_.begin(), spec_charges_.end());
@@ -16,12 +16,27 @@
 //
 // SpectrumCollection::FindHighestMZ() returns the maximum MZ seen across all
 // input spectra. This is cached by the MaxMZ class.
+//
+// ReadSpectrumRecordsLazily() is for searches that go through the
+// spectrum-charge pairs once, in order of mass. It keeps each record encoded
+// (which is several times smaller than the decoded peaks) and creates the
+// spectra without their peaks. Before a range of pairs is searched,
+// LoadSpecCharges() decodes the peaks of their spectra in parallel, while
+// PrefetchSpecCharges() decodes a later range in the background during the
+// search. Up to two prefetches run at once, so a range can be prefetched two
+// ranges ahead and LoadSpecCharges() then waits only for the prefetch that
+// covers its own range. ReleaseSpecCharges() frees the peaks of a spectrum again once all
+// of its pairs have been searched. Pairs of the same spectrum with different
+// charges are far apart in mass, so a spectrum may be decoded for its first
+// pair and kept until its last.
 
 #ifndef SPECTRUM_COLLECTION_H
 #define SPECTRUM_COLLECTION_H
 
 #include <iostream>
+#include <string>
 #include <vector>
+#include <boost/thread.hpp>
 #include "header.pb.h"
 #include "spectrum.pb.h"
 
@@ -50,8 +65,18 @@ class Spectrum {
   }
   
   explicit Spectrum(const pb::Spectrum& spec); // Instantiation from PB
+  // Instantiation from PB, without the peaks unless with_peaks
+  Spectrum(const pb::Spectrum& spec, bool with_peaks);
   void FillPB(pb::Spectrum* spec);
 
+  // Decode the peaks of spec, which must be the PB of this spectrum.
+  void ReadPeaks(const pb::Spectrum& spec);
+  // Free the peaks, e.g. after ReadPeaks().
+  void ClearPeaks() {
+    vector<double>().swap(peak_m_z_);
+    vector<double>().swap(peak_intensity_);
+  }
+
   int SpectrumNumber() const { return spectrum_number_; }
   double PrecursorMZ() const { return precursor_m_z_; }
   double RTime() const { return rtime_; }
@@ -103,13 +128,33 @@ class Spectrum {
 
 class SpectrumCollection {
  public:
+  SpectrumCollection()
+    : lazy_(false), num_threads_(1), highest_mz_(0), next_prefetch_(0) {
+    for (int i = 0; i < NUM_PREFETCHES; ++i)
+      prefetch_[i] = NULL;
+  }
+
   ~SpectrumCollection() {
+    for (int i = 0; i < NUM_PREFETCHES; ++i)
+      WaitForPrefetch(i);
     for (int i = 0; i < spectra_.size(); ++i)
       delete spectra_[i];
   }
 
   void ReadMS(istream& in, bool ms1);
   bool ReadSpectrumRecords(const string& filename, pb::Header* header = NULL);
+  // See the comment at the top. num_threads threads parse the records and
+  // decode the peaks in LoadSpecCharges().
+  bool ReadSpectrumRecordsLazily(const string& filename, int num_threads,
+                                 pb::Header* header = NULL);
+  bool Lazy() const { return lazy_; }
+
+  // The following take a range [begin, end) of SpecCharges(), after sorting.
+  // Only one thread at a time may call them, and not while a thread searches
+  // pairs outside the last range passed to LoadSpecCharges().
+  void LoadSpecCharges(int begin, int end);
+  void PrefetchSpecCharges(int begin, int end);
+  void ReleaseSpecCharges(int begin, int end);
   void Sort();
   int Size() const { return(spectra_.size()); } // number of spectra
 
@@ -144,8 +189,27 @@ class SpectrumCollection {
  private:
   void MakeSpecCharges();
 
+  // For lazy loading.
+  void ParseRecords(int begin, int end, double* highest_mz);
+  void DecodeSpectra(const vector<int>* indices, int begin, int end);
+  void WaitForPrefetch(int slot);
+
   vector<Spectrum*> spectra_;
   vector<SpecCharge> spec_charges_;
+
+  bool lazy_;
+  int num_threads_;
+  double highest_mz_;
+  vector<string> records_;  // encoded pb::Spectrum for each of spectra_
+  vector<int> pending_;     // pairs of each spectrum not yet released
+  vector<bool> decoded_;    // whether each spectrum has its peaks
+  // Background decoding; prefetch_slot_ is 1 + the slot still decoding each
+  // spectrum, or 0.
+  static const int NUM_PREFETCHES = 2;
+  boost::thread* prefetch_[NUM_PREFETCHES];
+  vector<int> prefetch_indices_[NUM_PREFETCHES];
+  vector<char> prefetch_slot_;
+  int next_prefetch_;
 };
 
 #endif // SPECTRUM_COLLECTION_H
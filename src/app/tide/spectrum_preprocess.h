@@ -114,6 +114,33 @@ using namespace std;
 
 class Spectrum;
 
+// Residue evidence for each amino acid (row) and mass bin (column), used when
+// scoring with residue-evidence. All rows are stored in one contiguous buffer,
+// and Init() keeps its capacity, so that a search thread can reuse a single
+// matrix for all of its spectra.
+class ResidueEvidenceMatrix {
+ public:
+  ResidueEvidenceMatrix() : rows_(0), cols_(0) {}
+
+  // Resize to rows x cols and set all entries to 0.
+  void Init(int rows, int cols) {
+    rows_ = rows;
+    cols_ = cols;
+    data_.assign((size_t)rows * cols, 0.0);
+  }
+
+  int Rows() const { return rows_; }
+  int Cols() const { return cols_; }
+
+  double* operator[](int row) { return &data_[(size_t)row * cols_]; }
+  const double* operator[](int row) const { return &data_[(size_t)row * cols_]; }
+
+ private:
+  int rows_;
+  int cols_;
+  vector<double> data_;
+};
+
 class ObservedPeakSet {
  public:
 
@@ -164,7 +191,7 @@ class ObservedPeakSet {
                                    long int* num_precursors_skipped,
                                    long int* num_isotopes_skipped,
                                    long int* num_retained,
-                                   vector< vector<double> >& residueEvidenceMatrix);
+                                   ResidueEvidenceMatrix& residueEvidenceMatrix);
    // created by Andy Lin in Feb 2018
    // help method for CreateResidueEvidenceMatrix
    void addEvidToResEvMatrix(vector<double>& ionMass,
@@ -177,7 +204,7 @@ class ObservedPeakSet {
                     const vector<double>& aaMass,
                     const vector<int>& aaMassBin,
                     const double residueToleranceMass,
-                    vector< vector<double> >& residueEvidenceMatrix);
+                    ResidueEvidenceMatrix& residueEvidenceMatrix);
 
   // For debugging
   void Show(const string& name, TheoreticalPeakType peak_type, bool cache_end) {
@@ -297,7 +297,7 @@ void ObservedPeakSet::addEvidToResEvMatrix(
   const vector<double>& aaMass,
   const vector<int>& aaMassBin,
   const double residueToleranceMass,
-  vector<vector<double> >& residueEvidenceMatrix
+  ResidueEvidenceMatrix& residueEvidenceMatrix
   ) {
   double bIonMass; int bIonMassBin;
   for (int ion = 0; ion < ionMass.size(); ion++) {
@@ -365,10 +365,11 @@ void ObservedPeakSet::CreateResidueEvidenceMatrix(
   long int* num_precursors_skipped,
   long int* num_isotopes_skipped,
   long int* num_retained,
-  vector<vector<double> >& residueEvidenceMatrix
+  ResidueEvidenceMatrix& residueEvidenceMatrix
   ) {
 
   assert(MaxBin::Global().MaxBinEnd() > 0);
+  residueEvidenceMatrix.Init(nAA, maxPrecurMassBin);
 
   //TODO move to constants file?
   const double massHMono = MassConstants::mono_h;  // mass of hydrogen (monoisotopic)
@@ -623,21 +624,22 @@ void ObservedPeakSet::CreateResidueEvidenceMatrix(
 
   // Get maxEvidence value
   double maxEvidence = -1.0;
-  for (int i = 0; i < maxPrecurMassBin; i++) {
-    for (int curAaMass = 0; curAaMass < nAA; curAaMass++) {
-      if (residueEvidenceMatrix[curAaMass][i] > maxEvidence) {
-        maxEvidence = residueEvidenceMatrix[curAaMass][i];
+  for (int curAaMass = 0; curAaMass < nAA; curAaMass++) {
+    const double* row = residueEvidenceMatrix[curAaMass];
+    for (int i = 0; i < maxPrecurMassBin; i++) {
+      if (row[i] > maxEvidence) {
+        maxEvidence = row[i];
       }
     }
   }
 
   // Discretize residue evidence so largest value is residueEvidenceIntScale
   double residueEvidenceIntScale = (double)granularityScale;
-  for (int i = 0; i < maxPrecurMassBin; i++) {
-    for (int curAaMass = 0; curAaMass < nAA; curAaMass++) {
-      if (residueEvidenceMatrix[curAaMass][i] > 0) {
-        double residueEvidence = residueEvidenceMatrix[curAaMass][i];
-        residueEvidenceMatrix[curAaMass][i] = round(residueEvidenceIntScale * residueEvidence / maxEvidence);
+  for (int curAaMass = 0; curAaMass < nAA; curAaMass++) {
+    double* row = residueEvidenceMatrix[curAaMass];
+    for (int i = 0; i < maxPrecurMassBin; i++) {
+      if (row[i] > 0) {
+        row[i] = round(residueEvidenceIntScale * row[i] / maxEvidence);
       }
     }
   }
@@ -0,0 +1,163 @@
+// SpectrumScheduler hands out spectrum-charge pairs to the tide-search
+// threads, one batch at a time. The pairs are sorted by neutral mass, and
+// each batch is searched against the peptides loaded for it into the shared
+// ActivePeptideQueue.
+//
+// At the start of a batch every thread owns an equal, contiguous slice of
+// it, so that consecutive pairs searched by a thread have similar masses.
+// A thread takes pairs from the front of its own slice. When its slice is
+// empty, it steals the back half of the largest remaining slice of another
+// thread. Pairs differ greatly in their number of candidate peptides, so
+// stealing keeps all threads busy until the batch is nearly done.
+//
+// Each slice has its own mutex, which is normally taken only by its owner.
+//
+// The scheduler also reports search progress and, at the end, how many pairs
+// each thread searched and which fraction of the time it was busy.
+
+#ifndef SPECTRUM_SCHEDULER_H
+#define SPECTRUM_SCHEDULER_H
+
+#include <vector>
+#include <boost/thread/mutex.hpp>
+#include "io/carp.h"
+#include "util/utils.h"
+
+using namespace std;
+
+class SpectrumScheduler {
+ public:
+  SpectrumScheduler(int num_threads, int total, int print_interval)
+    : num_threads_(num_threads), total_(total),
+    print_interval_(print_interval), reported_(0),
+    start_time_(wall_clock()), slices_(new Slice[num_threads]),
+    stats_(num_threads) {
+  }
+
+  ~SpectrumScheduler() { delete[] slices_; }
+
+  // Divide the pairs [begin, end) among the threads. Must not be called while
+  // any thread may be in Next().
+  void StartBatch(int begin, int end) {
+    for (int i = 0; i < num_threads_; ++i) {
+      slices_[i].begin = begin + (long long)(end - begin) * i / num_threads_;
+      slices_[i].end = begin + (long long)(end - begin) * (i + 1) / num_threads_;
+    }
+    if (print_interval_ > 0 && begin / print_interval_ > reported_ / print_interval_) {
+      reported_ = begin / print_interval_ * print_interval_;
+      carp(CARP_INFO, "%d spectrum-charge combinations searched, %.0f%% complete",
+           reported_, (double)reported_ / total_ * 100);
+    }
+  }
+
+  // Set *pos to the index of the next pair for thread to search. Returns
+  // false when no pairs of the current batch remain.
+  bool Next(int thread, int* pos) {
+    ThreadStats& stats = stats_[thread];
+    double now = wall_clock();
+    if (stats.searching) {
+      stats.busy += now - stats.start;
+      stats.searching = false;
+    }
+    for (;;) {
+      {
+        Slice& slice = slices_[thread];
+        boost::mutex::scoped_lock lock(slice.mutex);
+        if (slice.begin < slice.end) {
+          *pos = slice.begin++;
+          break;
+        }
+      }
+      if (!Steal(thread)) {
+        return false;
+      }
+    }
+    ++stats.searched;
+    stats.searching = true;
+    stats.start = now;
+    return true;
+  }
+
+  // Log what each thread did. Call after all threads have finished.
+  void Report() const {
+    double elapsed = wall_clock() - start_time_;
+    for (int i = 0; i < num_threads_; ++i) {
+      const ThreadStats& stats = stats_[i];
+      carp(CARP_INFO, "[Thread %d]: Searched %d spectrum-charge combinations "
+           "(%d in %d steals), busy %.0f%% of %.1f s.", i, stats.searched,
+           stats.stolen, stats.steals,
+           elapsed > 0 ? 100.0 * stats.busy / elapsed : 100.0, elapsed / 1e6);
+    }
+  }
+
+ private:
+  struct Slice {
+    Slice() : begin(0), end(0) {}
+    boost::mutex mutex;
+    int begin;
+    int end;
+  };
+
+  // Written only by the owning thread.
+  struct ThreadStats {
+    ThreadStats()
+      : searched(0), stolen(0), steals(0), busy(0), start(0), searching(false) {}
+    int searched;
+    int stolen;
+    int steals;
+    double busy;   // microseconds
+    double start;  // wall_clock() when the current pair was handed out
+    bool searching;
+  };
+
+  // Move the back half of the largest other slice to thread's (empty) slice.
+  // Returns false if all other slices are empty.
+  bool Steal(int thread) {
+    int victim = -1;
+    int most = 0;
+    for (int i = 0; i < num_threads_; ++i) {
+      if (i == thread) {
+        continue;
+      }
+      boost::mutex::scoped_lock lock(slices_[i].mutex);
+      if (slices_[i].end - slices_[i].begin > most) {
+        most = slices_[i].end - slices_[i].begin;
+        victim = i;
+      }
+    }
+    if (victim < 0) {
+      return false;
+    }
+    int begin, end;
+    {
+      Slice& slice = slices_[victim];
+      boost::mutex::scoped_lock lock(slice.mutex);
+      int remaining = slice.end - slice.begin;
+      if (remaining <= 0) {
+        return true; // taken by the owner or another thief; look again
+      }
+      end = slice.end;
+      begin = end - (remaining + 1) / 2;
+      slice.end = begin;
+    }
+    {
+      Slice& slice = slices_[thread];
+      boost::mutex::scoped_lock lock(slice.mutex);
+      slice.begin = begin;
+      slice.end = end;
+    }
+    ++stats_[thread].steals;
+    stats_[thread].stolen += end - begin;
+    return true;
+  }
+
+  int num_threads_;
+  int total_;
+  int print_interval_;
+  int reported_;
+  double start_time_;
+  Slice* slices_;
+  vector<ThreadStats> stats_;
+};
+
+#endif // SPECTRUM_SCHEDULER_H
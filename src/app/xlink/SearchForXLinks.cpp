@@ -252,6 +252,7 @@ vector<string> SearchForXLinks::getOptions() const {
     "use-z-line",
     "top-match",
     "print-search-progress",
+    "num-threads",
     "output-dir",
     "overwrite",
     "parameter-file",
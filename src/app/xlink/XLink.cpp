@@ -9,11 +9,26 @@
 
 #include <sstream>
 #include <iostream>
+#include <boost/thread/tss.hpp>
 using namespace std;
 
 namespace XLink {
 
-set<Crux::Peptide*> allocated_peptides_; ///< tracker for allocated peptides
+/**
+ * tracker for allocated peptides, one per thread, so that every thread
+ * searching spectra frees only its own decoys
+ */
+static boost::thread_specific_ptr<set<Crux::Peptide*> >* allocated_peptides_ =
+  new boost::thread_specific_ptr<set<Crux::Peptide*> >();
+
+static set<Crux::Peptide*>& getAllocatedPeptides() {
+  set<Crux::Peptide*>* peptides = allocated_peptides_->get();
+  if (peptides == NULL) {
+    peptides = new set<Crux::Peptide*>();
+    allocated_peptides_->reset(peptides);
+  }
+  return *peptides;
+}
 
 bool testInterIntraKeep(
   Crux::Peptide *pep1,
@@ -143,23 +158,36 @@ void addAllocatedPeptide(
   Crux::Peptide* peptide ///< peptide to add
   ) {
 
-  allocated_peptides_.insert(peptide);
+  getAllocatedPeptides().insert(peptide);
 }
 
 /**
  * delete all peptides that are allocated
  */
 void deleteAllocatedPeptides() {
-  carp(CARP_DEBUG, "deleting %d peptides", allocated_peptides_.size());
+  set<Crux::Peptide*>& allocated_peptides = getAllocatedPeptides();
+  carp(CARP_DEBUG, "deleting %d peptides", allocated_peptides.size());
   for (set<Crux::Peptide*>::iterator iter =
-    allocated_peptides_.begin();
-    iter != allocated_peptides_.end();
+    allocated_peptides.begin();
+    iter != allocated_peptides.end();
     ++iter) {
   
   delete *iter;
 
   }
-  allocated_peptides_.clear();
+  allocated_peptides.clear();
+}
+
+/**
+ * moves the peptides allocated by this thread into peptides, so that they
+ * outlive the thread's next call to deleteAllocatedPeptides
+ */
+void releaseAllocatedPeptides(
+  set<Crux::Peptide*>& peptides ///< set to add the peptides to -out
+  ) {
+  set<Crux::Peptide*>& allocated_peptides = getAllocatedPeptides();
+  peptides.insert(allocated_peptides.begin(), allocated_peptides.end());
+  allocated_peptides.clear();
 }
 
 
@@ -10,6 +10,7 @@
 #include "XLinkBondMap.h"
 #include "XLinkablePeptide.h"
 
+#include <set>
 #include <vector>
 #include <string>
 
@@ -94,6 +95,13 @@ void addAllocatedPeptide(
  */
 void deleteAllocatedPeptides();
 
+/**
+ * moves the peptides allocated so far into peptides, which then owns them
+ */
+void releaseAllocatedPeptides(
+  std::set<Crux::Peptide*>& peptides ///< set to add the peptides to -out
+  );
+
 } // namespace XLink
 
 #endif
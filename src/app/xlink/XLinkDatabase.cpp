@@ -1,4 +1,5 @@
 #include "XLinkDatabase.h"
+#include "XLinkPeptide.h"
 #include "util/modifications.h"
 #include "model/ModifiedPeptidesIterator.h"
 #include "util/GlobalParams.h"
@@ -32,6 +33,34 @@ std::vector<XLinkablePeptide> XLinkDatabase::target_xlinkable_peptides2_;
 std::vector<XLinkablePeptide> XLinkDatabase::target_xlinkable_peptides_flatten_;
 std::vector<XLinkablePeptide> XLinkDatabase::decoy_xlinkable_peptides_flatten_;
 
+std::vector<FLOAT_T> XLinkDatabase::target_xlinkable_masses_;
+std::vector<FLOAT_T> XLinkDatabase::decoy_xlinkable_masses_;
+
+/**
+ * Computes the cached masses, so that the search threads only read them.
+ */
+template<typename T>
+static void cacheMasses(vector<T>& peptides) {
+  for (typename vector<T>::iterator iter = peptides.begin();
+       iter != peptides.end();
+       ++iter) {
+    iter->getMass(MONO);
+    iter->getMass(AVERAGE);
+  }
+}
+
+/**
+ * Computes the cached masses and modified sequences of linkable peptides.
+ */
+static void cacheXLinkable(vector<XLinkablePeptide>& peptides) {
+  cacheMasses(peptides);
+  for (vector<XLinkablePeptide>::iterator iter = peptides.begin();
+       iter != peptides.end();
+       ++iter) {
+    iter->getModifiedSequencePtr();
+  }
+}
+
 bool XLinkDatabase::addPeptideToDatabase(Crux::Peptide* peptide) {
   
   bool added = false;
@@ -214,6 +243,20 @@ void XLinkDatabase::initialize() {
     flattenLinkablePeptides(target_xlinkable_peptides_, target_xlinkable_peptides_flatten_);
   }
 
+  // The database is shared by the search threads, so fill in everything
+  // that its peptides compute lazily now.
+  cacheMasses(target_linear_peptides_);
+  cacheMasses(target_monolink_peptides_);
+  cacheMasses(target_selfloop_peptides_);
+  cacheXLinkable(target_xlinkable_peptides_);
+  cacheXLinkable(target_xlinkable_peptides2_);
+  cacheXLinkable(target_xlinkable_peptides_flatten_);
+  indexMasses(target_xlinkable_peptides_, target_xlinkable_masses_);
+  indexMasses(decoy_xlinkable_peptides_, decoy_xlinkable_masses_);
+  if (!target_xlinkable_peptides_.empty()) {
+    XLinkPeptide::initPMin();
+  }
+
   carp(CARP_INFO, "Done initializing database");
 }
 
@@ -226,6 +269,8 @@ void XLinkDatabase::finalize() {
   target_xlinkable_peptides_.clear();
   decoy_xlinkable_peptides_.clear();
   target_xlinkable_peptides_flatten_.clear();
+  target_xlinkable_masses_.clear();
+  decoy_xlinkable_masses_.clear();
   for (size_t idx1=0;idx1<target_peptides_.size();idx1++) {
     for (size_t idx2=0;idx2<target_peptides_[idx1].size();idx2++) {
       delete target_peptides_[idx1][idx2];
@@ -665,6 +710,26 @@ vector<XLinkablePeptide>::iterator XLinkDatabase::getXLinkableFlattenBegin(
   }
 }
 
+const vector<FLOAT_T>& XLinkDatabase::getXLinkableMasses(
+  bool decoy
+  ) {
+  if (decoy) {
+    return(decoy_xlinkable_masses_);
+  } else {
+    return(target_xlinkable_masses_);
+  }
+}
+
+void XLinkDatabase::indexMasses(
+  vector<XLinkablePeptide>& peptides,
+  vector<FLOAT_T>& masses
+  ) {
+  masses.resize(peptides.size());
+  for (size_t idx = 0; idx < peptides.size(); idx++) {
+    masses[idx] = peptides[idx].getMass(MONO);
+  }
+}
+
 vector<XLinkablePeptide>::iterator XLinkDatabase::getXLinkableFlattenEnd() {
   return(target_xlinkable_peptides_flatten_.end());
 }
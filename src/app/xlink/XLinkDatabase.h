@@ -40,6 +40,9 @@ class XLinkDatabase {
 
   static std::vector<XLinkablePeptide> decoy_xlinkable_peptides_flatten_;
 
+  static std::vector<FLOAT_T> target_xlinkable_masses_; ///< mono masses of target_xlinkable_peptides_
+  static std::vector<FLOAT_T> decoy_xlinkable_masses_; ///< mono masses of decoy_xlinkable_peptides_
+
   static void findLinearPeptides(
     vector<Crux::Peptide*>& peptides, 
     vector<LinearPeptide>& linears
@@ -88,6 +91,23 @@ class XLinkDatabase {
     int idx
   );
 
+  /**
+   * \returns the monoisotopic masses of the linkable peptides, in the
+   * (ascending) order of getXLinkablePeptides()
+   */
+  static const std::vector<FLOAT_T>& getXLinkableMasses(
+    bool decoy
+  );
+
+  /**
+   * fills masses with the monoisotopic masses of the peptides, so that
+   * mass ranges can be found by binary search
+   */
+  static void indexMasses(
+    std::vector<XLinkablePeptide>& peptides,
+    std::vector<FLOAT_T>& masses
+  );
+
   static std::vector<XLinkablePeptide>::iterator getXLinkableFlattenBegin();
   static std::vector<XLinkablePeptide>::iterator getXLinkableFlattenBegin(
     bool decoy, 
@@ -7,6 +7,18 @@ vector<vector<IonSeries*> > XLinkIonSeriesCache::target_xlinkable_ion_series_;
 vector<vector<IonSeries*> > XLinkIonSeriesCache::decoy_xlinkable_ion_series_;
 vector<IonConstraint*> XLinkIonSeriesCache::xcorr_ion_constraint_;
 
+bool XLinkIonSeriesCache::enabled_ = true;
+
+void XLinkIonSeriesCache::setEnabled(
+  bool enabled
+  ) {
+  enabled_ = enabled;
+}
+
+bool XLinkIonSeriesCache::isEnabled() {
+  return enabled_;
+}
+
 
 IonSeries* XLinkIonSeriesCache::getXLinkablePeptideIonSeries(
   XLinkablePeptide& xpep,
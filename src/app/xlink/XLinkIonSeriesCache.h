@@ -15,8 +15,19 @@ class XLinkIonSeriesCache {
 
   static std::vector<IonConstraint*> xcorr_ion_constraint_;
 
+  static bool enabled_;
+
  public:
 
+  /**
+   * Allows or forbids use of the cache, when xlink-use-ion-cache is set.
+   * The cached ions are shared by every match that uses them, so the cache
+   * must only be used by a single thread.
+   */
+  static void setEnabled(bool enabled);
+
+  static bool isEnabled();
+
   static IonSeries* getXLinkablePeptideIonSeries(
     XLinkablePeptide& xpep,
     int charge
@@ -14,6 +14,7 @@
 #include "XLinkablePeptideIterator.h"
 #include "XLinkablePeptideIteratorTopN.h"
 
+#include <algorithm>
 #include <iostream>
 #include <sstream>
 
@@ -122,6 +123,16 @@ FLOAT_T XLinkPeptide::getLinkerMass() {
   return linker_mass_;
 }
 
+/**
+ * sets the minimum mass of a peptide in a crosslink product
+ */
+void XLinkPeptide::initPMin() {
+  if (!pmin_set_) {
+    pmin_ = XLinkDatabase::getXLinkableBegin()->getMass(GlobalParams::getIsotopicMass());
+    pmin_set_ = true;
+  }
+}
+
 /**
  * \returns the link position within each peptide
  */
@@ -198,10 +209,7 @@ int XLinkPeptide::addCandidates(
   carp(CARP_DEBUG, "XLinkPeptide::addCandidates - min:%g", min_mass);
   carp(CARP_DEBUG, "XLinkPeptide::addCandidates - max:%g", max_mass);
 
-  if (!pmin_set_) {
-    pmin_ = XLinkDatabase::getXLinkableBegin()->getMass(GlobalParams::getIsotopicMass());
-    pmin_set_ = true;
-  }
+  initPMin();
   FLOAT_T peptide1_min_mass = pmin_;
   FLOAT_T peptide1_max_mass = max_mass-pmin_-linker_mass_;
 
@@ -218,6 +226,7 @@ int XLinkPeptide::addCandidates(
 					  decoy);
     while(xlp_iter.hasNext()) {
       xlinkable_peptides.push_back(xlp_iter.next());
+      xlinkable_peptides.back().setXCorr(0, xlp_iter.getXCorr());
     }
     sort(xlinkable_peptides.begin(), xlinkable_peptides.end(), compareXLinkablePeptideMass);
     carp(CARP_DEBUG, "get xcorr");
@@ -226,7 +235,8 @@ int XLinkPeptide::addCandidates(
     }
     return(addCandidates(min_mass, max_mass, xlinkable_peptides, candidates));
   } else {
-    return(addCandidates(min_mass, max_mass, XLinkDatabase::getXLinkablePeptides(decoy), candidates));
+    return(addCandidates(min_mass, max_mass, XLinkDatabase::getXLinkablePeptides(decoy),
+                         XLinkDatabase::getXLinkableMasses(decoy), candidates));
   }
 }
 
@@ -268,6 +278,25 @@ int XLinkPeptide::addCandidates(
   XLinkMatchCollection& candidates ///< candidates -in/out
   ) {
 
+  vector<FLOAT_T> masses;
+  XLinkDatabase::indexMasses(linkable_peptides, masses);
+  return(addCandidates(min_mass, max_mass, linkable_peptides, masses, candidates));
+}
+
+/**
+ * adds crosslink candidates to the XLinkMatchCollection, pairing every
+ * linkable peptide with the heavier ones whose mass completes the
+ * crosslink within the mass range.  The partners are found by binary
+ * search on the masses.
+ */
+int XLinkPeptide::addCandidates(
+  FLOAT_T min_mass, ///< min mass of crosslinks
+  FLOAT_T max_mass, ///< max mass of crosslinks
+  vector<XLinkablePeptide>& linkable_peptides, ///< peptides sorted by mass
+  const vector<FLOAT_T>& masses, ///< mono masses of linkable_peptides
+  XLinkMatchCollection& candidates ///< candidates -in/out
+  ) {
+
   bool include_inter = GlobalParams::getXLinkIncludeInter();
   bool include_intra = GlobalParams::getXLinkIncludeIntra();
   bool include_inter_intra = GlobalParams::getXLinkIncludeInterIntra();
@@ -279,72 +308,55 @@ int XLinkPeptide::addCandidates(
 
   int num_candidates = 0;
   
-  bool done = false;
-
   for (size_t pep_idx1=0;pep_idx1 < xpeptide_count-1;pep_idx1++) {
-    XLinkablePeptide& pep1 = linkable_peptides.at(pep_idx1);
-    carp(CARP_DEBUG, "pep_idx1:%d %d %f %s",
-         pep_idx1,
-         xpeptide_count-1,
-         linkable_peptides[pep_idx1].getMass(MONO),
-         pep1.getModifiedSequenceString().c_str()
-         );
-    FLOAT_T pep1_mass = pep1.getMass(MONO);
+    XLinkablePeptide& pep1 = linkable_peptides[pep_idx1];
+    IF_CARP(CARP_DEBUG,
+      carp(CARP_DEBUG, "pep_idx1:%d %d %f %s",
+           pep_idx1,
+           xpeptide_count-1,
+           masses[pep_idx1],
+           pep1.getModifiedSequenceString().c_str()
+           );
+    );
+    FLOAT_T pep1_mass = masses[pep_idx1];
     FLOAT_T pep2_min_mass = min_mass - pep1_mass - linker_mass_;
     FLOAT_T pep2_max_mass = max_mass - pep1_mass - linker_mass_;
-    int start_idx2 = pep_idx1+1;
+    size_t start_idx2 = pep_idx1+1;
       
-    if (pep1_mass + linker_mass_ + linkable_peptides[start_idx2].getMass(MONO) > max_mass) {
+    if (pep1_mass + linker_mass_ + masses[start_idx2] > max_mass) {
       break;
     }
-    for (size_t pep_idx2=start_idx2;pep_idx2 < xpeptide_count;pep_idx2++) {
+    vector<FLOAT_T>::const_iterator begin2 =
+      lower_bound(masses.begin() + start_idx2, masses.end(), pep2_min_mass);
+    vector<FLOAT_T>::const_iterator end2 =
+      upper_bound(begin2, masses.end(), pep2_max_mass);
+    for (size_t pep_idx2 = begin2 - masses.begin(), end_idx2 = end2 - masses.begin();
+         pep_idx2 < end_idx2;
+         pep_idx2++) {
       
       XLinkablePeptide& pep2 = linkable_peptides[pep_idx2];
-      carp(CARP_DEBUG, "pep_idx2:%d %d %f %s",
-         pep_idx2,
-         xpeptide_count,
-         linkable_peptides[pep_idx2].getMass(MONO),
-         pep2.getModifiedSequenceString().c_str()
-         );
-      FLOAT_T current_mass = pep2.getMass(MONO);
-      if (current_mass > pep2_max_mass) {
-	      if (pep_idx2 == start_idx2) {
-	        //done = true;
-	      }
-	      break;
-      }
-      if (current_mass >= pep2_min_mass) {
-        XLINKMATCH_TYPE_T ctype = 
-          XLink::getCrossLinkCandidateType(pep1.getPeptide(), pep2.getPeptide());
+      XLINKMATCH_TYPE_T ctype = 
+        XLink::getCrossLinkCandidateType(pep1.getPeptide(), pep2.getPeptide());
             
-        if ((include_intra && ctype == XLINK_INTRA_CANDIDATE) || 
-            (include_inter_intra && ctype == XLINK_INTER_INTRA_CANDIDATE) ||
-            (include_inter && ctype == XLINK_INTER_CANDIDATE)) {
-		            carp(CARP_DEBUG, "considering %s %s", pep1.getModifiedSequenceString().c_str(), pep2.getModifiedSequenceString().c_str());
-	
-              int mods = pep1.getPeptide()->countModifiedAAs() + pep2.getPeptide()->countModifiedAAs();
-              if (mods <= max_mod_xlink) {
-		            carp(CARP_DEBUG, "considering2 %s %s", pep1.getModifiedSequenceString().c_str(), pep2.getModifiedSequenceString().c_str());
-                num_candidates += addXLinkPeptides(pep1, pep2, candidates);
-              } // if (mods <= max_mod_xlink ..     
-          }
-	      
-        }
-      }
-      if (done) {
-        break;
+      if ((include_intra && ctype == XLINK_INTRA_CANDIDATE) || 
+          (include_inter_intra && ctype == XLINK_INTER_INTRA_CANDIDATE) ||
+          (include_inter && ctype == XLINK_INTER_CANDIDATE)) {
+        IF_CARP(CARP_DEBUG,
+          carp(CARP_DEBUG, "considering %s %s", pep1.getModifiedSequenceString().c_str(), pep2.getModifiedSequenceString().c_str());
+        );
+        int mods = pep1.getPeptide()->countModifiedAAs() + pep2.getPeptide()->countModifiedAAs();
+        if (mods <= max_mod_xlink) {
+          num_candidates += addXLinkPeptides(pep1, pep2, candidates);
+        } // if (mods <= max_mod_xlink ..     
       }
-    
+    }
   }
    
   carp(CARP_DEBUG, "Done searching");
-//  delete []tested;
   return(num_candidates);
 }
   
 
-
-
 /**
  * \returns the candidate type
  */
@@ -131,6 +131,13 @@ class XLinkPeptide : public XLinkMatch {
    */
   static FLOAT_T getLinkerMass();
 
+  /**
+   * sets the minimum mass of a peptide in a crosslink product from the
+   * database, if it has not been set yet.  Call before searching on
+   * multiple threads.
+   */
+  static void initPMin();
+
   /**
    * adds crosslink candidates to the XLinkMatchCollection using
    * the passed in iterator for the 1st peptide
@@ -142,6 +149,18 @@ class XLinkPeptide : public XLinkMatch {
     XLinkMatchCollection& candidates ///< candidates in/out
     );
 
+  /**
+   * adds crosslink candidates to the XLinkMatchCollection, finding the
+   * partners of each peptide by binary search on their masses
+   */
+  static int addCandidates(
+    FLOAT_T min_mass, ///< min mass of crosslinks
+    FLOAT_T max_mass, ///< max mass of crosslinks
+    vector<XLinkablePeptide>& linkable_peptides, ///< peptides sorted by mass
+    const vector<FLOAT_T>& masses, ///< mono masses of linkable_peptides
+    XLinkMatchCollection& candidates ///< candidates in/out
+    );
+
   /**
    * adds crosslink candidates by iterating through all possible masses
    */
@@ -15,9 +15,72 @@
 
 
 #include <iostream>
+#include <vector>
+
+#include <boost/thread/tss.hpp>
 
 using namespace std;
 
+/**
+ * The scorers of the spectrum that a thread scored last, by score type and
+ * charge.  Preprocessing the observed spectrum is the expensive part of
+ * setting up a scorer, and the targets, decoys, training candidates and
+ * top-n peptides of a spectrum all score against the same arrays.  The
+ * scorers are kept for the thread's next spectrum and reset for it, so
+ * that their arrays are only allocated once.
+ */
+struct SpectrumScorers {
+  Crux::Spectrum* spectrum;
+  vector<Scorer*> xcorr; ///< indexed by charge
+  vector<Scorer*> sp; ///< indexed by charge
+
+  SpectrumScorers() : spectrum(NULL) {}
+  ~SpectrumScorers() {
+    for (size_t idx = 0; idx < xcorr.size(); idx++) {
+      delete xcorr[idx];
+    }
+    for (size_t idx = 0; idx < sp.size(); idx++) {
+      delete sp[idx];
+    }
+  }
+
+  Scorer* get(Crux::Spectrum* for_spectrum, SCORER_TYPE_T type, int charge) {
+    if (for_spectrum != spectrum) {
+      for (size_t idx = 0; idx < xcorr.size(); idx++) {
+        if (xcorr[idx] != NULL) {
+          xcorr[idx]->reset();
+        }
+      }
+      for (size_t idx = 0; idx < sp.size(); idx++) {
+        if (sp[idx] != NULL) {
+          sp[idx]->reset();
+        }
+      }
+      spectrum = for_spectrum;
+    }
+    vector<Scorer*>& scorers = (type == SP) ? sp : xcorr;
+    if (scorers.size() <= (size_t)charge) {
+      scorers.resize(charge + 1, NULL);
+    }
+    if (scorers[charge] == NULL) {
+      scorers[charge] = new Scorer(type);
+    }
+    return scorers[charge];
+  }
+};
+
+static boost::thread_specific_ptr<SpectrumScorers>* spectrum_scorers_ =
+  new boost::thread_specific_ptr<SpectrumScorers>();
+
+static SpectrumScorers& getSpectrumScorers() {
+  SpectrumScorers* scorers = spectrum_scorers_->get();
+  if (scorers == NULL) {
+    scorers = new SpectrumScorers();
+    spectrum_scorers_->reset(scorers);
+  }
+  return *scorers;
+}
+
 /**
  * initializes the object with the spectrum
  * charge and appropriate objects
@@ -28,14 +91,17 @@ void XLinkScorer::init(
   bool compute_sp ///< are we scoring sp?
   ) {
 
-  scorer_xcorr_ = new Scorer(XCORR);
-  scorer_sp_ = new Scorer(SP);
   spectrum_ = spectrum;
   charge_ = charge;
   compute_sp_ = compute_sp;
 
   if ((spectrum_ != NULL) && (charge_ > 0)) {
 
+    SpectrumScorers& scorers = getSpectrumScorers();
+    scorer_xcorr_ = scorers.get(spectrum_, XCORR, charge_);
+    scorer_sp_ = compute_sp_ ? scorers.get(spectrum_, SP, charge_) : NULL;
+    owns_scorers_ = false;
+
     ion_constraint_xcorr_ = 
       IonConstraint::newIonConstraintSmart(XCORR, charge_);
 
@@ -49,6 +115,9 @@ void XLinkScorer::init(
       new IonSeries(ion_constraint_sp_, charge_);
   } else {
 
+    scorer_xcorr_ = new Scorer(XCORR);
+    scorer_sp_ = new Scorer(SP);
+    owns_scorers_ = true;
     ion_constraint_xcorr_ = NULL;
     ion_constraint_sp_ = NULL;
     ion_series_xcorr_ = NULL;
@@ -103,11 +172,21 @@ XLinkScorer::~XLinkScorer() {
   delete ion_series_sp_;
   delete ion_constraint_xcorr_;
   delete ion_constraint_sp_;
-  delete scorer_xcorr_;
-  delete scorer_sp_;
+  if (owns_scorers_) {
+    delete scorer_xcorr_;
+    delete scorer_sp_;
+  }
   
 }
 
+/**
+ * forgets the last spectrum scored by this thread; its scorers are reset
+ * for the next one
+ */
+void XLinkScorer::clearCache() {
+  getSpectrumScorers().spectrum = NULL;
+}
+
 /**
  * \returns the xcorr score for the candidate and sets the sp if requested
  */
@@ -22,6 +22,7 @@ class XLinkScorer {
   IonSeries* ion_series_xcorr_; ///< current ion series xcorr
   IonSeries* ion_series_sp_; ///< current ion series sp
   bool compute_sp_; ///< calculate sp score
+  bool owns_scorers_; ///< false if the scorers are shared for the spectrum
  
   /**
    * initializes the object with the spectrum
@@ -73,6 +74,15 @@ class XLinkScorer {
   );
   
   IonConstraint* getIonConstraintXCorr();
+
+  /**
+   * Scorers preprocess the observed spectrum once per charge, and are
+   * shared by every XLinkScorer created for that spectrum on the same
+   * thread until one is created for another spectrum, when they are reset
+   * and reused.  Call when done with a spectrum, before it is freed, so
+   * that a spectrum allocated at the same address is not taken for it.
+   */
+  static void clearCache();
   
 
 };
@@ -16,12 +16,21 @@
 #include "model/IonSeries.h"
 
 #include <iostream>
+#include <boost/thread/tss.hpp>
 
 #include "XLink.h"
 
 using namespace std;
 using namespace Crux;
 
+/**
+ * Ion series into which predictIons predicts the unlinked ions, one per
+ * thread, reused for every candidate. Never destroyed, like the ion pool
+ * its ions come from.
+ */
+static boost::thread_specific_ptr<IonSeries>* scratch_ion_series_ =
+  new boost::thread_specific_ptr<IonSeries>();
+
 /**
  * Initialize object
  */
@@ -692,12 +701,19 @@ void XLinkablePeptide::predictIons(
   const char* seq = NULL;
   IonSeries* cached_ions = NULL;
   bool cached = false;
-  if (GlobalParams::getXLinkUseIonCache()) {
+  if (GlobalParams::getXLinkUseIonCache() && XLinkIonSeriesCache::isEnabled()) {
     cached_ions = XLinkIonSeriesCache::getXLinkablePeptideIonSeries(*this, charge);
-    bool cached = cached_ions != NULL;
+    cached = cached_ions != NULL;
   }
   if (!cached) {
-    cached_ions = new IonSeries(ion_series->getIonConstraint(), charge);
+    cached_ions = scratch_ion_series_->get();
+    if (cached_ions == NULL) {
+      cached_ions = new IonSeries(ion_series->getIonConstraint(), charge);
+      scratch_ion_series_->reset(cached_ions);
+    } else {
+      cached_ions->setIonConstraint(ion_series->getIonConstraint());
+      cached_ions->setCharge(charge);
+    }
     seq = getSequence();
     cached_ions->update(seq, getModifiedSequencePtr());
     cached_ions->predictIons();
@@ -712,6 +728,7 @@ void XLinkablePeptide::predictIons(
   if (clear) {
     ion_series->clear();
   }
+  const string& ion_sequence = cached_ions->getPeptide();
   //modify the necessary ions and add to the ion_series
   IonIterator eiter = cached_ions->end();
   for (IonIterator ion_iter = cached_ions->begin(); 
@@ -723,11 +740,7 @@ void XLinkablePeptide::predictIons(
     if (ion->isForwardType()) { 
       if (cleavage_idx > (unsigned int)link_pos) {
         ion = Ion::newIon();
-	if (seq) {
-	  Ion::copy(src_ion, ion, seq);
-	} else {
-          Ion::copy(src_ion, ion, sequence_);
-	}
+        Ion::copy(src_ion, ion, ion_sequence);
         FLOAT_T mass = ion->getMassFromMassZ() + mod_mass;
         ion->setMassZFromMass(mass); 
         if (isnan(ion->getMassZ())) { 
@@ -737,11 +750,7 @@ void XLinkablePeptide::predictIons(
     } else { 
       if (cleavage_idx >= (seq_len-(unsigned int)link_pos)) { 
         ion = Ion::newIon();
-	if (seq) {
-	  Ion::copy(src_ion, ion, seq);
-	} else {
-	  Ion::copy(src_ion, ion, sequence_);
-	}
+        Ion::copy(src_ion, ion, ion_sequence);
         FLOAT_T mass = ion->getMassFromMassZ() + mod_mass;
         ion->setMassZFromMass(mass); 
         if (isnan(ion->getMassZ())) { 
@@ -752,9 +761,6 @@ void XLinkablePeptide::predictIons(
     ion_series->addIon(ion);
   }
   
-  if (!cached) {
-    delete cached_ions;
-  }
   if (seq) {
     std::free((char*)seq);
   }
@@ -17,6 +17,13 @@
 
 using namespace std;
 
+static bool compareScoredXLinkablePtr(
+  const pair<FLOAT_T, XLinkablePeptide*>& xpep1,
+  const pair<FLOAT_T, XLinkablePeptide*>& xpep2
+  ) {
+  return xpep1.first > xpep2.first;
+}
+
 /**
  * constructor that sets up the iterator
  */
@@ -85,19 +92,17 @@ void XLinkablePeptideIteratorTopN::scorePeptides(
     XLinkablePeptide& pep1 = *biter;
     FLOAT_T delta_mass = precursor_mass - pep1.getMass(MONO);// - XLinkPeptide::getLinkerMass();
     FLOAT_T xcorr = scorer.scoreXLinkablePeptide(pep1, 0, delta_mass);
-    pep1.setXCorr(0, xcorr);
-    //pep1.getXCorr();
-    scored_xlp_.push_back(&pep1);
+    scored_xlp_.push_back(make_pair(xcorr, &pep1));
     biter++;
   }
   if (scored_xlp_.size() > 0) {
-    sort(scored_xlp_.begin(), scored_xlp_.end(), compareXLinkableXCorrPtr);
+    sort(scored_xlp_.begin(), scored_xlp_.end(), compareScoredXLinkablePtr);
   }
  
   IF_CARP(CARP_DETAILED_DEBUG,
     for (size_t idx = 0;idx < min((size_t)top_n_,scored_xlp_.size());idx++) {
-      string seq = scored_xlp_[idx]->getModifiedSequenceString();
-      carp(CARP_INFO,"%d %g %s", idx, scored_xlp_[idx]->getXCorr(), seq.c_str());
+      string seq = scored_xlp_[idx].second->getModifiedSequenceString();
+      carp(CARP_INFO,"%d %g %s", idx, scored_xlp_[idx].first, seq.c_str());
     }
   );
 }
@@ -141,7 +146,7 @@ XLinkablePeptide& XLinkablePeptideIteratorTopN::next() {
     carp(CARP_FATAL, "next called on empty iterator!");
   }
 
-  XLinkablePeptide& ans = *scored_xlp_[current_count_-1];
+  XLinkablePeptide& ans = *scored_xlp_[current_count_-1].second;
   //carp(CARP_INFO, "next peptide:%s %g", ans.getSequence(), ans.getXCorr());
   queueNextPeptide();
   //carp(CARP_INFO, "XLinkablePeptideIteratorTopN: returning reference");
@@ -153,12 +158,17 @@ XLinkablePeptide* XLinkablePeptideIteratorTopN::nextPtr() {
     carp(CARP_FATAL, "next called on empty iterator!");
   }
   
-  XLinkablePeptide* ans = scored_xlp_[current_count_-1];
+  XLinkablePeptide* ans = scored_xlp_[current_count_-1].second;
   queueNextPeptide();
   return ans;
   
 }
 
+FLOAT_T XLinkablePeptideIteratorTopN::getXCorr() {
+  int idx = has_next_ ? current_count_ - 2 : current_count_ - 1;
+  return scored_xlp_[idx].first;
+}
+
 
 
 /*                                                                                                                                                                                                                          
@@ -21,7 +21,12 @@ class XLinkablePeptideIteratorTopN: public XLinkablePeptideIterator {
  protected:
 
   //std::priority_queue<XLinkablePeptide, std::vector<XLinkablePeptide>, CompareXCorr> scored_xlp_;  
-  std::vector<XLinkablePeptide*> scored_xlp_; ///< sorted by highest XCorr score.
+  /**
+   * scored peptides, sorted by highest XCorr score.  The scores are kept
+   * here rather than in the database peptides, which are shared between
+   * search threads.
+   */
+  std::vector<std::pair<FLOAT_T, XLinkablePeptide*> > scored_xlp_;
   int current_count_;
   int top_n_; ///<set by kojak-top-n
   bool has_next_; ///< is there a next candidate
@@ -70,6 +75,11 @@ class XLinkablePeptideIteratorTopN: public XLinkablePeptideIterator {
   
   XLinkablePeptide* nextPtr();
 
+  /**
+   *\returns the XCorr score of the peptide last returned by next()
+   */
+  FLOAT_T getXCorr();
+
 };
 
 
@@ -136,6 +136,7 @@ int XLinkScoreSpectrum::main(int argc, char** argv) {
     carp(CARP_ERROR, "Unknown score method (%s).", scoremethod.c_str());
   }
   // free heap
+  XLinkScorer::clearCache();
   delete collection;
   delete spectrum;
 
@@ -280,12 +281,9 @@ FLOAT_T* XLinkScoreSpectrum::get_observed_raw(Spectrum* spectrum, int charge) {
   // DEBUG
   // carp(CARP_INFO, "max_peak_mz: %.2f, region size: %d",get_spectrum_max_peak_mz(spectrum), region_selector);
   
-  for (PeakIterator peak_iterator = spectrum->begin();
-    peak_iterator != spectrum->end();
-    ++peak_iterator) {
+  for (int peak_idx = 0; peak_idx < spectrum->getNumPeaks(); ++peak_idx) {
 
-    Peak *peak = *peak_iterator;
-    peak_location = peak->getLocation();
+    peak_location = spectrum->getPeakMz(peak_idx);
     
     // skip all peaks larger than experimental mass
     if(peak_location > experimental_mass_cut_off) {
@@ -302,7 +300,7 @@ FLOAT_T* XLinkScoreSpectrum::get_observed_raw(Spectrum* spectrum, int charge) {
 
     // get intensity
     // sqrt the original intensity
-    intensity = peak->getIntensity();
+    intensity = spectrum->getPeakIntensity(peak_idx);
 
     // set intensity in array with correct mz, only if max peak in the bin
     if(observed[mz] < intensity) {
@@ -313,13 +313,10 @@ FLOAT_T XHHC_Scorer::getIonCurrentExplained(
 
   map<int, bool> by_found;
 
-  for (PeakIterator peak_iter = spectrum->begin();
-    peak_iter != spectrum->end();
-    ++peak_iter) {
+  for (int peak_idx = 0; peak_idx < spectrum->getNumPeaks(); ++peak_idx) {
 
-    Peak * peak = *peak_iter;
-    FLOAT_T spec_mz = peak->getLocation();
-    FLOAT_T spec_intensity = peak->getIntensity();
+    FLOAT_T spec_mz = spectrum->getPeakMz(peak_idx);
+    FLOAT_T spec_intensity = spectrum->getPeakIntensity(peak_idx);
     //for each peak in the spectrum, find the array index for the theoretical.
     int intensity_array_idx = (int)(spec_mz / bin_width + 0.5);
 
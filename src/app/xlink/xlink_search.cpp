@@ -9,6 +9,7 @@
 #include "XLinkBondMap.h"
 #include "XLinkPeptide.h"
 #include "XLinkIonSeriesCache.h"
+#include "XLinkScorer.h"
 #include "xlink_compute_qvalues.h"
 
 #include "Weibull.h"
@@ -29,9 +30,9 @@
 #include <fstream>
 #include <iomanip>
 #include <iostream>
+#include <set>
 
-#include <ctime>
-
+#include <boost/thread.hpp>
 
 
 using namespace std;
@@ -99,6 +100,230 @@ void writeTrainingCandidates(XLinkMatchCollection* training_candidates, int scan
 }
 
 
+/**
+ * One spectrum-charge combination, searched by a worker thread and
+ * written by the main thread.
+ */
+struct XLinkSearchItem {
+  Crux::Spectrum* spectrum;
+  SpectrumZState zstate;
+  int num_skipped; ///< spectra skipped by the iterator so far, for progress
+  XLinkMatchCollection* target_candidates;
+  XLinkMatchCollection* decoy_candidates;
+  set<Crux::Peptide*> peptides; ///< decoy peptides allocated for the item
+  bool done;
+};
+
+/**
+ * The spectrum-charge combinations of one ms2 file and the state shared by
+ * the threads searching them.  The decoys are shuffled in the order of the
+ * items, so that the random numbers, and hence the results, do not depend
+ * on the number of threads.
+ */
+struct XLinkSearchQueue {
+  vector<XLinkSearchItem> items;
+  vector<size_t> group_starts; ///< first item of each spectrum, and the end
+  size_t next_group; ///< next group to be claimed by a thread
+  size_t shuffle_turn; ///< item whose decoys are to be shuffled next
+  size_t written; ///< items written so far
+  size_t max_ahead; ///< limit on items searched ahead of the writer
+  boost::mutex mutex;
+  boost::condition_variable changed;
+
+  int top_match;
+  int min_weibull_points;
+  bool compute_pvalues;
+  bool concat;
+  FLOAT_T min_pvalue;
+
+  double candidate_time; ///< microseconds spent generating candidates
+  size_t num_candidates; ///< target candidates generated
+};
+
+/**
+ * Finds and scores the candidates of one spectrum-charge combination.
+ */
+static void searchXLinkItem(XLinkSearchQueue& queue, size_t item_idx, Weibull& weibull) {
+  XLinkSearchItem& item = queue.items[item_idx];
+  Crux::Spectrum* spectrum = item.spectrum;
+  SpectrumZState& zstate = item.zstate;
+  int scan_num = spectrum->getFirstScan();
+
+  double start_time = wall_clock();
+  XLinkMatchCollection* target_candidates =
+    new XLinkMatchCollection(spectrum, zstate, false, false);
+  XLinkMatchCollection* decoy_candidates = NULL;
+  XLinkMatchCollection* target_train_candidates = NULL;
+  XLinkMatchCollection* train_candidates = NULL;
+
+  bool skip = false;
+  if (target_candidates->getMatchTotal() < 0) {
+    carp(CARP_ERROR, "Scan %d has %d candidates.", scan_num,
+         target_candidates->getMatchTotal());
+  } else if (target_candidates->getMatchTotal() == 0) {
+    carp(CARP_DETAILED_INFO, "Skipping scan %d charge %d mass %lg",
+         scan_num, zstate.getCharge(), zstate.getNeutralMass());
+    skip = true;
+  }
+
+  if (!skip) {
+    carp(CARP_DETAILED_INFO, "Scan=%d charge=%d mass=%lg candidates=%d",
+         scan_num, zstate.getCharge(), zstate.getNeutralMass(),
+         target_candidates->getMatchTotal());
+    decoy_candidates = new XLinkMatchCollection();
+    if (queue.compute_pvalues) {
+      target_train_candidates =
+        new XLinkMatchCollection(spectrum, zstate, false, true);
+      train_candidates =
+        new XLinkMatchCollection(spectrum, zstate, true, true);
+      for (size_t idx=0;idx < target_train_candidates->getMatchTotal();idx++) {
+        train_candidates->add(target_train_candidates->at(idx), true);
+      }
+    }
+  }
+  double candidate_time = wall_clock() - start_time;
+
+  // Shuffle in the order of the items; the scoring below runs in parallel.
+  {
+    boost::mutex::scoped_lock lock(queue.mutex);
+    queue.candidate_time += candidate_time;
+    queue.num_candidates += max(0, target_candidates->getMatchTotal());
+    while (queue.shuffle_turn != item_idx) {
+      queue.changed.wait(lock);
+    }
+  }
+  if (!skip) {
+    carp(CARP_DEBUG, "Getting decoy candidates.");
+    target_candidates->shuffle(*decoy_candidates);
+    if (queue.compute_pvalues) {
+      while(train_candidates->getMatchTotal() < queue.min_weibull_points) {
+        target_train_candidates->shuffle(*train_candidates);
+      }
+    }
+  }
+  {
+    boost::mutex::scoped_lock lock(queue.mutex);
+    queue.shuffle_turn++;
+  }
+  queue.changed.notify_all();
+
+  if (skip) {
+    delete target_candidates;
+    XLink::releaseAllocatedPeptides(item.peptides);
+    return;
+  }
+
+  // Score targets.
+  target_candidates->scoreSpectrum(spectrum);
+
+  // Score decoys.
+  carp(CARP_DEBUG, "Scoring decoys.");
+  decoy_candidates->scoreSpectrum(spectrum);
+
+  if (queue.compute_pvalues) {
+    weibull.reset();
+    train_candidates->scoreSpectrum(spectrum);
+    for (int idx = 0;idx < train_candidates->getMatchTotal();idx++) {
+      const string& sequence = (*train_candidates)[idx]->getSequenceStringConst();
+      FLOAT_T score = (*train_candidates)[idx]->getScore(XCORR);
+      weibull.addPoint(sequence, score);
+    }
+    bool write_weibull_points = !weibull.fit();
+
+    target_candidates->sort(XCORR);
+
+    // Calculate pvalues.
+    int nprint = min(queue.top_match,target_candidates->getMatchTotal());
+    carp(CARP_DEBUG, "Calculating %d target p-values.", nprint);
+    for (int idx=0;idx < nprint;idx++) {
+      FLOAT_T score = (*target_candidates)[idx]->getScore(XCORR);
+      (*target_candidates)[idx]->setPValue(weibull.getPValue(score));
+    }
+
+    nprint = min(queue.top_match, (int)decoy_candidates->getMatchTotal());
+    carp(CARP_DEBUG, "Calculating %d decoy p-values.", nprint);
+    decoy_candidates->sort(XCORR);
+    for (int idx=0;idx < nprint;idx++) {
+      FLOAT_T score = (*decoy_candidates)[idx]->getScore(XCORR);
+      (*decoy_candidates)[idx]->setPValue(weibull.getPValue(score));
+      FLOAT_T wpvalue = weibull.getWeibullPValue(score);
+      FLOAT_T bpvalue = bonferroni_correction(wpvalue, decoy_candidates->getMatchTotal()) * 2.0;
+      if ((wpvalue == 0) || (wpvalue != wpvalue) || (bpvalue  < queue.min_pvalue)) {
+        //If we have a bad fit, 0 or too low pvalue, print out the points.
+        write_weibull_points = true;
+      }
+    }
+
+    if (write_weibull_points || Params::GetBool("write-weibull-points")) {
+      writeTrainingCandidates(train_candidates, scan_num, weibull);
+    }
+    carp(CARP_DEBUG, "Delete train candidates.");
+    delete train_candidates;
+    carp(CARP_DEBUG, "Delete target train candidates.");
+    delete target_train_candidates;
+  }
+
+  if (queue.concat) {
+    for (size_t idx=0;idx < decoy_candidates->getMatchTotal();idx++) {
+      target_candidates->add(decoy_candidates->at(idx), true);
+    }
+  } else {
+    if (decoy_candidates->getScoredType(SP) == true) {
+      decoy_candidates->populateMatchRank(SP);
+    }
+    decoy_candidates->populateMatchRank(XCORR);
+    decoy_candidates->sort(XCORR);
+  }
+
+  carp(CARP_DEBUG, "Ranking.");
+  if (target_candidates->getScoredType(SP) == true) {
+    target_candidates->populateMatchRank(SP);
+  }
+  target_candidates->populateMatchRank(XCORR);
+  target_candidates->sort(XCORR);
+
+  item.target_candidates = target_candidates;
+  item.decoy_candidates = decoy_candidates;
+  XLink::releaseAllocatedPeptides(item.peptides);
+}
+
+/**
+ * Searches the spectra of the queue, one spectrum (with all its charges)
+ * at a time, until none is left.
+ */
+static void searchXLinkSpectra(XLinkSearchQueue* queue) {
+  Weibull weibull;
+  while (true) {
+    size_t begin, end;
+    {
+      boost::mutex::scoped_lock lock(queue->mutex);
+      while (queue->next_group + 1 < queue->group_starts.size() &&
+             queue->group_starts[queue->next_group] >= queue->written + queue->max_ahead) {
+        queue->changed.wait(lock);
+      }
+      if (queue->next_group + 1 >= queue->group_starts.size()) {
+        return;
+      }
+      begin = queue->group_starts[queue->next_group];
+      end = queue->group_starts[queue->next_group + 1];
+      queue->next_group++;
+    }
+    for (size_t idx = begin; idx < end; idx++) {
+      searchXLinkItem(*queue, idx, weibull);
+    }
+    XLinkScorer::clearCache();
+    // The writer reads the spectrum, so hand it over only once all of its
+    // charges are searched.
+    {
+      boost::mutex::scoped_lock lock(queue->mutex);
+      for (size_t idx = begin; idx < end; idx++) {
+        queue->items[idx].done = true;
+      }
+    }
+    queue->changed.notify_all();
+  }
+}
+
 /**
  * main method for SearchForXLinks that implements the refactored code
  */
@@ -117,6 +342,17 @@ int SearchForXLinks::xlinkSearchMain() {
   XLinkPeptide::setLinkerMass(Params::GetDouble("link mass"));
   int min_weibull_points = Params::GetInt("min-weibull-points");
   bool compute_pvalues = Params::GetBool("compute-p-values");
+  int num_threads = Params::GetInt("num-threads");
+  if (num_threads < 1) {
+    num_threads = max(1u, boost::thread::hardware_concurrency());
+  }
+  // The cached ions are shared between matches, so the ion cache is only
+  // used by a single thread.
+  if (Params::GetBool("xlink-use-ion-cache") && num_threads > 1) {
+    carp(CARP_WARNING, "xlink-use-ion-cache is ignored when searching with "
+         "more than one thread.");
+  }
+  XLinkIonSeriesCache::setEnabled(num_threads == 1);
 
   /* Prepare input fasta  */
   carp(CARP_INFO, "Preparing database.");
@@ -133,8 +369,6 @@ int SearchForXLinks::xlinkSearchMain() {
     XLinkDatabase::print();
   }
 
-  SpectrumZState zstate;
-
   /* Prepare output files */
   carp(CARP_DETAILED_INFO, "Preparing output files.");
   OutputFiles output_files(this);
@@ -145,7 +379,6 @@ int SearchForXLinks::xlinkSearchMain() {
     string ms2_file = *ms2_file_iter;
     
     carp(CARP_INFO, "Loading spectra %s.", ms2_file.c_str());
-    Crux::Spectrum* spectrum = NULL;
     Crux::SpectrumCollection* spectra =
       SpectrumCollectionFactory::create(ms2_file);
     spectra->parse();
@@ -153,189 +386,109 @@ int SearchForXLinks::xlinkSearchMain() {
     FilteredSpectrumChargeIterator* spectrum_iterator =
       new FilteredSpectrumChargeIterator(spectra);
 
-
-    // main loop over spectra in ms2 file
-    int scan_num = 0;
-    int skipped_no_candidates = 0;
-    int search_count = 0;
     FLOAT_T num_spectra = (FLOAT_T)spectra->getNumSpectra();
-    FLOAT_T min_pvalue = 1.0 / num_spectra;
-    //class for estimating pvalues.
-    Weibull weibull;
-  
+
+    // Collect the spectrum-charge combinations; the charges of a spectrum
+    // are searched by the same thread.
+    XLinkSearchQueue queue;
+    while (spectrum_iterator->hasNext()) {
+      XLinkSearchItem item;
+      item.spectrum = spectrum_iterator->next(item.zstate);
+      item.num_skipped = spectrum_iterator->numSkipped();
+      item.target_candidates = NULL;
+      item.decoy_candidates = NULL;
+      item.done = false;
+      if (queue.items.empty() || queue.items.back().spectrum != item.spectrum) {
+        queue.group_starts.push_back(queue.items.size());
+      }
+      queue.items.push_back(item);
+    }
+    queue.group_starts.push_back(queue.items.size());
+    queue.next_group = 0;
+    queue.shuffle_turn = 0;
+    queue.written = 0;
+    queue.max_ahead = 16 * num_threads;
+    queue.top_match = top_match;
+    queue.min_weibull_points = min_weibull_points;
+    queue.compute_pvalues = compute_pvalues;
+    queue.concat = Params::GetBool("concat");
+    queue.min_pvalue = 1.0 / num_spectra;
+    queue.candidate_time = 0;
+    queue.num_candidates = 0;
+
     // for every observed spectrum 
     carp(CARP_INFO, "Beginning search.");
     int print_interval = Params::GetInt("print-search-progress");
+    int skipped_no_candidates = 0;
 
-    while (spectrum_iterator->hasNext()) {
+    boost::thread_group threads;
+    for (int t = 0; t < num_threads; t++) {
+      threads.create_thread(boost::bind(searchXLinkSpectra, &queue));
+    }
+
+    // Write the results in the order of the spectra.
+    for (size_t search_count = 0; search_count < queue.items.size(); search_count++) {
+      XLinkSearchItem& item = queue.items[search_count];
+      {
+        boost::mutex::scoped_lock lock(queue.mutex);
+        while (!item.done) {
+          queue.changed.wait(lock);
+        }
+      }
 
-      spectrum = spectrum_iterator->next(zstate);
-      scan_num = spectrum->getFirstScan();
-      
       if (print_interval > 0 && search_count > 0 && search_count % print_interval == 0) {
 	carp(CARP_INFO, 
 	     "%d spectrum-charge combinations searched, %.0f%% complete",
-	     search_count + spectrum_iterator->numSkipped(),
-	     (search_count + spectrum_iterator->numSkipped()) / num_spectra * 100);
-      }
-      search_count++;
-
-      FLOAT_T precursor_mz = spectrum->getPrecursorMz();
-
-      XLinkMatchCollection* target_candidates =
-	new XLinkMatchCollection(
-				 spectrum,
-				 zstate,
-				 false,
-				 false
-				 );
-
-      if (target_candidates->getMatchTotal() < 0) {
-	carp(CARP_ERROR, "Scan %d has %d candidates.", scan_num, 
-	     target_candidates->getMatchTotal());
-      } else if (target_candidates->getMatchTotal() == 0) {
-	skipped_no_candidates++;
-	carp(CARP_DETAILED_INFO, "Skipping scan %d charge %d mass %lg", 
-	     scan_num, 
-	     zstate.getCharge(),
-	     zstate.getNeutralMass()
-	     );
-	delete target_candidates;
-	//XLink::deleteAllocatedPeptides();
-	continue;
+	     search_count + item.num_skipped,
+	     (search_count + item.num_skipped) / num_spectra * 100);
       }
 
-      carp(CARP_DETAILED_INFO, "Scan=%d charge=%d mass=%lg candidates=%d", 
-	   scan_num, 
-	   zstate.getCharge(), 
-	   zstate.getNeutralMass(), 
-	   target_candidates->getMatchTotal());   
-
-      // Score targets.
-      target_candidates->scoreSpectrum(spectrum);
-
-      // Score decoys.
-      carp(CARP_DEBUG, "Getting decoy candidates.");
-      XLinkMatchCollection* decoy_candidates = new XLinkMatchCollection();
-      target_candidates->shuffle(*decoy_candidates);
-      carp(CARP_DEBUG, "Scoring decoys.");
-      decoy_candidates->scoreSpectrum(spectrum);
-      
-      if (compute_pvalues) {
-	weibull.reset();
-	XLinkMatchCollection *target_train_candidates =
-	  new XLinkMatchCollection(
-				   spectrum,
-				   zstate,
-				   false,
-				   true);
-	XLinkMatchCollection *train_candidates =
-	  new XLinkMatchCollection(
-				   spectrum,
-				   zstate,
-				   true,
-				   true
-				   );
-      
-	for (size_t idx=0;idx < target_train_candidates->getMatchTotal();idx++) {
-	  train_candidates->add(target_train_candidates->at(idx), true);
-	}
-	while(train_candidates->getMatchTotal() < min_weibull_points) {
-	  target_train_candidates->shuffle(*train_candidates);
-	}
-	train_candidates->scoreSpectrum(spectrum);
-	for (int idx = 0;idx < train_candidates->getMatchTotal();idx++) {
-	  const string& sequence = (*train_candidates)[idx]->getSequenceStringConst();
-	  FLOAT_T score = (*train_candidates)[idx]->getScore(XCORR);
-	  weibull.addPoint(sequence, score);
-	}
-	bool write_weibull_points = !weibull.fit();
-	
-	target_candidates->sort(XCORR);
-	
-	
-	// Calculate pvalues.
-	int nprint = min(top_match,target_candidates->getMatchTotal());
-	carp(CARP_DEBUG, "Calculating %d target p-values.", nprint);
-	for (int idx=0;idx < nprint;idx++) {
-	  FLOAT_T score = (*target_candidates)[idx]->getScore(XCORR);
-	  (*target_candidates)[idx]->setPValue(weibull.getPValue(score));
-	}
-	
-	nprint = min(top_match, (int)decoy_candidates->getMatchTotal());
-	carp(CARP_DEBUG, "Calculating %d decoy p-values.", nprint);
-	decoy_candidates->sort(XCORR);
-	for (int idx=0;idx < nprint;idx++) {
-	  FLOAT_T score = (*decoy_candidates)[idx]->getScore(XCORR);
-	  (*decoy_candidates)[idx]->setPValue(weibull.getPValue(score));
-	  FLOAT_T wpvalue = weibull.getWeibullPValue(score);
-	  FLOAT_T bpvalue = bonferroni_correction(wpvalue, decoy_candidates->getMatchTotal()) * 2.0;
-	  if ((wpvalue == 0) || (wpvalue != wpvalue) || (bpvalue  < min_pvalue)) {
-	    //If we have a bad fit, 0 or too low pvalue, print out the points.
-	    write_weibull_points = true;
-	  }
-        
-	}
-      
-      
-	if (write_weibull_points || Params::GetBool("write-weibull-points")) {
-	  writeTrainingCandidates(train_candidates, scan_num, weibull);
-	}
-	carp(CARP_DEBUG, "Delete train candidates.");
-	delete train_candidates;
-	carp(CARP_DEBUG, "Delete target train candidates.");
-	delete target_train_candidates;
-	
-      } // if (compute_p_values)
-      
-      //print out
-      target_candidates->setFilePath(ms2_file);
-      decoy_candidates->setFilePath(ms2_file);
-      vector<MatchCollection*> decoy_vec;
-    
-      if (Params::GetBool("concat")) {
-	for (size_t idx=0;idx < decoy_candidates->getMatchTotal();idx++) {
-	  target_candidates->add(decoy_candidates->at(idx), true);
-	}
+      XLinkMatchCollection* target_candidates = item.target_candidates;
+      XLinkMatchCollection* decoy_candidates = item.decoy_candidates;
+      if (target_candidates == NULL) {
+        skipped_no_candidates++;
       } else {
-	
-	decoy_vec.push_back(decoy_candidates);
-
-	if (decoy_candidates->getScoredType(SP) == true) {
-	  decoy_candidates->populateMatchRank(SP);
-	}
-	decoy_candidates->populateMatchRank(XCORR);
-	decoy_candidates->sort(XCORR);
+        //print out
+        target_candidates->setFilePath(ms2_file);
+        decoy_candidates->setFilePath(ms2_file);
+        vector<MatchCollection*> decoy_vec;
+        if (!queue.concat) {
+          decoy_vec.push_back(decoy_candidates);
+        }
+
+        carp(CARP_DEBUG, "Writing results.");
+        output_files.writeMatches(
+				  (MatchCollection*)target_candidates, 
+				  decoy_vec,
+				  XCORR,
+				  item.spectrum);
+
+        /* Clean up */
+        carp(CARP_DEBUG, "Deleting decoy candidates.");
+        delete decoy_candidates;
+        carp(CARP_DEBUG, "Deleting target candidates.");
+        delete target_candidates;
       }
-      
-      carp(CARP_DEBUG, "Ranking.");
-      
-      if (target_candidates->getScoredType(SP) == true) {
-	target_candidates->populateMatchRank(SP);
+      for (set<Crux::Peptide*>::iterator iter = item.peptides.begin();
+           iter != item.peptides.end();
+           ++iter) {
+        delete *iter;
       }
-      target_candidates->populateMatchRank(XCORR);
-      target_candidates->sort(XCORR);
-      
-    
-      carp(CARP_DEBUG, "Writing results.");
-      output_files.writeMatches(
-				(MatchCollection*)target_candidates, 
-				decoy_vec,
-				XCORR,
-				spectrum);
-
-      /* Clean up */
-      carp(CARP_DEBUG, "Deleting decoy candidates.");
-      delete decoy_candidates;
-      carp(CARP_DEBUG, "Deleting target candidates.");
-      delete target_candidates;
-      XLink::deleteAllocatedPeptides();
-    
-      //free_spectrum(spectrum);
-      
-      carp(CARP_DEBUG, "Done with spectrum %d.", scan_num);
+      item.peptides.clear();
+
+      carp(CARP_DEBUG, "Done with spectrum %d.", item.spectrum->getFirstScan());
       carp(CARP_DEBUG, "=====================================");
+
+      {
+        boost::mutex::scoped_lock lock(queue.mutex);
+        queue.written++;
+      }
+      queue.changed.notify_all();
     } // get next spectrum
+    threads.join_all();
+
+    carp(CARP_INFO, "Generated %lu target candidates in %.3g s (summed over threads).",
+         (unsigned long)queue.num_candidates, queue.candidate_time / 1e6);
 
     carp(CARP_INFO, "Skipped %d (%g%%) spectra with 0 candidates.", 
 	 skipped_no_candidates, skipped_no_candidates / num_spectra * 100);
@@ -361,7 +514,6 @@ int SearchForXLinks::xlinkSearchMain() {
   //finalize_weibull();
   //Scorer::finalize();
   XLinkIonSeriesCache::finalize();
-  IonSeries::finalize();
   XLinkDatabase::finalize();
   //modifications_finalize(); TODO - Figure where to free the modification cache.
 
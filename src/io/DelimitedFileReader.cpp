@@ -5,6 +5,9 @@
 
 #include "DelimitedFileReader.h"
 
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
 #include <fstream>
 
 #include <iostream>
@@ -16,6 +19,73 @@
 
 using namespace std;
 
+namespace {
+
+// Size of the blocks read from the stream.
+const size_t READ_BLOCK_SIZE = 1 << 18;
+
+// Longest cell that is parsed as a number in place; longer ones are left to
+// StringUtils::FromString.
+const size_t MAX_NUMBER_LENGTH = 63;
+
+/**
+ * \returns whether the cell consists only of characters that strtod/strtol
+ * parse exactly as the stream extraction in StringUtils::FromString does,
+ * i.e. digits, signs, and for floating point values '.', 'e' and 'E'.
+ */
+bool isPlainNumber(const char* begin, size_t length, bool integer) {
+  if (length == 0 || length > MAX_NUMBER_LENGTH) {
+    return false;
+  }
+  for (const char* c = begin; c != begin + length; ++c) {
+    if (!(*c >= '0' && *c <= '9') && *c != '-' && *c != '+' &&
+        (integer || (*c != '.' && *c != 'e' && *c != 'E'))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Parse a null-terminated plain number; false if it is not valid as a whole
+// or out of range, so that the caller can fall back to FromString.
+bool parseNumber(const char* s, size_t length, double* value) {
+  char* end;
+  errno = 0;
+  *value = strtod(s, &end);
+  return end == s + length && errno == 0;
+}
+
+bool parseNumber(const char* s, size_t length, float* value) {
+  char* end;
+  errno = 0;
+  *value = strtof(s, &end);
+  return end == s + length && errno == 0;
+}
+
+bool parseNumber(const char* s, size_t length, int* value) {
+  char* end;
+  errno = 0;
+  long l = strtol(s, &end, 10);
+  *value = (int)l;
+  return end == s + length && errno == 0 &&
+    l >= numeric_limits<int>::min() && l <= numeric_limits<int>::max();
+}
+
+/**
+ * \returns whether the cell of the current row is equal to value.
+ */
+bool cellEquals(
+  const string& row,
+  const pair<size_t, size_t>& field,
+  const char* value
+  ) {
+  size_t length = strlen(value);
+  return field.second - field.first == length &&
+    row.compare(field.first, length, value) == 0;
+}
+
+} // namespace
+
 /**
  * \returns a DelimitedFileReader object
  */  
@@ -81,13 +151,24 @@ unsigned int DelimitedFileReader::numRows() {
 
     istream_ptr_->clear();
     istream_ptr_->seekg(istream_begin_, ios::beg);
-    
-    string temp_str;
 
-    while (getline(*istream_ptr_, temp_str)) {
+    // Count the lines as getline would: a last line without a newline
+    // counts too.
+    vector<char> block(READ_BLOCK_SIZE);
+    char last = '\n';
+    while (istream_ptr_->read(&block[0], block.size()) || istream_ptr_->gcount() > 0) {
+      streamsize count = istream_ptr_->gcount();
+      for (const char* c = &block[0];
+           (c = (const char*)memchr(c, '\n', &block[0] + count - c)) != NULL;
+           ++c) {
+        num_rows_++;
+      }
+      last = block[count - 1];
+    }
+    if (last != '\n') {
       num_rows_++;
     }
-    
+
     if (has_header_) {
       num_rows_--;
     }
@@ -153,19 +234,30 @@ void DelimitedFileReader::loadData() {
   has_current_ = false;
   column_mismatch_warned_ = false;
   istream_begin_ = istream_ptr_->tellg(); 
+  buffer_.resize(READ_BLOCK_SIZE);
+  buffer_begin_ = buffer_end_ = 0;
+  stream_done_ = false;
+  fields_.clear();
+  data_row_.assign(data_row_.size(), 0);
 
-  has_next_ = !getline(*istream_ptr_, next_data_string_).fail();
+  has_next_ = readLine(next_data_string_);
   next_data_string_ = StringUtils::Trim(next_data_string_);
   if (has_header_) {
     if (has_next_) {
       column_names_ = StringUtils::Split(next_data_string_, delimiter_);
-      has_next_ = !getline(*istream_ptr_, next_data_string_).fail();
+      has_next_ = readLine(next_data_string_);
     } else {
       carp(CARP_WARNING, "No data/headers found!");
       return;
     }
   }
 
+  // Resolve column names once; the first of duplicate names wins.
+  column_indices_.clear();
+  for (unsigned int col_idx = 0; col_idx < column_names_.size(); col_idx++) {
+    column_indices_.insert(make_pair(column_names_[col_idx], (int)col_idx));
+  }
+
   if (has_next_) {
     next();
   } 
@@ -215,12 +307,8 @@ void DelimitedFileReader::loadData(
 int DelimitedFileReader::findColumn(
   const string& column_name ///< the column name
   ) {
-  for (unsigned int col_idx=0;col_idx < column_names_.size();col_idx++) {
-    if (column_names_[col_idx] == column_name) {
-      return col_idx;
-    }
-  }
-  return -1;
+  map<string, int>::const_iterator i = column_indices_.find(column_name);
+  return i != column_indices_.end() ? i->second : -1;
 }
 
 /**
@@ -273,11 +361,16 @@ const string& DelimitedFileReader::getString() {
 const string& DelimitedFileReader::getString(
   unsigned int col_idx ///< the column index
   ) {
-  if (col_idx >= data_.size()) {
+  if (col_idx >= fields_.size()) {
     carp(CARP_FATAL, "col idx:%i is out of bounds! (0,%i,%i)",
-         col_idx, (column_names_.size()-1), (data_.size()-1));
+         col_idx, (column_names_.size()-1), (fields_.size()-1));
+  }
+  if (data_row_[col_idx] != current_row_) {
+    data_[col_idx].assign(current_data_string_, fields_[col_idx].first,
+                          fields_[col_idx].second - fields_[col_idx].first);
+    data_row_[col_idx] = current_row_;
   }
-  return data_.at(col_idx);
+  return data_[col_idx];
 }
 
 /** 
@@ -305,19 +398,45 @@ TValue DelimitedFileReader::getValue(
   return StringUtils::FromString<TValue>(getString(col_idx));
 }
 
+/**
+ * \returns the numeric value of a cell, parsed without copying it.
+ */
+template<typename TValue>
+TValue DelimitedFileReader::parseCell(
+  unsigned int col_idx ///< the column index
+  ) {
+  if (col_idx < fields_.size()) {
+    const char* begin = current_data_string_.data() + fields_[col_idx].first;
+    size_t length = fields_[col_idx].second - fields_[col_idx].first;
+    if (isPlainNumber(begin, length, numeric_limits<TValue>::is_integer)) {
+      char number[MAX_NUMBER_LENGTH + 1];
+      memcpy(number, begin, length);
+      number[length] = '\0';
+      TValue value;
+      if (parseNumber(number, length, &value)) {
+        return value;
+      }
+    }
+  }
+  // Anything else, including the errors, is handled as before.
+  return getValue<TValue>(col_idx);
+}
+
 /**
  * \returns the FLOAT_T value of a cell, checks for infinity
  */
 FLOAT_T DelimitedFileReader::getFloat(
   unsigned int col_idx ///< the column index
   ) {
-  const string& string_ans = getString(col_idx);
-  if (string_ans == "Inf") {
+  if (col_idx >= fields_.size()) {
+    return getValue<FLOAT_T>(col_idx);
+  }
+  if (cellEquals(current_data_string_, fields_[col_idx], "Inf")) {
     return numeric_limits<FLOAT_T>::infinity();
-  } else if (string_ans == "-Inf") {
+  } else if (cellEquals(current_data_string_, fields_[col_idx], "-Inf")) {
     return -numeric_limits<FLOAT_T>::infinity();
   } else {
-    return getValue<FLOAT_T>(col_idx);
+    return parseCell<FLOAT_T>(col_idx);
   }
 }
 
@@ -344,15 +463,18 @@ FLOAT_T DelimitedFileReader::getFloat(
 double DelimitedFileReader::getDouble(
   unsigned int col_idx ///< the column index 
   ) {
-  const string& string_ans = getString(col_idx);
-  if (string_ans == "") {
+  if (col_idx >= fields_.size()) {
+    return getValue<double>(col_idx);
+  }
+  const pair<size_t, size_t>& field = fields_[col_idx];
+  if (field.first == field.second) {
     return 0.0;
-  } else if (string_ans == "Inf") {
+  } else if (cellEquals(current_data_string_, field, "Inf")) {
     return numeric_limits<double>::infinity();
-  } else if (string_ans == "-Inf") {
+  } else if (cellEquals(current_data_string_, field, "-Inf")) {
     return -numeric_limits<double>::infinity();
   } else {
-    return getValue<double>(col_idx);
+    return parseCell<double>(col_idx);
   }
 }
 
@@ -379,7 +501,7 @@ int DelimitedFileReader::getInteger(
   unsigned int col_idx ///< the column index 
   ) {
   //TODO : check the string for a valid integer.
-  return getValue<int>(col_idx);
+  return parseCell<int>(col_idx);
 }
 
 /**
@@ -469,31 +591,80 @@ void DelimitedFileReader::reset() {
 void DelimitedFileReader::next() {
   if (has_next_) {
     current_row_++;
-    current_data_string_ = next_data_string_;
-    //parse next_data_string_ into data_
-    data_ = StringUtils::Split(current_data_string_, delimiter_);
+    current_data_string_.swap(next_data_string_);
+    //index the cells of current_data_string_
+    fields_.clear();
+    const char* row = current_data_string_.data();
+    const char* row_end = row + current_data_string_.size();
+    const char* from = row;
+    for (const char* i;
+         (i = (const char*)memchr(from, delimiter_, row_end - from)) != NULL;
+         from = i + 1) {
+      fields_.push_back(make_pair((size_t)(from - row), (size_t)(i - row)));
+    }
+    fields_.push_back(make_pair((size_t)(from - row), current_data_string_.size()));
     //make sure data has the right number of columns for the header.
-    if (data_.size() < column_names_.size()) {
+    if (fields_.size() < column_names_.size()) {
       if (!column_mismatch_warned_) {
         carp(CARP_WARNING, "Column count %d for line %d is less than header %d",
-             data_.size(), current_row_, column_names_.size());
+             fields_.size(), current_row_, column_names_.size());
         carp(CARP_WARNING, "%s", current_data_string_.c_str());
         carp(CARP_WARNING, "Suppressing warnings, other mismatches may exist!");
         column_mismatch_warned_ = true;
       }
-      while (data_.size() < column_names_.size()) {
-        data_.push_back("");
-      }
+      fields_.resize(column_names_.size(),
+                     make_pair(current_data_string_.size(), current_data_string_.size()));
+    }
+    if (data_.size() < fields_.size()) {
+      data_.resize(fields_.size());
+      data_row_.resize(fields_.size(), 0);
     }
 
     //read next line
-    has_next_ = !getline(*istream_ptr_, next_data_string_).fail();
+    has_next_ = readLine(next_data_string_);
     has_current_ = true;
   } else {
     has_current_ = false;
   }
 }
 
+/**
+ * reads the next line from the buffered stream, without the newline
+ */
+bool DelimitedFileReader::readLine(
+  string& line ///< the line read
+  ) {
+  while (true) {
+    const char* begin = &buffer_[0] + buffer_begin_;
+    const char* newline = (const char*)memchr(begin, '\n', buffer_end_ - buffer_begin_);
+    if (newline != NULL) {
+      line.assign(begin, newline - begin);
+      buffer_begin_ = newline - &buffer_[0] + 1;
+      return true;
+    }
+    if (stream_done_) {
+      if (buffer_begin_ == buffer_end_) {
+        return false;
+      }
+      line.assign(begin, buffer_end_ - buffer_begin_);
+      buffer_begin_ = buffer_end_;
+      return true;
+    }
+    // Move the partial line to the front, growing the buffer if the line
+    // fills it, and read the next block behind it.
+    size_t partial = buffer_end_ - buffer_begin_;
+    memmove(&buffer_[0], begin, partial);
+    buffer_begin_ = 0;
+    buffer_end_ = partial;
+    if (buffer_end_ == buffer_.size()) {
+      buffer_.resize(2 * buffer_.size());
+    }
+    istream_ptr_->read(&buffer_[buffer_end_], buffer_.size() - buffer_end_);
+    buffer_end_ += istream_ptr_->gcount();
+    stream_done_ = !*istream_ptr_;
+  }
+}
+
 /**
  * \returns whether there are more rows to 
  * iterate through
@@ -9,7 +9,10 @@
  * Types from each cell of the table.  This class also provides function
  * for reading a list of integers or string from a cell using a delimiter
  * that is different from the column delimiter (default is comma ',').
- * This class reads the data in line by line
+ * This class reads the data in line by line.  The stream is read in large
+ * blocks, and a row is only indexed by the positions of its cells; a cell is
+ * copied into a string when it is asked for as a string, and numeric cells
+ * are parsed in place.
  ****************************************************************************/
 #ifndef DELIMITEDFILEREADER_H
 #define DELIMITEDFILEREADER_H
@@ -36,8 +39,11 @@ class DelimitedFileReader {
 
   std::string next_data_string_; ///<the next data string.
   std::string current_data_string_; ///<the current data string.
-  std::vector<std::string> data_; ///<the current vectorized data.
+  std::vector<std::pair<size_t, size_t> > fields_; ///<[begin, end) of each cell in current_data_string_.
+  std::vector<std::string> data_; ///<the cells of the current row, filled in on request.
+  std::vector<unsigned int> data_row_; ///<the row each cell of data_ was filled in for.
   std::vector<std::string> column_names_; ///<the column names.
+  std::map<std::string, int> column_indices_; ///<the column indices by name.
 
   char delimiter_; ///<the delimiter to use.
 
@@ -59,6 +65,29 @@ class DelimitedFileReader {
 
   bool column_mismatch_warned_; ///<indicator of whether the column mismatch warning has been issued
 
+  std::vector<char> buffer_; ///<block of the stream that has not been split into lines yet
+  size_t buffer_begin_; ///<start of the next line in buffer_
+  size_t buffer_end_; ///<end of the data in buffer_
+  bool stream_done_; ///<indicator of whether the stream has been read to its end
+
+  /**
+   * reads the next line from the buffered stream, without the newline,
+   * like getline.
+   * \returns false if there are no more lines.
+   */
+  bool readLine(
+    std::string& line ///< the line read
+  );
+
+  /**
+   * \returns the numeric value of a cell, parsed without copying it. Cells
+   * that are not plain numbers are converted by StringUtils::FromString.
+   */
+  template<typename TValue>
+  TValue parseCell(
+    unsigned int col_idx ///< the column index
+  );
+
   /**
    * clears the current data and column names,
    * parses the header if it exists,
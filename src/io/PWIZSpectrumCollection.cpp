@@ -211,8 +211,10 @@ bool PWIZSpectrumCollection::parse() {
 
     Crux::Spectrum* crux_spectrum = new Crux::Spectrum();
     if (crux_spectrum->parsePwizSpecInfo(spectrum, scan_number_begin, scan_number_end)) {
+      if (handler_ == NULL) {
+        spectraByScan_[scan_number_begin] = crux_spectrum;
+      }
       addSpectrumToEnd(crux_spectrum);
-      spectraByScan_[scan_number_begin] = crux_spectrum;
     } else {
       delete crux_spectrum;
     }
@@ -30,7 +30,8 @@ namespace Crux {
 SpectrumCollection::SpectrumCollection (
   const string& filename ///< The spectrum collection filename. 
   ) 
-: filename_(filename), is_parsed_(false), num_charged_spectra_(0) {
+: filename_(filename), is_parsed_(false), num_charged_spectra_(0),
+  handler_(NULL) {
 #if DARWIN
   char path_buffer[PATH_MAX];
   char* absolute_path_file =  realpath(filename.c_str(), path_buffer);
@@ -60,7 +61,8 @@ SpectrumCollection::SpectrumCollection(
   SpectrumCollection& old_collection
   ) : filename_(old_collection.filename_),
       is_parsed_(old_collection.is_parsed_),
-      num_charged_spectra_(old_collection.num_charged_spectra_) {
+      num_charged_spectra_(old_collection.num_charged_spectra_),
+      handler_(NULL) {
   // copy spectra
   for (SpectrumIterator spectrum_iterator = old_collection.begin();
     spectrum_iterator != old_collection.end();
@@ -154,6 +156,11 @@ bool SpectrumCollection::getSpectrum(
 void SpectrumCollection::addSpectrumToEnd(
   Spectrum* spectrum ///< spectrum to add to spectrum_collection -in
   ) {
+  if (handler_ != NULL) {
+    handler_->handleSpectrum(spectrum);
+    delete spectrum;
+    return;
+  }
   // set spectrum
   spectra_.push_back(spectrum);
   num_charged_spectra_ += spectrum->getNumZStates();
@@ -167,7 +174,12 @@ void SpectrumCollection::addSpectrumToEnd(
 void SpectrumCollection::addSpectrum(
   Spectrum* spectrum ///< spectrum to add to spectrum_collection -in
   ) {
-    
+  if (handler_ != NULL) {
+    handler_->handleSpectrum(spectrum);
+    delete spectrum;
+    return;
+  }
+
   unsigned int add_index = 0;
 
   // find correct location
@@ -236,6 +248,25 @@ int SpectrumCollection::getNumChargedSpectra() {
 }
 
 
+/**
+ * Parses the spectra, passing each one to handler instead of keeping it.
+ * \returns True if the spectra are parsed successfully. False if otherwise.
+ */
+bool SpectrumCollection::parse(
+  SpectrumHandler* handler ///< receives each spectrum -in
+  ) {
+  handler_ = handler;
+  bool success;
+  try {
+    success = parse();
+  } catch (...) {
+    handler_ = NULL;
+    throw;
+  }
+  handler_ = NULL;
+  return success;
+}
+
 /**
  * \returns True if the spectrum_collection file has been parsed.
  */
@@ -13,11 +13,27 @@
 
 #include <deque>
 
+namespace Crux {
+
+/**
+ * \class SpectrumHandler
+ * \brief Receives spectra one at a time from SpectrumCollection::parse().
+ */
+class SpectrumHandler {
+ public:
+  virtual ~SpectrumHandler() {}
+
+  /**
+   * Called for each spectrum in file order. The spectrum is deleted when
+   * this returns.
+   */
+  virtual void handleSpectrum(Crux::Spectrum* spectrum) = 0;
+};
+
 /**
  * \class SpectrumCollection
  * \brief An abstract class for accessing spectra from a file.
  */
-namespace Crux {
 
 class SpectrumCollection {
 
@@ -29,6 +45,7 @@ class SpectrumCollection {
   std::string filename_;                  ///< filename
   bool is_parsed_;      ///< file has been read and spectra_ populated 
   int num_charged_spectra_;  ///< sum of all charge states from all spectra
+  SpectrumHandler* handler_; ///< receives parsed spectra instead of spectra_
   
   /**
    * Base class constructor is protected.  Sets filename and
@@ -42,6 +59,7 @@ class SpectrumCollection {
    * Adds a spectrum to the spectrum_collection.
    * adds the spectrum in correct order into the spectra array
    * spectrum must be heap allocated
+   * while parsing with a handler, spectrum is passed to it and deleted
    *\returns TRUE if succeed to add, else FALSE 
    */
   void addSpectrum(
@@ -54,6 +72,7 @@ class SpectrumCollection {
    * should only be used when the adding in increasing scan num order
    * when adding in random order should use add_spectrum
    * spectrum must be heap allocated
+   * while parsing with a handler, spectrum is passed to it and deleted
    *\returns TRUE if succeed to add, else FALSE 
    */
   void addSpectrumToEnd(
@@ -88,6 +107,16 @@ class SpectrumCollection {
    */
   virtual bool parse() = 0;
 
+  /**
+   * Parses the spectra like parse(), but passes each one to handler as
+   * soon as it is read instead of keeping it, so that memory use does not
+   * grow with the size of the file. The collection stays empty.
+   * \returns TRUE if the spectra are parsed successfully. FALSE if otherwise.
+   */
+  bool parse(
+    SpectrumHandler* handler ///< receives each spectrum -in
+  );
+
   /**
    * Parses a single spectrum from a spectrum_collection with first scan
    * number equal to first_scan.
@@ -17,28 +17,38 @@
 
 int SpectrumRecordWriter::scanCounter_ = 0;
 
+/**
+ * Writes each spectrum as soon as the parser has read it.
+ */
+class SpectrumRecordWriter::StreamingHandler : public Crux::SpectrumHandler {
+ public:
+  StreamingHandler(HeadedRecordWriter* writer, Crux::SpectrumHandler* observer)
+    : writer_(writer), observer_(observer) {}
+
+  virtual void handleSpectrum(Crux::Spectrum* spectrum) {
+    spectrum->sortPeaks(_PEAK_LOCATION); // Sort by m/z
+    writeSpectrum(writer_, spectrum);
+    if (observer_ != NULL) {
+      observer_->handleSpectrum(spectrum);
+    }
+  }
+
+ private:
+  HeadedRecordWriter* writer_;
+  Crux::SpectrumHandler* observer_;
+};
+
 /**
  * Converts a spectra file to spectrumrecords format for use with tide-search.
  * Spectra file is read by pwiz. Returns true on successful conversion.
  */
 bool SpectrumRecordWriter::convert(
   const string& infile, ///< spectra file to convert
-  string outfile  ///< spectrumrecords file to output
+  string outfile,  ///< spectrumrecords file to output
+  Crux::SpectrumHandler* observer ///< also sees every spectrum
 ) {
   auto_ptr<Crux::SpectrumCollection> spectra(SpectrumCollectionFactory::create(infile.c_str()));
 
-  // Open infile
-  try {
-    if (!spectra->parse()) {
-      return false;
-    }
-  } catch (const std::exception& e) {
-    carp(CARP_ERROR, "%s", e.what());
-    return false;
-  } catch (...) {
-    return false;
-  }
-
   // Write outfile
   pb::Header header;
   header.set_file_type(pb::Header::SPECTRA);
@@ -58,23 +68,40 @@ bool SpectrumRecordWriter::convert(
 
   scanCounter_ = 0;
 
-  // Go through the spectrum list and write each spectrum
-  for (SpectrumIterator i = spectra->begin(); i != spectra->end(); ++i) {
-    (*i)->sortPeaks(_PEAK_LOCATION); // Sort by m/z
-    vector<pb::Spectrum> pb_spectra = getPbSpectra(*i);
-    for (vector<pb::Spectrum>::const_iterator j = pb_spectra.begin();
-         j != pb_spectra.end();
-         ++j) { 
-      writer.Write(&*j);
+  // Parse infile, writing each spectrum as it is read
+  StreamingHandler handler(&writer, observer);
+  try {
+    if (!spectra->parse(&handler)) {
+      return false;
     }
+  } catch (const std::exception& e) {
+    carp(CARP_ERROR, "%s", e.what());
+    return false;
+  } catch (...) {
+    return false;
   }
 
-  return true;
+  return writer.OK();
 }
 
 /**
- * Return a pb::Spectrum from a pwiz SpectrumPtr
- * If spectrum is ms1, or has no precursors/peaks then return empty pb::Spectrum
+ * Write the records for one spectrum.
+ */
+void SpectrumRecordWriter::writeSpectrum(
+  HeadedRecordWriter* writer,
+  const Crux::Spectrum* s
+) {
+  vector<pb::Spectrum> pb_spectra = getPbSpectra(s);
+  for (vector<pb::Spectrum>::const_iterator i = pb_spectra.begin();
+       i != pb_spectra.end();
+       ++i) {
+    writer->Write(&*i);
+  }
+}
+
+/**
+ * Return the pb::Spectrum records for a Crux::Spectrum
+ * If spectrum has no precursors/peaks then return no records
  */
 vector<pb::Spectrum> SpectrumRecordWriter::getPbSpectra(
   const Crux::Spectrum* s
@@ -93,17 +120,30 @@ vector<pb::Spectrum> SpectrumRecordWriter::getPbSpectra(
     scan_num = ++scanCounter_;
   }
 
+  // Encode the peaks once for all charge states.
+  pb::Spectrum peaks;
+  addPeaks(&peaks, s);
+  if (peaks.peak_m_z_size() == 0) {
+    return spectra;
+  }
+
+  // Charge states whose precursor m/z agree up to rounding error (they are
+  // recomputed from the neutral mass) share a record.
+  const double kSameMz = 1e-9;
   const vector<SpectrumZState>& zStates = s->getZStates();
   for (vector<SpectrumZState>::const_iterator i = zStates.begin(); i != zStates.end(); ++i) {
-    spectra.push_back(pb::Spectrum());
-    pb::Spectrum& newSpectrum = spectra.back();
-    newSpectrum.set_spectrum_number(scan_num);
-    newSpectrum.set_precursor_m_z(i->getMZ());
-    newSpectrum.mutable_charge_state()->Add(i->getCharge());
-    addPeaks(&newSpectrum, s);
-    if (newSpectrum.peak_m_z_size() == 0) {
-      spectra.pop_back();
+    double mz = i->getMZ();
+    vector<pb::Spectrum>::iterator j = spectra.begin();
+    while (j != spectra.end() && fabs(j->precursor_m_z() - mz) >= kSameMz) {
+      ++j;
+    }
+    if (j == spectra.end()) {
+      spectra.push_back(peaks);
+      j = spectra.end() - 1;
+      j->set_spectrum_number(scan_num);
+      j->set_precursor_m_z(mz);
     }
+    j->add_charge_state(i->getCharge());
   }
 
   return spectra;
@@ -124,10 +164,11 @@ void SpectrumRecordWriter::addPeaks(
   int last_index = -1;
   uint64_t intensity_sum = 0;
 
-  for (PeakIterator i = s->begin(); i != s->end(); ++i) {
-    FLOAT_T peakMz = (*i)->getLocation();
+  int numPeaks = s->getNumPeaks();
+  for (int i = 0; i < numPeaks; ++i) {
+    FLOAT_T peakMz = s->getPeakMz(i);
     uint64_t mz = peakMz * mz_denom + 0.5;
-    uint64_t intensity = (*i)->getIntensity() * intensity_denom + 0.5;
+    uint64_t intensity = s->getPeakIntensity(i) * intensity_denom + 0.5;
     if (mz < last) {
       // Unsorted peaks, this should never happen since peaks get sorted earlier
       carp(CARP_FATAL, "Peaks are not sorted");
@@ -161,15 +202,15 @@ void SpectrumRecordWriter::getDenoms(
     if (!mzDenomOk && !intensityDenomOk) {
       return;
     }
-    for (PeakIterator i = s->begin(); i != s->end(); ++i) {
+    for (int i = 0; i < s->getNumPeaks(); ++i) {
       if (mzDenomOk) {
-        double mzX = (*i)->getLocation() * precision;
+        double mzX = s->getPeakMz(i) * precision;
         if (fabs(mzX - google::protobuf::uint64(mzX + 0.5)) >= 0.001) {
           mzDenomOk = false;
         }
       }
       if (intensityDenomOk) {
-        double intensityX = (*i)->getIntensity() * precision;
+        double intensityX = s->getPeakIntensity(i) * precision;
         if (fabs(intensityX - google::protobuf::uint64(intensityX + 0.5)) >= 0.001) {
           intensityDenomOk = false;
         }
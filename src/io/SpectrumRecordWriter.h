@@ -2,10 +2,13 @@
 #define SPECTRUM_RECORD_WRITER_H
 
 #include "Spectrum.h"
+#include "SpectrumCollection.h"
 #include "spectrum.pb.h"
 
 using namespace std;
 
+class HeadedRecordWriter;
+
 /**
  * A class for converting spectra file to the spectrumrecords format for use
  * with tide-search.
@@ -17,19 +20,35 @@ class SpectrumRecordWriter {
   /**
    * Converts a spectra file to spectrumrecords format for use with tide-search.
    * Spectra file is read by pwiz. Returns true on successful conversion.
+   * Spectra are read, encoded and written one at a time, so memory use does
+   * not depend on the size of the file. If observer is given, each spectrum
+   * is also passed to it after it has been written.
    */
   static bool convert(
     const string& infile, ///< spectra file to convert
-    string outfile  ///< spectrumrecords file to output
+    string outfile,  ///< spectrumrecords file to output
+    Crux::SpectrumHandler* observer = NULL ///< also sees every spectrum
   );
 
  protected:
 
+  class StreamingHandler;
+
   static int scanCounter_;
 
   /**
-   * Return a pb::Spectrum from a Crux::Spectrum
-   * Returns a default instance if there is a problem
+   * Write the records for one spectrum. Its peaks must be sorted by m/z.
+   */
+  static void writeSpectrum(
+    HeadedRecordWriter* writer,
+    const Crux::Spectrum* s
+  );
+
+  /**
+   * Return the pb::Spectrum records for a Crux::Spectrum, one for each
+   * distinct precursor m/z. Charge states with the same precursor m/z share
+   * a record, so that their peaks are stored only once.
+   * Returns no records if there is a problem
    */
   static std::vector<pb::Spectrum> getPbSpectra(
     const Crux::Spectrum* s
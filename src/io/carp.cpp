@@ -5,6 +5,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <stdexcept>
+#include <boost/thread.hpp>
 #include "carp.h"
 #include "util/crux-utils.h"
 #include "parameter.h"
@@ -21,6 +23,10 @@ static FILE* log_file = NULL;
 
 unsigned int hash_size_ = 1000;
 
+// The thread whose fatal carps throw instead of exiting; see
+// set_carp_fatal_throws().
+static boost::thread::id fatal_throw_thread;
+
 void set_verbosity_level(int verbosity) {
   G_verbosity = verbosity;
 }
@@ -29,6 +35,10 @@ int get_verbosity_level(void) {
   return G_verbosity;
 }
 
+void set_carp_fatal_throws(bool throws) {
+  fatal_throw_thread = throws ? boost::this_thread::get_id() : boost::thread::id();
+}
+
 /**
  * Open log file for carp messages.
  *
@@ -114,6 +124,14 @@ void carp( int verbosity, const char* format, ...) {
     }
   } 
   if (verbosity == CARP_FATAL) {
+    if (fatal_throw_thread == boost::this_thread::get_id()) {
+      char msg[1024];
+      va_list argp;
+      va_start(argp, format);
+      vsnprintf(msg, sizeof(msg), format, argp);
+      va_end(argp);
+      throw std::runtime_error(msg);
+    }
     // Fatal carps cause the program to exit
 #ifdef DEBUG
     abort(); // Dump core in DEBUG mode.  Use 'make CXXFLAGS=-DDEBUG"'
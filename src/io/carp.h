@@ -92,6 +92,14 @@ void set_verbosity_level(int verbosity);
  */
 int get_verbosity_level(void);
 
+/**
+ * If throws is true, CARP_FATAL carps made by the calling thread throw a
+ * std::runtime_error with the message instead of exiting, so that a
+ * long-running caller (e.g. tide-search in server mode) can recover.
+ * Fatal carps made by other threads still exit.
+ */
+void set_carp_fatal_throws(bool throws);
+
 /**
  * Open log file for carp messages.
  *
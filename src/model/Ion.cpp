@@ -21,35 +21,60 @@
 #include "util/WinCrux.h"
 #endif
 
-#include <stack>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/tss.hpp>
 
 using namespace Crux;
 using namespace std;
 
 
-class IonCache {
+/**
+ * Ions are allocated in contiguous blocks of ION_BLOCK_SIZE and are never
+ * returned to the heap until the program exits. Each thread keeps its own
+ * list of free ions, so that Ion::newIon and Ion::freeIon need no locking
+ * and, once the pools have grown to the size of the largest ion series,
+ * scoring allocates no memory. An ion freed on another thread than the one
+ * that created it is handed back to the pool that allocated it, which takes
+ * it back before allocating another block, so that a thread that only frees
+ * ions does not grow a pool without bound.
+ *
+ * The blocks and the pools are deliberately never destroyed, since ion
+ * series held by other static objects, or by other threads, may still free
+ * their ions after the thread that created them has exited. The pool of an
+ * exited thread is kept for the next thread that needs one.
+ */
+static const size_t ION_BLOCK_SIZE = 1024;
+
+static boost::mutex* ion_blocks_mutex_ = new boost::mutex();
+static vector<Ion*>* ion_blocks_ = new vector<Ion*>();
+
+static Ion* allocateIonBlock() {
+  Ion* block = new Ion[ION_BLOCK_SIZE];
+  boost::mutex::scoped_lock lock(*ion_blocks_mutex_);
+  ion_blocks_->push_back(block);
+  return block;
+}
+
+class IonPool {
  protected:
-  stack<Ion*> cache_;
+  vector<Ion*> free_;      ///< only touched by the thread using this pool
+  vector<Ion*> returned_;  ///< ions of this pool freed by other threads
+  boost::mutex returned_mutex_;
   #ifdef DEBUG
   int ncheckin;
   int ncheckout;
   #endif
  public:
-  IonCache() {
+  IonPool() {
     #ifdef DEBUG
     ncheckin = 0;
     ncheckout = 0;
     #endif
   }
 
-  ~IonCache() {
-    while(!cache_.empty()) {
-      Ion* ion = cache_.top();
-      cache_.pop();
-      delete ion;
-    }
+  ~IonPool() {
     #ifdef DEBUG
-    carp(CARP_INFO, "Ion cache check in: %d check out:%d", ncheckin, ncheckout);
+    carp(CARP_INFO, "Ion pool check in: %d check out:%d", ncheckin, ncheckout);
     #endif
   }
 
@@ -57,24 +82,76 @@ class IonCache {
     #ifdef DEBUG
     ncheckout++;
     #endif
-    if (cache_.empty()) {
-      return (new Ion());
+    if (free_.empty()) {
+      boost::mutex::scoped_lock lock(returned_mutex_);
+      free_.swap(returned_);
+    }
+    if (free_.empty()) {
+      // Hand out the block front to back.
+      Ion* block = allocateIonBlock();
+      for (size_t idx = ION_BLOCK_SIZE; idx > 0; idx--) {
+        block[idx - 1].pool_ = this;
+        free_.push_back(block + idx - 1);
+      }
+    }
+    Ion* ion = free_.back();
+    free_.pop_back();
+    return ion;
+  }
+
+  /**
+   * Returns an ion to the pool that allocated it, from any thread.
+   */
+  static void checkin(Ion* ion) {
+    IonPool* pool = ion->pool_;
+    if (pool == pools_->get()) {
+      #ifdef DEBUG
+      pool->ncheckin++;
+      #endif
+      pool->free_.push_back(ion);
     } else {
-      Ion* ion = cache_.top();
-      cache_.pop();
-      return(ion);
+      boost::mutex::scoped_lock lock(pool->returned_mutex_);
+      pool->returned_.push_back(ion);
     }
   }
-  void checkin(Ion* ion) {
-    #ifdef DEBUG
-    ncheckin++;
-    #endif
-    cache_.push(ion);
+
+  /**
+   * \returns the pool of the calling thread
+   */
+  static IonPool& get() {
+    IonPool* pool = pools_->get();
+    if (pool == NULL) {
+      boost::mutex::scoped_lock lock(*retired_mutex_);
+      if (retired_->empty()) {
+        pool = new IonPool();
+      } else {
+        pool = retired_->back();
+        retired_->pop_back();
+      }
+      pools_->reset(pool);
+    }
+    return *pool;
   }
-};
 
+ protected:
+  /**
+   * Called when a thread exits: keeps its pool, whose ions may still be
+   * in use, for the next thread.
+   */
+  static void retire(IonPool* pool) {
+    boost::mutex::scoped_lock lock(*retired_mutex_);
+    retired_->push_back(pool);
+  }
+
+  static boost::thread_specific_ptr<IonPool>* pools_;
+  static boost::mutex* retired_mutex_;
+  static vector<IonPool*>* retired_;
+};
 
-IonCache ion_cache_;
+boost::thread_specific_ptr<IonPool>* IonPool::pools_ =
+  new boost::thread_specific_ptr<IonPool>(&IonPool::retire);
+boost::mutex* IonPool::retired_mutex_ = new boost::mutex();
+vector<IonPool*>* IonPool::retired_ = new vector<IonPool*>();
 
 
 // At one point I need to reverse the endianness for pfile_create to work
@@ -138,6 +215,7 @@ void Ion::init() {
  * \returns An (empty) ion object.
  */
 Ion::Ion() {
+  pool_ = NULL;
   init();
 }
 
@@ -302,12 +380,12 @@ void Ion::freeIon(
   ion->pointer_count_--;
 
   if (ion->pointer_count_ <= 0) {
-    ion_cache_.checkin(ion);//delete ion;
+    IonPool::checkin(ion);
   }
 }
 
 Ion* Ion::newIon() {
-  Ion* ion = ion_cache_.checkout();
+  Ion* ion = IonPool::get().checkout();
   ion->init();
   return(ion);
 }
@@ -20,8 +20,12 @@
 
 static const int MAX_MODIFICATIONS = 4; ///< maximum modifications allowed per ion
 
+class IonPool;
+
 class Ion : public CacheableMass {
 
+  friend class IonPool;
+
  protected:
   ION_TYPE_T type_;  ///< type of the ion 
   int cleavage_idx_; ///< index of peptide amide that fragments to form this ion, starting from the N-term end 
@@ -33,6 +37,7 @@ class Ion : public CacheableMass {
   FLOAT_T ion_mass_z_;   ///< The mass/z of the ion. 
   Peak * peak_;  ///< The assigned peak. NULL if no peak // TODO add ptr count
   int pointer_count_; ///< count of number of references to this ion.
+  IonPool* pool_; ///< the pool that allocated this ion; not reset by init()
 
   static const int MZ_INT_MAX = 10;
   static const int MZ_INT_MIN = 0;
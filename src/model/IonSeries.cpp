@@ -23,6 +23,7 @@
 #include "Spectrum.h"
 
 #include <stack>
+#include <boost/thread/mutex.hpp>
 
 using namespace Crux;
 
@@ -30,8 +31,6 @@ static const int BINARY_GMTK = 1;
 static const int PRINT_NULL_IONS = 1;
 static const int MIN_FRAMES = 3;
 
-FLOAT_T* IonSeries::mass_matrix_ = NULL;
-
 
 /**
  * \struct loss_limit
@@ -52,6 +51,7 @@ struct loss_limit{
 class LossLimitCache {
  protected:
   stack<LOSS_LIMIT_T*> cache_;
+  boost::mutex mutex_;
  public:
   LossLimitCache() {
   }
@@ -65,6 +65,7 @@ class LossLimitCache {
   }
 
   LOSS_LIMIT_T* checkout() {
+    boost::mutex::scoped_lock lock(mutex_);
     LOSS_LIMIT_T* new_element;
     if (cache_.empty()) {
       new_element = new LOSS_LIMIT_T[GlobalParams::getMaxLength()];
@@ -75,6 +76,7 @@ class LossLimitCache {
     return (new_element);
   }
   void checkin(LOSS_LIMIT_T* array) {
+    boost::mutex::scoped_lock lock(mutex_);
     cache_.push(array);
   }
 
@@ -258,11 +260,6 @@ IonSeries::~IonSeries()
 
 }
 
-void IonSeries::finalize() {
-  delete []mass_matrix_;
-
-}
-
 
 /**
  * Iterator access
@@ -449,12 +446,13 @@ FLOAT_T* IonSeries::createIonMassMatrix(
     return NULL;
   }
 
-  if (mass_matrix_ == NULL) {
-    //Allocate the static mass_matrix_
-    mass_matrix_ = new FLOAT_T[sizeof(FLOAT_T)*(GlobalParams::getMaxLength()+1)];
+  // Each ion series keeps its own matrix, so that series may be predicted
+  // on several threads at once.
+  if (mass_matrix_.empty()) {
+    mass_matrix_.resize(GlobalParams::getMaxLength() + 1);
   }
 
-  FLOAT_T* mass_matrix = mass_matrix_;
+  FLOAT_T* mass_matrix = &mass_matrix_[0];
   
   // at index 0, the length of the peptide is stored
   mass_matrix[0] = peptide_length;
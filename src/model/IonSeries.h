@@ -29,7 +29,7 @@ class IonSeries {
   friend class XLinkIonSeriesCache;
  protected:
 
-  static FLOAT_T* mass_matrix_; /// < Pre-allocated mass matrix
+  std::vector<FLOAT_T> mass_matrix_; ///< mass matrix, reused across updates
   // TODO change name to unmodified_char_seq
   std::string peptide_; ///< The peptide sequence for this ion series
   MODIFIED_AA_T* modified_aa_seq_; ///< sequence of the peptide
@@ -155,8 +155,6 @@ class IonSeries {
 
   static void freeIonSeries(IonSeries* ions);
 
-  static void finalize();
-
   /**
    *Iterator access
    */
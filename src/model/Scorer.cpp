@@ -29,6 +29,16 @@
 #include "model/Spectrum.h"
 #include "Scorer.h"
 #include "parameter.h"
+#include <algorithm>
+#include <boost/thread/tss.hpp>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__clang__) || __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+// As in app/tide/dot_product.cc, the AVX kernels are compiled with target
+// attributes and selected at run time.
+#define SCORER_HAVE_AVX
+#include <immintrin.h>
+#endif
 
 using namespace Crux;
 
@@ -37,6 +47,11 @@ using namespace Crux;
  */
 static const int MAX_XCORR_OFFSET = 75;
 
+/**
+ * Number of bins averaged for the XCorr background.
+ */
+static const double XCORR_WINDOW = MAX_XCORR_OFFSET * 2.0 + 1;
+
 // The following two constants are hardware dependent.
 // These values should be good for double precision floating point
 // numbers compatible with the IEEE 754 standard.
@@ -90,6 +105,138 @@ static const int NUM_REGIONS = 10;
  */ 
 static const int MAX_PER_REGION = 50;
 
+/**
+ * Prefix sums of the observed spectrum for subtractXcorrBackground, one
+ * buffer per thread, reused for every spectrum. Never destroyed, so that
+ * threads exiting late can still free their buffers.
+ */
+static boost::thread_specific_ptr<vector<double> >* xcorr_prefix_sums_ =
+  new boost::thread_specific_ptr<vector<double> >();
+
+/**
+ * Number of FLOAT_Ts in an AVX register. The dot products sum this many
+ * lanes separately, whichever kernel computes them.
+ */
+static const int DOT_LANES = 32 / sizeof(FLOAT_T);
+
+/**
+ * \returns true if the processor can run the AVX kernels.
+ */
+static bool cpuHasAvx() {
+#ifdef SCORER_HAVE_AVX
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx");
+#else
+  return false;
+#endif
+}
+
+static const bool CPU_HAS_AVX = cpuHasAvx();
+
+/**
+ * Subtracts the mean of the window of bins around it from each of the bins
+ * [begin, end) of the observed spectrum. prefix[k] is the sum of bins 1 to
+ * k-1; bin 0 is never part of a window.
+ */
+static void subtractBackgroundScalar(
+  FLOAT_T* observed,
+  const double* prefix,
+  int size,
+  int begin,
+  int end
+  ) {
+  for (int i = begin; i < end; ++i) {
+    int lo = max(i - MAX_XCORR_OFFSET, 1);
+    int hi = min(i + MAX_XCORR_OFFSET, size - 1);
+    observed[i] -= (FLOAT_T)((prefix[hi + 1] - prefix[lo]) / XCORR_WINDOW);
+  }
+}
+
+/**
+ * Adds the partial sums of the lanes and the products of the remaining
+ * elements, in the same order for every kernel.
+ */
+static FLOAT_T sumLanes(
+  const FLOAT_T* lanes,
+  const FLOAT_T* x,
+  const FLOAT_T* y,
+  int rest
+  ) {
+  FLOAT_T total = 0;
+  for (int k = 0; k < DOT_LANES; ++k) {
+    total += lanes[k];
+  }
+  for (int i = 0; i < rest; ++i) {
+    total += x[i] * y[i];
+  }
+  return total;
+}
+
+static FLOAT_T dotProductScalar(const FLOAT_T* x, const FLOAT_T* y, int size) {
+  FLOAT_T lanes[DOT_LANES] = {0};
+  int i = 0;
+  for (; i + DOT_LANES <= size; i += DOT_LANES) {
+    for (int k = 0; k < DOT_LANES; ++k) {
+      lanes[k] += x[i + k] * y[i + k];
+    }
+  }
+  return sumLanes(lanes, x + i, y + i, size - i);
+}
+
+#ifdef SCORER_HAVE_AVX
+/**
+ * Like subtractBackgroundScalar; every window of the bins [begin, end) must
+ * lie within the spectrum. Rounds exactly as the scalar version does.
+ */
+__attribute__((target("avx")))
+static void subtractBackgroundAvx(
+  FLOAT_T* observed,
+  const double* prefix,
+  int size,
+  int begin,
+  int end
+  ) {
+  const __m256d window = _mm256_set1_pd(XCORR_WINDOW);
+  int i = begin;
+  for (; i + 4 <= end; i += 4) {
+    __m256d sum = _mm256_sub_pd(
+      _mm256_loadu_pd(prefix + i + MAX_XCORR_OFFSET + 1),
+      _mm256_loadu_pd(prefix + i - MAX_XCORR_OFFSET));
+    __m256d mean = _mm256_div_pd(sum, window);
+#ifdef USE_DOUBLES
+    _mm256_storeu_pd(observed + i,
+                     _mm256_sub_pd(_mm256_loadu_pd(observed + i), mean));
+#else
+    _mm_storeu_ps(observed + i,
+                  _mm_sub_ps(_mm_loadu_ps(observed + i), _mm256_cvtpd_ps(mean)));
+#endif
+  }
+  subtractBackgroundScalar(observed, prefix, size, i, end);
+}
+
+__attribute__((target("avx")))
+static FLOAT_T dotProductAvx(const FLOAT_T* x, const FLOAT_T* y, int size) {
+  FLOAT_T lanes[DOT_LANES];
+  int i = 0;
+#ifdef USE_DOUBLES
+  __m256d sum = _mm256_setzero_pd();
+  for (; i + DOT_LANES <= size; i += DOT_LANES) {
+    sum = _mm256_add_pd(sum, _mm256_mul_pd(_mm256_loadu_pd(x + i),
+                                           _mm256_loadu_pd(y + i)));
+  }
+  _mm256_storeu_pd(lanes, sum);
+#else
+  __m256 sum = _mm256_setzero_ps();
+  for (; i + DOT_LANES <= size; i += DOT_LANES) {
+    sum = _mm256_add_ps(sum, _mm256_mul_ps(_mm256_loadu_ps(x + i),
+                                           _mm256_loadu_ps(y + i)));
+  }
+  _mm256_storeu_ps(lanes, sum);
+#endif
+  return sumLanes(lanes, x + i, y + i, size - i);
+}
+#endif
+
 
 int ion_counter=0;
 
@@ -109,6 +256,7 @@ void Scorer::init() {
   bin_width_ = 0;
   bin_offset_ = 0;
   observed_ = NULL;
+  observed_size_ = 0;
   theoretical_ = NULL;
 }
 
@@ -179,6 +327,18 @@ Scorer::~Scorer() {
 }
 
 
+/**
+ * Prepares the scorer for another spectrum, keeping its arrays.
+ */
+void Scorer::reset() {
+  if (type_ == SP) {
+    memset(intensity_array_, 0, sizeof(FLOAT_T) * getMaxBin());
+    max_intensity_ = 0;
+  }
+  last_idx_ = 0;
+  initialized_ = false;
+}
+
 /**
  * normalize array so that maximum peak equals threshold
  */
@@ -210,29 +370,38 @@ void nomalize_intensity_array(
 void Scorer::smoothPeaks() {
 
   int idx = 2;
+  int max_bin = getMaxBin();
   FLOAT_T* array = intensity_array_;
 
-  // create a new array, which will replace the original intensity array
-  FLOAT_T* new_array = (FLOAT_T*)mycalloc(getMaxBin(), sizeof(FLOAT_T));
-
-  if (type_ == SP){
+  // smooth in place, keeping the two previous unsmoothed intensities
+  if (type_ == SP && max_bin > 4) {
+    FLOAT_T before2 = array[0];
+    FLOAT_T before1 = array[1];
+    array[0] = 0;
+    array[1] = 0;
     // iterate over all peaks
-    for(; idx < getMaxBin()-2; ++idx){
+    for(; idx < max_bin-2; ++idx){
+      FLOAT_T current = array[idx];
       // smooooth
-      new_array[idx] = (array[idx-2] + 
-                        (4 * array[idx-1]) + 
-                        (6 * array[idx]) + 
-                        (4 * array[idx+1]) + array[idx+2] ) / 16;
+      array[idx] = (before2 + 
+                    (4 * before1) + 
+                    (6 * current) + 
+                    (4 * array[idx+1]) + array[idx+2] ) / 16;
+      before2 = before1;
+      before1 = current;
 
       // set last idx in the array
-      if(last_idx_ < idx && new_array[idx] == 0){
+      if(last_idx_ < idx && array[idx] == 0){
         last_idx_ = idx -1;
+        ++idx;
         break;
       }
     }
+  } else {
+    idx = 0;
   }
-  free(intensity_array_);
-  intensity_array_ = new_array;
+  // everything that was not smoothed is zero
+  fill(array + idx, array + max_bin, (FLOAT_T)0);
 }
 
 /**
@@ -499,7 +668,6 @@ bool Scorer::createIntensityArraySp(
   int charge               ///< the peptide charge -in 
   )
 {
-  Peak * peak = NULL;
   FLOAT_T peak_location = 0;
   FLOAT_T max_intensity = 0;
   int mz = 0;
@@ -517,12 +685,10 @@ bool Scorer::createIntensityArraySp(
   }
   
   // while there are more peaks to iterate over..
-  for (PeakIterator peak_iterator = spectrum->begin();
-    peak_iterator != spectrum->end();
-    ++peak_iterator) {
+  int num_peaks = spectrum->getNumPeaks();
+  for (int peak_idx = 0; peak_idx < num_peaks; ++peak_idx) {
 
-    peak = *peak_iterator;
-    peak_location = peak->getLocation();
+    peak_location = spectrum->getPeakMz(peak_idx);
 
     // skip all peaks larger than experimental mass
     if(peak_location > experimental_mass_cut_off){
@@ -550,7 +716,7 @@ bool Scorer::createIntensityArraySp(
     }
 
     // get intensity
-    intensity = sqrt(peak->getIntensity());
+    intensity = sqrt(spectrum->getPeakIntensity(peak_idx));
     
     // set intensity in array with correct mz, only if max peak in the bin
     if(intensity_array_[mz] < intensity){
@@ -765,30 +931,89 @@ FLOAT_T Scorer::genScoreSp(
  * .
  */
 void Scorer::normalizeEachRegion(
-  vector<FLOAT_T>& observed,  ///< intensities to normalize
+  FLOAT_T* observed,  ///< intensities to normalize
+  int size, ///< the number of intensities -in
   const vector<FLOAT_T>& max_intensity_per_region, ///< the max intensity in each 10 regions -in
   int region_selector ///< the size of each regions -in
   )
 {
-  int region_idx = 0;
-  int next_region = region_selector;
-  FLOAT_T max_intensity = max_intensity_per_region[region_idx];
-
-  // normalize each region
-  for (int i = 0; i < observed.size(); ++i) {
-    // increment the region index and update max_intensity if this
-    // peak is in the next region
-    if (i >= next_region && region_idx < (NUM_REGIONS - 1)) {
-      max_intensity = max_intensity_per_region[++region_idx];
-      next_region += region_selector;
+  // normalize each region in a separate loop, the last region extending to
+  // the end of the spectrum
+  for (int region_idx = 0; region_idx < NUM_REGIONS; ++region_idx) {
+    int begin = min(region_idx * region_selector, size);
+    int end = (region_idx == NUM_REGIONS - 1)
+      ? size : min(begin + region_selector, size);
+    FLOAT_T max_intensity = max_intensity_per_region[region_idx];
+    if (max_intensity == 0) {
+      fill(observed + begin, observed + end, (FLOAT_T)0);
+      continue;
     }
     // normalize intensity to max 50
-    observed[i] = (max_intensity != 0)
-      ? (observed[i] / max_intensity) * MAX_PER_REGION
-      : 0.0;
+    for (int i = begin; i < end; ++i) {
+      observed[i] = (observed[i] / max_intensity) * MAX_PER_REGION;
+    }
   }
 }
 
+/**
+ * Subtracts from each bin of the observed spectrum the mean of the bins
+ * within MAX_XCORR_OFFSET of it, using prefix sums rather than summing each
+ * window. Bin 0 is never part of a window.
+ */
+void Scorer::subtractXcorrBackground(
+  FLOAT_T* observed,
+  int size,
+  bool simd
+  ) {
+  if (size <= 0) {
+    return;
+  }
+  if (xcorr_prefix_sums_->get() == NULL) {
+    xcorr_prefix_sums_->reset(new vector<double>());
+  }
+  vector<double>& prefix = *xcorr_prefix_sums_->get();
+  if (prefix.size() < (size_t)size + 1) {
+    prefix.resize(size + 1);
+  }
+  prefix[0] = 0;
+  prefix[1] = 0;
+  for (int i = 1; i < size; ++i) {
+    prefix[i + 1] = prefix[i] + observed[i];
+  }
+
+  // bins whose windows are cut off by either end of the spectrum are done
+  // separately, so that the kernels need no bounds checks
+  int begin = min(MAX_XCORR_OFFSET + 1, size);
+  int end = max(size - MAX_XCORR_OFFSET, begin);
+  subtractBackgroundScalar(observed, &prefix[0], size, 0, begin);
+#ifdef SCORER_HAVE_AVX
+  if (simd && CPU_HAS_AVX) {
+    subtractBackgroundAvx(observed, &prefix[0], size, begin, end);
+  } else
+#endif
+  {
+    subtractBackgroundScalar(observed, &prefix[0], size, begin, end);
+  }
+  subtractBackgroundScalar(observed, &prefix[0], size, end, size);
+}
+
+/**
+ * \returns the dot product of x and y.
+ */
+FLOAT_T Scorer::dotProduct(
+  const FLOAT_T* x,
+  const FLOAT_T* y,
+  int size,
+  bool simd
+  ) {
+#ifdef SCORER_HAVE_AVX
+  if (simd && CPU_HAS_AVX) {
+    return dotProductAvx(x, y, size);
+  }
+#endif
+  return dotProductScalar(x, y, size);
+}
+
 FLOAT_T* Scorer::getIntensityArrayObserved() {
   return observed_;
 }
@@ -821,7 +1046,16 @@ bool Scorer::createIntensityArrayObserved(
 
   sp_max_mz_ = sp_max_mz;
 
-  vector<FLOAT_T> observed(getMaxBin(), 0);
+  int max_bin = getMaxBin();
+  FLOAT_T* observed = observed_;
+  if (observed == NULL || observed_size_ < max_bin) {
+    free(observed);
+    observed = (FLOAT_T*)mycalloc(max_bin, sizeof(FLOAT_T));
+    observed_size_ = max_bin;
+  } else {
+    // reused after reset()
+    memset(observed, 0, sizeof(FLOAT_T) * max_bin);
+  }
 
   // Store the max intensity in entire spectrum
   FLOAT_T max_intensity_overall = 0.0;
@@ -832,13 +1066,11 @@ bool Scorer::createIntensityArrayObserved(
   // find the maximum peak m/z (location)
   double max_peak = 0.0;
 
-  for (PeakIterator peak_iterator = spectrum->begin();
-    peak_iterator != spectrum->end();
-    ++peak_iterator) {
-    Peak* peak = *peak_iterator;
-    FLOAT_T peak_location = peak->getLocation();
+  int num_peaks = spectrum->getNumPeaks();
+  for (int peak_idx = 0; peak_idx < num_peaks; ++peak_idx) {
+    FLOAT_T peak_location = spectrum->getPeakMz(peak_idx);
     if (peak_location < experimental_mass_cut_off && peak_location > max_peak
-        && peak->getIntensity() > 0) {
+        && spectrum->getPeakIntensity(peak_idx) > 0) {
       max_peak = peak_location;
     }
   }
@@ -848,11 +1080,8 @@ bool Scorer::createIntensityArrayObserved(
 
   // while there are more peaks to iterate over..
   // bin peaks, adjust intensties, find max for each region
-  for (PeakIterator peak_iterator = spectrum->begin();
-       peak_iterator != spectrum->end();
-       ++peak_iterator) {
-    Peak* peak = *peak_iterator;
-    FLOAT_T peak_location = peak->getLocation();
+  for (int peak_idx = 0; peak_idx < num_peaks; ++peak_idx) {
+    FLOAT_T peak_location = spectrum->getPeakMz(peak_idx);
 
     // skip all peaks larger than experimental mass
     // skip all peaks within precursor ion mz +/- 15
@@ -878,8 +1107,9 @@ bool Scorer::createIntensityArrayObserved(
 
     // get intensity
     // sqrt the original intensity
+    FLOAT_T peak_intensity = spectrum->getPeakIntensity(peak_idx);
     FLOAT_T intensity = (stop_after >= SQUARE_ROOT_STEP)
-      ? sqrt(peak->getIntensity()) : peak->getIntensity();
+      ? sqrt(peak_intensity) : peak_intensity;
 
     // Record the max intensity in the full spectrum
     if (intensity > max_intensity_overall) {
@@ -899,32 +1129,24 @@ bool Scorer::createIntensityArrayObserved(
   // For compatibility with SEQUEST drop peaks with intensity less than 1/20 of
   // the overall max intensity.
   if (stop_after >= REMOVE_GRASS_STEP) {
-    for (vector<FLOAT_T>::iterator i = observed.begin(); i != observed.end(); i++) {
-      if (*i <= 0.05 * max_intensity_overall) {
-        *i = 0.0;
+    for (int i = 0; i < max_bin; ++i) {
+      if (observed[i] <= 0.05 * max_intensity_overall) {
+        observed[i] = 0.0;
       }
     }
   }
 
   // normalize each 10 regions to max intensity of 50
   if (stop_after >= TEN_BIN_STEP) {
-    normalizeEachRegion(observed, max_intensity_per_region, region_selector);
+    normalizeEachRegion(observed, max_bin, max_intensity_per_region,
+                        region_selector);
   }
 
-  observed_ = (FLOAT_T*)mycalloc(observed.size(), sizeof(FLOAT_T));
-  copy(observed.begin(), observed.end(), observed_);
-
   if (stop_after == XCORR_STEP) {
-    // TODO maybe replace with a faster implementation that uses cum distribution
-    for (int i = 0; i < observed.size(); i++) {
-      for (int j = i - MAX_XCORR_OFFSET; j <= i + MAX_XCORR_OFFSET; j++) {
-        if (j > 0 && j < observed.size()) {
-          observed_[i] -= (observed[j] / (MAX_XCORR_OFFSET * 2.0 + 1));
-        }
-      }
-    }
+    subtractXcorrBackground(observed, max_bin);
   }
 
+  observed_ = observed;
   return true;
 }
 
@@ -952,6 +1174,9 @@ void Scorer::getProcessedPeaks(
   // return the observed array and the sp_max_mz
   *intensities = scorer.observed_;
   *max_mz_bin = scorer.getMaxBin();
+  // the caller owns the array now
+  scorer.observed_ = NULL;
+  scorer.observed_size_ = 0;
 }
 
 
@@ -1086,14 +1311,8 @@ FLOAT_T Scorer::crossCorrelation(
   )
 {
 
-  int size = getMaxBin();
-  FLOAT_T score_at_zero = 0;
-  
   // compare each location in theoretical spectrum
-  int idx;
-  for(idx = 0; idx < size; ++idx){
-    score_at_zero += observed_[idx] * theoretical[idx];
-  }
+  FLOAT_T score_at_zero = dotProduct(observed_, theoretical, getMaxBin());
 
   return score_at_zero / 10000.0;
 }
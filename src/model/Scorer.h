@@ -53,6 +53,7 @@ class Scorer {
 
   /// used for xcorr
   FLOAT_T* observed_; ///< used for Xcorr: observed spectrum intensity array
+  int observed_size_; ///< used for Xcorr: number of bins allocated for observed_
   FLOAT_T* theoretical_; ///< used for Xcorr: theoretical spectrum intensity array
 
   /**
@@ -142,7 +143,8 @@ class Scorer {
    * normalize each 10 regions of the observed spectrum to max 50
    */
   void normalizeEachRegion(
-    vector<FLOAT_T>& observed,  ///< intensities to normalize
+    FLOAT_T* observed,  ///< intensities to normalize
+    int size, ///< the number of intensities -in
     const vector<FLOAT_T>& max_intensity_per_region, ///< the max intensity in each 10 regions -in
     int region_selector ///< the size of each regions -in
     );
@@ -201,6 +203,12 @@ class Scorer {
    */
   ~Scorer();
 
+  /**
+   * Prepares the scorer for another spectrum, keeping its arrays, so that
+   * a scorer can be reused without allocating them again.
+   */
+  void reset();
+
   /**
    * Score a spectrum vs. an ion series
    */
@@ -389,6 +397,29 @@ class Scorer {
 
   FLOAT_T* getIntensityArrayObserved();
 
+  /**
+   * Subtracts from each bin of the observed spectrum, in place, the mean of
+   * the bins around it: the background correction of XCorr. Uses AVX if the
+   * processor has it and simd is true; both give identical results.
+   */
+  static void subtractXcorrBackground(
+    FLOAT_T* observed, ///< the observed spectrum -in/out
+    int size, ///< the number of bins -in
+    bool simd = true ///< use AVX if available -in
+    );
+
+  /**
+   * Sums the products in several lanes, in the same order whether or not
+   * AVX is used, so results do not depend on the processor.
+   *\returns the dot product of x and y
+   */
+  static FLOAT_T dotProduct(
+    const FLOAT_T* x,
+    const FLOAT_T* y,
+    int size, ///< the number of elements -in
+    bool simd = true ///< use AVX if available -in
+    );
+
   bool createIntensityArrayObserved(
     Crux::Spectrum* spectrum,    ///< the spectrum to score(observed) -in
     int charge,              ///< the peptide charge -in 
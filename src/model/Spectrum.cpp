@@ -18,6 +18,7 @@
 #include "parameter.h"
 #include "Scorer.h"
 #include "io/carp.h"
+#include <algorithm>
 #include <vector>
 #include <string>
 #include "io/DelimitedFile.h"
@@ -90,11 +91,7 @@ Spectrum::Spectrum (
  */
 Spectrum::~Spectrum()
 {
-  free_peak_vector(peaks_);
-  
-  if(has_mz_peak_array_){
-    delete [] mz_peak_array_;
-  }
+  clearPeakObjects();
 }
 
 /**
@@ -102,7 +99,8 @@ Spectrum::~Spectrum()
  * in the spectrum
  */
 PeakIterator Spectrum::begin() const {
-  return peaks_.begin();
+  createPeakObjects();
+  return peak_pointers_.begin();
 }
 
 /**
@@ -110,7 +108,52 @@ PeakIterator Spectrum::begin() const {
  * in the spectrum
  */
 PeakIterator Spectrum::end() const {
-  return peaks_.end();
+  createPeakObjects();
+  return peak_pointers_.end();
+}
+
+/**
+ * Creates the Peak objects for the peak arrays, if they do not exist yet.
+ */
+void Spectrum::createPeakObjects() const {
+  if (peak_pointers_.size() == peak_mz_.size()) {
+    return;
+  }
+  peak_objects_.clear();
+  peak_pointers_.clear();
+  peak_objects_.reserve(peak_mz_.size());
+  for (size_t peak_idx = 0; peak_idx < peak_mz_.size(); peak_idx++) {
+    peak_objects_.push_back(Peak(peak_intensity_[peak_idx], peak_mz_[peak_idx]));
+    if (!peak_rank_.empty()) {
+      peak_objects_.back().setIntensityRank(peak_rank_[peak_idx]);
+    }
+  }
+  for (size_t peak_idx = 0; peak_idx < peak_objects_.size(); peak_idx++) {
+    peak_pointers_.push_back(&peak_objects_[peak_idx]);
+  }
+}
+
+/**
+ * Deletes the Peak objects and mz_peak_array_, which points to them.
+ */
+void Spectrum::clearPeakObjects() {
+  vector<Peak>().swap(peak_objects_);
+  vector<Peak*>().swap(peak_pointers_);
+  if (has_mz_peak_array_) {
+    delete [] mz_peak_array_;
+    has_mz_peak_array_ = false;
+  }
+  mz_peak_array_ = NULL;
+}
+
+/**
+ * Removes all peaks.
+ */
+void Spectrum::clearPeaks() {
+  clearPeakObjects();
+  peak_mz_.clear();
+  peak_intensity_.clear();
+  peak_rank_.clear();
 }
 
 /**
@@ -156,11 +199,11 @@ void Spectrum::print(FILE* file) ///< output file to print at -out
   }
 
   // print peaks
-  for(int peak_idx = 0; peak_idx < (int)peaks_.size(); ++peak_idx){
+  for(int peak_idx = 0; peak_idx < (int)peak_mz_.size(); ++peak_idx){
     fprintf(file, "%.*f %.4f\n",
             mass_precision,
-            peaks_[peak_idx]->getLocation(),
-            peaks_[peak_idx]->getIntensity());
+            peak_mz_[peak_idx],
+            peak_intensity_[peak_idx]);
   }
 }
 
@@ -269,13 +312,16 @@ void Spectrum::printSqt(
  has_peaks_(old_spectrum.has_peaks_),
  sorted_by_mz_(old_spectrum.sorted_by_mz_),
  sorted_by_intensity_(old_spectrum.sorted_by_intensity_),
- has_mz_peak_array_(old_spectrum.has_mz_peak_array_)
+ has_mz_peak_array_(false),
+ mz_peak_array_(NULL)
 {
 
   // copy each peak
-  for(int peak_idx=0; peak_idx < (int)old_spectrum.peaks_.size(); ++peak_idx){
-    this->addPeak(old_spectrum.peaks_[peak_idx]->getIntensity(),
-                  old_spectrum.peaks_[peak_idx]->getLocation());
+  peak_mz_.reserve(old_spectrum.peak_mz_.size());
+  peak_intensity_.reserve(old_spectrum.peak_mz_.size());
+  for(int peak_idx=0; peak_idx < (int)old_spectrum.peak_mz_.size(); ++peak_idx){
+    this->addPeak(old_spectrum.peak_intensity_[peak_idx],
+                  old_spectrum.peak_mz_[peak_idx]);
   }
 
   /*  Should we do this??
@@ -299,11 +345,10 @@ void Spectrum::copyFrom(Spectrum *src) {
  has_peaks_ = src-> has_peaks_;
  sorted_by_mz_ = src->sorted_by_mz_;
  sorted_by_intensity_ = src->sorted_by_intensity_;
- has_mz_peak_array_ = src->has_mz_peak_array_;
  // copy each peak
- for(int peak_idx=0; peak_idx < (int)src->peaks_.size(); ++peak_idx){
-   this->addPeak(src->peaks_[peak_idx]->getIntensity(),
-                  src->peaks_[peak_idx]->getLocation());
+ for(int peak_idx=0; peak_idx < (int)src->peak_mz_.size(); ++peak_idx){
+   this->addPeak(src->peak_intensity_[peak_idx],
+                  src->peak_mz_[peak_idx]);
   }
 
   /*  Should we do this??
@@ -326,10 +371,9 @@ bool Spectrum::parseMstoolkitSpectrum
   // clear any existing values
   zstates_.clear();
 
-  free_peak_vector(peaks_);
+  clearPeaks();
   i_lines_v_.clear();
   d_lines_v_.clear();
-  if( mz_peak_array_ ){ delete [] mz_peak_array_; }
 
   MSToolkit::Spectrum* mst_real_spectrum = (MSToolkit::Spectrum*)mst_spectrum;
 
@@ -342,6 +386,8 @@ bool Spectrum::parseMstoolkitSpectrum
   filename_ = filename;
 
   //add all peaks.
+  peak_mz_.reserve(mst_real_spectrum->size());
+  peak_intensity_.reserve(mst_real_spectrum->size());
   for(int peak_idx = 0; peak_idx < (int)mst_real_spectrum->size(); peak_idx++){
     this->addPeak(mst_real_spectrum->at(peak_idx).intensity,
                    mst_real_spectrum->at(peak_idx).mz);
@@ -377,10 +423,9 @@ bool Spectrum::parsePwizSpecInfo(
   // clear any existing values
   zstates_.clear();
   ezstates_.clear();
-  free_peak_vector(peaks_);
+  clearPeaks();
   i_lines_v_.clear();
   d_lines_v_.clear();
-  if( mz_peak_array_ ){ free(mz_peak_array_); }
 
   // assign new values
   first_scan_ = firstScan;
@@ -390,6 +435,8 @@ bool Spectrum::parsePwizSpecInfo(
   int num_peaks = pwiz_spectrum->defaultArrayLength;
   const vector<double>& mzs = pwiz_spectrum->getMZArray()->data;
   const vector<double>& intensities = pwiz_spectrum->getIntensityArray()->data;
+  peak_mz_.reserve(num_peaks);
+  peak_intensity_.reserve(num_peaks);
   for(int peak_idx = 0; peak_idx < num_peaks; peak_idx++){
     addPeak(intensities[peak_idx], mzs[peak_idx]);
   }
@@ -504,8 +551,14 @@ void Spectrum::addPeak
   FLOAT_T location_mz ///< the location of peak to add -in
   )
 {
-  Peak *peak = new Peak(intensity, location_mz);
-  peaks_.push_back(peak);
+  if (!peak_pointers_.empty()) {
+    clearPeakObjects();
+  }
+  peak_mz_.push_back(location_mz);
+  peak_intensity_.push_back(intensity);
+  if (!peak_rank_.empty()) {
+    peak_rank_.push_back(0);
+  }
   updateFields(intensity, location_mz);
   has_peaks_ = true;
 }
@@ -514,15 +567,14 @@ void Spectrum::truncatePeaks(int count) {
   if (count < 0) {
     count = 0;
   }
-  if (peaks_.size() <= count) {
+  if (peak_mz_.size() <= count) {
     return;
   }
   min_peak_mz_ = count > 0 ? numeric_limits<FLOAT_T>::max() : 0;
   max_peak_mz_ = 0;
-  vector<Peak*>::const_iterator removePoint = peaks_.begin() + count;
-  for (vector<Peak*>::const_iterator i = peaks_.begin(); i != peaks_.end(); i++) {
-    if (i < removePoint) {
-      FLOAT_T mz = (*i)->getLocation();
+  for (size_t peak_idx = 0; peak_idx < peak_mz_.size(); peak_idx++) {
+    if (peak_idx < count) {
+      FLOAT_T mz = peak_mz_[peak_idx];
       if (mz < min_peak_mz_) {
         min_peak_mz_ = mz;
       }
@@ -530,11 +582,24 @@ void Spectrum::truncatePeaks(int count) {
         max_peak_mz_ = mz;
       }
     } else {
-      total_energy_ -= (*i)->getIntensity();
-      delete *i;
+      total_energy_ -= peak_intensity_[peak_idx];
     }
   }
-  peaks_.resize(count);
+  peak_mz_.resize(count);
+  peak_intensity_.resize(count);
+  if (!peak_rank_.empty()) {
+    peak_rank_.resize(count);
+  }
+  // The Peak objects of the remaining peaks stay where they are, but
+  // mz_peak_array_ may point to removed ones.
+  if (peak_pointers_.size() > count) {
+    peak_pointers_.resize(count);
+  }
+  if (has_mz_peak_array_) {
+    delete [] mz_peak_array_;
+    mz_peak_array_ = NULL;
+    has_mz_peak_array_ = false;
+  }
 }
 
 /**
@@ -553,13 +618,14 @@ void Spectrum::populateMzPeakArray()
   for (int peak_idx = 0; peak_idx < array_length; peak_idx++){
     mz_peak_array_[peak_idx] = NULL;
   }
-  for(int peak_idx = 0; peak_idx < (int)peaks_.size(); peak_idx++){
-    Peak * peak = peaks_[peak_idx];
-    FLOAT_T peak_mz = peak->getLocation();
+  createPeakObjects();
+  for(int peak_idx = 0; peak_idx < (int)peak_mz_.size(); peak_idx++){
+    Peak * peak = peak_pointers_[peak_idx];
+    FLOAT_T peak_mz = peak_mz_[peak_idx];
     int mz_idx = (int) (peak_mz * MZ_TO_PEAK_ARRAY_RESOLUTION);
     if (mz_peak_array_[mz_idx] != NULL){
       carp(CARP_INFO, "Peak collision at mz %.3f = %i", peak_mz, mz_idx);
-      if (mz_peak_array_[mz_idx]->getIntensity() < peak->getIntensity()) {
+      if (mz_peak_array_[mz_idx]->getIntensity() < peak_intensity_[peak_idx]) {
         mz_peak_array_[mz_idx] = peak;
       }
     } else {
@@ -623,22 +689,21 @@ Peak* Spectrum::getMaxIntensityPeak(
   ) {
 
   FLOAT_T max_intensity = -BILLION;
-  Peak* max_intensity_peak = NULL;
-
-  for (PeakIterator peak_iter = begin();
-    peak_iter != end();
-    ++peak_iter) {
+  int max_intensity_idx = -1;
 
-    Peak* peak = *peak_iter;
-    FLOAT_T peak_mz = peak->getLocation();
-    FLOAT_T distance = fabs(mz - peak_mz);
-    FLOAT_T intensity = peak->getIntensity();
+  for (int peak_idx = 0; peak_idx < (int)peak_mz_.size(); peak_idx++) {
+    FLOAT_T distance = fabs(mz - peak_mz_[peak_idx]);
+    FLOAT_T intensity = peak_intensity_[peak_idx];
     if ((distance <= max) && (intensity > max_intensity)){
-      max_intensity_peak = peak;
+      max_intensity_idx = peak_idx;
       max_intensity = intensity;
     }
   }
-  return max_intensity_peak;
+  if (max_intensity_idx < 0) {
+    return NULL;
+  }
+  createPeakObjects();
+  return peak_pointers_[max_intensity_idx];
 }
 
 /**
@@ -649,11 +714,11 @@ void Spectrum::updateFields(
   FLOAT_T location ///< the location of the peak that has been added -in
 ) {
   // is new peak the smallest peak
-  if(peaks_.size() == 1 || min_peak_mz_ > location){
+  if(peak_mz_.size() == 1 || min_peak_mz_ > location){
     min_peak_mz_ = location;
   }
   // is new peak the largest peak
-  if(peaks_.size() == 1 || max_peak_mz_ < location){
+  if(peak_mz_.size() == 1 || max_peak_mz_ < location){
     max_peak_mz_ = location;
   }
   // update total_energy
@@ -705,7 +770,7 @@ FLOAT_T Spectrum::getMaxPeakMz()
  */
 int Spectrum::getNumPeaks() const
 {
-  return (int)peaks_.size();
+  return (int)peak_mz_.size();
 }
 
 
@@ -840,9 +905,9 @@ FLOAT_T Spectrum::getMaxPeakIntensity()
 {
   FLOAT_T max_intensity = -1;
 
-  for(int peak_idx = 0; peak_idx < (int)peaks_.size(); ++peak_idx){
-    if (max_intensity <= peaks_[peak_idx]->getIntensity()) {
-      max_intensity = peaks_[peak_idx]->getIntensity();
+  for(int peak_idx = 0; peak_idx < (int)peak_intensity_.size(); ++peak_idx){
+    if (max_intensity <= peak_intensity_[peak_idx]) {
+      max_intensity = peak_intensity_[peak_idx];
     }
   }
   return max_intensity; 
@@ -853,10 +918,66 @@ FLOAT_T Spectrum::getMaxPeakIntensity()
  */
 void Spectrum::sumNormalize()
 {
-  for(int peak_idx = 0; peak_idx < (int)peaks_.size(); peak_idx++){
-    Peak * peak = peaks_[peak_idx];
-    FLOAT_T new_intensity = peak->getIntensity() / total_energy_;
-    peak->setIntensity(new_intensity);
+  for(int peak_idx = 0; peak_idx < (int)peak_intensity_.size(); peak_idx++){
+    FLOAT_T new_intensity = peak_intensity_[peak_idx] / total_energy_;
+    peak_intensity_[peak_idx] = new_intensity;
+    if (peak_idx < (int)peak_pointers_.size()) {
+      peak_pointers_[peak_idx]->setIntensity(new_intensity);
+    }
+  }
+}
+
+namespace {
+
+// Orders peak indices as sort_peaks() orders peaks, so that both give the
+// same order.
+struct ComparePeakIndices {
+  const vector<FLOAT_T>& values_;
+  bool by_intensity_;
+  ComparePeakIndices(const vector<FLOAT_T>& values, bool by_intensity)
+    : values_(values), by_intensity_(by_intensity) {}
+  bool operator()(int x, int y) const {
+    return by_intensity_ ? values_[x] > values_[y] : values_[x] < values_[y];
+  }
+};
+
+template<typename T>
+void permute(vector<T>& values, const vector<int>& order) {
+  if (values.empty()) {
+    return;
+  }
+  vector<T> permuted;
+  permuted.reserve(values.size());
+  for (vector<int>::const_iterator i = order.begin(); i != order.end(); i++) {
+    permuted.push_back(values[*i]);
+  }
+  values.swap(permuted);
+}
+
+} // namespace
+
+/**
+ * Reorders the peak arrays. Existing Peak objects keep their addresses;
+ * only the order in which PeakIterator returns them changes.
+ */
+void Spectrum::sortPeakArrays(PEAK_SORT_TYPE_T type)
+{
+  if (type != _PEAK_INTENSITY && type != _PEAK_LOCATION) {
+    carp(CARP_ERROR, "no matching peak sort type");
+    return;
+  }
+  vector<int> order(peak_mz_.size());
+  for (size_t peak_idx = 0; peak_idx < order.size(); peak_idx++) {
+    order[peak_idx] = peak_idx;
+  }
+  bool by_intensity = type == _PEAK_INTENSITY;
+  sort(order.begin(), order.end(),
+       ComparePeakIndices(by_intensity ? peak_intensity_ : peak_mz_, by_intensity));
+  permute(peak_mz_, order);
+  permute(peak_intensity_, order);
+  permute(peak_rank_, order);
+  if (peak_pointers_.size() == order.size()) {
+    permute(peak_pointers_, order);
   }
 }
 
@@ -869,7 +990,7 @@ void Spectrum::sortPeaks(PEAK_SORT_TYPE_T type)
       (type == _PEAK_INTENSITY && sorted_by_intensity_)) {
     return;
   }
-  sort_peaks(peaks_, type);
+  sortPeakArrays(type);
   sorted_by_mz_ = (type == _PEAK_LOCATION);
   sorted_by_intensity_ = (type == _PEAK_INTENSITY);
 }
@@ -879,15 +1000,18 @@ void Spectrum::sortPeaks(PEAK_SORT_TYPE_T type)
  */
 void Spectrum::rankPeaks()
 {
-  sort_peaks(peaks_, _PEAK_INTENSITY);
+  sortPeakArrays(_PEAK_INTENSITY);
   sorted_by_intensity_ = true;
   sorted_by_mz_ = false;
-  int rank = (int)peaks_.size();
-  for(int peak_idx = 0; peak_idx < (int) peaks_.size(); peak_idx++){
-    Peak * peak = peaks_[peak_idx];
-    FLOAT_T new_rank = rank/(float)peaks_.size();
+  int rank = (int)peak_mz_.size();
+  peak_rank_.resize(peak_mz_.size());
+  for(int peak_idx = 0; peak_idx < (int) peak_mz_.size(); peak_idx++){
+    FLOAT_T new_rank = rank/(float)peak_mz_.size();
     rank--;
-    peak->setIntensityRank(new_rank);
+    peak_rank_[peak_idx] = new_rank;
+    if (peak_idx < (int)peak_pointers_.size()) {
+      peak_pointers_[peak_idx]->setIntensityRank(new_rank);
+    }
   }
 
 }
@@ -908,7 +1032,7 @@ bool Spectrum::assignZState() {
   carp_once(CARP_WARNING, "Spectrum %i has no charge state. Calculating charge",
             first_scan_);
   
-  if (peaks_.empty()) {
+  if (peak_mz_.empty()) {
     carp(CARP_INFO, "Cannot determine charge state of spectrum %d with no peaks.",
          first_scan_);
     return false;
@@ -917,19 +1041,19 @@ bool Spectrum::assignZState() {
   // sum peaks below and above the precursor m/z window separately
   FLOAT_T left_sum = 0.00001;
   FLOAT_T right_sum = 0.00001;
-  for (vector<Peak*>::const_iterator i = peaks_.begin(); i != peaks_.end(); i++) {
-    FLOAT_T location = (*i)->getLocation();
+  for (size_t peak_idx = 0; peak_idx < peak_mz_.size(); peak_idx++) {
+    FLOAT_T location = peak_mz_[peak_idx];
     if (location < precursor_mz_ - 20) {
-      left_sum += (*i)->getIntensity();
+      left_sum += peak_intensity_[peak_idx];
     } else if (location > precursor_mz_ + 20) {
-      right_sum += (*i)->getIntensity();
+      right_sum += peak_intensity_[peak_idx];
     } // else, skip peaks around precursor
   }
 
   // What is the justification for this? Ask Mike MacCoss
   FLOAT_T FractionWindow = 0;
   FLOAT_T CorrectionFactor = 1;
-  FLOAT_T max_peak_mz = peaks_.back()->getLocation();
+  FLOAT_T max_peak_mz = peak_mz_.back();
   if ((precursor_mz_ * 2) >= max_peak_mz) {
     FractionWindow = (precursor_mz_ * 2) - max_peak_mz;
     CorrectionFactor = fabs((precursor_mz_ - FractionWindow)) / precursor_mz_;
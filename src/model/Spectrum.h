@@ -49,7 +49,13 @@ class Spectrum{
   FLOAT_T          precursor_mz_;  ///< The m/z of precursor (MS-MS spectra)
   std::vector<SpectrumZState> zstates_;
   std::vector<SpectrumZState> ezstates_;
-  std::vector<Peak*>  peaks_;         ///< The spectrum peaks
+  // The peaks are stored as parallel arrays; Peak objects are only created
+  // when they are asked for (see createPeakObjects()).
+  std::vector<FLOAT_T> peak_mz_;        ///< The m/z of each peak
+  std::vector<FLOAT_T> peak_intensity_; ///< The intensity of each peak
+  std::vector<FLOAT_T> peak_rank_;      ///< The intensity ranks; empty until rankPeaks()
+  mutable std::vector<Peak> peak_objects_;   ///< Peaks handed out through PeakIterator
+  mutable std::vector<Peak*> peak_pointers_; ///< peak_pointers_[i] is the Peak of peak i
   FLOAT_T          min_peak_mz_;   ///< The minimum m/z of all peaks
   FLOAT_T          max_peak_mz_;   ///< The maximum m/z of all peaks
   double           total_energy_;  ///< The sum of intensities in all peaks
@@ -74,6 +80,30 @@ class Spectrum{
   static const int MAX_CHARGE = 6;     ///< Maximum allowed charge.
   
   // private methods
+  /**
+   * Creates the Peak objects returned by begin(), end(), getNearestPeak()
+   * and getMaxIntensityPeak(), if they do not exist yet. They stay valid
+   * until peaks are added or removed. Not thread-safe: although the method
+   * is const, it fills mutable members, so threads that share a Spectrum
+   * must not call those accessors concurrently before it has run once.
+   */
+  void createPeakObjects() const;
+
+  /**
+   * Deletes the Peak objects and mz_peak_array_.
+   */
+  void clearPeakObjects();
+
+  /**
+   * Removes all peaks.
+   */
+  void clearPeaks();
+
+  /**
+   * Reorders the peaks by m/z or by decreasing intensity.
+   */
+  void sortPeakArrays(PEAK_SORT_TYPE_T type);
+
   /**
    * Updates num_peaks, min_peak_mz, max_peak_mz, total_energy fields.
    */
@@ -237,6 +267,16 @@ class Spectrum{
    */
   int getNumPeaks() const;
 
+  /**
+   * \returns The m/z of the peak at idx, in the current peak order.
+   */
+  FLOAT_T getPeakMz(int idx) const { return peak_mz_[idx]; }
+
+  /**
+   * \returns The intensity of the peak at idx, in the current peak order.
+   */
+  FLOAT_T getPeakIntensity(int idx) const { return peak_intensity_[idx]; }
+
   /**
    * \returns The closest PEAK_T within 'max' of 'mz' in 'spectrum'
    * NULL if no peak within 'max'
@@ -1,5 +1,6 @@
 #include "FileUtils.h"
 #include "boost/filesystem.hpp"
+#include <algorithm>
 #include <fstream>
 #include <stdexcept>
 
@@ -89,3 +90,16 @@ void FileUtils::Copy(const std::string& orig, const std::string& dest) {
   }
 }
 
+
+vector<string> FileUtils::List(const string& path) {
+  vector<string> names;
+  if (IsDir(path)) {
+    for (boost::filesystem::directory_iterator i(path);
+         i != boost::filesystem::directory_iterator();
+         ++i) {
+      names.push_back(i->path().filename().string());
+    }
+  }
+  sort(names.begin(), names.end());
+  return names;
+}
@@ -3,6 +3,7 @@
 
 #include <fstream>
 #include <string>
+#include <vector>
 
 class FileUtils {
  public:
@@ -20,6 +21,8 @@ class FileUtils {
   static std::string Stem(const std::string& path);
   static std::string Extension(const std::string& path);
   static void Copy(const std::string& orig, const std::string& dest);
+  // Names of the entries of a directory, sorted
+  static std::vector<std::string> List(const std::string& path);
  private:
   FileUtils();
   ~FileUtils();
@@ -294,9 +294,35 @@ Params::Params() : finalized_(false) {
     "then a second file will be created containing the decoy peptides. Decoys that also "
     "appear in the target database are marked with an asterisk in a third column.",
     "Available for tide-index.", true);
+  InitBoolParam("mapped-index", false,
+    "Write the peptide index in a memory-mapped format with a mass directory. "
+    "tide-search can then skip directly to the peptides in each precursor mass "
+    "window, and concurrent searches of the same index share its pages in memory. "
+    "Such an index cannot be read by older versions of Crux, nor on Windows.",
+    "Available for tide-index.", true);
+  InitBoolParam("precompute-peaks", false,
+    "Store the theoretical peaks of each peptide in the index, so that tide-search "
+    "does not have to compute them again. The peaks depend on mz-bin-width and "
+    "mz-bin-offset; tide-search uses them only if it is run with the same values, "
+    "and otherwise computes the peaks as usual. This option makes the index larger.",
+    "Available for tide-index.", true);
+  InitIntParam("memory-limit", 0, 0, BILLION,
+    "Maximum amount of memory, in MB, used to sort the unmodified peptides. "
+    "When more peptides are generated, they are sorted in parts that are written "
+    "to temp-dir and then merged. A value of 0 means that all peptides are "
+    "sorted in memory. This bounds only the sort, not the total memory used: "
+    "the proteins, any decoy peptides that are generated and, unless allow-dups "
+    "is set, one copy of each distinct target peptide are always kept in memory.",
+    "Available for tide-index.", true);
+  InitIntParam("mods-memory-limit", 4096, 0, BILLION,
+    "Maximum amount of memory, in MB, for modified peptides that wait to be "
+    "written in order of mass. When more are waiting, they are sorted in parts "
+    "that are written to temp-dir and then merged. A value of 0 means that they "
+    "are always kept in memory.",
+    "Available for tide-index.", true);
   InitIntParam("modsoutputter-threshold", 1000, 0, BILLION,
-    "Maximum number of temporary files that would be opened by ModsOutputter "
-    "before switching to ModsOutputterAlt.",
+    "Maximum number of combinations of modification counts handled by "
+    "ModsOutputter before switching to ModsOutputterAlt.",
     "Available for tide-index.", false);
   // print-processed-spectra option
   InitStringParam("stop-after", "xcorr", "remove-precursor|square-root|"
@@ -364,13 +390,13 @@ Params::Params() : finalized_(false) {
     "formula for computing the discretized m/z value is floor((x/mz-bin-width) + 1.0 - mz-bin-offset), where x is the observed m/z "
     "value. For low resolution ion trap ms/ms data 1.0005079 and for high resolution ms/ms "
     "0.02 is recommended.",
-    "Available for tide-search and xlink-assign-ions.", true);
+    "Available for tide-index, tide-search and xlink-assign-ions.", true);
   InitDoubleParam("mz-bin-offset", 0.40, 0.0, 1.0,
     "In the discretization of the m/z axes of the observed and theoretical spectra, this "
     "parameter specifies the location of the left edge of the first bin, relative to "
     "mass = 0 (i.e., mz-bin-offset = 0.xx means the left edge of the first bin will be "
     "located at +0.xx Da).",
-    "Available for tide-search.", true);
+    "Available for tide-index and tide-search.", true);
   InitStringParam("auto-mz-bin-width", "false", "false|warn|fail",
     "Automatically estimate optimal value for the mz-bin-width parameter "
     "from the spectra themselves. false=no estimation, warn=try to estimate "
@@ -398,6 +424,17 @@ Params::Params() : finalized_(false) {
   InitStringParam("output-dir", "crux-output",
     "The name of the directory where output files will be created.",
     "Available for most commands.", true);
+  InitStringParam("spool-dir", "",
+    "Run tide-search as a server that keeps the index loaded. After the spectrum "
+    "files given on the command line have been searched, tide-search waits for "
+    "job files named NAME.job in this directory. The first line of a job "
+    "file is the output directory for its results, and each further line is a "
+    "spectrum file to search. A job is renamed to NAME.running while it "
+    "is searched, and to NAME.done or NAME.failed afterwards. "
+    "Jobs are searched one at a time, in the order of their names, each with "
+    "all num-threads threads and with the parameters of the server. The server "
+    "stops when a file named stop appears in the directory.",
+    "Available for tide-search.", true);
   InitStringParam("temp-dir", "",
     "The name of the directory where temporary files will be created. If this "
     "parameter is blank, then the system temporary directory will be used",
@@ -900,7 +937,15 @@ Params::Params() : finalized_(false) {
                   "Available for tide-search", true);
   InitIntParam("num-threads", 0, 0, 64,
                "0=poll CPU to set num threads; else specify num threads directly.",
-               "Available for tide-search tab-delimited files only.", true);
+               "Available for tide-index, search-for-xlinks, hardklor, and for tide-search "
+               "tab-delimited files only.", true);
+  InitStringParam("xcorr-kernel", "auto", "auto|jit|simd|scalar",
+    "Code used to compute XCorr scores against the candidate peptides. 'jit' generates "
+    "machine code for each peptide and is only available on x86 processors; 'simd' "
+    "uses AVX-512 or AVX2 instructions, whichever the processor supports; 'scalar' "
+    "works on any processor. All give identical scores. 'auto' uses 'jit' where it "
+    "is available and 'simd' otherwise.",
+    "Available for tide-search.", true);
   /*
    * Comet parameters
    */
@@ -1498,7 +1543,8 @@ Params::Params() : finalized_(false) {
 
   InitBoolParam("xlink-use-ion-cache", false,
 		"Use an ion cache for the xlinkable peptides.  "
-                "May not be scalable for large databases.",
+                "May not be scalable for large databases. Not used when "
+                "searching with more than one thread.",
 		"Available for search-for-xlinks.", false);
 
   InitBoolParam("xlink-include-linears", true,
@@ -2046,6 +2092,7 @@ void Params::Categorize() {
   items.clear();
   items.insert("num-threads");
   items.insert("num_threads");
+  items.insert("xcorr-kernel");
   AddCategory("CPU threads", items);
 
   items.clear();
@@ -2184,7 +2231,10 @@ void Params::Categorize() {
   items.insert("fileroot");
   items.insert("header");
   items.insert("list-of-files");
+  items.insert("mapped-index");
   items.insert("mass-precision");
+  items.insert("memory-limit");
+  items.insert("mods-memory-limit");
   items.insert("mzid-output");
   items.insert("num_output_lines");
   items.insert("output-dir");
@@ -2201,6 +2251,7 @@ void Params::Categorize() {
   items.insert("pin-output");
   items.insert("pout-output");
   items.insert("precision");
+  items.insert("precompute-peaks");
   items.insert("print-search-progress");
   items.insert("print_expect_score");
   items.insert("sample_enzyme_number");
@@ -2209,6 +2260,7 @@ void Params::Categorize() {
   items.insert("spectrum-parser");
   items.insert("sqt-output");
   items.insert("store-index");
+  items.insert("spool-dir");
   items.insert("store-spectra");
   items.insert("temp-dir");
   items.insert("top-match");
@@ -2320,6 +2372,12 @@ void Params::Set(const string& name, const string& value) {
   param->ThrowIfInvalid();
 }
 
+void Params::SetOutputDir(const string& dir) {
+  Param* param = Require("output-dir");
+  param->Set(dir);
+  param->ThrowIfInvalid();
+}
+
 void Params::AddArgValue(const string& name, const string& value) {
   paramContainer_.CanModifyCheck();
   Param* param = Require(name);
@@ -64,6 +64,10 @@ class Params {
   static void Set(const std::string& name, const char* value);
   static void Set(const std::string& name, const std::string& value);
 
+  // Change output-dir, even after the parameters have been finalized, for
+  // applications that write several sets of results (tide-search spool-dir)
+  static void SetOutputDir(const std::string& dir);
+
   // Add the value of an argument
   // Throws exception if parameter has an invalid value, already exists as a non-argument,
   // or parameters have been finalized
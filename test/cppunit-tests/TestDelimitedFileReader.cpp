@@ -0,0 +1,177 @@
+#include <cppunit/config/SourcePrefix.h>
+#include <stdio.h>
+#include <fstream>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+#include "TestDelimitedFileReader.h"
+#include "util/StringUtils.h"
+#include "parameter.h" 
+
+using namespace std;
+
+CPPUNIT_TEST_SUITE_REGISTRATION( TestDelimitedFileReader );
+
+/**
+ * Size of the blocks DelimitedFileReader reads from its stream.
+ */
+static const size_t BLOCK_SIZE = 1 << 18;
+
+/**
+ * \returns rows of two columns, the row number and a filler whose length
+ * varies, so that the block boundaries fall inside lines. One line is
+ * longer than a block. The text is about three blocks long.
+ */
+static string makeRows(vector<string>& fillers) {
+  ostringstream text;
+  text << "row\tfiller\n";
+  fillers.clear();
+  size_t length = text.str().length();
+  for (int row = 0; length < 3 * BLOCK_SIZE; row++) {
+    size_t filler_length = row == 100 ? BLOCK_SIZE + 17 : 1000 + (row * 37) % 991;
+    string filler(filler_length, 'a' + row % 26);
+    fillers.push_back(filler);
+    text << row << '\t' << filler << '\n';
+    length = text.str().length();
+  }
+  return text.str();
+}
+
+void TestDelimitedFileReader::setUp(){
+  initialize_parameters();
+  file_name = "delimited-file-reader-test.txt";
+}
+
+void TestDelimitedFileReader::tearDown(){
+  remove(file_name.c_str());
+}
+
+void TestDelimitedFileReader::linesAcrossBlocks(){
+  vector<string> fillers;
+  istringstream text(makeRows(fillers));
+  DelimitedFileReader reader(&text);
+  CPPUNIT_ASSERT_EQUAL((unsigned int)fillers.size(), reader.numRows());
+  size_t row = 0;
+  for (; reader.hasNext(); reader.next(), row++) {
+    CPPUNIT_ASSERT(row < fillers.size());
+    CPPUNIT_ASSERT_EQUAL((int)row, reader.getInteger("row"));
+    CPPUNIT_ASSERT_EQUAL(fillers[row], reader.getString("filler"));
+    if (row == fillers.size() / 2) {
+      // counting the rows does not move the reader
+      CPPUNIT_ASSERT_EQUAL((unsigned int)fillers.size(), reader.numRows());
+    }
+  }
+  CPPUNIT_ASSERT_EQUAL(fillers.size(), row);
+}
+
+void TestDelimitedFileReader::noTrailingNewline(){
+  istringstream text("a\tb\n1\t2\n3\t4");
+  DelimitedFileReader reader(&text);
+  CPPUNIT_ASSERT_EQUAL(2u, reader.numRows());
+  CPPUNIT_ASSERT(reader.hasNext());
+  CPPUNIT_ASSERT_EQUAL(2, reader.getInteger("b"));
+  reader.next();
+  CPPUNIT_ASSERT(reader.hasNext());
+  CPPUNIT_ASSERT_EQUAL(3, reader.getInteger("a"));
+  CPPUNIT_ASSERT_EQUAL(4, reader.getInteger("b"));
+  CPPUNIT_ASSERT_EQUAL(string("3\t4"), reader.getString());
+  reader.next();
+  CPPUNIT_ASSERT(!reader.hasNext());
+
+  // without a header
+  istringstream no_header("5\t6");
+  DelimitedFileReader headless(&no_header, false);
+  CPPUNIT_ASSERT_EQUAL(1u, headless.numRows());
+  CPPUNIT_ASSERT(headless.hasNext());
+  CPPUNIT_ASSERT_EQUAL(6, headless.getInteger(1));
+}
+
+void TestDelimitedFileReader::shortRows(){
+  istringstream text("a\tb\tc\n1\t2\n3\n4\t5\t6\n");
+  DelimitedFileReader reader(&text);
+  CPPUNIT_ASSERT_EQUAL(3u, reader.numRows());
+  CPPUNIT_ASSERT_EQUAL(2, reader.getInteger("b"));
+  CPPUNIT_ASSERT_EQUAL(string(""), reader.getString("c"));
+  CPPUNIT_ASSERT_EQUAL(0.0, reader.getDouble("c"));
+  reader.next();
+  CPPUNIT_ASSERT_EQUAL(3, reader.getInteger("a"));
+  CPPUNIT_ASSERT_EQUAL(string(""), reader.getString("b"));
+  CPPUNIT_ASSERT_EQUAL(string(""), reader.getString("c"));
+  reader.next();
+  // cells of a short row are not left over in the next one
+  CPPUNIT_ASSERT_EQUAL(5, reader.getInteger("b"));
+  CPPUNIT_ASSERT_EQUAL(string("6"), reader.getString("c"));
+}
+
+void TestDelimitedFileReader::specialCells(){
+  istringstream text("x\ty\n\tInf\n-Inf\t\n");
+  DelimitedFileReader reader(&text);
+  CPPUNIT_ASSERT_EQUAL(0.0, reader.getDouble("x"));
+  CPPUNIT_ASSERT_EQUAL(numeric_limits<double>::infinity(), reader.getDouble("y"));
+  CPPUNIT_ASSERT_EQUAL(numeric_limits<FLOAT_T>::infinity(), reader.getFloat("y"));
+  // an empty cell is not a float, as before
+  CPPUNIT_ASSERT_THROW(reader.getFloat("x"), runtime_error);
+  reader.next();
+  CPPUNIT_ASSERT_EQUAL(-numeric_limits<double>::infinity(), reader.getDouble("x"));
+  CPPUNIT_ASSERT_EQUAL(-numeric_limits<FLOAT_T>::infinity(), reader.getFloat("x"));
+  CPPUNIT_ASSERT_EQUAL(0.0, reader.getDouble("y"));
+}
+
+void TestDelimitedFileReader::fallbackParsing(){
+  // longer than the fast parser takes
+  string long_number = "0." + string(70, '0') + "125";
+  istringstream text("d\ti\n" +
+                     long_number + "\t+7\n"
+                     "-2.5e-3\t-0012\n"
+                     "1e400\t99999999999\n"
+                     "1.5.2\t1.5\n");
+  DelimitedFileReader reader(&text);
+  CPPUNIT_ASSERT_EQUAL(StringUtils::FromString<double>(long_number),
+                       reader.getDouble("d"));
+  CPPUNIT_ASSERT_EQUAL(StringUtils::FromString<FLOAT_T>(long_number),
+                       reader.getFloat("d"));
+  CPPUNIT_ASSERT_EQUAL(7, reader.getInteger("i"));
+  reader.next();
+  CPPUNIT_ASSERT_EQUAL(StringUtils::FromString<double>("-2.5e-3"),
+                       reader.getDouble("d"));
+  CPPUNIT_ASSERT_EQUAL(StringUtils::FromString<FLOAT_T>("-2.5e-3"),
+                       reader.getFloat("d"));
+  CPPUNIT_ASSERT_EQUAL(-12, reader.getInteger("i"));
+  reader.next();
+  // out of range: the conversion errors of FromString are kept
+  CPPUNIT_ASSERT_THROW(StringUtils::FromString<double>("1e400"), runtime_error);
+  CPPUNIT_ASSERT_THROW(reader.getDouble("d"), runtime_error);
+  CPPUNIT_ASSERT_THROW(StringUtils::FromString<int>("99999999999"), runtime_error);
+  CPPUNIT_ASSERT_THROW(reader.getInteger("i"), runtime_error);
+  reader.next();
+  // not numbers
+  CPPUNIT_ASSERT_THROW(reader.getDouble("d"), runtime_error);
+  CPPUNIT_ASSERT_THROW(reader.getInteger("i"), runtime_error);
+}
+
+void TestDelimitedFileReader::numRowsLargeFile(){
+  vector<string> fillers;
+  string text = makeRows(fillers);
+  {
+    ofstream file(file_name.c_str());
+    file << text;
+  }
+  DelimitedFileReader reader(file_name);
+  CPPUNIT_ASSERT_EQUAL((unsigned int)fillers.size(), reader.numRows());
+
+  // the last line without its newline
+  {
+    ofstream file(file_name.c_str());
+    file << text.substr(0, text.length() - 1);
+  }
+  DelimitedFileReader no_newline(file_name);
+  CPPUNIT_ASSERT_EQUAL((unsigned int)fillers.size(), no_newline.numRows());
+  unsigned int rows = 0;
+  string last_filler;
+  for (; no_newline.hasNext(); no_newline.next()) {
+    last_filler = no_newline.getString("filler");
+    rows++;
+  }
+  CPPUNIT_ASSERT_EQUAL((unsigned int)fillers.size(), rows);
+  CPPUNIT_ASSERT_EQUAL(fillers.back(), last_filler);
+}
@@ -0,0 +1,36 @@
+#ifndef CPP_UNIT_TESTDELIMITEDFILEREADER_H
+#define CPP_UNIT_TESTDELIMITEDFILEREADER_H
+
+#include <cppunit/extensions/HelperMacros.h>
+#include <string>
+#include "DelimitedFileReader.h"
+
+class TestDelimitedFileReader : public CPPUNIT_NS::TestFixture
+{
+  CPPUNIT_TEST_SUITE( TestDelimitedFileReader );
+  CPPUNIT_TEST( linesAcrossBlocks );
+  CPPUNIT_TEST( noTrailingNewline );
+  CPPUNIT_TEST( shortRows );
+  CPPUNIT_TEST( specialCells );
+  CPPUNIT_TEST( fallbackParsing );
+  CPPUNIT_TEST( numRowsLargeFile );
+  CPPUNIT_TEST_SUITE_END();
+  
+ protected:
+  // temporary file for the tests that read from a file
+  std::string file_name;
+
+ public:
+  void setUp();
+  void tearDown();
+
+ protected:
+  void linesAcrossBlocks();
+  void noTrailingNewline();
+  void shortRows();
+  void specialCells();
+  void fallbackParsing();
+  void numRowsLargeFile();
+};
+
+#endif //CPP_UNIT_TESTDELIMITEDFILEREADER_H
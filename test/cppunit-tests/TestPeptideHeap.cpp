@@ -0,0 +1,144 @@
+#include <cppunit/config/SourcePrefix.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include "TestPeptideHeap.h"
+#include "parameter.h" 
+
+using namespace std;
+
+CPPUNIT_TEST_SUITE_REGISTRATION( TestPeptideHeap );
+
+/**
+ * Gives the tests access to the peptide heap of tide-index.
+ */
+class PeptideHeapTest : public TideIndexApplication {
+ public:
+  typedef TideIndexApplication::TideIndexPeptide IndexPeptide;
+  typedef TideIndexApplication::PeptideHeap Heap;
+};
+
+typedef PeptideHeapTest::IndexPeptide IndexPeptide;
+typedef PeptideHeapTest::Heap Heap;
+
+/**
+ * Peptides are pushed in this order, so that equal peptides are neither
+ * grouped nor in location order.
+ */
+static vector<IndexPeptide> makePeptides(vector<string*>& sequences,
+                                    int numProteins) {
+  vector<IndexPeptide> peptides;
+  for (int protein = 0; protein < numProteins; protein++) {
+    const string& seq = *sequences[protein];
+    for (size_t pos = 0; pos < seq.length(); pos++) {
+      for (size_t length = 2; length <= 4 && pos + length <= seq.length(); length++) {
+        // Anagrams have equal masses.
+        double mass = 0;
+        for (size_t i = pos; i < pos + length; i++) {
+          mass += seq[i];
+        }
+        peptides.push_back(IndexPeptide(mass, length, sequences[protein], protein, pos));
+      }
+    }
+  }
+  for (size_t decoy = numProteins; decoy < sequences.size(); decoy++) {
+    const string& seq = *sequences[decoy];
+    double mass = 0;
+    for (size_t i = 0; i < seq.length(); i++) {
+      mass += seq[i];
+    }
+    peptides.push_back(IndexPeptide(mass, seq.length(), sequences[decoy], decoy, 0,
+                               decoy - numProteins));
+  }
+  srand(7);
+  for (size_t i = peptides.size() - 1; i > 0; i--) {
+    swap(peptides[i], peptides[rand() % (i + 1)]);
+  }
+  return peptides;
+}
+
+/**
+ * Pushes peptides into a heap keeping at most maxSize of them in memory,
+ * and returns them in the order they are popped.
+ */
+static vector<IndexPeptide> heapSort(const vector<IndexPeptide>& peptides, size_t maxSize,
+                                const vector<string*>& sequences) {
+  Heap heap(maxSize, ".", sequences);
+  for (size_t i = 0; i < peptides.size(); i++) {
+    heap.push(peptides[i]);
+  }
+  if (maxSize > 0) {
+    // The first run has been written.
+    FILE* run = fopen("tide_index_peptides_partial_0", "rb");
+    CPPUNIT_ASSERT_MESSAGE("Peptides should have been written to a run",
+                           run != NULL);
+    fclose(run);
+  }
+  CPPUNIT_ASSERT_EQUAL(peptides.size(), heap.size());
+  heap.finish();
+  vector<IndexPeptide> sorted;
+  while (!heap.empty()) {
+    sorted.push_back(heap.top());
+    heap.pop();
+  }
+  return sorted;
+}
+
+static bool lessPeptide(const IndexPeptide& lhs, const IndexPeptide& rhs) {
+  return rhs > lhs;
+}
+
+static void assertSameOrder(const vector<IndexPeptide>& expected,
+                            const vector<IndexPeptide>& actual) {
+  CPPUNIT_ASSERT_EQUAL(expected.size(), actual.size());
+  for (size_t i = 0; i < expected.size(); i++) {
+    CPPUNIT_ASSERT_EQUAL(expected[i].getMass(), actual[i].getMass());
+    CPPUNIT_ASSERT_EQUAL(expected[i].getSequence(), actual[i].getSequence());
+    CPPUNIT_ASSERT_EQUAL(expected[i].decoyIdx(), actual[i].decoyIdx());
+    // Ties come out in the same order.
+    CPPUNIT_ASSERT_EQUAL(expected[i].getProteinId(), actual[i].getProteinId());
+    CPPUNIT_ASSERT_EQUAL(expected[i].getProteinPos(), actual[i].getProteinPos());
+  }
+}
+
+void TestPeptideHeap::setUp(){
+  initialize_parameters();
+  // repeated and permuted stretches give equal peptides and equal masses
+  const char* proteins[] = {
+    "MKPEPTIDEKAAGR", "PEPTIDEKLMNKAAGR", "GRAAKEDITPEPK", "MKPEPTIDEK",
+    "AAGRAAGRAAGR"
+  };
+  numProteins = sizeof(proteins) / sizeof(proteins[0]);
+  sequences.clear();
+  for (int i = 0; i < numProteins; i++) {
+    sequences.push_back(new string(proteins[i]));
+  }
+  const char* decoys[] = { "EPTP", "KDE", "EPTP", "GA", "AG" };
+  for (size_t i = 0; i < sizeof(decoys) / sizeof(decoys[0]); i++) {
+    sequences.push_back(new string(decoys[i]));
+  }
+}
+
+void TestPeptideHeap::tearDown(){
+  for (size_t i = 0; i < sequences.size(); i++) {
+    delete sequences[i];
+  }
+  sequences.clear();
+}
+
+void TestPeptideHeap::inMemoryMatchesSort(){
+  vector<IndexPeptide> peptides = makePeptides(sequences, numProteins);
+  vector<IndexPeptide> expected(peptides);
+  sort(expected.begin(), expected.end(), lessPeptide);
+  assertSameOrder(expected, heapSort(peptides, 0, sequences));
+}
+
+void TestPeptideHeap::spilledMatchesInMemory(){
+  vector<IndexPeptide> peptides = makePeptides(sequences, numProteins);
+  vector<IndexPeptide> expected = heapSort(peptides, 0, sequences);
+  // several runs, the last of them partly in memory
+  size_t maxSizes[] = { 2, 7, 20, peptides.size() - 1 };
+  for (size_t i = 0; i < sizeof(maxSizes) / sizeof(maxSizes[0]); i++) {
+    assertSameOrder(expected, heapSort(peptides, maxSizes[i], sequences));
+  }
+}
@@ -0,0 +1,30 @@
+#ifndef CPP_UNIT_TESTPEPTIDEHEAP_H
+#define CPP_UNIT_TESTPEPTIDEHEAP_H
+
+#include <cppunit/extensions/HelperMacros.h>
+#include <string>
+#include <vector>
+#include "TideIndexApplication.h"
+
+class TestPeptideHeap : public CPPUNIT_NS::TestFixture
+{
+  CPPUNIT_TEST_SUITE( TestPeptideHeap );
+  CPPUNIT_TEST( inMemoryMatchesSort );
+  CPPUNIT_TEST( spilledMatchesInMemory );
+  CPPUNIT_TEST_SUITE_END();
+  
+ protected:
+  // proteins, followed by decoy peptide sequences
+  std::vector<std::string*> sequences;
+  int numProteins;
+
+ public:
+  void setUp();
+  void tearDown();
+
+ protected:
+  void inMemoryMatchesSort();
+  void spilledMatchesInMemory();
+};
+
+#endif //CPP_UNIT_TESTPEPTIDEHEAP_H
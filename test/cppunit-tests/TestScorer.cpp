@@ -0,0 +1,102 @@
+#include <cppunit/config/SourcePrefix.h>
+#include <math.h>
+#include <stdlib.h>
+#include "TestScorer.h"
+#include "Scorer.h"
+#include "parameter.h" 
+
+using namespace std;
+
+CPPUNIT_TEST_SUITE_REGISTRATION( TestScorer );
+
+/**
+ * Largest absolute difference allowed between the background-corrected
+ * intensities and those of the reference loop. The reference subtracts the
+ * 151 terms of a window one at a time, rounding to FLOAT_T after each, so it
+ * is off by up to about 151 * 50 * FLT_EPSILON = 1e-3 itself; in practice
+ * the differences are below 1e-4.
+ */
+static const double BACKGROUND_TOLERANCE = 1e-3;
+
+/**
+ * Largest relative difference allowed between the dot products and the
+ * dot product summed in double precision.
+ */
+static const double DOT_PRODUCT_TOLERANCE = 1e-5;
+
+void TestScorer::setUp(){
+  initialize_parameters();  
+  // sizes around the window of 151 bins and the vector widths
+  int sizes[] = { 1, 2, 10, 76, 150, 151, 152, 153, 157, 300, 2048, 50000 };
+  srand(42);
+  spectra.clear();
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    vector<FLOAT_T> spectrum(sizes[i], 0);
+    for (int j = 0; j < sizes[i]; j++) {
+      // binned spectra are mostly empty
+      if (rand() % 3 == 0) {
+        spectrum[j] = 50.0 * rand() / RAND_MAX;
+      }
+    }
+    spectra.push_back(spectrum);
+  }
+}
+
+void TestScorer::tearDown(){
+}
+
+/**
+ * The XCorr background subtraction as Scorer did it before it used prefix
+ * sums.
+ */
+static vector<FLOAT_T> referenceBackground(const vector<FLOAT_T>& observed) {
+  int size = observed.size();
+  vector<FLOAT_T> corrected(observed);
+  for (int i = 0; i < size; i++) {
+    for (int j = i - 75; j <= i + 75; j++) {
+      if (j > 0 && j < size) {
+        corrected[i] -= (observed[j] / (75 * 2.0 + 1));
+      }
+    }
+  }
+  return corrected;
+}
+
+void TestScorer::backgroundMatchesReference(){
+  for (size_t i = 0; i < spectra.size(); i++) {
+    vector<FLOAT_T> expected = referenceBackground(spectra[i]);
+    vector<FLOAT_T> corrected(spectra[i]);
+    Scorer::subtractXcorrBackground(&corrected[0], corrected.size());
+    for (size_t j = 0; j < corrected.size(); j++) {
+      CPPUNIT_ASSERT_DOUBLES_EQUAL(expected[j], corrected[j],
+                                   BACKGROUND_TOLERANCE);
+    }
+  }
+}
+
+void TestScorer::backgroundKernelsAgree(){
+  // the AVX and scalar kernels round alike, so they agree exactly
+  for (size_t i = 0; i < spectra.size(); i++) {
+    vector<FLOAT_T> simd(spectra[i]);
+    vector<FLOAT_T> scalar(spectra[i]);
+    Scorer::subtractXcorrBackground(&simd[0], simd.size(), true);
+    Scorer::subtractXcorrBackground(&scalar[0], scalar.size(), false);
+    CPPUNIT_ASSERT(simd == scalar);
+  }
+}
+
+void TestScorer::dotProduct(){
+  for (size_t i = 0; i < spectra.size(); i++) {
+    const vector<FLOAT_T>& x = spectra[i];
+    vector<FLOAT_T> y = referenceBackground(x);
+    double expected = 0;
+    for (size_t j = 0; j < x.size(); j++) {
+      expected += (double)x[j] * y[j];
+    }
+    FLOAT_T simd = Scorer::dotProduct(&x[0], &y[0], x.size(), true);
+    FLOAT_T scalar = Scorer::dotProduct(&x[0], &y[0], x.size(), false);
+    CPPUNIT_ASSERT(simd == scalar);
+    CPPUNIT_ASSERT_DOUBLES_EQUAL(expected, simd,
+      DOT_PRODUCT_TOLERANCE * (fabs(expected) > 1 ? fabs(expected) : 1));
+  }
+}
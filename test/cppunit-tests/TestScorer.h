@@ -0,0 +1,30 @@
+#ifndef CPP_UNIT_TESTSCORER_H
+#define CPP_UNIT_TESTSCORER_H
+
+#include <cppunit/extensions/HelperMacros.h>
+#include <vector>
+#include "Scorer.h"
+
+class TestScorer : public CPPUNIT_NS::TestFixture
+{
+  CPPUNIT_TEST_SUITE( TestScorer );
+  CPPUNIT_TEST( backgroundMatchesReference );
+  CPPUNIT_TEST( backgroundKernelsAgree );
+  CPPUNIT_TEST( dotProduct );
+  CPPUNIT_TEST_SUITE_END();
+  
+ protected:
+  // test spectra of various sizes, intensities between 0 and 50
+  std::vector<std::vector<FLOAT_T> > spectra;
+
+ public:
+  void setUp();
+  void tearDown();
+
+ protected:
+  void backgroundMatchesReference();
+  void backgroundKernelsAgree();
+  void dotProduct();
+};
+
+#endif //CPP_UNIT_TESTSCORER_H
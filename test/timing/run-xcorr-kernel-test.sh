@@ -0,0 +1,70 @@
+#!/bin/bash
+# Compare the tide-search XCorr kernels (see src/app/tide/dot_product.h):
+# time each of them against the JIT and check that they produce identical
+# search results.
+
+set -o nounset
+set -o pipefail
+set -o errexit
+set -o xtrace
+
+# Location of the data
+ms2_file=../performance-tests/051708-worm-ASMS-10.ms2
+fasta_file=../performance-tests/worm+contaminants.fa
+
+CRUX=../../src/crux
+
+scratch_dir=.
+
+# Build the index.
+index=$scratch_dir/my_index
+if [[ ! -e $index ]]; then
+    $CRUX tide-index --decoy-format none \
+	  --output-dir $index \
+	  $fasta_file $index
+fi
+
+# Convert the MS2 to spectrumrecords
+spectrum_records=$scratch_dir/my_spectra
+if [[ ! -e $spectrum_records ]]; then
+    $CRUX tide-search \
+	  --output-dir tmp \
+	  --store-spectra $spectrum_records \
+	  $ms2_file $index
+    rm -r tmp
+fi
+
+html=xcorr-kernel.html
+echo "<html><body><pre>" > $html
+for fragment in 1 02; do
+
+    if [[ $fragment == 02 ]]; then
+	tide_fragment="--mz-bin-width 0.02"
+    else
+	tide_fragment=""
+    fi
+
+    for threads in 1 4; do
+	for kernel in jit simd scalar; do
+	    root=$kernel.frag$fragment.threads$threads
+
+	    $CRUX tide-search --top-match 1 \
+		  $tide_fragment \
+		  --num-threads $threads \
+		  --xcorr-kernel $kernel \
+		  --output-dir $scratch_dir/$root --overwrite T \
+		  $spectrum_records $index
+
+	    echo -n "$root " >> $html
+	    awk -F ":" '$2 == " Elapsed time" {print $3}' \
+		$scratch_dir/$root/tide-search.log.txt >> $html
+
+	    # Every kernel must give exactly the results of the JIT.
+	    if [[ $kernel != jit ]]; then
+		diff $scratch_dir/jit.frag$fragment.threads$threads/tide-search.target.txt \
+		     $scratch_dir/$root/tide-search.target.txt
+	    fi
+	done
+    done
+done
+echo "</pre></body></html>" >> $html